@@ -39,10 +39,9 @@ void setup() {
 }
 
 void UpdateConfigFunction(void *pvParameters) {
-  uint32_t tmp = 0;
+  int64_t tmp = 0;
   for (;;) {
-    {
-      tmp = g_confrm->get_config("flash_time").toInt();
+    if (g_confrm->get_config_int64("flash_time", tmp) == CONFIG_OK) {
       std::lock_guard<std::mutex> guard(g_mutex);
       g_flash_time = (tmp > 0) ? tmp : g_flash_time;
     }
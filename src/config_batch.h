@@ -0,0 +1,196 @@
+/** @file
+ * Coalescing of concurrent config requests
+ *
+ *  Copyright 2020 confrm.io
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __CONFIG_BATCH_H__
+#define __CONFIG_BATCH_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+#include "config_cache.h"
+
+/*
+ * Decides which task fetches which keys, when several tasks ask for config
+ * at once. The fetch itself stores results in the config cache, where each
+ * caller reads its value afterwards.
+ *
+ * A caller asking for a key that is already being fetched, or is waiting to
+ * be, waits for that fetch instead of making its own. A caller asking for a
+ * new key while another batch is waiting joins that batch. Otherwise the
+ * caller leads a new batch, which waits for the window for others to join
+ * and for any fetch in progress to finish, then is fetched in one request.
+ * Only one fetch is made at a time, as they share one connection.
+ */
+
+#ifndef CONFIG_BATCH_KEYS
+#define CONFIG_BATCH_KEYS 8
+#endif
+
+struct ConfigBatchStats {
+  uint32_t requests;  // Keys asked for
+  uint32_t fetches;   // Fetches made, one request to the server each
+  uint32_t coalesced; // Requests that shared a fetch of the same key
+  uint32_t batched;   // Requests that joined a fetch of other keys
+  uint32_t failures;  // Fetches that failed
+};
+
+class ConfigBatcher {
+
+public:
+  /**
+   * Fetch the keys and store the results in the cache
+   *
+   * @return False if the request failed
+   */
+  typedef bool (*Fetch)(void *ctx, const char *const *keys, size_t n);
+
+  ConfigBatcher()
+      : m_window(0), m_next_id(1), m_done_id(0), m_in_flight(false) {
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_pending.count = 0;
+    m_flight.count = 0;
+  }
+
+  /**
+   * @brief Time a new batch waits for other keys to join, in ms
+   */
+  void set_window(uint32_t window_ms) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_window = window_ms;
+  }
+
+  ConfigBatchStats stats() {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_stats;
+  }
+
+  /**
+   * @brief Return once a fetch including the key has completed, either made
+   * by this call or by another
+   *
+   * @param key    Config key, no longer than CONFIG_CACHE_KEY_LENGTH
+   * @param fetch  Called without any lock held if this call makes the fetch
+   * @param ctx    Passed to fetch
+   */
+  void request(const char *key, Fetch fetch, void *ctx) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_stats.requests++;
+
+    while (true) {
+      if (m_in_flight && m_flight.contains(key)) {
+        m_stats.coalesced++;
+        wait_done(lock, m_flight.id);
+        return;
+      }
+      if (m_pending.count > 0 && m_pending.contains(key)) {
+        m_stats.coalesced++;
+        wait_done(lock, m_pending.id);
+        return;
+      }
+      if (m_pending.count > 0 && m_pending.count < CONFIG_BATCH_KEYS) {
+        m_pending.add(key);
+        m_stats.batched++;
+        m_cv.notify_all(); // Leader may be waiting for a full batch
+        wait_done(lock, m_pending.id);
+        return;
+      }
+      if (m_pending.count == 0) {
+        break;
+      }
+      // Pending batch is full, wait for it to be taken
+      m_cv.wait(lock);
+    }
+
+    m_pending.id = m_next_id++;
+    m_pending.add(key);
+    uint32_t id = m_pending.id;
+
+    if (m_window > 0) {
+      m_cv.wait_for(lock, std::chrono::milliseconds(m_window), [this] {
+        return m_pending.count == CONFIG_BATCH_KEYS;
+      });
+    }
+    while (m_in_flight) {
+      m_cv.wait(lock);
+    }
+
+    m_flight = m_pending;
+    m_pending.count = 0;
+    m_in_flight = true;
+    m_cv.notify_all(); // Room for a new pending batch
+
+    const char *keys[CONFIG_BATCH_KEYS];
+    for (size_t i = 0; i < m_flight.count; i++) {
+      keys[i] = m_flight.keys[i];
+    }
+    lock.unlock();
+    bool ok = fetch(ctx, keys, m_flight.count);
+    lock.lock();
+
+    m_stats.fetches++;
+    if (!ok) {
+      m_stats.failures++;
+    }
+    m_in_flight = false;
+    m_done_id = id;
+    m_cv.notify_all();
+  }
+
+private:
+  struct Batch {
+    uint32_t id;
+    size_t count;
+    char keys[CONFIG_BATCH_KEYS][CONFIG_CACHE_KEY_LENGTH + 1];
+
+    bool contains(const char *key) const {
+      for (size_t i = 0; i < count; i++) {
+        if (strcmp(keys[i], key) == 0) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void add(const char *key) {
+      strncpy(keys[count], key, CONFIG_CACHE_KEY_LENGTH);
+      keys[count][CONFIG_CACHE_KEY_LENGTH] = '\0';
+      count++;
+    }
+  };
+
+  // Batches complete in order of id, as there is one fetch at a time
+  void wait_done(std::unique_lock<std::mutex> &lock, uint32_t id) {
+    while ((int32_t)(m_done_id - id) < 0) {
+      m_cv.wait(lock);
+    }
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  ConfigBatchStats m_stats;
+  uint32_t m_window;
+  uint32_t m_next_id;
+  uint32_t m_done_id;
+  bool m_in_flight;
+  Batch m_pending; // Waiting to be fetched, count is 0 if none
+  Batch m_flight;  // Being fetched, if m_in_flight
+};
+
+#endif
@@ -0,0 +1,531 @@
+/** @file
+ * In-memory cache of config values fetched from the confrm server
+ *
+ *  Copyright 2020 confrm.io
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __CONFIG_CACHE_H__
+#define __CONFIG_CACHE_H__
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * Fixed number of entries of fixed size, so the cache lives inside the
+ * Confrm instance and never allocates. When full the least recently used
+ * entry is replaced.
+ */
+
+#ifndef CONFIG_CACHE_ENTRIES
+#define CONFIG_CACHE_ENTRIES 8
+#endif
+
+#ifndef CONFIG_CACHE_KEY_LENGTH
+#define CONFIG_CACHE_KEY_LENGTH 32
+#endif
+
+#ifndef CONFIG_CACHE_VALUE_LENGTH
+#define CONFIG_CACHE_VALUE_LENGTH 256
+#endif
+
+#ifndef CONFIG_CACHE_ETAG_LENGTH
+#define CONFIG_CACHE_ETAG_LENGTH 64
+#endif
+
+#ifndef CONFIG_TABLE_ENTRIES
+#define CONFIG_TABLE_ENTRIES 32
+#endif
+
+#ifndef CONFIG_TABLE_BYTES
+#define CONFIG_TABLE_BYTES 1024
+#endif
+
+/**
+ * Result of reading a typed config value
+ */
+enum ConfigStatus {
+  CONFIG_OK,        // Value read
+  CONFIG_NOT_FOUND, // Key not set on the server, or server not reachable
+  CONFIG_INVALID    // Value could not be converted to the type asked for
+};
+
+// Flags for the types a value could be parsed as
+#define CONFIG_NATIVE_INT64 0x01
+#define CONFIG_NATIVE_BOOL 0x02
+#define CONFIG_NATIVE_DOUBLE 0x04
+
+/**
+ * A config value converted to each type it is valid as, so typed reads do
+ * not parse the string every time
+ */
+struct ConfigNative {
+  uint8_t types; // CONFIG_NATIVE_ flags of the fields below that are set
+  int64_t int64;
+  bool boolean;
+  double number;
+};
+
+/**
+ * @brief Parse a whole string as a base 10 integer, surrounding white space
+ * is allowed
+ */
+inline bool config_parse_int64(const char *value, int64_t &out) {
+  char *end;
+  errno = 0;
+  long long parsed = strtoll(value, &end, 10);
+  if (end == value || errno == ERANGE) {
+    return false;
+  }
+  while (*end == ' ') {
+    end++;
+  }
+  if (*end != '\0') {
+    return false;
+  }
+  out = parsed;
+  return true;
+}
+
+inline bool config_parse_double(const char *value, double &out) {
+  char *end;
+  errno = 0;
+  double parsed = strtod(value, &end);
+  if (end == value || errno == ERANGE) {
+    return false;
+  }
+  while (*end == ' ') {
+    end++;
+  }
+  if (*end != '\0') {
+    return false;
+  }
+  out = parsed;
+  return true;
+}
+
+/**
+ * @brief Parse true/false, yes/no, on/off or 1/0, in any case
+ */
+inline bool config_parse_bool(const char *value, bool &out) {
+  static const char *const words[] = {"false", "true", "no",  "yes",
+                                      "off",   "on",   "0",   "1"};
+  for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+    const char *a = value;
+    const char *b = words[i];
+    while (*a != '\0' && (*a | 0x20) == *b) {
+      a++;
+      b++;
+    }
+    if (*a == '\0' && *b == '\0') {
+      out = (i % 2) == 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Convert a value to every type it is valid as
+ */
+inline void config_parse_native(const char *value, ConfigNative &native) {
+  native.types = 0;
+  if (config_parse_int64(value, native.int64)) {
+    native.types |= CONFIG_NATIVE_INT64;
+  }
+  if (config_parse_bool(value, native.boolean)) {
+    native.types |= CONFIG_NATIVE_BOOL;
+  }
+  if (config_parse_double(value, native.number)) {
+    native.types |= CONFIG_NATIVE_DOUBLE;
+  }
+}
+
+/**
+ * @brief Decode a value holding exactly len bytes, written as hex or as
+ * standard base64
+ *
+ * @return False if the value is neither, or is not len bytes long
+ */
+inline bool config_decode_bytes(const char *value, uint8_t *out, size_t len) {
+  size_t value_len = strlen(value);
+
+  if (value_len == len * 2) {
+    size_t i = 0;
+    for (; i < value_len; i++) {
+      char c = value[i];
+      uint8_t nibble;
+      if (c >= '0' && c <= '9') {
+        nibble = c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        nibble = c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        nibble = c - 'A' + 10;
+      } else {
+        break; // Not hex, may still be base64
+      }
+      if (i % 2 == 0) {
+        out[i / 2] = nibble << 4;
+      } else {
+        out[i / 2] |= nibble;
+      }
+    }
+    if (i == value_len) {
+      return true;
+    }
+  }
+
+  if (value_len != (len + 2) / 3 * 4) {
+    return false;
+  }
+  size_t padding = (3 - len % 3) % 3;
+  uint32_t bits = 0;
+  size_t written = 0;
+  for (size_t i = 0; i < value_len; i++) {
+    char c = value[i];
+    uint32_t sextet;
+    if (c >= 'A' && c <= 'Z') {
+      sextet = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      sextet = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      sextet = c - '0' + 52;
+    } else if (c == '+') {
+      sextet = 62;
+    } else if (c == '/') {
+      sextet = 63;
+    } else if (c == '=' && i >= value_len - padding) {
+      sextet = 0;
+    } else {
+      return false;
+    }
+    if (c != '=' && i >= value_len - padding) {
+      return false;
+    }
+    bits = (bits << 6) | sextet;
+    if (i % 4 == 3) {
+      for (int shift = 16; shift >= 0 && written < len; shift -= 8) {
+        out[written++] = (uint8_t)(bits >> shift);
+      }
+      bits = 0;
+    }
+  }
+  return true;
+}
+
+struct ConfigCacheEntry {
+  bool valid;
+  char key[CONFIG_CACHE_KEY_LENGTH + 1];
+  char value[CONFIG_CACHE_VALUE_LENGTH + 1];
+  char etag[CONFIG_CACHE_ETAG_LENGTH + 1]; // Empty if server sent none
+  ConfigNative native; // Value parsed when stored
+  uint32_t updated; // Time in ms the value was last confirmed by the server
+  uint32_t ttl;     // Time in ms the value is fresh for after update
+  uint32_t used;    // Lookup sequence number, for eviction
+};
+
+struct ConfigCacheStats {
+  uint32_t hits;          // Fresh values returned without a request
+  uint32_t misses;        // Keys not in the cache
+  uint32_t revalidations; // Stale values the server confirmed unchanged
+  uint32_t updates;       // Stale values the server replaced
+  uint32_t evictions;     // Entries replaced to make room
+};
+
+enum ConfigCacheLookup {
+  CONFIG_CACHE_MISS,
+  CONFIG_CACHE_FRESH,
+  CONFIG_CACHE_STALE
+};
+
+class ConfigCache {
+
+public:
+  ConfigCache() : m_version(0) { clear(); }
+
+  void clear() {
+    memset(m_entries, 0, sizeof(m_entries));
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_sequence = 0;
+    m_version++;
+  }
+
+  const ConfigCacheStats &stats() const { return m_stats; }
+
+  /**
+   * @brief Changes each time an entry's value or freshness changes, so
+   * copies of the cache can tell if they are out of date
+   */
+  uint32_t version() const { return m_version; }
+
+  /**
+   * @brief Entry in slot i, for copying the cache, check valid before use
+   */
+  const ConfigCacheEntry &entry(size_t i) const { return m_entries[i]; }
+
+  /**
+   * @brief Find a key
+   *
+   * @param key    Config key
+   * @param now    Current time in ms
+   * @param entry  Set to the entry if the key is cached, NULL otherwise
+   * @return CONFIG_CACHE_FRESH if the value can be used as-is,
+   *         CONFIG_CACHE_STALE if it must be revalidated with the server
+   */
+  ConfigCacheLookup lookup(const char *key, uint32_t now,
+                           ConfigCacheEntry **entry) {
+    *entry = find(key);
+    if (*entry == NULL) {
+      m_stats.misses++;
+      return CONFIG_CACHE_MISS;
+    }
+    (*entry)->used = ++m_sequence;
+    if (now - (*entry)->updated < (*entry)->ttl) {
+      m_stats.hits++;
+      return CONFIG_CACHE_FRESH;
+    }
+    return CONFIG_CACHE_STALE;
+  }
+
+  /**
+   * @brief Store a value from the server
+   *
+   * @return The entry, or NULL if the key or value are too long to cache
+   */
+  ConfigCacheEntry *store(const char *key, const char *value,
+                          const char *etag, uint32_t now, uint32_t ttl) {
+    if (strlen(key) > CONFIG_CACHE_KEY_LENGTH ||
+        strlen(value) > CONFIG_CACHE_VALUE_LENGTH) {
+      remove(key);
+      return NULL;
+    }
+
+    ConfigCacheEntry *entry = find(key);
+    if (entry != NULL) {
+      m_stats.updates++;
+    } else {
+      entry = &m_entries[0];
+      for (size_t i = 0; i < CONFIG_CACHE_ENTRIES; i++) {
+        if (!m_entries[i].valid) {
+          entry = &m_entries[i];
+          break;
+        }
+        if (m_entries[i].used < entry->used) {
+          entry = &m_entries[i];
+        }
+      }
+      if (entry->valid) {
+        m_stats.evictions++;
+      }
+      strcpy(entry->key, key);
+    }
+
+    strcpy(entry->value, value);
+    config_parse_native(value, entry->native);
+    if (etag != NULL && strlen(etag) <= CONFIG_CACHE_ETAG_LENGTH) {
+      strcpy(entry->etag, etag);
+    } else {
+      entry->etag[0] = '\0';
+    }
+    entry->valid = true;
+    entry->updated = now;
+    entry->ttl = ttl;
+    entry->used = ++m_sequence;
+    m_version++;
+    return entry;
+  }
+
+  /**
+   * @brief Server confirmed a stale value is unchanged (304 Not Modified)
+   */
+  void revalidated(ConfigCacheEntry *entry, uint32_t now, uint32_t ttl) {
+    m_stats.revalidations++;
+    entry->updated = now;
+    entry->ttl = ttl;
+    m_version++;
+  }
+
+  /**
+   * @brief Mark a value stale, so it is revalidated on next use
+   */
+  void expire(const char *key) {
+    ConfigCacheEntry *entry = find(key);
+    if (entry != NULL) {
+      entry->ttl = 0;
+      m_version++;
+    }
+  }
+
+  /**
+   * @brief Mark every value stale, so each is revalidated on next use
+   */
+  void expire_all() {
+    for (size_t i = 0; i < CONFIG_CACHE_ENTRIES; i++) {
+      m_entries[i].ttl = 0;
+    }
+    m_version++;
+  }
+
+  /**
+   * @brief Find a key without counting it as a use
+   *
+   * @return The entry whether fresh or stale, or NULL if not cached
+   */
+  ConfigCacheEntry *peek(const char *key) { return find(key); }
+
+  void remove(const char *key) {
+    ConfigCacheEntry *entry = find(key);
+    if (entry != NULL) {
+      entry->valid = false;
+      m_version++;
+    }
+  }
+
+private:
+  ConfigCacheEntry *find(const char *key) {
+    for (size_t i = 0; i < CONFIG_CACHE_ENTRIES; i++) {
+      if (m_entries[i].valid && strcmp(m_entries[i].key, key) == 0) {
+        return &m_entries[i];
+      }
+    }
+    return NULL;
+  }
+
+  ConfigCacheEntry m_entries[CONFIG_CACHE_ENTRIES];
+  ConfigCacheStats m_stats;
+  uint32_t m_sequence;
+  uint32_t m_version;
+};
+
+/**
+ * Sorted key-value table, the result of fetching many config values at once.
+ * Keys and values are packed null terminated in to one fixed buffer and
+ * looked up by binary search.
+ */
+class ConfigTable {
+
+public:
+  ConfigTable() { clear(); }
+
+  void clear() {
+    m_count = 0;
+    m_used = 0;
+    m_ok = true;
+  }
+
+  /**
+   * @brief False if any key-value pair did not fit in the table
+   */
+  bool ok() const { return m_ok; }
+
+  size_t size() const { return m_count; }
+
+  const char *key(size_t i) const { return m_bytes + m_entries[i].key; }
+
+  const char *value(size_t i) const { return m_bytes + m_entries[i].value; }
+
+  /**
+   * @brief Add a pair, replacing the value if the key is already present
+   *
+   * @return False if there was no room
+   */
+  bool add(const char *key, size_t key_len, const char *value,
+           size_t value_len) {
+    size_t index;
+    bool found = search(key, key_len, index);
+    size_t needed = value_len + 1 + (found ? 0 : key_len + 1);
+    if (m_used + needed > CONFIG_TABLE_BYTES ||
+        (!found && m_count == CONFIG_TABLE_ENTRIES)) {
+      m_ok = false;
+      return false;
+    }
+
+    if (!found) {
+      memmove(&m_entries[index + 1], &m_entries[index],
+              (m_count - index) * sizeof(Entry));
+      m_count++;
+      m_entries[index].key = (uint16_t)push(key, key_len);
+    }
+    m_entries[index].value = (uint16_t)push(value, value_len);
+    return true;
+  }
+
+  /**
+   * @brief Value for a key
+   *
+   * @return The value, or NULL if the key is not in the table
+   */
+  const char *get(const char *key) const {
+    size_t index;
+    if (search(key, strlen(key), index)) {
+      return value(index);
+    }
+    return NULL;
+  }
+
+private:
+  static_assert(CONFIG_TABLE_BYTES <= 0xFFFF,
+                "ConfigTable offsets are 16 bit");
+
+  struct Entry {
+    uint16_t key;   // Offset in to m_bytes
+    uint16_t value; // Offset in to m_bytes
+  };
+
+  size_t push(const char *str, size_t len) {
+    size_t offset = m_used;
+    memcpy(m_bytes + m_used, str, len);
+    m_bytes[m_used + len] = '\0';
+    m_used += len + 1;
+    return offset;
+  }
+
+  static int compare(const char *key, size_t key_len, const char *entry) {
+    int c = strncmp(key, entry, key_len);
+    if (c == 0 && entry[key_len] != '\0') {
+      return -1;
+    }
+    return c;
+  }
+
+  // Position of the key, or where it would be inserted if not found
+  bool search(const char *key, size_t key_len, size_t &index) const {
+    size_t low = 0;
+    size_t high = m_count;
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      int c = compare(key, key_len, this->key(mid));
+      if (c == 0) {
+        index = mid;
+        return true;
+      }
+      if (c < 0) {
+        high = mid;
+      } else {
+        low = mid + 1;
+      }
+    }
+    index = low;
+    return false;
+  }
+
+  Entry m_entries[CONFIG_TABLE_ENTRIES];
+  char m_bytes[CONFIG_TABLE_BYTES];
+  size_t m_count;
+  size_t m_used;
+  bool m_ok;
+};
+
+#endif
@@ -0,0 +1,161 @@
+/** @file
+ * Lock-free copy of the config cache for readers on other tasks
+ *
+ *  Copyright 2020 confrm.io
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __CONFIG_SNAPSHOT_H__
+#define __CONFIG_SNAPSHOT_H__
+
+#include <atomic>
+
+#if defined(CPP_STANDARD)
+#include <thread>
+#endif
+
+#include "config_cache.h"
+
+/*
+ * The config cache is only changed with the Confrm lock held, and that lock
+ * is also held across requests to the server. So that reading a cached value
+ * never waits for a request, the cache is published after each change as an
+ * immutable snapshot that readers use without any lock.
+ *
+ * There are two snapshot buffers and an atomic index of the current one.
+ * Readers register on the current buffer by incrementing its reader count,
+ * then check it is still current, so the writer can see when the old buffer
+ * is no longer in use. Publishing writes the buffer that is not current,
+ * waiting first for any readers still on it, then swaps the index. Readers
+ * never wait, they only retry if a publish swapped buffers as they
+ * registered.
+ *
+ * There must only be one writer at a time.
+ */
+
+struct ConfigSnapshotEntry {
+  bool valid;
+  char key[CONFIG_CACHE_KEY_LENGTH + 1];
+  char value[CONFIG_CACHE_VALUE_LENGTH + 1];
+  ConfigNative native;
+  uint32_t updated;
+  uint32_t ttl;
+};
+
+class ConfigSnapshot {
+
+public:
+  ConfigSnapshot() : m_current(0), m_version(0), m_hits(0) {
+    m_readers[0] = 0;
+    m_readers[1] = 0;
+    memset(m_buffers, 0, sizeof(m_buffers));
+  }
+
+  /**
+   * @brief Publish the cache if it has changed since the last publish
+   */
+  void publish(const ConfigCache &cache) {
+    if (cache.version() == m_version) {
+      return;
+    }
+    m_version = cache.version();
+
+    size_t next = 1 - m_current.load();
+    while (m_readers[next].load() != 0) {
+      wait();
+    }
+
+    ConfigSnapshotEntry *entries = m_buffers[next];
+    for (size_t i = 0; i < CONFIG_CACHE_ENTRIES; i++) {
+      const ConfigCacheEntry &entry = cache.entry(i);
+      entries[i].valid = entry.valid;
+      if (!entry.valid) {
+        continue;
+      }
+      strcpy(entries[i].key, entry.key);
+      strcpy(entries[i].value, entry.value);
+      entries[i].native = entry.native;
+      entries[i].updated = entry.updated;
+      entries[i].ttl = entry.ttl;
+    }
+    m_current.store(next);
+  }
+
+  /**
+   * @brief Look up a key, from any task without a lock
+   *
+   * @param key     Config key
+   * @param now     Current time in ms
+   * @param value   Set to the value if found, CONFIG_CACHE_VALUE_LENGTH + 1
+   *                bytes
+   * @param native  If not NULL, set to the parsed value if found
+   * @return As ConfigCache::lookup
+   */
+  ConfigCacheLookup read(const char *key, uint32_t now, char *value,
+                         ConfigNative *native) {
+    size_t current;
+    while (true) {
+      current = m_current.load();
+      m_readers[current]++;
+      if (m_current.load() == current) {
+        break;
+      }
+      m_readers[current]--; // Swapped as we registered, try the other
+    }
+
+    ConfigCacheLookup result = CONFIG_CACHE_MISS;
+    const ConfigSnapshotEntry *entries = m_buffers[current];
+    for (size_t i = 0; i < CONFIG_CACHE_ENTRIES; i++) {
+      if (entries[i].valid && strcmp(entries[i].key, key) == 0) {
+        strcpy(value, entries[i].value);
+        if (native != NULL) {
+          *native = entries[i].native;
+        }
+        result = (now - entries[i].updated < entries[i].ttl)
+                     ? CONFIG_CACHE_FRESH
+                     : CONFIG_CACHE_STALE;
+        break;
+      }
+    }
+    m_readers[current]--;
+
+    if (result == CONFIG_CACHE_FRESH) {
+      m_hits++;
+    }
+    return result;
+  }
+
+  /**
+   * @brief Number of fresh values read, these are not counted by the cache
+   */
+  uint32_t hits() const { return m_hits.load(); }
+
+private:
+  // The writer is usually on a higher priority task than the readers, so it
+  // has to sleep rather than yield for them to run
+  static void wait() {
+#if defined(CPP_STANDARD)
+    std::this_thread::yield();
+#else
+    delay(1);
+#endif
+  }
+
+  ConfigSnapshotEntry m_buffers[2][CONFIG_CACHE_ENTRIES];
+  std::atomic<size_t> m_current;
+  std::atomic<uint32_t> m_readers[2];
+  uint32_t m_version; // Of the cache when last published, writer only
+  std::atomic<uint32_t> m_hits;
+};
+
+#endif
@@ -0,0 +1,202 @@
+/** @file
+ * Config change callbacks
+ *
+ *  Copyright 2020 confrm.io
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __CONFIG_WATCH_H__
+#define __CONFIG_WATCH_H__
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(ARDUINO_ARCH_ESP8266)
+// Single threaded, nothing to lock
+struct ConfigWatchLock {
+  void lock() {}
+  void unlock() {}
+};
+#else
+#include <mutex>
+typedef std::mutex ConfigWatchLock;
+#endif
+
+struct ConfigWatchGuard {
+  explicit ConfigWatchGuard(ConfigWatchLock &lock) : m_lock(lock) {
+    m_lock.lock();
+  }
+  ~ConfigWatchGuard() { m_lock.unlock(); }
+  ConfigWatchLock &m_lock;
+};
+
+/*
+ * Every value fetched from the server is passed to notify(), which compares
+ * it with the last value seen for each watched key. Changes are held until
+ * dispatch() is called, which runs the callbacks with no lock held. Each
+ * watch has one pending slot, so if a key changes several times before
+ * dispatch only the latest value is delivered and nothing is ever dropped.
+ */
+
+#ifndef CONFIG_WATCH_ENTRIES
+#define CONFIG_WATCH_ENTRIES 8
+#endif
+
+#ifndef CONFIG_WATCH_KEY_LENGTH
+#define CONFIG_WATCH_KEY_LENGTH 32
+#endif
+
+#ifndef CONFIG_WATCH_VALUE_LENGTH
+#define CONFIG_WATCH_VALUE_LENGTH 256
+#endif
+
+/**
+ * Called with the key and new value, empty if the key was removed
+ */
+typedef void (*ConfigChangeCallback)(const char *key, const char *value,
+                                     void *ctx);
+
+class ConfigWatchers {
+
+public:
+  ConfigWatchers() : m_count(0) {}
+
+  /**
+   * @brief Watch a key, the callback is called with the first value seen
+   * and then each time it changes
+   *
+   * @return False if the key is too long or there are no free watches
+   */
+  bool add(const char *key, ConfigChangeCallback callback, void *ctx) {
+    if (strlen(key) > CONFIG_WATCH_KEY_LENGTH || callback == NULL) {
+      return false;
+    }
+    ConfigWatchGuard guard(m_lock);
+    if (m_count == CONFIG_WATCH_ENTRIES) {
+      return false;
+    }
+    Watch &watch = m_watches[m_count];
+    strcpy(watch.key, key);
+    watch.callback = callback;
+    watch.ctx = ctx;
+    watch.known = false;
+    watch.pending = false;
+    m_count++;
+    return true;
+  }
+
+  size_t size() const {
+    ConfigWatchGuard guard(m_lock);
+    return m_count;
+  }
+
+  /**
+   * @brief Key of a watch, i less than size(). Watches are never removed
+   * and their keys never change, so this is stable
+   */
+  const char *key(size_t i) const { return m_watches[i].key; }
+
+  /**
+   * @brief Record the latest value of a key
+   *
+   * @return True if a callback is now pending
+   */
+  bool notify(const char *key, const char *value) {
+    size_t len = strlen(value);
+    // Only the start of a long value is kept, the rest is compared by hash
+    size_t kept = len;
+    uint32_t hash = 0;
+    if (len > CONFIG_WATCH_VALUE_LENGTH) {
+      kept = CONFIG_WATCH_VALUE_LENGTH;
+      hash = value_hash(value, len);
+    }
+    bool queued = false;
+
+    ConfigWatchGuard guard(m_lock);
+    for (size_t i = 0; i < m_count; i++) {
+      Watch &watch = m_watches[i];
+      if (strcmp(watch.key, key) != 0) {
+        continue;
+      }
+      if (watch.known && watch.length == len && watch.hash == hash &&
+          memcmp(watch.value, value, kept) == 0) {
+        continue;
+      }
+      watch.known = true;
+      watch.hash = hash;
+      watch.length = len;
+      memcpy(watch.value, value, kept);
+      watch.value[kept] = '\0';
+      watch.pending = true;
+      queued = true;
+    }
+    return queued;
+  }
+
+  /**
+   * @brief Run the callbacks for any changes, must not be called with a
+   * lock held that the callbacks might need
+   *
+   * @return Number of callbacks run
+   */
+  size_t dispatch() {
+    size_t count = 0;
+    char value[CONFIG_WATCH_VALUE_LENGTH + 1];
+    for (size_t i = 0; i < CONFIG_WATCH_ENTRIES; i++) {
+      ConfigChangeCallback callback;
+      void *ctx;
+      {
+        ConfigWatchGuard guard(m_lock);
+        if (i >= m_count || !m_watches[i].pending) {
+          continue;
+        }
+        Watch &watch = m_watches[i];
+        strcpy(value, watch.value);
+        callback = watch.callback;
+        ctx = watch.ctx;
+        watch.pending = false;
+      }
+      callback(m_watches[i].key, value, ctx);
+      count++;
+    }
+    return count;
+  }
+
+private:
+  // FNV-1a, only used to tell if the part of a long value that is not kept
+  // changed
+  static uint32_t value_hash(const char *value, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+      hash = (hash ^ (uint8_t)value[i]) * 16777619u;
+    }
+    return hash;
+  }
+
+  struct Watch {
+    char key[CONFIG_WATCH_KEY_LENGTH + 1];
+    ConfigChangeCallback callback;
+    void *ctx;
+    bool known;  // A value has been seen
+    uint32_t hash; // Of the whole value if longer than is kept, else 0
+    size_t length;
+    bool pending; // Callback due with value
+    char value[CONFIG_WATCH_VALUE_LENGTH + 1];
+  };
+
+  Watch m_watches[CONFIG_WATCH_ENTRIES];
+  size_t m_count;
+  mutable ConfigWatchLock m_lock;
+};
+
+#endif
@@ -7,7 +7,6 @@
 
 #include <mutex>
 
-#include <HTTPClient.h> // NOLINT
 #include <WiFiClient.h>
 
 #include "esp_ota_ops.h"
@@ -16,14 +15,17 @@
 
 #include "mbedtls/sha256.h"
 
+#include "simple_inflate.h"
+#include "simple_patch.h"
+
 // Storage includes for persistent data
 #include "FS.h"
 #include "SPIFFS.h"
 
-#define CONFRM_TRY_CATCH
-
 #elif defined(ARDUINO_ARCH_ESP8266)
 
+#include <new>
+
 #include <ESP8266HTTPClient.h>
 #include <ESP8266httpUpdate.h>
 
@@ -51,140 +53,289 @@ static const char *TAG = "confrm";
 #endif
 
 #include "confrm.h"
-#include "simple_json.h"
+#include "confrm_responses.h"
+
+// Stack for the esp32 push notification task
+#if not defined(CONFRM_PUSH_STACK_SIZE)
+#define CONFRM_PUSH_STACK_SIZE 4096
+#endif
+
+// Stack for the esp32 config change task, the callbacks run on it
+#if not defined(CONFRM_DISPATCH_STACK_SIZE)
+#define CONFRM_DISPATCH_STACK_SIZE 4096
+#endif
+
+// Task making the requests to the server on the esp32, the update is
+// downloaded on it so the stack must allow for that
+#if not defined(CONFRM_WORKER_STACK_SIZE)
+#define CONFRM_WORKER_STACK_SIZE 8192
+#endif
+
+#if not defined(CONFRM_WORKER_PRIORITY)
+#define CONFRM_WORKER_PRIORITY 1
+#endif
+
+// Core to pin the worker task to, WORK_NO_AFFINITY to let it run on either
+#if not defined(CONFRM_WORKER_CORE)
+#define CONFRM_WORKER_CORE WORK_NO_AFFINITY
+#endif
+
+// Task hashing and writing the update to flash while it downloads, esp32
+// only. Running it on the other core to the worker keeps the download going
+// during flash writes.
+#if not defined(CONFRM_OTA_STACK_SIZE)
+#define CONFRM_OTA_STACK_SIZE 4096
+#endif
+
+#if not defined(CONFRM_OTA_PRIORITY)
+#define CONFRM_OTA_PRIORITY CONFRM_WORKER_PRIORITY
+#endif
+
+#if not defined(CONFRM_OTA_CORE)
+#define CONFRM_OTA_CORE WORK_NO_AFFINITY
+#endif
+
+// Default time a config request waits for others to join it, esp32 only
+#if not defined(CONFRM_CONFIG_BATCH_MS)
+#define CONFRM_CONFIG_BATCH_MS 2
+#endif
+
+// Longest time in seconds a config value is cached for, which keeps TTLs in
+// milliseconds well inside the range the cache's wrap-around test allows
+#if not defined(CONFRM_CONFIG_MAX_TTL)
+#define CONFRM_CONFIG_MAX_TTL 86400
+#endif
+
+// Values are returned to the caller in a buffer sized for the cache
+static_assert(CONFRM_JSON_VALUE_LENGTH <= CONFIG_CACHE_VALUE_LENGTH,
+              "Config value longer than the cache holds");
 
-#define SHORT_REST_RESPONSE_LENGTH 256
+/*
+ * Sinks used with stream_rest
+ */
+static bool json_sink(void *ctx, const uint8_t *data, size_t len) {
+  // Anything after the end of the object is read and dropped, so that the
+  // connection is left ready for the next request
+  ConfrmJSONParser *parser = reinterpret_cast<ConfrmJSONParser *>(ctx);
+  if (!parser->finished()) {
+    parser->feed(reinterpret_cast<const char *>(data), len);
+  }
+  return true;
+}
+
+static uint32_t config_ttl_ms(uint32_t seconds) {
+  if (seconds > CONFRM_CONFIG_MAX_TTL) {
+    seconds = CONFRM_CONFIG_MAX_TTL;
+  }
+  return seconds * 1000;
+}
 
-String simple_url_encode(String input) {
-  input.replace(" ", "%20");
-  return input;
+static void set_system_time(int64_t time) {
+  struct timeval now;
+  now.tv_sec = time;
+  now.tv_usec = 0;
+  settimeofday(&now, NULL);
 }
 
-// https://stackoverflow.com/a/62612409
-static char h2b(char c) {
-  return '0' <= c && c <= '9'   ? c - '0'
-         : 'A' <= c && c <= 'F' ? c - 'A' + 10
-         : 'a' <= c && c <= 'f' ? c - 'a' + 10
-                                :
-                                /* else */ -1;
+bool Confrm::json_rest(const char *path, int &httpCode,
+                       SimpleJSONBinding &binding, const char *payload,
+                       const char *headers) {
+  return json_rest(path, httpCode, simple_json_bind_callback, &binding,
+                   payload, headers);
 }
 
-int hex2bin(unsigned char *bin, unsigned int bin_len, const char *hex) {
-  for (unsigned int i = 0; i < bin_len; i++) {
-    char b[2] = {h2b(hex[2 * i + 0]), h2b(hex[2 * i + 1])};
-    if (b[0] < 0 || b[1] < 0)
-      return -1;
-    bin[i] = b[0] * 16 + b[1];
+bool Confrm::json_rest(const char *path, int &httpCode,
+                       SimpleJSONStreamCallback callback, void *ctx,
+                       const char *payload, const char *headers) {
+  ConfrmJSONParser parser(callback, ctx);
+  if (payload == NULL) {
+    stream_rest(path, httpCode, json_sink, &parser, "GET", NULL, 0, headers);
+  } else {
+    RequestHeaders post_headers;
+    post_headers.append("Content-Type: application/json\r\n");
+    if (headers != NULL) {
+      post_headers.append(headers);
+    }
+    if (!post_headers.ok()) {
+      ESP_LOGE(TAG, "Request headers too long");
+      httpCode = -1;
+      return false;
+    }
+    stream_rest(path, httpCode, json_sink, &parser, "POST",
+                reinterpret_cast<const uint8_t *>(payload), strlen(payload),
+                post_headers.c_str());
+  }
+  if (httpCode != 200) {
+    return false;
+  }
+  if (!parser.finished()) {
+    ESP_LOGI(TAG, "Error parsing json");
+    return false;
   }
-  return 0;
+  return true;
 }
 
-String Confrm::short_rest(String url, int &httpCode, String type,
-                          String payload) {
+Confrm::rest_status_t
+Confrm::stream_rest(const char *path, int &httpCode, response_sink_t sink,
+                    void *ctx, const char *type, const uint8_t *payload,
+                    size_t payload_len, const char *headers,
+                    uint32_t limit_ms) {
 
   // If not configured this cannot work
   if (!m_config_status) {
-    return "";
+    httpCode = -1;
+    return REST_FAILED;
   }
 
-#if defined(ARDUINO_ARCH_ESP32)
-  HTTPClient http;
-  http.begin(url);
-
-  if (type == "GET") {
-    httpCode = http.GET();
-  } else if (type == "PUT") {
-    httpCode = http.PUT(payload);
-  } else if (type == "POST") {
-    httpCode = http.POST(payload);
-  } else {
+  if (strcmp(type, "GET") != 0 && strcmp(type, "PUT") != 0 &&
+      strcmp(type, "POST") != 0) {
     ESP_LOGE(TAG, "Unsupported call type");
     httpCode = -1;
-    http.end();
-    return "";
+    return REST_FAILED;
   }
 
+#if defined(ARDUINO_ARCH_ESP8266)
+  // Abandons any request made by yield(), which sends it again next time
+  m_yield_sent = false;
+#endif
+  httpCode = m_http.request(type, path, payload, payload_len, sink, ctx,
+                            headers, limit_ms);
   if (httpCode < 0) {
     ESP_LOGI(TAG, "Unable to connect to confrm server");
-    http.end();
-    return "";
-  }
-
-  int len = http.getSize();
-  if (len >= SHORT_REST_RESPONSE_LENGTH) {
-    ESP_LOGE(TAG, "confrm server sending too much data...");
-    http.end();
-    return "";
-  }
-
-  // create buffer for read
-  // One longer to ensure buf is null terminated
-  uint8_t *buff = new uint8_t[SHORT_REST_RESPONSE_LENGTH + 1];
-  memset(buff, 0, SHORT_REST_RESPONSE_LENGTH + 1);
-  uint8_t *buff_ptr = buff;
-
-  // get tcp stream
-  WiFiClient *stream = http.getStreamPtr();
-
-  // read all data from server
-  while (http.connected() && (len > 0 || len == -1)) {
-    size_t size = stream->available();
-    if (size) {
-      size_t to_read = SHORT_REST_RESPONSE_LENGTH - 1 - (buff_ptr - buff);
-      if (to_read > len)
-        to_read = len;
-      int c = stream->readBytes(buff_ptr, to_read);
-      buff_ptr += c;
-      if (len > 0) {
-        len -= c;
-      }
-    }
+    return REST_FAILED;
+  }
+  if (httpCode < 200 || httpCode >= 300) {
+    return REST_HTTP_ERROR;
+  }
+  if (!m_http.complete()) {
+    ESP_LOGI(TAG, "Response incomplete");
+    return REST_INCOMPLETE;
+  }
+  return REST_OK;
+}
+
+void Confrm::connection_begin() {
+  Client *client = &m_client;
+  if (strncmp(m_confrm_url.c_str(), "https://", 8) == 0) {
+#if defined(ARDUINO_ARCH_ESP32)
+    // As with HTTPClient given only a URL, the certificate is not verified
+    m_secure_client.setInsecure();
+    client = &m_secure_client;
+#elif defined(ARDUINO_ARCH_ESP8266)
+    ESP_LOGE(TAG, "https is not supported on the esp8266");
+#endif
+  }
+  if (!m_http.begin(client, m_confrm_url.c_str())) {
+    ESP_LOGE(TAG, "Unable to parse confrm server URL");
+  }
+}
 
-    String retstr = String((char *)buff);
-    delete[] buff;
+bool Confrm::enable_push() {
+#if defined(ARDUINO_ARCH_ESP32)
+  std::lock_guard<std::mutex> guard(m_mutex);
+#endif
 
-    // Save data to output string
-    return retstr;
+  if (m_push.state() != PUSH_STOPPED) {
+    return true;
   }
 
-  http.end();
-  return "";
+  Client *client = &m_push_client;
+  if (strncmp(m_confrm_url.c_str(), "https://", 8) == 0) {
+#if defined(ARDUINO_ARCH_ESP32)
+    m_push_secure_client.setInsecure();
+    client = &m_push_secure_client;
 #elif defined(ARDUINO_ARCH_ESP8266)
+    ESP_LOGE(TAG, "https is not supported on the esp8266");
+    return false;
+#endif
+  }
 
-  WiFiClient client;
-  HTTPClient http;
+  RequestPath path;
+  m_requests.subscribe(path);
+  if (!path.ok() || !m_push.begin(client, m_confrm_url.c_str(), path.c_str(),
+                    Confrm::push_callback, this)) {
+    ESP_LOGE(TAG, "Unable to start push notifications");
+    return false;
+  }
 
-  if (http.begin(client, url)) {
+#if defined(ARDUINO_ARCH_ESP32)
+  if (xTaskCreate(Confrm::push_task, "confrm_push", CONFRM_PUSH_STACK_SIZE,
+                  this, 1, &m_push_task) != pdPASS) {
+    ESP_LOGE(TAG, "Unable to start push notification task");
+    m_push.stop();
+    return false;
+  }
+#endif
+  return true;
+}
 
-    if (type == "GET") {
-      httpCode = http.GET();
-    } else if (type == "PUT") {
-      httpCode = http.PUT(payload);
-    } else if (type == "POST") {
-      httpCode = http.POST(payload);
-    } else {
-      ESP_LOGE(TAG, "Unsupported call type");
-      httpCode = -1;
-      http.end();
-      return "";
-    }
+PushStats Confrm::get_push_stats() {
+  // Only written by the push task, a torn read of a counter is harmless
+  return m_push.stats();
+}
 
-    if (httpCode < 0) {
-      ESP_LOGI(TAG, "Unable to connect to confrm server");
-      http.end();
-      return "";
-    }
+void Confrm::push_callback(void *ctx, PushEvent event, const char *data) {
+  Confrm *self = reinterpret_cast<Confrm *>(ctx);
+  if (event == PUSH_UPDATE) {
+    ESP_LOGD(TAG, "Update notification");
+#if defined(ARDUINO_ARCH_ESP32)
+    self->m_worker.post(WORK_POLL);
+#else
+    self->m_push_update = true;
+#endif
+    return;
+  }
 
-    String response = http.getString();
-    http.end();
+  ESP_LOGD(TAG, "Config notification: %s", data);
+#if defined(ARDUINO_ARCH_ESP32)
+  std::lock_guard<std::mutex> guard(self->m_mutex);
+#endif
+  if (data[0] == '\0') {
+    self->m_config_cache.expire_all();
+  } else {
+    self->m_config_cache.expire(data);
+  }
+  self->publish_config();
+#if defined(ARDUINO_ARCH_ESP32)
+  self->m_worker.post(WORK_REFRESH_CONFIG);
+#else
+  self->m_push_config = true;
+#endif
+}
 
-    return response;
+void Confrm::push_poll() {
+  m_push.poll();
+#if defined(ARDUINO_ARCH_ESP8266)
+  // Flags are left set if the updates are busy, to be acted on once done
+  if (m_push_update && yield_start(YIELD_HEARTBEAT)) {
+    m_push_update = false;
+    m_push_config = false; // The heartbeat refreshes the watched keys too
+  } else if (m_push_config && yield_start(YIELD_CONFIG)) {
+    m_push_config = false;
+  }
+#endif
+}
 
-  } else {
-    ESP_LOGI(TAG, "Unable to connect to confrm server");
-    return "";
+void Confrm::push_task(void *ptr) {
+  Confrm *self = reinterpret_cast<Confrm *>(ptr);
+  while (true) {
+    self->push_poll();
+    delay(self->m_push.streaming() ? 10 : 100);
   }
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+UpdateStats Confrm::get_update_stats() {
+  std::lock_guard<std::mutex> guard(m_mutex);
+  return m_update_stats;
+}
+#endif
+
+SimpleHTTPStats Confrm::get_connection_stats() {
+#if defined(ARDUINO_ARCH_ESP32)
+  std::lock_guard<std::mutex> guard(m_mutex);
 #endif
+  return m_http.stats();
 }
 
 bool Confrm::check_for_updates() {
@@ -192,159 +343,423 @@ bool Confrm::check_for_updates() {
   set_time();
 
   int httpCode = 0;
-  String request = m_confrm_url +
-                   "/check_for_update/?package=" + m_package_name +
-                   "&node_id=" + WiFi.macAddress();
-  String response = short_rest(request, httpCode, "GET");
-
-  if (httpCode != 200 || response == "" || response == "{}") {
+  CheckForUpdateResponse response = {};
+  SimpleJSONBinding binding =
+      simple_json_binding(check_for_update_schema, response);
+  RequestPath path;
+  m_requests.check_for_update(path, m_config.current_version);
+  if (!path.ok()) {
+    ESP_LOGE(TAG, "Request path too long");
     return false;
   }
-
-  std::vector<SimpleJSONElement> content;
-#if defined(CONFRM_TRY_CATCH)
-  try {
-    content = simple_json(response);
-  } catch (...) {
-    ESP_LOGI(TAG, "Error parsing json");
+  if (!json_rest(path.c_str(), httpCode, binding) || binding.found == 0) {
     return false;
   }
-#else
-  content = simple_json(response);
-  if (content.size() == 0) {
-    ESP_LOGI(TAG, "No JSON data was extracted, there may have been and error "
-                  "processing the response");
+  if (binding.errors != 0) {
+    ESP_LOGE(TAG, "Malformed update details");
     return false;
   }
-#endif
 
-  String ver = get_simple_json_string(content, "current_version");
-  ESP_LOGI(TAG, "Current version of %s on confrm server is: %s",
-           m_package_name.c_str(), ver.c_str());
+  return update_required(response);
+}
 
-  bool force = get_simple_json_bool(content, "force");
-  bool reboot = get_simple_json_bool(content, "reboot");
+bool Confrm::update_required(const CheckForUpdateResponse &update) {
+
+  ESP_LOGI(TAG, "Current version of %s on confrm server is: %s",
+           m_package_name.c_str(), update.version);
 
-  if (force || 0 != strcmp(m_config.current_version, ver.c_str())) {
-    if (force) {
+  if (update.force || 0 != strcmp(m_config.current_version, update.version)) {
+    if (update.force) {
       ESP_LOGI(TAG, "Server is forcing an update");
     } else {
       ESP_LOGI(TAG, "Different version available, update required...");
     }
-    m_next_version = ver;
-    m_next_blob = get_simple_json_string(content, "blob");
-    hex2bin(m_next_hash, 32, get_simple_json_string(content, "hash").c_str());
+    m_next_version = update.version;
+    m_next_blob = update.blob;
+    m_next_encoding = update.encoding;
+    m_next_patch = update.patch;
+    memcpy(m_next_hash, update.hash, sizeof(m_next_hash));
     return true;
-  } else if (reboot) {
+  } else if (update.reboot) {
     hard_restart();
   }
 
   return false;
 }
 
-#if defined(ARDUINO_ARCH_ESP32)
-bool Confrm::do_update() {
-
-  // If not configured this cannot work
-  if (!m_config_status) {
+bool Confrm::heartbeat_payload(char *payload, size_t len) {
+  SimpleJSONWriter writer(payload, len);
+  writer.begin_object();
+  writer.string("package", m_package_name.c_str());
+  writer.string("node_id", m_requests.node_id());
+  writer.string("version", m_config.current_version);
+  writer.string("description", m_node_description.c_str());
+  writer.string("platform", m_node_platform.c_str());
+  writer.end_object();
+  if (!writer.finish()) {
+    ESP_LOGE(TAG, "Heartbeat request too long");
     return false;
   }
+  return true;
+}
 
-  // Likewise, sanity check the update settings
-  if (m_next_version == "" or m_next_blob == "") {
-    return false;
+Confrm::heartbeat_result_t
+Confrm::heartbeat_response(int httpCode, bool ok,
+                           const HeartbeatResponse &response,
+                           const SimpleJSONBinding &binding) {
+
+  // Older servers do not have the endpoint, use the separate calls from
+  // now on. Any other failure falls back for this heartbeat only.
+  if (httpCode == 404 || httpCode == 405) {
+    ESP_LOGI(TAG, "Server does not support heartbeat");
+    m_heartbeat_support = HEARTBEAT_UNSUPPORTED;
+  } else if (ok && (binding.found & 1)) { // Bit 0 is the time field
+    m_heartbeat_support = HEARTBEAT_SUPPORTED;
+    if (!(binding.errors & 1)) {
+      set_system_time(response.time);
+    }
+    if (response.config_changed) {
+      m_config_cache.expire_all(); // Revalidate on next get_config
+      publish_config();
+    }
+    if ((binding.found & 0x3E) == 0) { // Bits 1-5 are the update fields
+      return HEARTBEAT_DONE;
+    }
+    // Any malformed field, not only the update fields, means the response
+    // cannot be trusted to update from
+    if (binding.errors != 0) {
+      ESP_LOGE(TAG, "Malformed update details");
+      return HEARTBEAT_DONE;
+    }
+    return update_required(response.update) ? HEARTBEAT_UPDATE
+                                            : HEARTBEAT_DONE;
+  } else if (httpCode < 0) {
+    return HEARTBEAT_DONE; // Server unreachable, separate calls would fail too
+  }
+  return HEARTBEAT_FALLBACK;
+}
+
+bool Confrm::heartbeat() {
+
+  if (m_heartbeat_support != HEARTBEAT_UNSUPPORTED && m_config_status) {
+    char payload[CONFRM_HEARTBEAT_LENGTH];
+    if (heartbeat_payload(payload, sizeof(payload))) {
+      int httpCode = 0;
+      HeartbeatResponse response = {};
+      SimpleJSONBinding binding =
+          simple_json_binding(heartbeat_schema, response);
+      bool ok = json_rest("/heartbeat/", httpCode, binding, payload);
+      heartbeat_result_t result =
+          heartbeat_response(httpCode, ok, response, binding);
+      if (result != HEARTBEAT_FALLBACK) {
+        return result == HEARTBEAT_UPDATE;
+      }
+    }
   }
 
-  HTTPClient http;
-  String request = m_confrm_url + "/blob/?package=" + m_package_name +
-                   "&blob=" + m_next_blob;
-  http.begin(request);
-  int httpCode = http.GET();
+  register_node();
+  return check_for_updates();
+}
 
-  if (httpCode == 200) {
+#if defined(ARDUINO_ARCH_ESP32)
+/*
+ * State for writing the blob to the next partition as it is downloaded. The
+ * download passes the blob through the pipeline; decompression, patching,
+ * the hash and flash writes are done by the pipeline's writer task.
+ */
+struct OtaWrite {
+  SimpleHTTPConnection<Client> *http;
+  OtaPipeline pipeline;
+  int64_t length; // Content-Length, read when the first data arrives
+  bool started;
+  SimpleInflate *inflate; // Created when the first data arrives, if needed
+  SimplePatch *patch;     // Set if the blob is a patch to the running image
+
+  // Writer task only
+  const esp_partition_t *partition;
+  esp_ota_handle_t handle;
+  bool begun;
+  mbedtls_sha256_context sha;
+  uint32_t image_bytes; // Written to the partition
+  uint32_t flash_ms;    // Spent hashing and writing
+  uint32_t patch_ms;    // Spent patching, less the flash writes
+};
+
+// Set up decompression for the Content-Encoding of the blob
+static bool ota_encoding(OtaWrite *ota, const char *encoding) {
+  SimpleInflateFormat format;
+  if (encoding[0] == '\0' || strcasecmp(encoding, "identity") == 0) {
+    return true;
+  } else if (strcasecmp(encoding, "gzip") == 0) {
+    format = SIMPLE_INFLATE_GZIP;
+  } else if (strcasecmp(encoding, "deflate") == 0) {
+    format = SIMPLE_INFLATE_ZLIB;
+  } else {
+    ESP_LOGE(TAG, "Unsupported blob encoding: %s", encoding);
+    return false;
+  }
+  ota->inflate = new (std::nothrow) SimpleInflate(format);
+  if (ota->inflate == NULL) {
+    ESP_LOGE(TAG, "Unable to allocate decompression window");
+    return false;
+  }
+  return true;
+}
 
-    int len = http.getSize();
+static bool ota_sink(void *ctx, const uint8_t *data, size_t len) {
+  OtaWrite *ota = reinterpret_cast<OtaWrite *>(ctx);
+  esp_task_wdt_reset();
+  if (!ota->started) {
+    ota->length = ota->http->content_length();
+    ota->started = true;
+    if (!ota_encoding(ota, ota->http->content_encoding())) {
+      return false;
+    }
+  }
+  return ota->pipeline.write(data, len);
+}
 
-    // There is data incoming, start the OTA programming process
-    esp_err_t err;
-    esp_ota_handle_t ota_handle;
-    const esp_partition_t *current = esp_ota_get_running_partition();
-    const esp_partition_t *next = esp_ota_get_next_update_partition(current);
-    err = esp_ota_begin(next, len, &ota_handle);
+// Old image for a patch, read from the running partition
+static bool ota_running(void *ctx, uint32_t offset, uint8_t *data,
+                        size_t len) {
+  const esp_partition_t *running = reinterpret_cast<esp_partition_t *>(ctx);
+  return esp_partition_read(running, offset, data, len) == ESP_OK;
+}
 
+// Hash and write the next piece of the image
+static bool ota_image(void *ctx, const uint8_t *data, size_t len) {
+  OtaWrite *ota = reinterpret_cast<OtaWrite *>(ctx);
+  uint32_t start = millis();
+
+  // Only start the OTA process once data is arriving for a 200 response.
+  // The image size is known from a patch, or from the response if the blob
+  // is not compressed.
+  if (!ota->begun) {
+    int64_t length = (ota->patch != NULL)    ? ota->patch->image_size()
+                     : (ota->inflate == NULL) ? ota->length
+                                              : -1;
+    esp_err_t err =
+        esp_ota_begin(ota->partition, length > 0 ? length : OTA_SIZE_UNKNOWN,
+                      &ota->handle);
     if (err != ESP_OK) {
       ESP_LOGE(TAG, "Error initializing OTA process");
-      http.end();
       return false;
     }
+    ota->begun = true;
+  }
 
-    // create buffer for read
-    uint8_t buff[128] = {0};
-
-    // Create buffer and context for sha256 calc, start the hashing
-    unsigned char hash[32];
-    mbedtls_sha256_context ctx2;
-    mbedtls_sha256_init(&ctx2);
-    mbedtls_sha256_starts(&ctx2, 0);
-
-    // get tcp stream
-    WiFiClient *stream = http.getStreamPtr();
-
-    // read all data from server
-    while (http.connected() && (len > 0 || len == -1)) {
-      esp_task_wdt_reset();
-      size_t size = stream->available();
-      if (size) {
-        size_t to_read = sizeof(buff);
-        if (to_read > len)
-          to_read = len;
-        int c = stream->readBytes(buff, to_read);
-        mbedtls_sha256_update(&ctx2, buff, c);
-        err = esp_ota_write(ota_handle, buff, c);
-        if (err != ESP_OK) {
-          ESP_LOGE(TAG, "Error initializing OTA process");
-          esp_ota_end(ota_handle);
-          http.end();
-          return false;
-        }
-        if (len > 0) {
-          len -= c;
-        }
-      }
+  mbedtls_sha256_update(&ota->sha, data, len);
+  if (esp_ota_write(ota->handle, data, len) != ESP_OK) {
+    ESP_LOGE(TAG, "Error writing OTA data");
+    return false;
+  }
+  ota->image_bytes += len;
+  ota->flash_ms += millis() - start;
+  return true;
+}
+
+// The blob once decompressed, either the image or a patch to make it
+static bool ota_decoded(void *ctx, const uint8_t *data, size_t len) {
+  OtaWrite *ota = reinterpret_cast<OtaWrite *>(ctx);
+  if (ota->patch == NULL) {
+    return ota_image(ota, data, len);
+  }
+
+  uint32_t start = millis();
+  uint32_t flash_ms = ota->flash_ms;
+  size_t used = 0;
+  bool ok = ota->patch->feed(data, len, ota_image, ota, &used);
+  ota->patch_ms += (millis() - start) - (ota->flash_ms - flash_ms);
+  if (!ok) {
+    if (ota->patch->error()) {
+      ESP_LOGE(TAG, "Error applying patch");
     }
+    return false;
+  }
+  if (used < len) {
+    ESP_LOGE(TAG, "Data after the end of the patch");
+    return false;
+  }
+  return true;
+}
 
-    esp_ota_end(ota_handle);
-    esp_task_wdt_reset(); // Ensure WDT does not trigger for a bit longer
+static bool ota_write(void *ctx, const uint8_t *data, size_t len) {
+  OtaWrite *ota = reinterpret_cast<OtaWrite *>(ctx);
+  if (ota->inflate == NULL) {
+    return ota_decoded(ota, data, len);
+  }
 
-    mbedtls_sha256_finish(&ctx2, hash);
-    mbedtls_sha256_free(&ctx2);
-    bool integrity = true;
-    for (int i = 0; i < 32; i++) {
-      if (hash[i] != m_next_hash[i]) {
-        integrity = false;
-      }
+  size_t used = 0;
+  if (!ota->inflate->feed(data, len, ota_decoded, ota, &used)) {
+    if (ota->inflate->error()) {
+      ESP_LOGE(TAG, "Error decompressing blob");
     }
-    if (integrity == false) {
-      ESP_LOGE(TAG, "Blob sha256 does not match expected value");
-      http.end();
+    return false;
+  }
+  if (used < len) {
+    ESP_LOGE(TAG, "Data after the end of the compressed blob");
+    return false;
+  }
+  return true;
+}
+
+bool Confrm::download_update(const char *blob, bool patch) {
+
+  RequestPath path;
+  m_requests.blob(path, blob);
+  if (!path.ok()) {
+    ESP_LOGE(TAG, "Request path too long");
+    return false;
+  }
+
+  // Ask for the blob compressed if the server said it can send it so
+  RequestHeaders headers;
+  if (m_next_encoding == "gzip" || m_next_encoding == "deflate") {
+    headers.append("Accept-Encoding: ")
+        .append(m_next_encoding.c_str())
+        .append("\r\n");
+  }
+
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  OtaWrite ota;
+  ota.http = &m_http;
+  ota.length = -1;
+  ota.started = false;
+  ota.inflate = NULL;
+  ota.patch = NULL;
+  ota.partition = esp_ota_get_next_update_partition(running);
+  ota.begun = false;
+  ota.image_bytes = 0;
+  ota.flash_ms = 0;
+  ota.patch_ms = 0;
+
+  if (patch) {
+    ota.patch = new (std::nothrow) SimplePatch();
+    if (ota.patch == NULL) {
+      ESP_LOGE(TAG, "Unable to allocate patch buffer");
       return false;
     }
+    ota.patch->reset(ota_running, (void *)running, running->size);
+  }
 
-    for (int i = 0; i < sizeof(m_config.current_version); i++) {
-      if (i < m_next_version.length()) {
-        m_config.current_version[i] = m_next_version.c_str()[i];
-      } else {
-        m_config.current_version[i] = '\0';
-      }
+  WorkTaskConfig writer_config;
+  writer_config.stack_size = CONFRM_OTA_STACK_SIZE;
+  writer_config.priority = CONFRM_OTA_PRIORITY;
+  writer_config.core = CONFRM_OTA_CORE;
+  if (!ota.pipeline.begin(ota_write, &ota, writer_config)) {
+    ESP_LOGE(TAG, "Unable to start OTA writer");
+    delete ota.patch;
+    return false;
+  }
+  mbedtls_sha256_init(&ota.sha);
+  mbedtls_sha256_starts(&ota.sha, 0);
+
+  // The download takes as long as it takes, the connection timeout still
+  // applies between pieces
+  int httpCode = 0;
+  rest_status_t status = stream_rest(
+      path.c_str(), httpCode, ota_sink, &ota, "GET", NULL, 0,
+      headers.length() > 0 ? headers.c_str() : NULL, 0);
+  bool written = ota.pipeline.end();
+  bool compressed = ota.inflate != NULL;
+  if (compressed) {
+    written = written && ota.inflate->done();
+    delete ota.inflate;
+  }
+  if (patch) {
+    written = written && ota.patch->done();
+    delete ota.patch;
+  }
+
+  m_update_stats.download = ota.pipeline.stats();
+  m_update_stats.image_bytes = ota.image_bytes;
+  m_update_stats.patch_ms = ota.patch_ms;
+  m_update_stats.inflate_ms =
+      compressed ? m_update_stats.download.write_ms - ota.flash_ms -
+                       ota.patch_ms
+                 : 0;
+  m_update_stats.patched = patch;
+  ESP_LOGI(TAG, "Update %u bytes in %u ms, writing %u ms, %u stalls",
+           (unsigned)m_update_stats.download.bytes,
+           (unsigned)m_update_stats.download.elapsed_ms,
+           (unsigned)m_update_stats.download.write_ms,
+           (unsigned)m_update_stats.download.stalls);
+  if ((compressed || patch) && m_update_stats.image_bytes > 0) {
+    ESP_LOGI(TAG, "Image %u bytes, downloaded as %u%%, decompressed in %u "
+             "ms, patched in %u ms",
+             (unsigned)m_update_stats.image_bytes,
+             (unsigned)((uint64_t)m_update_stats.download.bytes * 100 /
+                        m_update_stats.image_bytes),
+             (unsigned)m_update_stats.inflate_ms,
+             (unsigned)m_update_stats.patch_ms);
+  }
+
+  unsigned char hash[32];
+  mbedtls_sha256_finish(&ota.sha, hash);
+  mbedtls_sha256_free(&ota.sha);
+  if (ota.begun) {
+    esp_ota_end(ota.handle);
+  }
+  esp_task_wdt_reset(); // Ensure WDT does not trigger for a bit longer
+
+  if (httpCode != 200 || status != REST_OK || !written || !ota.begun) {
+    ESP_LOGE(TAG, "Error downloading blob");
+    return false;
+  }
+
+  bool integrity = true;
+  for (int i = 0; i < 32; i++) {
+    if (hash[i] != m_next_hash[i]) {
+      integrity = false;
     }
-    save_config(m_config);
+  }
+  if (integrity == false) {
+    ESP_LOGE(TAG, "Blob sha256 does not match expected value");
+    return false;
+  }
 
-    esp_ota_set_boot_partition(next);
-    http.end();
-    hard_restart();
+  return true;
+}
+
+bool Confrm::do_update() {
+
+  // If not configured this cannot work
+  if (!m_config_status) {
+    return false;
+  }
+
+  // Likewise, sanity check the update settings
+  if (m_next_version == "" or m_next_blob == "") {
+    return false;
+  }
+
+  // A patch from the running version is much smaller, but if it cannot be
+  // applied, or the image it makes is not the one expected, the full blob
+  // is downloaded instead
+  bool written = false;
+  if (m_next_patch != "") {
+    written = download_update(m_next_patch.c_str(), true);
+    if (!written) {
+      ESP_LOGI(TAG, "Patch failed, downloading full blob");
+    }
+  }
+  if (!written && !download_update(m_next_blob.c_str(), false)) {
+    return false;
+  }
+
+  for (int i = 0; i < sizeof(m_config.current_version); i++) {
+    if (i < m_next_version.length()) {
+      m_config.current_version[i] = m_next_version.c_str()[i];
+    } else {
+      m_config.current_version[i] = '\0';
+    }
   }
+  save_config(m_config);
+
+  esp_ota_set_boot_partition(
+      esp_ota_get_next_update_partition(esp_ota_get_running_partition()));
+  hard_restart();
 
-  http.end();
   return false;
 }
 #elif defined(ARDUINO_ARCH_ESP8266)
@@ -368,14 +783,19 @@ bool Confrm::do_update() {
     return false;
   }
 
-  String request = m_confrm_url + "/blob/?package=" + m_package_name +
-                   "&blob=" + m_next_blob;
+  RequestPath url;
+  url.append(m_confrm_url.c_str());
+  m_requests.blob(url, m_next_blob.c_str());
+  if (!url.ok()) {
+    ESP_LOGE(TAG, "Request path too long");
+    return false;
+  }
 
   WiFiClient client;
   // Disable reboot as we need to update the persistent settings
   // if the update is successful before rebooting
   ESPhttpUpdate.rebootOnUpdate(false);
-  t_httpUpdate_return ret = ESPhttpUpdate.update(client, request);
+  t_httpUpdate_return ret = ESPhttpUpdate.update(client, url.c_str());
 
   switch (ret) {
   case HTTP_UPDATE_FAILED:
@@ -655,71 +1075,318 @@ void Confrm::timer_stop() {
 
 void Confrm::timer_callback(void *ptr) {
   Confrm *self = reinterpret_cast<Confrm *>(ptr);
-  self->yield_do(ptr);
+#if defined(ARDUINO_ARCH_ESP32)
+  // Runs on the shared esp_timer task, which must not wait on the network
+  if (!self->m_worker.post(WORK_POLL)) {
+    ESP_LOGE(TAG, "Worker queue full");
+  }
+#endif
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+void Confrm::work_handler(void *ctx, WorkCommand command) {
+  Confrm *self = reinterpret_cast<Confrm *>(ctx);
+  switch (command) {
+  case WORK_POLL:
+    self->yield_do(ctx);
+    break;
+  case WORK_REFRESH_CONFIG: {
+    std::lock_guard<std::mutex> guard(self->m_mutex);
+    self->refresh_watched();
+    break;
+  }
+  case WORK_UPDATE: {
+    std::lock_guard<std::mutex> guard(self->m_mutex);
+    self->do_update(); // Restarts if successful
+    break;
+  }
+  default:
+    break;
+  }
 }
+#endif
 
-void Confrm::yield() {
+void Confrm::yield(uint32_t budget_us) {
+#if defined(ARDUINO_ARCH_ESP8266)
+  uint32_t start = micros();
+  push_poll();
+#endif
   uint32_t current_time = millis() / 1000;
   if (m_last_yield_time > current_time) {
     m_last_yield_time = current_time;
   } else if (current_time - m_last_yield_time >= m_update_period) {
-    yield_do(reinterpret_cast<void *>(this));
+#if defined(ARDUINO_ARCH_ESP32)
+    m_worker.post(WORK_POLL);
+#else
+    yield_start(YIELD_HEARTBEAT);
+#endif
     m_last_yield_time = current_time;
   }
+#if defined(ARDUINO_ARCH_ESP8266)
+  while (true) {
+    yield_progress_t progress = yield_step();
+    if (progress == YIELD_FINISHED) {
+      break;
+    }
+    if (budget_us == 0) {
+      if (progress == YIELD_WAITING) {
+        delay(1);
+      }
+    } else if (progress == YIELD_WAITING || micros() - start >= budget_us) {
+      break;
+    }
+  }
+  // No other task to run them on, and nothing is locked here
+  m_watchers.dispatch();
+#endif
 }
 
+#if defined(ARDUINO_ARCH_ESP32)
 void Confrm::yield_do(void *ptr) {
   Confrm *self = reinterpret_cast<Confrm *>(ptr);
-#if defined(ARDUINO_ARCH_ESP32)
   std::lock_guard<std::mutex> guard(self->m_mutex);
-  self->timer_stop();
-#endif
-  self->register_node();
-  if (self->check_for_updates()) {
-    ESP_LOGD(TAG, "Rebooting from timer_callback");
-    self->hard_restart(); // The ESP32 does not like updating from the timer
-                          // callback
+  if (self->heartbeat()) {
+    // Done as a separate command, so it does not hold up a yield() caller
+    self->m_worker.post(WORK_UPDATE);
   }
-#if defined(ARDUINO_ARCH_ESP32)
-  self->timer_start();
-#endif
+  self->refresh_watched();
 }
+#endif
 
-void Confrm::set_time() {
-  String request = m_confrm_url + "/time/";
-  int httpCode = 0;
-  String response = short_rest(request, httpCode, "GET");
-  if (httpCode == 200 && response != "" && response != "{}") {
-    std::vector<SimpleJSONElement> content;
-#if defined(CONFRM_TRY_CATCH)
-    try {
-      content = simple_json(response);
-    } catch (...) {
+#if defined(ARDUINO_ARCH_ESP8266)
+/*
+ * Updates done a step at a time by yield(). Each step sends one request,
+ * then parses the response as it arrives over as many calls as it takes,
+ * and acts on it once complete.
+ */
+
+struct Confrm::YieldResponse {
+  union {
+    HeartbeatResponse heartbeat;
+    TimeResponse time;
+    CheckForUpdateResponse check;
+    ConfigResponse config;
+  };
+  SimpleJSONBinding binding;
+  ConfrmJSONParser parser;
+
+  YieldResponse() : binding(), parser(simple_json_bind_callback, &binding) {}
+
+  // Clear the response and bind the schema for the given step
+  void begin(yield_step_t step) {
+    switch (step) {
+    case YIELD_HEARTBEAT:
+      memset(&heartbeat, 0, sizeof(heartbeat));
+      binding = simple_json_binding(heartbeat_schema, heartbeat);
+      break;
+    case YIELD_TIME:
+      memset(&time, 0, sizeof(time));
+      binding = simple_json_binding(time_schema, time);
+      break;
+    case YIELD_CHECK:
+      memset(&check, 0, sizeof(check));
+      binding = simple_json_binding(check_for_update_schema, check);
+      break;
+    default: // Config, the register response is dropped unparsed
+      memset(&config, 0, sizeof(config));
+      binding = simple_json_binding(config_schema, config);
+      break;
+    }
+    parser.reset();
+  }
+
+  // As json_rest, once the whole response has been fed to the parser
+  bool complete(int httpCode) const {
+    if (httpCode != 200) {
+      return false;
+    }
+    if (!parser.finished()) {
       ESP_LOGI(TAG, "Error parsing json");
-      return;
+      return false;
     }
-#else
-    content = simple_json(response);
-    if (content.size() == 0) {
-      ESP_LOGI(
-          TAG,
-          "There may have been an error parsing the JSON, or it was empty");
+    return true;
+  }
+};
+
+bool Confrm::yield_start(yield_step_t step) {
+  if (m_yield_step != YIELD_IDLE) {
+    return false;
+  }
+  if (m_config_status) {
+    m_yield_step = step;
+    m_yield_key = 0;
+  }
+  return true;
+}
+
+Confrm::yield_progress_t Confrm::yield_step() {
+  if (m_yield_step == YIELD_IDLE) {
+    return YIELD_FINISHED;
+  }
+
+  if (!m_yield_sent) {
+    m_yield_path.clear();
+    m_yield_headers.clear();
+    m_yield_payload[0] = '\0';
+    if (m_yield_response == NULL) {
+      m_yield_response = new (std::nothrow) YieldResponse();
+      if (m_yield_response == NULL) {
+        ESP_LOGE(TAG, "Unable to allocate response parser");
+        m_yield_step = YIELD_IDLE;
+        return YIELD_FINISHED;
+      }
+    }
+    const char *method = yield_begin();
+    if (method == NULL) {
+      return YIELD_WORKED; // Nothing to ask for in this step
+    }
+    m_yield_response->begin(m_yield_step);
+    if (!m_yield_path.ok() || !m_yield_headers.ok()) {
+      ESP_LOGE(TAG, "Request path too long");
+      yield_end(0); // As for a response that could not be used
+      return YIELD_WORKED;
+    }
+    int httpCode = m_http.start(
+        method, m_yield_path.c_str(),
+        reinterpret_cast<const uint8_t *>(m_yield_payload),
+        strlen(m_yield_payload),
+        m_yield_headers.length() > 0 ? m_yield_headers.c_str() : NULL,
+        CONFRM_REST_TIMEOUT_MS);
+    if (httpCode < 0) {
+      yield_end(httpCode);
+    } else {
+      m_yield_sent = true;
+    }
+    return YIELD_WORKED;
+  }
+
+  // The register response is not used, it is read and dropped
+  int httpCode =
+      m_http.poll(m_yield_step == YIELD_REGISTER ? NULL : json_sink,
+                  &m_yield_response->parser);
+  if (httpCode == SIMPLE_HTTP_PENDING) {
+    return m_http.progressed() ? YIELD_WORKED : YIELD_WAITING;
+  }
+  m_yield_sent = false;
+  yield_end(httpCode);
+  return YIELD_WORKED;
+}
+
+const char *Confrm::yield_begin() {
+  switch (m_yield_step) {
+  case YIELD_HEARTBEAT:
+    if (m_heartbeat_support == HEARTBEAT_UNSUPPORTED ||
+        !heartbeat_payload(m_yield_payload, sizeof(m_yield_payload))) {
+      m_yield_step = YIELD_REGISTER;
+      return NULL;
+    }
+    m_yield_path.append("/heartbeat/");
+    m_yield_headers.append("Content-Type: application/json\r\n");
+    return "POST";
+  case YIELD_REGISTER:
+    m_requests.register_node(m_yield_path, m_config.current_version);
+    return "PUT";
+  case YIELD_TIME:
+    m_yield_path.append("/time/");
+    return "GET";
+  case YIELD_CHECK:
+    m_requests.check_for_update(m_yield_path, m_config.current_version);
+    return "GET";
+  case YIELD_CONFIG:
+    // Fresh values are served from the cache, stale ones are revalidated
+    while (m_yield_key < m_watchers.size()) {
+      ConfigCacheEntry *entry;
+      m_yield_time = millis();
+      if (config_request(m_watchers.key(m_yield_key), m_yield_time, &entry,
+                         m_yield_path, m_yield_headers) !=
+          CONFIG_CACHE_FRESH) {
+        return "GET";
+      }
+      m_yield_key++;
+    }
+    m_yield_step = YIELD_IDLE;
+    return NULL;
+  default:
+    m_yield_step = YIELD_IDLE;
+    return NULL;
+  }
+}
+
+void Confrm::yield_end(int httpCode) {
+  if (httpCode < 0) {
+    ESP_LOGI(TAG, "Unable to connect to confrm server");
+  }
+
+  YieldResponse &response = *m_yield_response;
+  bool update = false;
+  switch (m_yield_step) {
+  case YIELD_HEARTBEAT: {
+    bool ok = response.complete(httpCode);
+    heartbeat_result_t result = heartbeat_response(
+        httpCode, ok, response.heartbeat, response.binding);
+    update = result == HEARTBEAT_UPDATE;
+    m_yield_step = (result == HEARTBEAT_FALLBACK) ? YIELD_REGISTER : YIELD_CONFIG;
+    break;
+  }
+  case YIELD_REGISTER:
+    m_yield_step = YIELD_TIME;
+    break;
+  case YIELD_TIME:
+    if (response.complete(httpCode) && response.binding.found != 0 &&
+        response.binding.errors == 0) {
+      set_system_time(response.time.time);
     }
+    m_yield_step = YIELD_CHECK;
+    break;
+  case YIELD_CHECK:
+    if (response.complete(httpCode) && response.binding.found != 0) {
+      if (response.binding.errors == 0) {
+        update = update_required(response.check);
+      } else {
+        ESP_LOGE(TAG, "Malformed update details");
+      }
+    }
+    m_yield_step = YIELD_CONFIG;
+    break;
+  case YIELD_CONFIG: {
+    // A value cut short is not stored or returned
+    bool ok = response.complete(httpCode) && response.binding.errors == 0;
+    config_response(m_watchers.key(m_yield_key), m_yield_time, httpCode, ok,
+                    response.config.value, NULL);
+    m_yield_key++;
+    break;
+  }
+  default:
+    break;
+  }
+
+  if (update) {
+    ESP_LOGD(TAG, "Rebooting to update");
+    hard_restart(); // The update is done on boot
+  }
+}
 #endif
-    int64_t epoch = get_simple_json_number(content, "time");
-    struct timeval now;
-    now.tv_sec = epoch;
-    settimeofday(&now, NULL);
+
+void Confrm::set_time() {
+  int httpCode = 0;
+  TimeResponse response = {};
+  SimpleJSONBinding binding = simple_json_binding(time_schema, response);
+  if (json_rest("/time/", httpCode, binding) && binding.found != 0 &&
+      binding.errors == 0) {
+    set_system_time(response.time);
   }
 }
 
 void Confrm::register_node() {
+  RequestPath path;
+  m_requests.register_node(path, m_config.current_version);
+  if (!path.ok()) {
+    ESP_LOGE(TAG, "Request path too long");
+    return;
+  }
+  // Nothing is needed from the response
   int httpCode = 0;
-  String request =
-      m_confrm_url + "/register_node/" + "?package=" + m_package_name +
-      "&node_id=" + WiFi.macAddress() + "&version=" + m_config.current_version +
-      "&description=" + m_node_description + "&platform=" + m_node_platform;
-  short_rest(request, httpCode, "PUT");
+  stream_rest(path.c_str(), httpCode, NULL, NULL, "PUT");
 }
 
 void Confrm::hard_restart() {
@@ -736,36 +1403,401 @@ void Confrm::hard_restart() {
 }
 
 const String Confrm::get_config(String name) {
-  int httpCode = 0;
+  return read_config(name.c_str(), NULL);
+}
+
+String Confrm::read_config(const char *name, ConfigNative *native) {
 #if defined(ARDUINO_ARCH_ESP32)
+  char value[CONFIG_CACHE_VALUE_LENGTH + 1];
+  ConfigCacheLookup cached =
+      m_config_snapshot.read(name, millis(), value, native);
+  if (cached == CONFIG_CACHE_FRESH) {
+    return value;
+  }
+  if (cached == CONFIG_CACHE_STALE) {
+    // Busy with a request, the stale value is better than waiting for it
+    std::unique_lock<std::mutex> probe(m_mutex, std::try_to_lock);
+    if (!probe.owns_lock()) {
+      return value;
+    }
+  }
+
+  if (strlen(name) <= CONFIG_CACHE_KEY_LENGTH) {
+    // Share the request with any other task asking for config, the result
+    // is in the cache once it returns
+    m_config_batcher.request(name, Confrm::fetch_batch, this);
+    std::lock_guard<std::mutex> guard(m_mutex);
+    const ConfigCacheEntry *entry = m_config_cache.peek(name);
+    if (entry == NULL) {
+      return "";
+    }
+    if (native != NULL) {
+      *native = entry->native;
+    }
+    return entry->value;
+  }
+
   std::lock_guard<std::mutex> guard(m_mutex);
 #endif
-  String request = m_confrm_url + "/config/" + "?package=" + m_package_name +
-                   "&node_id=" + WiFi.macAddress() + "&key=" + name;
-  String response = short_rest(request, httpCode, "GET");
-  if (httpCode == 200) {
-    std::vector<SimpleJSONElement> content;
-#if defined(CONFRM_TRY_CATCH)
-    try {
-      content = simple_json(response);
-    } catch (...) {
-      ESP_LOGI(TAG, "Error parsing json");
-      return "";
+  return fetch_config(name, native);
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+bool Confrm::fetch_batch(void *ctx, const char *const *keys, size_t n) {
+  Confrm *self = reinterpret_cast<Confrm *>(ctx);
+  std::lock_guard<std::mutex> guard(self->m_mutex);
+
+  if (n > 1 && self->m_bulk_support != BULK_UNSUPPORTED) {
+    int httpCode = 0;
+    if (self->fetch_configs(keys, n, self->m_batch_table, httpCode)) {
+      // Keys not in the response are not set on the server
+      for (size_t i = 0; i < n; i++) {
+        if (self->m_batch_table.get(keys[i]) == NULL) {
+          self->m_config_cache.remove(keys[i]);
+          self->config_seen(keys[i], "");
+        }
+      }
+      self->publish_config();
+      return true;
     }
-#else
-    content = simple_json(response);
-    if (content.size() == 0) {
-      ESP_LOGI(
-          TAG,
-          "There may have been an error parsing the JSON, or it was empty");
-      return "";
+    if (httpCode != 404) {
+      return false;
     }
+    ESP_LOGI(TAG, "Server does not support bulk config requests");
+    self->m_bulk_support = BULK_UNSUPPORTED;
+  }
+
+  bool ok = true;
+  char value[CONFIG_CACHE_VALUE_LENGTH + 1];
+  for (size_t i = 0; i < n; i++) {
+    int httpCode = 0;
+    self->request_config(keys[i], NULL, httpCode, value);
+    // 0 if another task refreshed the key since the batch was made
+    ok = ok && (httpCode == 0 || httpCode == 200 || httpCode == 304 ||
+                httpCode == 404);
+  }
+  self->publish_config();
+  return ok;
+}
+#endif
+
+void Confrm::publish_config() {
+#if defined(ARDUINO_ARCH_ESP32)
+  m_config_snapshot.publish(m_config_cache);
 #endif
-    return get_simple_json_string(content, "value");
+}
+
+String Confrm::fetch_config(const char *name, ConfigNative *native) {
+  char value[CONFIG_CACHE_VALUE_LENGTH + 1];
+  int httpCode = 0;
+  request_config(name, native, httpCode, value);
+  publish_config();
+  return value;
+}
+
+void Confrm::request_config(const char *name, ConfigNative *native,
+                            int &httpCode, char *value) {
+  uint32_t now = millis();
+  ConfigCacheEntry *entry;
+  RequestPath path;
+  RequestHeaders headers;
+  if (config_request(name, now, &entry, path, headers) ==
+      CONFIG_CACHE_FRESH) {
+    if (native != NULL) {
+      *native = entry->native;
+    }
+    strcpy(value, entry->value);
+    return;
+  }
+  if (!path.ok() || !headers.ok()) {
+    ESP_LOGE(TAG, "Request path too long");
+    value[0] = '\0';
+    return;
+  }
+
+  ConfigResponse response = {};
+  SimpleJSONBinding binding = simple_json_binding(config_schema, response);
+  // A value cut short is not stored or returned
+  bool ok = json_rest(path.c_str(), httpCode, binding, NULL,
+                      headers.length() > 0 ? headers.c_str() : NULL) &&
+            binding.errors == 0;
+  strcpy(value,
+         config_response(name, now, httpCode, ok, response.value, native));
+}
+
+ConfigCacheLookup Confrm::config_request(const char *name, uint32_t now,
+                                         ConfigCacheEntry **entry,
+                                         RequestPath &path,
+                                         RequestHeaders &headers) {
+  ConfigCacheLookup cached = m_config_cache.lookup(name, now, entry);
+  if (cached == CONFIG_CACHE_FRESH) {
+    config_seen(name, (*entry)->value);
+    return cached;
+  }
+
+  // Ask the server to only send the value if it has changed
+  if (cached == CONFIG_CACHE_STALE && (*entry)->etag[0] != '\0') {
+    headers.append("If-None-Match: ").append((*entry)->etag).append("\r\n");
+  }
+
+  m_requests.config(path, name);
+  return cached;
+}
+
+const char *Confrm::config_response(const char *name, uint32_t now,
+                                    int httpCode, bool ok, const char *value,
+                                    ConfigNative *native) {
+  // Found again, as the cache may have changed while the request was made
+  ConfigCacheEntry *entry = m_config_cache.peek(name);
+
+  uint32_t ttl = response_ttl();
+
+  if (httpCode == 304 && entry != NULL) {
+    m_config_cache.revalidated(entry, now, ttl);
+    config_seen(name, entry->value);
+    if (native != NULL) {
+      *native = entry->native;
+    }
+    return entry->value;
+  }
+  if (ok) {
+    entry = m_config_cache.store(name, value, m_http.etag(), now, ttl);
+    config_seen(name, value);
+    if (native != NULL) {
+      if (entry != NULL) {
+        *native = entry->native;
+      } else {
+        config_parse_native(value, *native); // Too long to cache
+      }
+    }
+    return value;
+  }
+  if (httpCode == 404) {
+    m_config_cache.remove(name);
+    config_seen(name, "");
+  } else if (entry != NULL) {
+    ESP_LOGI(TAG, "Unable to refresh config, using cached value");
+    if (native != NULL) {
+      *native = entry->native;
+    }
+    return entry->value;
   }
   return "";
 }
 
+ConfigStatus Confrm::native_config(const char *name, uint8_t type,
+                                   ConfigNative &native) {
+  String value = read_config(name, &native);
+  if (value.length() == 0) {
+    return CONFIG_NOT_FOUND;
+  }
+  if ((native.types & type) == 0) {
+    ESP_LOGE(TAG, "Config %s has unexpected value \"%s\"", name,
+             value.c_str());
+    return CONFIG_INVALID;
+  }
+  return CONFIG_OK;
+}
+
+ConfigStatus Confrm::get_config_int64(const char *name, int64_t &value) {
+  ConfigNative native;
+  ConfigStatus status = native_config(name, CONFIG_NATIVE_INT64, native);
+  if (status == CONFIG_OK) {
+    value = native.int64;
+  }
+  return status;
+}
+
+ConfigStatus Confrm::get_config_bool(const char *name, bool &value) {
+  ConfigNative native;
+  ConfigStatus status = native_config(name, CONFIG_NATIVE_BOOL, native);
+  if (status == CONFIG_OK) {
+    value = native.boolean;
+  }
+  return status;
+}
+
+ConfigStatus Confrm::get_config_double(const char *name, double &value) {
+  ConfigNative native;
+  ConfigStatus status = native_config(name, CONFIG_NATIVE_DOUBLE, native);
+  if (status == CONFIG_OK) {
+    value = native.number;
+  }
+  return status;
+}
+
+ConfigStatus Confrm::get_config_bytes(const char *name, uint8_t *value,
+                                      size_t len) {
+  String str = read_config(name, NULL);
+  if (str.length() == 0) {
+    return CONFIG_NOT_FOUND;
+  }
+  if (!config_decode_bytes(str.c_str(), value, len)) {
+    ESP_LOGE(TAG, "Config %s is not %u bytes of hex or base64", name,
+             (unsigned)len);
+    return CONFIG_INVALID;
+  }
+  return CONFIG_OK;
+}
+
+/*
+ * Collects the top level values of a bulk config response
+ */
+static void config_table_callback(void *ctx,
+                                  const SimpleJSONStreamEvent &event) {
+  ConfigTable *table = reinterpret_cast<ConfigTable *>(ctx);
+  if (event.truncated || event.type == OBJECT || event.type == ARRAY) {
+    ESP_LOGE(TAG, "Ignoring config value for %s", event.key);
+    return;
+  }
+  if (!table->add(event.key, event.key_length, event.value,
+                  event.value_length)) {
+    ESP_LOGE(TAG, "Config table full");
+  }
+}
+
+bool Confrm::fetch_configs(const char *const *keys, size_t n,
+                           ConfigTable &table, int &httpCode) {
+  table.clear();
+  RequestPath path;
+  m_requests.configs(path, keys, n);
+  if (!path.ok()) {
+    ESP_LOGE(TAG, "Request path too long");
+    return false;
+  }
+  if (!json_rest(path.c_str(), httpCode, config_table_callback, &table)) {
+    return false;
+  }
+
+  // Seed the cache so get_config for these keys needs no request
+  uint32_t now = millis();
+  uint32_t ttl = response_ttl();
+  for (size_t i = 0; i < table.size(); i++) {
+    m_config_cache.store(table.key(i), table.value(i), NULL, now, ttl);
+    config_seen(table.key(i), table.value(i));
+  }
+  publish_config();
+  return true;
+}
+
+bool Confrm::get_configs(const char *const *keys, size_t n,
+                         ConfigTable &table) {
+  int httpCode = 0;
+  {
+#if defined(ARDUINO_ARCH_ESP32)
+    std::lock_guard<std::mutex> guard(m_mutex);
+#endif
+    if (fetch_configs(keys, n, table, httpCode)) {
+      return true;
+    }
+  }
+
+  // Older servers without the bulk endpoint
+  if (httpCode != 404) {
+    return false;
+  }
+  table.clear();
+  for (size_t i = 0; i < n; i++) {
+    String value = get_config(keys[i]);
+    if (value.length() > 0) {
+      table.add(keys[i], strlen(keys[i]), value.c_str(), value.length());
+    }
+  }
+  return true;
+}
+
+bool Confrm::get_all_configs(ConfigTable &table) {
+  int httpCode = 0;
+#if defined(ARDUINO_ARCH_ESP32)
+  std::lock_guard<std::mutex> guard(m_mutex);
+#endif
+  return fetch_configs(NULL, 0, table, httpCode);
+}
+
+void Confrm::set_config_ttl(uint32_t seconds) {
+#if defined(ARDUINO_ARCH_ESP32)
+  std::lock_guard<std::mutex> guard(m_mutex);
+#endif
+  m_config_ttl = config_ttl_ms(seconds);
+}
+
+uint32_t Confrm::response_ttl() const {
+  if (m_http.max_age() >= 0) {
+    return config_ttl_ms((uint32_t)m_http.max_age());
+  }
+  return m_config_ttl;
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+void Confrm::set_config_batch_window(uint32_t ms) {
+  m_config_batcher.set_window(ms);
+}
+
+ConfigBatchStats Confrm::get_config_batch_stats() {
+  return m_config_batcher.stats();
+}
+#endif
+
+ConfigCacheStats Confrm::get_config_cache_stats() {
+#if defined(ARDUINO_ARCH_ESP32)
+  std::lock_guard<std::mutex> guard(m_mutex);
+#endif
+  ConfigCacheStats stats = m_config_cache.stats();
+#if defined(ARDUINO_ARCH_ESP32)
+  stats.hits += m_config_snapshot.hits();
+#endif
+  return stats;
+}
+
+bool Confrm::on_config_change(const char *key, ConfigChangeCallback callback,
+                              void *ctx) {
+#if defined(ARDUINO_ARCH_ESP32)
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (m_dispatch_task == NULL &&
+      xTaskCreate(Confrm::dispatch_task, "confrm_config",
+                  CONFRM_DISPATCH_STACK_SIZE, this, 1,
+                  &m_dispatch_task) != pdPASS) {
+    ESP_LOGE(TAG, "Unable to start config change task");
+    m_dispatch_task = NULL;
+    return false;
+  }
+#endif
+  if (!m_watchers.add(key, callback, ctx)) {
+    ESP_LOGE(TAG, "Unable to watch config %s", key);
+    return false;
+  }
+  fetch_config(key); // Current value, delivered as the first change
+  return true;
+}
+
+void Confrm::config_seen(const char *key, const char *value) {
+  if (m_watchers.notify(key, value)) {
+#if defined(ARDUINO_ARCH_ESP32)
+    xTaskNotifyGive(m_dispatch_task);
+#endif
+  }
+}
+
+void Confrm::refresh_watched() {
+  // Fresh values are served from the cache, stale ones are revalidated
+  char value[CONFIG_CACHE_VALUE_LENGTH + 1];
+  for (size_t i = 0; i < m_watchers.size(); i++) {
+    int httpCode = 0;
+    request_config(m_watchers.key(i), NULL, httpCode, value);
+  }
+  publish_config();
+}
+
+void Confrm::dispatch_task(void *ptr) {
+  Confrm *self = reinterpret_cast<Confrm *>(ptr);
+  while (true) {
+#if defined(ARDUINO_ARCH_ESP32)
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#endif
+    self->m_watchers.dispatch();
+  }
+}
+
 Confrm::Confrm(String package_name, String confrm_url, String node_description,
                String node_platform, int32_t update_period,
                const bool reset_configuration) {
@@ -778,8 +1810,16 @@ Confrm::Confrm(String package_name, String confrm_url, String node_description,
 
   m_package_name = package_name;
   m_confrm_url = confrm_url;
-  m_node_description = simple_url_encode(node_description);
+  connection_begin();
+#if defined(ARDUINO_ARCH_ESP32)
+  m_config_batcher.set_window(CONFRM_CONFIG_BATCH_MS);
+#endif
+  m_node_description = node_description;
   m_node_platform = node_platform;
+  if (!m_requests.begin(m_package_name.c_str(), WiFi.macAddress().c_str(),
+                        m_node_description.c_str(), m_node_platform.c_str())) {
+    ESP_LOGE(TAG, "Package name or node details too long");
+  }
 
   m_config_status = init_config(reset_configuration);
   if (!m_config_status) {
@@ -787,14 +1827,23 @@ Confrm::Confrm(String package_name, String confrm_url, String node_description,
   }
 
   // Register the node first, before checking for updates
-  register_node();
-
-  if (check_for_updates()) {
+  if (heartbeat()) {
     do_update();
     register_node();
   }
 
   m_update_period = update_period;
+
+#if defined(ARDUINO_ARCH_ESP32)
+  WorkTaskConfig worker_config;
+  worker_config.stack_size = CONFRM_WORKER_STACK_SIZE;
+  worker_config.priority = CONFRM_WORKER_PRIORITY;
+  worker_config.core = CONFRM_WORKER_CORE;
+  if (!m_worker.begin(Confrm::work_handler, this, worker_config)) {
+    ESP_LOGE(TAG, "Unable to start worker task");
+  }
+#endif
+
   if (m_update_period > 2) {
 #if defined(ARDUINO_ARCH_ESP32)
     esp_timer_create_args_t timer_config;
@@ -821,3 +1870,9 @@ Confrm::Confrm(String package_name, String confrm_url,
   Confrm(package_name, confrm_url, node_description, node_platform,
          update_period, reset_config);
 }
+
+Confrm::~Confrm() {
+#if defined(ARDUINO_ARCH_ESP8266)
+  delete m_yield_response;
+#endif
+}
@@ -21,9 +21,14 @@
 #include <unistd.h> // uintXX_t definition
 
 #include <Arduino.h> // String type
+#include <Client.h>
+#include <WiFiClient.h>
 
 #if defined(ARDUINO_ARCH_ESP32)
 #include "esp_timer.h" // esp_timer_handle_t definition
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <WiFiClientSecure.h>
 #include <mutex>
 #define CONFRM_PLATFORM "esp32"
 #elif defined(ARDUINO_ARCH_ESP8266)
@@ -31,6 +36,48 @@
 #define CONFRM_PLATFORM "esp8266"
 #endif
 
+#include "config_cache.h"
+#if defined(ARDUINO_ARCH_ESP32)
+#include "config_batch.h"
+#include "config_snapshot.h"
+#include "ota_pipeline.h"
+#include "work_queue.h"
+#endif
+#include "config_watch.h"
+#include "push_channel.h"
+#include "request_builder.h"
+#include "simple_http.h"
+
+// Buffer for the heartbeat request body
+#ifndef CONFRM_HEARTBEAT_LENGTH
+#define CONFRM_HEARTBEAT_LENGTH 320
+#endif
+
+// Time limit for REST calls other than the blob download
+#ifndef CONFRM_REST_TIMEOUT_MS
+#define CONFRM_REST_TIMEOUT_MS 10000
+#endif
+
+struct SimpleJSONBinding;
+struct SimpleJSONStreamEvent;
+struct HeartbeatResponse;
+struct CheckForUpdateResponse;
+
+#if defined(ARDUINO_ARCH_ESP32)
+/**
+ * Counters for an update download. For a compressed blob the compression
+ * ratio is download.bytes / image_bytes, and the decompression rate is
+ * image_bytes / inflate_ms.
+ */
+struct UpdateStats {
+  OtaPipelineStats download; // The blob as received
+  uint32_t image_bytes;      // Written to the partition
+  uint32_t inflate_ms;       // Spent decompressing, 0 if not compressed
+  uint32_t patch_ms;         // Spent applying a patch
+  bool patched;              // The blob was a patch to the running image
+};
+#endif
+
 class Confrm {
 
 public:
@@ -107,21 +154,191 @@ public:
          String node_platform = CONFRM_PLATFORM, int32_t update_period = 60,
          bool reset_configuration = false);
 
+  ~Confrm();
+
   /**
    * Queries the confrm server for the given string name
    *
+   * Values are cached, a repeat call within the TTL returns the cached value
+   * without a request. Once the TTL has passed the value is revalidated with
+   * the server, which only sends it again if it has changed. If the server
+   * cannot be reached the last known value is returned.
+   *
+   * On the esp32 cached values are read without taking the Confrm lock, so
+   * a read never waits for a request made by another task. If a value is
+   * stale while a request is in progress the stale value is returned.
+   *
    * @param name    Config name to ask the server for
    * @returns       Empty string if not found, or string result if found
    */
   const String get_config(String name);
 
+  /**
+   * Typed versions of get_config
+   *
+   * Values are converted once when they arrive from the server and kept
+   * in the cache in their native form, so repeat reads do no parsing.
+   * Integers are base 10, booleans are true/false, yes/no, on/off or 1/0.
+   * The value is only written on CONFIG_OK.
+   *
+   * @param name    Config name to ask the server for
+   * @param value   Set to the value
+   * @returns       CONFIG_NOT_FOUND if the key is not set, CONFIG_INVALID if
+   *                the value is not of the type asked for
+   */
+  ConfigStatus get_config_int64(const char *name, int64_t &value);
+  ConfigStatus get_config_bool(const char *name, bool &value);
+  ConfigStatus get_config_double(const char *name, double &value);
+
+  /**
+   * Reads a config value holding a fixed number of bytes, such as a key,
+   * written as hex or base64
+   *
+   * @param name    Config name to ask the server for
+   * @param value   Filled with exactly len bytes
+   * @param len     Number of bytes expected
+   * @returns       CONFIG_INVALID if the value is not len bytes of hex or
+   *                base64
+   */
+  ConfigStatus get_config_bytes(const char *name, uint8_t *value, size_t len);
+
+  /**
+   * Queries the confrm server for several config values in one request
+   *
+   * The results are sorted in to the table for lookup with table.get(key),
+   * keys not found on the server are not in the table. The values also
+   * update the config cache, so later get_config calls for them are served
+   * locally.
+   *
+   * Falls back to a get_config call per key if the server does not support
+   * bulk requests.
+   *
+   * @param keys    Config names to ask the server for
+   * @param n       Number of names
+   * @param table   Filled with the values found
+   * @returns       False if the request failed
+   */
+  bool get_configs(const char *const *keys, size_t n, ConfigTable &table);
+
+  /**
+   * Fetches every config value set for this package and node, as for
+   * get_configs.
+   *
+   * @param table   Filled with the values found
+   * @returns       False if the request failed
+   */
+  bool get_all_configs(ConfigTable &table);
+
+  /**
+   * Sets how long config values are cached for when the server does not
+   * give a Cache-Control max-age, up to CONFRM_CONFIG_MAX_TTL. Set to 0 to
+   * revalidate on every call.
+   *
+   * @param seconds  Time to live of cached config values
+   */
+  void set_config_ttl(uint32_t seconds);
+
+  /**
+   * Counters for the config cache
+   */
+  ConfigCacheStats get_config_cache_stats(void);
+
+#if defined(ARDUINO_ARCH_ESP32)
+  /**
+   * Sets how long a config request waits for requests from other tasks to
+   * join it, so they are made as one request to the server
+   *
+   * Tasks asking for a key that is already being requested always wait for
+   * that request rather than making their own, whatever the window.
+   *
+   * @param ms  Window in milliseconds, 0 to only combine requests made
+   *            while another is in progress
+   */
+  void set_config_batch_window(uint32_t ms);
+
+  /**
+   * Counters for combined config requests, requests / fetches is the
+   * number of get_config calls served by each request to the server
+   */
+  ConfigBatchStats get_config_batch_stats(void);
+#endif
+
+  /**
+   * Calls back when a config value changes, so the application does not
+   * need to poll get_config
+   *
+   * The callback is called with the current value once it is known, then
+   * each time the value on the server changes. Changes are picked up as the
+   * cached value is refreshed, when the heartbeat reports a change and when
+   * a push notification arrives. The value is empty if the key is removed.
+   *
+   * Callbacks are run on their own task on the esp32, and from yield() on
+   * the esp8266, never from within a request to the server, so they may call
+   * get_config. If a value changes several times before the callback runs it
+   * is only called with the latest value.
+   *
+   * @param key       Config name to watch
+   * @param callback  Called with the key, the new value and ctx
+   * @param ctx       Passed to the callback
+   * @returns         False if the key is too long or too many keys are
+   *                  watched
+   */
+  bool on_config_change(const char *key, ConfigChangeCallback callback,
+                        void *ctx = NULL);
+
   /**
    * Processes the time based updates for confrm.
    *
    * Is primarily used where background timers are not suitable, or where
    * foreground tasks need to take priority over any background activity.
+   *
+   * On the esp8266 the updates are done a step at a time, each call doing
+   * as many steps as fit in the budget: sending a request, reading the part
+   * of the response that has arrived, or acting on a complete response. A
+   * call returns early rather than wait for the server. Opening a new
+   * connection to the server still blocks until connected.
+   *
+   * On the esp32 the updates are passed to the background task, and the
+   * call returns straight away.
+   *
+   * @param budget_us  Time to spend in microseconds, 0 to finish any
+   *                   updates that are due before returning
+   */
+  void yield(uint32_t budget_us = 0);
+
+  /**
+   * Subscribes to change notifications from the confrm server
+   *
+   * Updates and config changes are acted on as soon as the server publishes
+   * them, rather than at the next poll. On the esp32 the subscription runs
+   * on its own task, on the esp8266 it is serviced by yield(). Polling
+   * carries on as before, so nothing is missed if the server does not
+   * support notifications or the connection drops.
+   *
+   * @returns False if the subscription could not be started
+   */
+  bool enable_push(void);
+
+  /**
+   * Counters for the notification subscription
    */
-  void yield(void);
+  PushStats get_push_stats(void);
+
+  /**
+   * Counters for the connection to the confrm server, shows how often the
+   * persistent connection was reused rather than reopened.
+   */
+  SimpleHTTPStats get_connection_stats(void);
+
+#if defined(ARDUINO_ARCH_ESP32)
+  /**
+   * Counters for the last update download, which show whether the download
+   * or the flash writes held it back, and how well a compressed blob did.
+   * An update that succeeds restarts the node, so these are mostly of use
+   * after one fails.
+   */
+  UpdateStats get_update_stats(void);
+#endif
 
   /**
    * Configuration struct, data is read from the non-volatile partition in
@@ -209,6 +426,187 @@ private:
    */
   String m_confrm_url;
 
+  /**
+   * @brief Builds request paths, with the node details encoded once
+   */
+  RequestBuilder m_requests;
+
+  /**
+   * @brief Cache of config values, and default time to live in ms
+   */
+  ConfigCache m_config_cache;
+  uint32_t m_config_ttl = 10000;
+
+  /**
+   * @brief Get a config value through the cache, caller holds m_mutex
+   *
+   * @param native  If not NULL, set to the parsed value when one is found
+   */
+  String fetch_config(const char *name, ConfigNative *native = NULL);
+
+  /**
+   * @brief The cache part of fetch_config, without publishing the result
+   *
+   * @param httpCode  Set to the http code of the request, left as is if no
+   *                  request was made
+   * @param value     Set to the value, at least CONFIG_CACHE_VALUE_LENGTH + 1
+   *                  bytes
+   */
+  void request_config(const char *name, ConfigNative *native, int &httpCode,
+                      char *value);
+
+  /**
+   * @brief Get a config value for the application, caller does not hold
+   * m_mutex
+   *
+   * On the esp32 fresh values are read from the snapshot and requests are
+   * shared with other tasks through the batcher.
+   */
+  String read_config(const char *name, ConfigNative *native);
+
+#if defined(ARDUINO_ARCH_ESP32)
+  /**
+   * @brief Copy of the config cache read without taking m_mutex, so tasks
+   * reading config do not wait while it is held for a request
+   */
+  ConfigSnapshot m_config_snapshot;
+
+  /**
+   * @brief Combines config requests made by several tasks at once
+   */
+  ConfigBatcher m_config_batcher;
+  ConfigTable m_batch_table;
+
+  /**
+   * @brief Fetch a batch of keys in to the cache, called by the batcher
+   */
+  static bool fetch_batch(void *ctx, const char *const *keys, size_t n);
+#endif
+
+  /**
+   * Whether the server supports bulk config requests, found out on the
+   * first batch of more than one key
+   */
+  enum bulk_support_t { BULK_UNKNOWN, BULK_UNSUPPORTED };
+  bulk_support_t m_bulk_support = BULK_UNKNOWN;
+
+  /**
+   * @brief Publish changes to the config cache to the snapshot, caller holds
+   * m_mutex
+   */
+  void publish_config(void);
+
+  /**
+   * @brief The parts of request_config before and after the request
+   *
+   * config_request looks the key up in the cache, and if it must be asked
+   * for sets the path and headers of the request. config_response acts on
+   * the response, finding the entry again as the cache may have changed,
+   * and returns the value to use, valid until the cache is next changed.
+   */
+  ConfigCacheLookup config_request(const char *name, uint32_t now,
+                                   ConfigCacheEntry **entry, RequestPath &path,
+                                   RequestHeaders &headers);
+  const char *config_response(const char *name, uint32_t now, int httpCode,
+                              bool ok, const char *value,
+                              ConfigNative *native);
+
+  /**
+   * @brief TTL in milliseconds for values in the last response, from its
+   * Cache-Control max-age if it had one, capped at CONFRM_CONFIG_MAX_TTL
+   */
+  uint32_t response_ttl(void) const;
+
+  /**
+   * @brief Get a config value and check it is valid as a type
+   *
+   * @param type    CONFIG_NATIVE_ flag of the type wanted
+   * @param native  Set to the parsed value
+   */
+  ConfigStatus native_config(const char *name, uint8_t type,
+                             ConfigNative &native);
+
+  /**
+   * @brief Keys with change callbacks, and the changes waiting to be
+   * delivered
+   */
+  ConfigWatchers m_watchers;
+#if defined(ARDUINO_ARCH_ESP32)
+  TaskHandle_t m_dispatch_task = NULL;
+#endif
+
+  /**
+   * @brief Pass a value from the server to the watchers, waking the
+   * dispatcher if it changed
+   */
+  void config_seen(const char *key, const char *value);
+
+  /**
+   * @brief Refresh every watched key that is stale in the cache, caller
+   * holds m_mutex
+   */
+  void refresh_watched(void);
+
+  /**
+   * @brief Background task running the change callbacks on the esp32
+   */
+  static void dispatch_task(void *ptr);
+
+  /**
+   * @brief Persistent connection to the confrm server
+   *
+   * All REST calls share the one keep-alive connection, which is reopened
+   * transparently if the server closes it.
+   */
+  WiFiClient m_client;
+#if defined(ARDUINO_ARCH_ESP32)
+  WiFiClientSecure m_secure_client;
+#endif
+  SimpleHTTPConnection<Client> m_http;
+
+  /**
+   * @brief Point the connection at m_confrm_url
+   */
+  void connection_begin(void);
+
+  /**
+   * @brief Notification subscription, on its own connection as the
+   * response never ends
+   */
+  WiFiClient m_push_client;
+#if defined(ARDUINO_ARCH_ESP32)
+  WiFiClientSecure m_push_secure_client;
+  TaskHandle_t m_push_task = NULL;
+#endif
+  PushChannel<Client> m_push;
+
+  /**
+   * @brief Set by a push notification, the update check is done from
+   * push_poll rather than from within the event callback
+   */
+  volatile bool m_push_update = false;
+
+  /**
+   * @brief Set by a config notification, the watched keys are refreshed
+   * from push_poll
+   */
+  volatile bool m_push_config = false;
+
+  /**
+   * @brief Read any notifications and act on them
+   */
+  void push_poll(void);
+
+  /**
+   * @brief Called by the push channel for each notification
+   */
+  static void push_callback(void *ctx, PushEvent event, const char *data);
+
+  /**
+   * @brief Background task servicing the push channel on the esp32
+   */
+  static void push_task(void *ptr);
+
   /**
    * @brief Description of this node (i.e. Temperature Sensor)
    */
@@ -220,20 +618,95 @@ private:
   String m_node_platform = CONFRM_PLATFORM;
 
   /**
-   * @brief Obtain result for short REST API calls
+   * @brief Outcome of a REST call
+   */
+  enum rest_status_t {
+    REST_OK,         // 2xx response read to completion
+    REST_HTTP_ERROR, // Response was not 2xx, see httpCode
+    REST_INCOMPLETE, // Response cut short, by the server or the time limit
+    REST_FAILED      // No response, see httpCode
+  };
+
+  /**
+   * @brief Sink for response data, called for each chunk read from the
+   * server. Return false to stop reading.
+   */
+  typedef bool (*response_sink_t)(void *ctx, const uint8_t *data, size_t len);
+
+  /**
+   * @brief Stream the response of a REST API call in to a sink
+   *
+   * Response data is passed to the sink as it arrives from the server, so
+   * there is no limit on the length of the response and no buffer for the
+   * full response is allocated. Chunked responses are decoded on the way.
+   * The sink can be the JSON parser, a hash or a flash writer.
+   *
+   * The payload is sent as-is from the given buffer, a SimpleJSONWriter can
+   * be used to build JSON payloads without a String.
+   *
+   * The request is sent on the persistent connection to the server.
+   *
+   * @param path         Path and query of REST call, relative to the server
+   *                     URL
+   * @param httpCode     Will contain the return http code
+   * @param sink         Called with each chunk of the response body
+   * @param ctx          Passed to the sink
+   * @param type         GET/PUT/POST
+   * @param payload      PUT/POST content, if required
+   * @param payload_len  Length of payload
+   * @param headers      Extra request header lines, each ending "\r\n"
+   * @param limit_ms     Time limit for the whole call, 0 for none
+   * @return REST_OK if a 2xx response was read to completion
+   */
+  rest_status_t stream_rest(const char *path, int &httpCode,
+                            response_sink_t sink, void *ctx,
+                            const char *type = "GET",
+                            const uint8_t *payload = NULL,
+                            size_t payload_len = 0, const char *headers = NULL,
+                            uint32_t limit_ms = CONFRM_REST_TIMEOUT_MS);
+
+  /**
+   * @brief Stream a REST API call response through the JSON parser
+   *
+   * @param path      Path and query of REST call, relative to the server URL
+   * @param httpCode  Will contain the return http code
+   * @param binding   Schema binding the top level JSON elements are stored
+   *                  through
+   * @param payload   JSON document to POST, or NULL to GET
+   * @param headers   Extra request header lines, each ending "\r\n"
+   * @return True if a complete JSON object was received
+   */
+  bool json_rest(const char *path, int &httpCode, SimpleJSONBinding &binding,
+                 const char *payload = NULL, const char *headers = NULL);
+
+  /**
+   * @brief Stream a REST API call response through the JSON parser, passing
+   * each top level element to a callback
    *
-   * Obtains response from server for given API call, uses full URL. If the
-   * response is longer than the heap allocation the method will return an
-   * empty string.
+   * @param path      Path and query of REST call, relative to the server URL
+   * @param httpCode  Will contain the return http code
+   * @param callback  Called with each top level element
+   * @param ctx       Passed to the callback
+   * @param payload   JSON document to POST, or NULL to GET
+   * @param headers   Extra request header lines, each ending "\r\n"
+   * @return True if a complete JSON object was received
+   */
+  bool json_rest(const char *path, int &httpCode,
+                 void (*callback)(void *, const SimpleJSONStreamEvent &),
+                 void *ctx, const char *payload = NULL,
+                 const char *headers = NULL);
+
+  /**
+   * @brief Fetch config values in to a table with one request
    *
-   * @param url       URL of REST GET call
-   * @param type      GET/PUT/POST
-   * @param payload   PUT/POST content, if required
+   * @param keys    Config names to ask for
+   * @param n       Number of names, 0 for all
+   * @param table   Filled with the values found
    * @param httpCode  Will contain the return http code
-   * @return      Response as string, or empty string on error
+   * @return True if a complete response was received
    */
-  String short_rest(String url, int &httpCode, String type = "GET",
-                    String payload = "");
+  bool fetch_configs(const char *const *keys, size_t n, ConfigTable &table,
+                     int &httpCode);
 
   /**
    * @brief Initialises REST calls to the confrm server to check for updates
@@ -242,6 +715,60 @@ private:
    */
   bool check_for_updates(void);
 
+  /**
+   * @brief Act on the update information returned by the server
+   *
+   * Stores the next version details if an update is required, and restarts
+   * the node if the server asks for a reboot.
+   *
+   * @return True if update required
+   */
+  bool update_required(const CheckForUpdateResponse &update);
+
+  /**
+   * Whether the server supports the combined heartbeat call, found out on
+   * the first heartbeat.
+   */
+  enum heartbeat_support_t {
+    HEARTBEAT_UNKNOWN,
+    HEARTBEAT_SUPPORTED,
+    HEARTBEAT_UNSUPPORTED
+  };
+  heartbeat_support_t m_heartbeat_support = HEARTBEAT_UNKNOWN;
+
+  /**
+   * @brief Write the heartbeat request body
+   *
+   * @return False if it does not fit
+   */
+  bool heartbeat_payload(char *payload, size_t len);
+
+  /**
+   * @brief Act on the response to a heartbeat
+   *
+   * @param ok       True if a complete JSON object was received
+   * @param binding  Fields found in the response, and any in error
+   * @return HEARTBEAT_FALLBACK if the separate calls should be made instead
+   */
+  enum heartbeat_result_t {
+    HEARTBEAT_DONE,
+    HEARTBEAT_UPDATE,
+    HEARTBEAT_FALLBACK
+  };
+  heartbeat_result_t heartbeat_response(int httpCode, bool ok,
+                                        const HeartbeatResponse &response,
+                                        const SimpleJSONBinding &binding);
+
+  /**
+   * @brief Register the node, sync the time and check for updates
+   *
+   * Uses a single POST to /heartbeat/ when the server supports it, otherwise
+   * falls back to register_node, set_time and check_for_updates.
+   *
+   * @return True if update required
+   */
+  bool heartbeat(void);
+
   /**
    * If there is an update to be done, the update specifics will be stored
    * here.
@@ -249,6 +776,8 @@ private:
   String m_next_version;
   unsigned char m_next_hash[32];
   String m_next_blob;
+  String m_next_encoding; // Compression the server offers the blob with
+  String m_next_patch;    // Patch from the running version, if offered
 
   /**
    * @brief Action the required update
@@ -260,21 +789,121 @@ private:
    */
   bool do_update(void);
 
+#if defined(ARDUINO_ARCH_ESP32)
+  /**
+   * @brief Download a blob in to the next partition and check its hash
+   *
+   * @param blob   Blob to download
+   * @param patch  The blob is a patch to the running image
+   * @return False if the download fails or the image is not as expected
+   */
+  bool download_update(const char *blob, bool patch);
+#endif
+
   /**
    * Update timer period in seconds
    */
   int m_update_period;
 
+#if defined(ARDUINO_ARCH_ESP32)
   /**
    * @brief Does the yield work
    */
   void yield_do(void *self);
+#endif
+
+#if defined(ARDUINO_ARCH_ESP8266)
+  /**
+   * Steps of the updates done by yield() on the esp8266, in the order they
+   * are done. The register, time and check steps are only done if the
+   * server does not support the heartbeat.
+   */
+  enum yield_step_t {
+    YIELD_IDLE,
+    YIELD_HEARTBEAT,
+    YIELD_REGISTER,
+    YIELD_TIME,
+    YIELD_CHECK,
+    YIELD_CONFIG // Refresh each watched key in turn
+  };
+  yield_step_t m_yield_step = YIELD_IDLE;
+
+  /**
+   * Request of the current step, kept while it is in progress as the
+   * connection sends it again if the server had closed it.
+   */
+  bool m_yield_sent = false;
+  RequestPath m_yield_path;
+  RequestHeaders m_yield_headers;
+  char m_yield_payload[CONFRM_HEARTBEAT_LENGTH];
+
+  /**
+   * Response of the current step, parsed as it arrives. Allocated by the
+   * first step and reused for every response after it.
+   */
+  struct YieldResponse;
+  YieldResponse *m_yield_response = NULL;
+
+  /**
+   * Watched key being refreshed, and when its request was made
+   */
+  size_t m_yield_key = 0;
+  uint32_t m_yield_time = 0;
+
+  /**
+   * @brief Start the updates from the given step, if they are not already
+   * in progress
+   *
+   * @return False if busy with earlier updates
+   */
+  bool yield_start(yield_step_t step);
+
+  /**
+   * @brief Do the next piece of the updates without waiting
+   *
+   * @return YIELD_WAITING if waiting on the server, YIELD_FINISHED if there
+   * is nothing left to do
+   */
+  enum yield_progress_t { YIELD_WORKED, YIELD_WAITING, YIELD_FINISHED };
+  yield_progress_t yield_step(void);
+
+  /**
+   * @brief Set up the request for the current step
+   *
+   * @return The method, or NULL if there is nothing to ask for and the
+   * step was moved on
+   */
+  const char *yield_begin(void);
+
+  /**
+   * @brief Act on the response to the current step and move on
+   *
+   * @param httpCode  http code, or negative if the request failed
+   */
+  void yield_end(int httpCode);
+#endif
 
   /**
    * Handle to configured timer object, used for starting and stopping timer
    */
 #if defined(ARDUINO_ARCH_ESP32)
   esp_timer_handle_t m_timer;
+
+  /**
+   * @brief Task doing the requests to the server, so the timer and push
+   * callbacks only post work and never block on the network
+   */
+  WorkQueue m_worker;
+
+  /**
+   * @brief Counters for the last update download
+   */
+  UpdateStats m_update_stats = {};
+
+  /**
+   * @brief Runs each command posted to the worker
+   */
+  static void work_handler(void *ctx, WorkCommand command);
 #endif
 
   /**
@@ -291,8 +920,8 @@ private:
    * @brief Timer callback
    *
    * This is static so that the compiler knows where to point the callback to.
-   * The method will reinterpret_cast the ptr to a Confrm* in order to access
-   * check_for_updates and do_update methods.
+   * The method will reinterpret_cast the ptr to a Confrm* in order to post
+   * a poll to the worker task.
    *
    * @param ptr Pointer to 'this'
    */
@@ -0,0 +1,100 @@
+/** @file
+ * Responses from the confrm server, and the schemas they are parsed with
+ *
+ *  Copyright 2020 confrm.io
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __CONFRM_RESPONSES_H__
+#define __CONFRM_RESPONSES_H__
+
+#include <cstdint>
+
+// Defines functions, so is only included by confrm.cpp in the library
+#include "simple_json.h"
+
+// Fixed buffer sizes used when parsing responses from the server
+#define CONFRM_JSON_KEY_LENGTH 32
+#define CONFRM_JSON_VALUE_LENGTH 256
+
+typedef SimpleJSONStreamParser<CONFRM_JSON_KEY_LENGTH, CONFRM_JSON_VALUE_LENGTH>
+    ConfrmJSONParser;
+
+struct CheckForUpdateResponse {
+  char version[32];
+  bool force;
+  bool reboot;
+  char blob[33];
+  uint8_t hash[32];
+  char encoding[16]; // Content-Encoding the server can send the blob with
+  char patch[33];    // Blob patching the reported version to this one
+};
+
+constexpr SimpleJSONField check_for_update_schema[] = {
+    SIMPLE_JSON_FIELD(CheckForUpdateResponse, "current_version", version,
+                      SIMPLE_JSON_FIELD_STRING),
+    SIMPLE_JSON_FIELD(CheckForUpdateResponse, "force", force,
+                      SIMPLE_JSON_FIELD_BOOL),
+    SIMPLE_JSON_FIELD(CheckForUpdateResponse, "reboot", reboot,
+                      SIMPLE_JSON_FIELD_BOOL),
+    SIMPLE_JSON_FIELD(CheckForUpdateResponse, "blob", blob,
+                      SIMPLE_JSON_FIELD_STRING),
+    SIMPLE_JSON_FIELD(CheckForUpdateResponse, "hash", hash,
+                      SIMPLE_JSON_FIELD_HEX),
+    SIMPLE_JSON_FIELD(CheckForUpdateResponse, "blob_encoding", encoding,
+                      SIMPLE_JSON_FIELD_STRING),
+    SIMPLE_JSON_FIELD(CheckForUpdateResponse, "patch", patch,
+                      SIMPLE_JSON_FIELD_STRING)};
+
+struct HeartbeatResponse {
+  CheckForUpdateResponse update;
+  int64_t time;
+  bool config_changed;
+};
+
+constexpr SimpleJSONField heartbeat_schema[] = {
+    SIMPLE_JSON_FIELD(HeartbeatResponse, "time", time,
+                      SIMPLE_JSON_FIELD_INT64),
+    SIMPLE_JSON_FIELD(HeartbeatResponse, "current_version", update.version,
+                      SIMPLE_JSON_FIELD_STRING),
+    SIMPLE_JSON_FIELD(HeartbeatResponse, "force", update.force,
+                      SIMPLE_JSON_FIELD_BOOL),
+    SIMPLE_JSON_FIELD(HeartbeatResponse, "reboot", update.reboot,
+                      SIMPLE_JSON_FIELD_BOOL),
+    SIMPLE_JSON_FIELD(HeartbeatResponse, "blob", update.blob,
+                      SIMPLE_JSON_FIELD_STRING),
+    SIMPLE_JSON_FIELD(HeartbeatResponse, "hash", update.hash,
+                      SIMPLE_JSON_FIELD_HEX),
+    SIMPLE_JSON_FIELD(HeartbeatResponse, "config_changed", config_changed,
+                      SIMPLE_JSON_FIELD_BOOL),
+    SIMPLE_JSON_FIELD(HeartbeatResponse, "blob_encoding", update.encoding,
+                      SIMPLE_JSON_FIELD_STRING),
+    SIMPLE_JSON_FIELD(HeartbeatResponse, "patch", update.patch,
+                      SIMPLE_JSON_FIELD_STRING)};
+
+struct TimeResponse {
+  int64_t time;
+};
+
+constexpr SimpleJSONField time_schema[] = {
+    SIMPLE_JSON_FIELD(TimeResponse, "time", time, SIMPLE_JSON_FIELD_INT64)};
+
+struct ConfigResponse {
+  char value[CONFRM_JSON_VALUE_LENGTH + 1];
+};
+
+constexpr SimpleJSONField config_schema[] = {
+    SIMPLE_JSON_FIELD(ConfigResponse, "value", value,
+                      SIMPLE_JSON_FIELD_STRING)};
+
+#endif
@@ -0,0 +1,372 @@
+/** @file
+ * Double buffered writing of an update image, overlapping the download with
+ * hashing and flash writes
+ *
+ *  Copyright 2020 confrm.io
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __OTA_PIPELINE_H__
+#define __OTA_PIPELINE_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#if defined(CPP_STANDARD)
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#else
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#endif
+
+#include "simple_http.h"
+#include "work_queue.h"
+
+/*
+ * The download fills a ring of buffers while a writer task hashes and
+ * writes full ones, so a slow flash write or erase no longer stops the
+ * connection being read. Buffers pass between the two through a pair of
+ * queues, free and full. When every buffer is full the download waits for
+ * the writer, and the server is held back by TCP flow control as before.
+ *
+ * On the esp32 the writer is a FreeRTOS task. Built with CPP_STANDARD it is
+ * a std::thread, for testing on a host.
+ */
+
+#ifndef OTA_PIPELINE_BUFFERS
+#define OTA_PIPELINE_BUFFERS 4
+#endif
+
+#ifndef OTA_PIPELINE_BUFFER_SIZE
+#define OTA_PIPELINE_BUFFER_SIZE 4096
+#endif
+
+/**
+ * Called on the writer task with each full buffer, in order. Return false
+ * to stop the update.
+ */
+typedef bool (*OtaPipelineWriter)(void *ctx, const uint8_t *data, size_t len);
+
+struct OtaPipelineStats {
+  uint32_t bytes;      // Bytes passed to the writer
+  uint32_t buffers;    // Buffers passed to the writer
+  uint32_t stalls;     // Times the download waited for a free buffer
+  uint32_t stall_ms;   // Time the download spent waiting
+  uint32_t write_ms;   // Time spent in the writer
+  uint32_t elapsed_ms; // From begin() to end()
+};
+
+class OtaPipeline {
+
+public:
+  OtaPipeline()
+      : m_writer(NULL), m_ctx(NULL), m_buffers(NULL), m_fill(0),
+        m_fill_len(0), m_have_buffer(false), m_failed(false) {
+    memset(&m_stats, 0, sizeof(m_stats));
+#if defined(CPP_STANDARD)
+    memset(&m_free, 0, sizeof(m_free));
+    memset(&m_full, 0, sizeof(m_full));
+#else
+    m_free = NULL;
+    m_full = NULL;
+    m_task = NULL;
+#endif
+  }
+
+  ~OtaPipeline() { end(); }
+
+  /**
+   * @brief Allocate the buffers and start the writer
+   *
+   * @param writer  Called on the writer task with each full buffer
+   * @param ctx     Passed to the writer
+   * @param config  Writer task settings
+   * @return False if the buffers or task could not be created
+   */
+  bool begin(OtaPipelineWriter writer, void *ctx,
+             const WorkTaskConfig &config) {
+    end();
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_stats.elapsed_ms = simple_http_millis();
+    m_writer = writer;
+    m_ctx = ctx;
+    m_failed = false;
+    m_have_buffer = false;
+    m_fill_len = 0;
+
+    m_buffers = new (std::nothrow)
+        uint8_t[OTA_PIPELINE_BUFFERS * OTA_PIPELINE_BUFFER_SIZE];
+    if (m_buffers == NULL) {
+      return false;
+    }
+
+#if defined(CPP_STANDARD)
+    (void)config;
+    for (uint8_t i = 0; i < OTA_PIPELINE_BUFFERS; i++) {
+      push(m_free, i);
+    }
+    m_thread = std::thread(OtaPipeline::run, this);
+    return true;
+#else
+    // One more than the buffers, for the end marker
+    m_free = xQueueCreate(OTA_PIPELINE_BUFFERS + 1, sizeof(uint8_t));
+    m_full = xQueueCreate(OTA_PIPELINE_BUFFERS + 1, sizeof(uint8_t));
+    if (m_free == NULL || m_full == NULL) {
+      release();
+      return false;
+    }
+    for (uint8_t i = 0; i < OTA_PIPELINE_BUFFERS; i++) {
+      push(m_free, i);
+    }
+    BaseType_t core =
+        (config.core == WORK_NO_AFFINITY) ? tskNO_AFFINITY : config.core;
+    if (xTaskCreatePinnedToCore(OtaPipeline::run, "confrm_ota",
+                                config.stack_size, this, config.priority,
+                                &m_task, core) != pdPASS) {
+      release();
+      return false;
+    }
+    return true;
+#endif
+  }
+
+  /**
+   * @brief Copy data in to the ring, waiting for a free buffer if all are
+   * full
+   *
+   * @return False if the writer has failed
+   */
+  bool write(const uint8_t *data, size_t len) {
+    while (len > 0 && !m_failed) {
+      if (!m_have_buffer) {
+        take_free();
+      }
+      size_t space = OTA_PIPELINE_BUFFER_SIZE - m_fill_len;
+      size_t chunk = (len < space) ? len : space;
+      memcpy(buffer(m_fill) + m_fill_len, data, chunk);
+      m_fill_len += chunk;
+      data += chunk;
+      len -= chunk;
+      if (m_fill_len == OTA_PIPELINE_BUFFER_SIZE) {
+        pass_full();
+      }
+    }
+    return !m_failed;
+  }
+
+  /**
+   * @brief Sink for SimpleHTTPConnection, ctx is the pipeline
+   */
+  static bool sink(void *ctx, const uint8_t *data, size_t len) {
+    return reinterpret_cast<OtaPipeline *>(ctx)->write(data, len);
+  }
+
+  /**
+   * @brief Pass the partly filled buffer to the writer, wait for it to
+   * finish, then free the buffers
+   *
+   * @return True if everything written was accepted by the writer
+   */
+  bool end() {
+    if (m_buffers == NULL) {
+      return !m_failed;
+    }
+    if (m_have_buffer && m_fill_len > 0) {
+      pass_full();
+    }
+
+    // The writer returns the end marker once the buffers before it are done
+    push(m_full, OTA_PIPELINE_BUFFERS);
+    while (pop(m_free) != OTA_PIPELINE_BUFFERS) {
+    }
+#if defined(CPP_STANDARD)
+    m_thread.join();
+#endif
+    release();
+    m_stats.elapsed_ms = simple_http_millis() - m_stats.elapsed_ms;
+    return !m_failed;
+  }
+
+  /**
+   * @brief True if the writer returned false
+   */
+  bool failed() const { return m_failed; }
+
+  /**
+   * @brief Counters, complete once end() has returned
+   */
+  const OtaPipelineStats &stats() const { return m_stats; }
+
+private:
+#if defined(CPP_STANDARD)
+  struct Queue {
+    uint8_t items[OTA_PIPELINE_BUFFERS + 1];
+    size_t head;
+    size_t count;
+  };
+
+  void push(Queue &queue, uint8_t item) {
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      queue.items[(queue.head + queue.count) % (OTA_PIPELINE_BUFFERS + 1)] =
+          item;
+      queue.count++;
+    }
+    m_cv.notify_all();
+  }
+
+  bool try_pop(Queue &queue, uint8_t &item) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (queue.count == 0) {
+      return false;
+    }
+    item = pop_locked(queue);
+    return true;
+  }
+
+  uint8_t pop(Queue &queue) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (queue.count == 0) {
+      m_cv.wait(lock);
+    }
+    return pop_locked(queue);
+  }
+
+  static uint8_t pop_locked(Queue &queue) {
+    uint8_t item = queue.items[queue.head];
+    queue.head = (queue.head + 1) % (OTA_PIPELINE_BUFFERS + 1);
+    queue.count--;
+    return item;
+  }
+
+  static void run(OtaPipeline *self) { self->drain(); }
+
+  void release() {
+    delete[] m_buffers;
+    m_buffers = NULL;
+  }
+#else
+  typedef QueueHandle_t Queue;
+
+  void push(Queue &queue, uint8_t item) {
+    xQueueSend(queue, &item, portMAX_DELAY);
+  }
+
+  bool try_pop(Queue &queue, uint8_t &item) {
+    return xQueueReceive(queue, &item, 0) == pdPASS;
+  }
+
+  uint8_t pop(Queue &queue) {
+    uint8_t item;
+    while (xQueueReceive(queue, &item, portMAX_DELAY) != pdPASS) {
+    }
+    return item;
+  }
+
+  // Once drained the task waits to be deleted by release()
+  static void run(void *ptr) {
+    reinterpret_cast<OtaPipeline *>(ptr)->drain();
+    while (true) {
+      vTaskSuspend(NULL);
+    }
+  }
+
+  void release() {
+    if (m_task != NULL) {
+      vTaskDelete(m_task);
+      m_task = NULL;
+    }
+    if (m_free != NULL) {
+      vQueueDelete(m_free);
+      m_free = NULL;
+    }
+    if (m_full != NULL) {
+      vQueueDelete(m_full);
+      m_full = NULL;
+    }
+    delete[] m_buffers;
+    m_buffers = NULL;
+  }
+#endif
+
+  uint8_t *buffer(uint8_t index) {
+    return m_buffers + (size_t)index * OTA_PIPELINE_BUFFER_SIZE;
+  }
+
+  void take_free() {
+    if (!try_pop(m_free, m_fill)) {
+      uint32_t start = simple_http_millis();
+      m_stats.stalls++;
+      m_fill = pop(m_free);
+      m_stats.stall_ms += simple_http_millis() - start;
+    }
+    m_have_buffer = true;
+    m_fill_len = 0;
+  }
+
+  void pass_full() {
+    m_lengths[m_fill] = m_fill_len;
+    m_stats.bytes += m_fill_len;
+    m_stats.buffers++;
+    push(m_full, m_fill);
+    m_have_buffer = false;
+    m_fill_len = 0;
+  }
+
+  // Writer task, writes full buffers in order until the end marker. After a
+  // failure the rest are returned unwritten.
+  void drain() {
+    uint8_t index;
+    while ((index = pop(m_full)) != OTA_PIPELINE_BUFFERS) {
+      if (!m_failed) {
+        uint32_t start = simple_http_millis();
+        if (!m_writer(m_ctx, buffer(index), m_lengths[index])) {
+          m_failed = true;
+        }
+        m_stats.write_ms += simple_http_millis() - start;
+      }
+      push(m_free, index);
+    }
+    push(m_free, OTA_PIPELINE_BUFFERS);
+  }
+
+  OtaPipelineWriter m_writer;
+  void *m_ctx;
+  uint8_t *m_buffers;
+  size_t m_lengths[OTA_PIPELINE_BUFFERS]; // Of each full buffer
+
+  // Download side
+  uint8_t m_fill; // Buffer being filled
+  size_t m_fill_len;
+  bool m_have_buffer;
+
+  std::atomic<bool> m_failed;
+  OtaPipelineStats m_stats;
+
+#if defined(CPP_STANDARD)
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::thread m_thread;
+#else
+  TaskHandle_t m_task;
+#endif
+  Queue m_free; // Buffers ready to fill, and the end marker once written
+  Queue m_full; // Buffers ready to write, and the end marker
+};
+
+#endif
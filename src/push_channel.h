@@ -0,0 +1,394 @@
+/** @file
+ * Server-sent events subscription to the confrm server
+ *
+ *  Copyright 2020 confrm.io
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PUSH_CHANNEL_H__
+#define __PUSH_CHANNEL_H__
+
+#include "simple_http.h"
+
+/*
+ * Holds a long lived GET open to the server, which answers with a
+ * text/event-stream and writes an event whenever something changes:
+ *
+ *   event: update
+ *   data:
+ *
+ *   event: config
+ *   data: mqtt_server
+ *
+ * poll() never blocks on reading, it handles whatever has arrived and
+ * returns, so it can be driven from a background task or from yield(). If
+ * the stream drops it is reopened with exponential backoff, if the server
+ * does not have the endpoint the channel gives up and the caller carries on
+ * polling.
+ */
+
+#ifndef PUSH_CHANNEL_LINE_LENGTH
+#define PUSH_CHANNEL_LINE_LENGTH 128
+#endif
+
+#ifndef PUSH_CHANNEL_PATH_LENGTH
+#define PUSH_CHANNEL_PATH_LENGTH 160
+#endif
+
+#ifndef PUSH_CHANNEL_RETRY_MIN_MS
+#define PUSH_CHANNEL_RETRY_MIN_MS 1000
+#endif
+
+#ifndef PUSH_CHANNEL_RETRY_MAX_MS
+#define PUSH_CHANNEL_RETRY_MAX_MS 60000
+#endif
+
+// Reconnect if nothing arrives for this long, servers are expected to send
+// a comment line as keep-alive well within it
+#ifndef PUSH_CHANNEL_IDLE_MS
+#define PUSH_CHANNEL_IDLE_MS 90000
+#endif
+
+enum PushEvent {
+  PUSH_UPDATE, // A new version is available
+  PUSH_CONFIG  // A config value changed, data is the key or empty for all
+};
+
+typedef void (*PushCallback)(void *ctx, PushEvent event, const char *data);
+
+enum PushState {
+  PUSH_STOPPED,     // Not started
+  PUSH_WAITING,     // Waiting to connect, or reconnect after a failure
+  PUSH_HEAD,        // Reading the response headers
+  PUSH_STREAMING,   // Receiving events
+  PUSH_UNSUPPORTED  // Server does not have the endpoint
+};
+
+struct PushStats {
+  uint32_t connects; // Streams opened
+  uint32_t drops;    // Open streams which were lost
+  uint32_t failures; // Attempts that did not open a stream
+  uint32_t events;   // Events delivered to the callback
+};
+
+template <class TClient> class PushChannel {
+
+public:
+  PushChannel()
+      : m_client(NULL), m_state(PUSH_STOPPED), m_callback(NULL), m_ctx(NULL),
+        m_retry_min(PUSH_CHANNEL_RETRY_MIN_MS),
+        m_retry_max(PUSH_CHANNEL_RETRY_MAX_MS),
+        m_idle_timeout(PUSH_CHANNEL_IDLE_MS) {
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_path[0] = '\0';
+  }
+
+  /**
+   * @brief Start subscribing, the first connection is made by poll()
+   *
+   * @param client    Transport, must outlive the channel
+   * @param url       Root URL of the server
+   * @param path      Path and query of the event stream
+   * @param callback  Called with each event
+   * @param ctx       Passed to the callback
+   * @return False if the URL or path are not valid
+   */
+  bool begin(TClient *client, const char *url, const char *path,
+             PushCallback callback, void *ctx) {
+    stop();
+    if (!simple_http_parse_url(url, m_url) ||
+        strlen(path) >= sizeof(m_path)) {
+      return false;
+    }
+    strcpy(m_path, path);
+    m_client = client;
+    m_callback = callback;
+    m_ctx = ctx;
+    m_retry = m_retry_min;
+    m_next_attempt = simple_http_millis();
+    m_state = PUSH_WAITING;
+    return true;
+  }
+
+  void stop() {
+    if (m_client != NULL) {
+      m_client->stop();
+    }
+    m_state = PUSH_STOPPED;
+  }
+
+  /**
+   * @brief Set the reconnect backoff, the delay doubles from min to max
+   */
+  void set_retry(uint32_t min_ms, uint32_t max_ms) {
+    m_retry_min = min_ms;
+    m_retry_max = max_ms;
+    m_retry = min_ms;
+  }
+
+  void set_idle_timeout(uint32_t timeout_ms) { m_idle_timeout = timeout_ms; }
+
+  PushState state() const { return m_state; }
+
+  /**
+   * @brief True while events are being received
+   */
+  bool streaming() const { return m_state == PUSH_STREAMING; }
+
+  /**
+   * @brief Delay before the next reconnect attempt
+   */
+  uint32_t retry_delay() const { return m_retry; }
+
+  const PushStats &stats() const { return m_stats; }
+
+  /**
+   * @brief Do any pending work: connect when due, read and dispatch events
+   */
+  void poll() {
+    uint32_t now = simple_http_millis();
+    if (m_state == PUSH_WAITING && (int32_t)(now - m_next_attempt) >= 0) {
+      open(now);
+    } else if (m_state == PUSH_HEAD || m_state == PUSH_STREAMING) {
+      read(now);
+    }
+  }
+
+private:
+  void open(uint32_t now) {
+    m_client->stop();
+    if (!m_client->connect(m_url.host, m_url.port)) {
+      m_stats.failures++;
+      retry_later(now);
+      return;
+    }
+
+    char request[PUSH_CHANNEL_PATH_LENGTH + 192];
+    int len = snprintf(request, sizeof(request),
+                       "GET %s%s HTTP/1.1\r\nHost: %s:%u\r\n"
+                       "Accept: text/event-stream\r\n"
+                       "Cache-Control: no-cache\r\n\r\n",
+                       m_url.path, m_path, m_url.host, (unsigned)m_url.port);
+    if (len <= 0 || len >= (int)sizeof(request) ||
+        m_client->write((const uint8_t *)request, len) != (size_t)len) {
+      m_stats.failures++;
+      retry_later(now);
+      return;
+    }
+
+    m_state = PUSH_HEAD;
+    m_last_data = now;
+    m_code = 0;
+    m_chunked = false;
+    m_line_length = 0;
+  }
+
+  void retry_later(uint32_t now) {
+    m_client->stop();
+    m_state = PUSH_WAITING;
+    m_next_attempt = now + m_retry;
+    m_retry = (m_retry > m_retry_max / 2) ? m_retry_max : m_retry * 2;
+  }
+
+  void read(uint32_t now) {
+    uint8_t buf[128];
+    bool received = false;
+    while (m_client->available() > 0) {
+      int c = m_client->read(buf, sizeof(buf));
+      if (c <= 0) {
+        break;
+      }
+      received = true;
+      process(buf, c, now);
+      if (m_state != PUSH_HEAD && m_state != PUSH_STREAMING) {
+        return;
+      }
+    }
+
+    if (received) {
+      m_last_data = now;
+    } else if (!m_client->connected() || now - m_last_data > m_idle_timeout) {
+      lost(now);
+    }
+  }
+
+  void lost(uint32_t now) {
+    if (m_state == PUSH_STREAMING) {
+      m_stats.drops++;
+    } else {
+      m_stats.failures++;
+    }
+    retry_later(now);
+  }
+
+  void process(const uint8_t *data, size_t len, uint32_t now) {
+    size_t i = 0;
+    while (m_state == PUSH_HEAD && i < len) {
+      if (line_byte(data[i++])) {
+        head_line(now);
+      }
+    }
+    if (m_state != PUSH_STREAMING || i == len) {
+      return;
+    }
+    if (m_chunked) {
+      if (!m_decoder.feed(data + i, len - i, stream_sink, this) ||
+          m_decoder.done()) {
+        lost(now);
+      }
+    } else {
+      stream_sink(this, data + i, len - i);
+    }
+  }
+
+  // Add a byte to the current line, true when the line is complete
+  bool line_byte(uint8_t c) {
+    if (c == '\n') {
+      m_line[m_line_length] = '\0';
+      m_line_length = 0;
+      return true;
+    }
+    if (c != '\r' && m_line_length + 1 < sizeof(m_line)) {
+      m_line[m_line_length++] = (char)c;
+    }
+    return false;
+  }
+
+  void head_line(uint32_t now) {
+    if (m_code == 0) {
+      if (strncmp(m_line, "HTTP/1.", 7) != 0 || strlen(m_line) < 12) {
+        lost(now);
+        return;
+      }
+      m_code = atoi(m_line + 9);
+      return;
+    }
+
+    if (m_line[0] != '\0') {
+      if (simple_http_equals_nocase(m_line, "Transfer-Encoding:", 18) &&
+          strstr(m_line + 18, "chunked") != NULL) {
+        m_chunked = true;
+      }
+      return;
+    }
+
+    // End of headers
+    if (m_code == 200) {
+      m_state = PUSH_STREAMING;
+      m_stats.connects++;
+      m_retry = m_retry_min;
+      m_decoder.reset();
+      m_event[0] = '\0';
+      m_data[0] = '\0';
+      m_data_length = 0;
+    } else if (m_code == 404 || m_code == 405 || m_code == 501) {
+      m_client->stop();
+      m_state = PUSH_UNSUPPORTED;
+    } else {
+      lost(now);
+    }
+  }
+
+  static bool stream_sink(void *ctx, const uint8_t *data, size_t len) {
+    PushChannel *self = reinterpret_cast<PushChannel *>(ctx);
+    for (size_t i = 0; i < len; i++) {
+      if (self->line_byte(data[i])) {
+        self->event_line();
+      }
+    }
+    return true;
+  }
+
+  void event_line() {
+    if (m_line[0] == '\0') {
+      dispatch();
+      return;
+    }
+    if (m_line[0] == ':') {
+      return; // Comment, used as keep-alive
+    }
+
+    char *value = strchr(m_line, ':');
+    if (value == NULL) {
+      value = m_line + strlen(m_line);
+    } else {
+      *value++ = '\0';
+      if (*value == ' ') {
+        value++;
+      }
+    }
+
+    if (strcmp(m_line, "event") == 0) {
+      strncpy(m_event, value, sizeof(m_event) - 1);
+      m_event[sizeof(m_event) - 1] = '\0';
+    } else if (strcmp(m_line, "data") == 0) {
+      size_t len = strlen(value);
+      if (m_data_length > 0 && m_data_length + 1 < sizeof(m_data)) {
+        m_data[m_data_length++] = '\n';
+      }
+      if (m_data_length + len >= sizeof(m_data)) {
+        len = sizeof(m_data) - 1 - m_data_length;
+      }
+      memcpy(m_data + m_data_length, value, len);
+      m_data_length += len;
+      m_data[m_data_length] = '\0';
+    } else if (strcmp(m_line, "retry") == 0) {
+      uint32_t retry = strtoul(value, NULL, 10);
+      if (retry > 0) {
+        m_retry_min = m_retry = retry;
+      }
+    }
+  }
+
+  void dispatch() {
+    if (m_callback != NULL) {
+      if (strcmp(m_event, "update") == 0) {
+        m_stats.events++;
+        m_callback(m_ctx, PUSH_UPDATE, m_data);
+      } else if (strcmp(m_event, "config") == 0) {
+        m_stats.events++;
+        m_callback(m_ctx, PUSH_CONFIG, m_data);
+      }
+    }
+    m_event[0] = '\0';
+    m_data[0] = '\0';
+    m_data_length = 0;
+  }
+
+  TClient *m_client;
+  SimpleHTTPUrl m_url;
+  char m_path[PUSH_CHANNEL_PATH_LENGTH];
+  PushState m_state;
+  PushStats m_stats;
+  PushCallback m_callback;
+  void *m_ctx;
+
+  uint32_t m_retry_min;
+  uint32_t m_retry_max;
+  uint32_t m_retry;
+  uint32_t m_next_attempt;
+  uint32_t m_idle_timeout;
+  uint32_t m_last_data;
+
+  int m_code;
+  bool m_chunked;
+  SimpleHTTPChunkedDecoder m_decoder;
+
+  char m_line[PUSH_CHANNEL_LINE_LENGTH];
+  size_t m_line_length;
+  char m_event[16];
+  char m_data[PUSH_CHANNEL_LINE_LENGTH];
+  size_t m_data_length;
+};
+
+#endif
@@ -0,0 +1,249 @@
+/** @file
+ * Request paths for the confrm server, built without the heap
+ *
+ *  Copyright 2020 confrm.io
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __REQUEST_BUILDER_H__
+#define __REQUEST_BUILDER_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * The query parameters identifying the node are the same for every request,
+ * so they are percent-encoded once when the builder is set up. Each request
+ * then copies them in to a fixed buffer on the stack and appends only the
+ * parts that vary, such as the config key.
+ */
+
+#ifndef REQUEST_PATH_LENGTH
+#define REQUEST_PATH_LENGTH 256
+#endif
+
+// Encoded "?package=...&node_id=..."
+#ifndef REQUEST_NODE_QUERY_LENGTH
+#define REQUEST_NODE_QUERY_LENGTH 128
+#endif
+
+// Encoded "&description=...&platform=..." sent when registering
+#ifndef REQUEST_NODE_DETAILS_LENGTH
+#define REQUEST_NODE_DETAILS_LENGTH 160
+#endif
+
+// Extra header lines, such as If-None-Match
+#ifndef REQUEST_HEADERS_LENGTH
+#define REQUEST_HEADERS_LENGTH 128
+#endif
+
+#ifndef REQUEST_NODE_ID_LENGTH
+#define REQUEST_NODE_ID_LENGTH 32
+#endif
+
+/**
+ * True for the RFC 3986 unreserved characters, which are sent as they are
+ */
+inline bool request_is_unreserved(uint8_t c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+         c == '~';
+}
+
+/**
+ * Text of a request, such as a path or header lines, built in a fixed
+ * buffer. Appending past the end stops the text growing and clears ok(),
+ * the text is never left with a partial escape.
+ */
+template <size_t LENGTH> class RequestBuffer {
+
+public:
+  RequestBuffer() { clear(); }
+
+  void clear() {
+    m_len = 0;
+    m_ok = true;
+    m_buf[0] = '\0';
+  }
+
+  const char *c_str() const { return m_buf; }
+
+  size_t length() const { return m_len; }
+
+  /**
+   * @brief False if anything appended did not fit
+   */
+  bool ok() const { return m_ok; }
+
+  RequestBuffer &append(const char *str, size_t len) {
+    if (!m_ok || len > LENGTH - m_len) {
+      m_ok = false;
+      return *this;
+    }
+    memcpy(m_buf + m_len, str, len);
+    m_len += len;
+    m_buf[m_len] = '\0';
+    return *this;
+  }
+
+  RequestBuffer &append(const char *str) { return append(str, strlen(str)); }
+
+  /**
+   * @brief Append a string percent-encoded for use in a query, every byte
+   * other than the unreserved characters is written as %XX
+   */
+  RequestBuffer &append_encoded(const char *str) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t len = m_len;
+    for (const uint8_t *c = (const uint8_t *)str; m_ok && *c != '\0'; c++) {
+      if (request_is_unreserved(*c)) {
+        m_ok = len < LENGTH;
+        if (m_ok) {
+          m_buf[len++] = (char)*c;
+        }
+      } else {
+        m_ok = len + 3 <= LENGTH;
+        if (m_ok) {
+          m_buf[len++] = '%';
+          m_buf[len++] = hex[*c >> 4];
+          m_buf[len++] = hex[*c & 0x0F];
+        }
+      }
+    }
+    if (m_ok) {
+      m_len = len;
+    }
+    m_buf[m_len] = '\0';
+    return *this;
+  }
+
+private:
+  char m_buf[LENGTH + 1];
+  size_t m_len;
+  bool m_ok;
+};
+
+typedef RequestBuffer<REQUEST_PATH_LENGTH> RequestPath;
+typedef RequestBuffer<REQUEST_HEADERS_LENGTH> RequestHeaders;
+
+/**
+ * Builds the path of each confrm server endpoint for this node
+ */
+class RequestBuilder {
+
+public:
+  RequestBuilder() : m_package_length(0) { m_node_id[0] = '\0'; }
+
+  /**
+   * @brief Encode the parts that are the same for every request
+   *
+   * @param package      Package name
+   * @param node_id      Node identity, the MAC address
+   * @param description  Description of the node
+   * @param platform     Platform of the node
+   * @return False if a part is too long
+   */
+  bool begin(const char *package, const char *node_id,
+             const char *description, const char *platform) {
+    size_t len = strlen(node_id);
+    if (len > REQUEST_NODE_ID_LENGTH) {
+      len = REQUEST_NODE_ID_LENGTH;
+    }
+    memcpy(m_node_id, node_id, len);
+    m_node_id[len] = '\0';
+
+    m_node_query.clear();
+    m_node_query.append("?package=").append_encoded(package);
+    m_package_length = m_node_query.length();
+    m_node_query.append("&node_id=").append_encoded(node_id);
+
+    m_node_details.clear();
+    m_node_details.append("&description=")
+        .append_encoded(description)
+        .append("&platform=")
+        .append_encoded(platform);
+
+    return len == strlen(node_id) && m_node_query.ok() &&
+           m_node_details.ok();
+  }
+
+  /**
+   * @brief Node identity, kept so it is not formatted again per request
+   */
+  const char *node_id() const { return m_node_id; }
+
+  /*
+   * Each appends the path of the endpoint, with the query for this node, to
+   * the path given. Check path.ok() before use.
+   */
+
+  /**
+   * @brief Check for update, with the running version so that the server
+   * can offer a patch from it
+   */
+  void check_for_update(RequestPath &path, const char *version) const {
+    path.append("/check_for_update/");
+    node_query(path);
+    path.append("&version=").append_encoded(version);
+  }
+
+  void register_node(RequestPath &path, const char *version) const {
+    path.append("/register_node/");
+    node_query(path);
+    path.append("&version=")
+        .append_encoded(version)
+        .append(m_node_details.c_str(), m_node_details.length());
+  }
+
+  void config(RequestPath &path, const char *key) const {
+    path.append("/config/");
+    node_query(path);
+    path.append("&key=").append_encoded(key);
+  }
+
+  /**
+   * @brief Bulk config request for the given keys, or all keys if n is 0
+   */
+  void configs(RequestPath &path, const char *const *keys, size_t n) const {
+    path.append("/configs/");
+    node_query(path);
+    for (size_t i = 0; i < n; i++) {
+      path.append(i == 0 ? "&keys=" : ",").append_encoded(keys[i]);
+    }
+  }
+
+  void blob(RequestPath &path, const char *blob) const {
+    path.append("/blob/")
+        .append(m_node_query.c_str(), m_package_length)
+        .append("&blob=")
+        .append_encoded(blob);
+  }
+
+  void subscribe(RequestPath &path) const {
+    path.append("/subscribe/");
+    node_query(path);
+  }
+
+private:
+  void node_query(RequestPath &path) const {
+    path.append(m_node_query.c_str(), m_node_query.length());
+  }
+
+  char m_node_id[REQUEST_NODE_ID_LENGTH + 1];
+  RequestBuffer<REQUEST_NODE_QUERY_LENGTH> m_node_query;
+  size_t m_package_length; // Of the package part of m_node_query
+  RequestBuffer<REQUEST_NODE_DETAILS_LENGTH> m_node_details;
+};
+
+#endif
@@ -0,0 +1,910 @@
+/** @file
+ * Minimal HTTP/1.1 client with persistent (keep-alive) connections
+ *
+ *  Copyright 2020 confrm.io
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __SIMPLEHTTP_H__
+#define __SIMPLEHTTP_H__
+
+#ifndef CPP_STANDARD
+#include <Arduino.h>
+#else
+#include <chrono>
+#include <thread>
+#endif
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * The connection is a template over the transport so that it can use any
+ * class with the Arduino Client interface: WiFiClient on the esp32/esp8266,
+ * or a socket based client when built on a host with CPP_STANDARD.
+ *
+ * Everything here is inline as the header is included from confrm.h.
+ */
+
+#ifndef SIMPLE_HTTP_BUFFER_SIZE
+#define SIMPLE_HTTP_BUFFER_SIZE 256
+#endif
+
+#ifndef SIMPLE_HTTP_ETAG_LENGTH
+#define SIMPLE_HTTP_ETAG_LENGTH 64
+#endif
+
+#ifndef SIMPLE_HTTP_TIMEOUT_MS
+#define SIMPLE_HTTP_TIMEOUT_MS 5000
+#endif
+
+// Result of SimpleHTTPConnection::poll while the response is arriving
+#define SIMPLE_HTTP_PENDING 0
+
+// Negative results from SimpleHTTPConnection::request
+#define SIMPLE_HTTP_ERROR_CONNECT -1     // Unable to connect to the server
+#define SIMPLE_HTTP_ERROR_SEND -2        // Writing the request failed
+#define SIMPLE_HTTP_ERROR_NO_RESPONSE -3 // Closed before any response
+#define SIMPLE_HTTP_ERROR_TIMEOUT -4     // Server stopped responding
+#define SIMPLE_HTTP_ERROR_PROTOCOL -5    // Response was not valid HTTP
+
+inline uint32_t simple_http_millis() {
+#ifdef CPP_STANDARD
+  return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return millis();
+#endif
+}
+
+inline void simple_http_wait() {
+#ifdef CPP_STANDARD
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#else
+  delay(1);
+#endif
+}
+
+/**
+ * Server location parsed from a URL such as http://192.168.0.42:8080/confrm
+ */
+struct SimpleHTTPUrl {
+  bool secure;
+  char host[64];
+  uint16_t port;
+  char path[64]; // Prefix for every request path, without trailing slash
+};
+
+/**
+ * @brief Split a http:// or https:// URL in to its parts
+ *
+ * @return False if the URL is not valid or a part is too long
+ */
+inline bool simple_http_parse_url(const char *url, SimpleHTTPUrl &out) {
+
+  if (strncmp(url, "http://", 7) == 0) {
+    out.secure = false;
+    out.port = 80;
+    url += 7;
+  } else if (strncmp(url, "https://", 8) == 0) {
+    out.secure = true;
+    out.port = 443;
+    url += 8;
+  } else {
+    return false;
+  }
+
+  size_t host_len = strcspn(url, ":/");
+  if (host_len == 0 || host_len >= sizeof(out.host)) {
+    return false;
+  }
+  memcpy(out.host, url, host_len);
+  out.host[host_len] = '\0';
+  url += host_len;
+
+  if (*url == ':') {
+    char *end;
+    long port = strtol(url + 1, &end, 10);
+    if (end == url + 1 || port <= 0 || port > 0xFFFF) {
+      return false;
+    }
+    out.port = (uint16_t)port;
+    url = end;
+  }
+
+  size_t path_len = strlen(url);
+  while (path_len > 0 && url[path_len - 1] == '/') {
+    path_len--;
+  }
+  if (path_len >= sizeof(out.path)) {
+    return false;
+  }
+  memcpy(out.path, url, path_len);
+  out.path[path_len] = '\0';
+
+  return true;
+}
+
+/**
+ * Case insensitive comparison of the first len characters
+ */
+inline bool simple_http_equals_nocase(const char *a, const char *b,
+                                      size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (tolower((uint8_t)a[i]) != tolower((uint8_t)b[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Sink for response bodies, called with each chunk as it is read. Return
+ * false to stop reading, in which case the connection is closed.
+ */
+typedef bool (*SimpleHTTPSink)(void *ctx, const uint8_t *data, size_t len);
+
+/**
+ * Fixed buffer for short response bodies, such as JSON documents. Whatever
+ * does not fit is read and dropped rather than stopping the response, so the
+ * connection is left ready for the next request, and truncated() is set.
+ */
+template <size_t LENGTH> class SimpleHTTPResponseBuffer {
+
+public:
+  SimpleHTTPResponseBuffer() { clear(); }
+
+  void clear() {
+    m_len = 0;
+    m_truncated = false;
+    m_buf[0] = '\0';
+  }
+
+  const char *c_str() const { return m_buf; }
+
+  size_t length() const { return m_len; }
+
+  /**
+   * @brief True if the body was longer than the buffer
+   */
+  bool truncated() const { return m_truncated; }
+
+  /**
+   * @brief Sink to read a body in to the buffer, ctx is the buffer
+   */
+  static bool sink(void *ctx, const uint8_t *data, size_t len) {
+    SimpleHTTPResponseBuffer *buffer =
+        reinterpret_cast<SimpleHTTPResponseBuffer *>(ctx);
+    size_t space = LENGTH - buffer->m_len;
+    if (len > space) {
+      len = space;
+      buffer->m_truncated = true;
+    }
+    memcpy(buffer->m_buf + buffer->m_len, data, len);
+    buffer->m_len += len;
+    buffer->m_buf[buffer->m_len] = '\0';
+    return true;
+  }
+
+private:
+  char m_buf[LENGTH + 1];
+  size_t m_len;
+  bool m_truncated;
+};
+
+/**
+ * Incremental decoder for Transfer-Encoding: chunked bodies. Data can be fed
+ * in pieces of any size, the decoded body is passed to the sink as it is
+ * found, so no chunk has to fit in memory.
+ */
+class SimpleHTTPChunkedDecoder {
+
+public:
+  SimpleHTTPChunkedDecoder() { reset(); }
+
+  void reset() {
+    m_state = SIZE;
+    m_remaining = 0;
+    m_digits = 0;
+    m_line = 0;
+  }
+
+  /**
+   * @brief True once the last (zero length) chunk and trailer are read
+   */
+  bool done() const { return m_state == DONE; }
+
+  bool error() const { return m_state == ERROR; }
+
+  /**
+   * @brief Decode the next piece of the body
+   *
+   * @param data  Encoded data
+   * @param len   Length of data
+   * @param sink  Called with the decoded body, may be NULL
+   * @param ctx   Passed to the sink
+   * @param used  Set to the number of bytes used, less than len only if the
+   *              body ended or there was an error
+   * @return False on a malformed body or if the sink stopped
+   */
+  bool feed(const uint8_t *data, size_t len, SimpleHTTPSink sink, void *ctx,
+            size_t *used = NULL) {
+    size_t i = 0;
+    bool ok = true;
+    while (i < len && ok && m_state != DONE && m_state != ERROR) {
+      uint8_t c = data[i];
+      switch (m_state) {
+      case SIZE:
+        if (isxdigit(c)) {
+          if (++m_digits > 15) {
+            m_state = ERROR; // Would overflow
+            break;
+          }
+          m_remaining = m_remaining * 16 +
+                        (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+        } else if (m_digits == 0) {
+          m_state = ERROR;
+          break;
+        } else if (c == '\n') {
+          end_size_line();
+        } else {
+          m_state = SIZE_EXTENSION; // ';' extension, or '\r'
+        }
+        i++;
+        break;
+      case SIZE_EXTENSION:
+        if (c == '\n') {
+          end_size_line();
+        }
+        i++;
+        break;
+      case DATA: {
+        size_t chunk = len - i;
+        if ((uint64_t)chunk > m_remaining) {
+          chunk = (size_t)m_remaining;
+        }
+        if (sink != NULL && !sink(ctx, data + i, chunk)) {
+          ok = false;
+        }
+        i += chunk;
+        m_remaining -= chunk;
+        if (m_remaining == 0) {
+          m_state = DATA_END;
+        }
+        break;
+      }
+      case DATA_END:
+        if (c == '\n') {
+          m_state = SIZE;
+          m_digits = 0;
+        } else if (c != '\r') {
+          m_state = ERROR;
+          break;
+        }
+        i++;
+        break;
+      case TRAILER:
+        if (c == '\n') {
+          if (m_line == 0) {
+            m_state = DONE;
+          }
+          m_line = 0;
+        } else if (c != '\r') {
+          m_line++;
+        }
+        i++;
+        break;
+      default:
+        break;
+      }
+    }
+    if (used != NULL) {
+      *used = i;
+    }
+    return ok && m_state != ERROR;
+  }
+
+private:
+  void end_size_line() {
+    m_state = (m_remaining == 0) ? TRAILER : DATA;
+    m_line = 0;
+  }
+
+  enum State { SIZE, SIZE_EXTENSION, DATA, DATA_END, TRAILER, DONE, ERROR };
+
+  State m_state;
+  uint64_t m_remaining; // Bytes left in the current chunk
+  uint8_t m_digits;     // Hex digits of the chunk size read so far
+  size_t m_line;        // Length of the current trailer line
+};
+
+/**
+ * Connection counters
+ */
+struct SimpleHTTPStats {
+  uint32_t requests;   // Requests made
+  uint32_t connects;   // New connections opened
+  uint32_t reuses;     // Requests sent on an already open connection
+  uint32_t reconnects; // Open connections found closed by the server
+  uint32_t failures;   // Requests which did not get a response
+};
+
+template <class TClient> class SimpleHTTPConnection {
+
+public:
+  SimpleHTTPConnection()
+      : m_client(NULL), m_timeout(SIMPLE_HTTP_TIMEOUT_MS), m_reusable(false),
+        m_reused(false), m_state(IDLE), m_method(NULL), m_path(NULL),
+        m_body(NULL), m_body_len(0), m_headers(NULL), m_started(0),
+        m_deadline(0), m_last_data(0), m_progressed(false), m_buf_pos(0), m_buf_len(0), m_line_len(0),
+        m_have_status(false), m_code(0), m_no_body(false), m_deliver(false),
+        m_remaining(0), m_chunked(false), m_content_length(-1),
+        m_close(false),
+        m_complete(false), m_timed_out(false) {
+    memset(&m_url, 0, sizeof(m_url));
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_etag[0] = '\0';
+    m_encoding[0] = '\0';
+    m_max_age = -1;
+  }
+
+  /**
+   * @brief Set the transport and the server all requests are sent to
+   *
+   * @param client  Transport, must outlive the connection
+   * @param url     Root URL of the server
+   * @return False if the URL could not be parsed
+   */
+  bool begin(TClient *client, const char *url) {
+    stop();
+    m_client = client;
+    return simple_http_parse_url(url, m_url);
+  }
+
+  const SimpleHTTPUrl &url() const { return m_url; }
+
+  /**
+   * @brief Close the connection, the next request will open a new one
+   */
+  void stop() {
+    if (m_client != NULL) {
+      m_client->stop();
+    }
+    m_reusable = false;
+    m_state = IDLE;
+    m_buf_pos = m_buf_len = 0;
+  }
+
+  void set_timeout(uint32_t timeout_ms) { m_timeout = timeout_ms; }
+
+  const SimpleHTTPStats &stats() const { return m_stats; }
+
+  /**
+   * @brief Content-Length of the current or last response, -1 if unknown
+   */
+  int64_t content_length() const { return m_content_length; }
+
+  /**
+   * @brief ETag of the last response, empty if there was none
+   */
+  const char *etag() const { return m_etag; }
+
+  /**
+   * @brief Cache-Control max-age of the last response in seconds, -1 if
+   * there was none and 0 for no-cache/no-store
+   */
+  int32_t max_age() const { return m_max_age; }
+
+  /**
+   * @brief True if the current or last response body is chunked
+   */
+  bool chunked() const { return m_chunked; }
+
+  /**
+   * @brief Content-Encoding of the last response, such as "gzip", empty if
+   * there was none. The body is passed to the sink still encoded.
+   */
+  const char *content_encoding() const { return m_encoding; }
+
+  /**
+   * @brief True if the body of the last response was read to completion
+   */
+  bool complete() const { return m_complete; }
+
+  /**
+   * @brief Make a request, reusing the open connection if there is one
+   *
+   * If an open connection turns out to have been closed by the server, it is
+   * reopened and the request sent again. Only the body of 2xx responses is
+   * passed to the sink, others are discarded. Chunked bodies are decoded as
+   * they arrive.
+   *
+   * Besides the timeout between pieces of the response set by set_timeout(),
+   * the whole request can be given a time limit. A body cut short by either
+   * returns the status code with complete() false.
+   *
+   * @param method    GET/PUT/POST
+   * @param path      Path and query, appended to the path of the URL
+   * @param body      Request body, may be NULL
+   * @param body_len  Length of request body
+   * @param sink      Called with each chunk of the response body, may be NULL
+   * @param ctx       Passed to the sink
+   * @param headers   Extra request header lines, each ending "\r\n", or NULL
+   * @param limit_ms  Time limit for the whole request, 0 for none
+   * @return HTTP status code, or a negative SIMPLE_HTTP_ERROR_ value
+   */
+  int request(const char *method, const char *path, const uint8_t *body,
+              size_t body_len, SimpleHTTPSink sink, void *ctx,
+              const char *headers = NULL, uint32_t limit_ms = 0) {
+    int code = start(method, path, body, body_len, headers, limit_ms);
+    while (code == SIMPLE_HTTP_PENDING) {
+      code = poll(sink, ctx);
+      if (code == SIMPLE_HTTP_PENDING && !m_progressed) {
+        simple_http_wait();
+      }
+    }
+    return code;
+  }
+
+  /**
+   * @brief Send a request without waiting for the response, which is then
+   * read by calling poll() until it returns a result
+   *
+   * Connecting and sending block as for request(). The method, path, body
+   * and headers must stay valid until poll() returns a result, as the
+   * request is sent again if the server had closed the open connection. A
+   * request still in progress is abandoned, closing the connection.
+   *
+   * @return SIMPLE_HTTP_PENDING, or a negative SIMPLE_HTTP_ERROR_ value
+   */
+  int start(const char *method, const char *path, const uint8_t *body,
+            size_t body_len, const char *headers = NULL,
+            uint32_t limit_ms = 0) {
+
+    if (m_state != IDLE) {
+      stop();
+    }
+
+    m_stats.requests++;
+    m_complete = false;
+    m_content_length = -1;
+
+    if (m_client == NULL) {
+      m_stats.failures++;
+      return SIMPLE_HTTP_ERROR_CONNECT;
+    }
+
+    m_method = method;
+    m_path = path;
+    m_body = body;
+    m_body_len = body_len;
+    m_headers = headers;
+    m_started = simple_http_millis();
+    m_deadline = limit_ms;
+    return send();
+  }
+
+  /**
+   * @brief Read the part of the response that has arrived, without waiting
+   *
+   * At most one buffer of data is read per call, so each call takes a
+   * bounded time. Only the body of 2xx responses is passed to the sink.
+   *
+   * @param sink  Called with each chunk of the response body, may be NULL
+   * @param ctx   Passed to the sink
+   * @return SIMPLE_HTTP_PENDING until the response is complete, then as
+   *         request(). SIMPLE_HTTP_ERROR_NO_RESPONSE if no request was
+   *         started.
+   */
+  int poll(SimpleHTTPSink sink, void *ctx) {
+    m_progressed = false;
+    if (m_state == IDLE) {
+      return SIMPLE_HTTP_ERROR_NO_RESPONSE;
+    }
+
+    if (m_deadline != 0 && simple_http_millis() - m_started > m_deadline) {
+      m_timed_out = true;
+      return end_of_data();
+    }
+
+    if (m_buf_pos >= m_buf_len && !receive()) {
+      if (m_client->connected() &&
+          simple_http_millis() - m_last_data <= m_timeout) {
+        return SIMPLE_HTTP_PENDING;
+      }
+      m_timed_out = m_client->connected();
+      return end_of_data();
+    }
+    m_progressed = true;
+
+    if (m_state == HEAD) {
+      int code = parse_head();
+      if (code == SIMPLE_HTTP_PENDING) {
+        return code;
+      }
+      if (code < 0) {
+        return fail(code);
+      }
+      m_code = code;
+      m_no_body = (strcmp(m_method, "HEAD") == 0) || code == 204 ||
+                  code == 304 || (code >= 100 && code < 200);
+      if (m_no_body) {
+        return finish(true);
+      }
+      m_deliver = code >= 200 && code < 300;
+      m_remaining = m_content_length;
+      m_decoder.reset();
+      m_state = BODY;
+    }
+
+    if (!parse_body(sink, ctx)) {
+      return finish(false);
+    }
+    if (m_chunked ? m_decoder.done() : m_remaining == 0) {
+      return finish(true);
+    }
+    return SIMPLE_HTTP_PENDING;
+  }
+
+  /**
+   * @brief True while a request started with start() has not returned a
+   * result from poll()
+   */
+  bool busy() const { return m_state != IDLE; }
+
+  /**
+   * @brief True if the last call to poll() read any of the response, false
+   * if there was nothing to read yet
+   */
+  bool progressed() const { return m_progressed; }
+
+private:
+  /*
+   * Request writing, staged through the buffer so the request line and
+   * headers go out in as few writes as possible
+   */
+  bool put(const char *data, size_t len) {
+    while (len > 0) {
+      size_t space = sizeof(m_buffer) - m_buf_len;
+      size_t chunk = (len < space) ? len : space;
+      memcpy(m_buffer + m_buf_len, data, chunk);
+      m_buf_len += chunk;
+      data += chunk;
+      len -= chunk;
+      if (m_buf_len == sizeof(m_buffer) && !flush()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool put(const char *str) { return put(str, strlen(str)); }
+
+  bool flush() {
+    size_t written = 0;
+    while (written < m_buf_len) {
+      size_t c = m_client->write(m_buffer + written, m_buf_len - written);
+      if (c == 0) {
+        m_buf_len = 0;
+        return false;
+      }
+      written += c;
+    }
+    m_buf_len = 0;
+    return true;
+  }
+
+  bool send_request(const char *method, const char *path, const uint8_t *body,
+                    size_t body_len, const char *headers) {
+    char length[24];
+    snprintf(length, sizeof(length), "%u", (unsigned)body_len);
+    char port[8];
+    snprintf(port, sizeof(port), "%u", (unsigned)m_url.port);
+
+    bool ok = put(method) && put(" ") && put(m_url.path) && put(path) &&
+              put(" HTTP/1.1\r\nHost: ") && put(m_url.host) && put(":") &&
+              put(port) && put("\r\nConnection: keep-alive\r\n");
+    if (ok && (body_len > 0 || strcmp(method, "GET") != 0)) {
+      ok = put("Content-Length: ") && put(length) && put("\r\n");
+    }
+    if (ok && headers != NULL) {
+      ok = put(headers);
+    }
+    ok = ok && put("\r\n") && flush();
+
+    // Large bodies go straight to the client rather than via the buffer
+    size_t written = 0;
+    while (ok && written < body_len) {
+      size_t c = m_client->write(body + written, body_len - written);
+      ok = (c > 0);
+      written += c;
+    }
+    return ok;
+  }
+
+  /*
+   * Connect or reuse the open connection, then send the request
+   */
+  int send() {
+    while (true) {
+      m_reused = false;
+      if (m_reusable && m_client->connected()) {
+        m_reused = true;
+        m_stats.reuses++;
+      } else {
+        if (m_reusable) {
+          m_stats.reconnects++;
+        }
+        stop();
+        if (!m_client->connect(m_url.host, m_url.port)) {
+          m_stats.failures++;
+          return SIMPLE_HTTP_ERROR_CONNECT;
+        }
+        m_stats.connects++;
+      }
+      m_reusable = false;
+      m_buf_pos = m_buf_len = 0;
+
+      if (send_request(m_method, m_path, m_body, m_body_len, m_headers)) {
+        m_state = HEAD;
+        m_have_status = false;
+        m_line_len = 0;
+        m_close = false;
+        m_chunked = false;
+        m_content_length = -1;
+        m_etag[0] = '\0';
+        m_encoding[0] = '\0';
+        m_max_age = -1;
+        m_timed_out = false;
+        m_last_data = simple_http_millis();
+        return SIMPLE_HTTP_PENDING;
+      }
+      if (!retry()) {
+        return fail(SIMPLE_HTTP_ERROR_SEND);
+      }
+    }
+  }
+
+  // A kept-alive connection may have been closed by the server while it was
+  // idle, in which case try once more on a new connection
+  bool retry() {
+    if (!m_reused) {
+      return false;
+    }
+    m_stats.reconnects++;
+    m_stats.reuses--;
+    stop();
+    return true;
+  }
+
+  int fail(int code) {
+    m_stats.failures++;
+    stop();
+    return code;
+  }
+
+  int finish(bool complete) {
+    m_state = IDLE;
+    m_complete = complete;
+    if (!complete || m_close ||
+        (m_content_length < 0 && !m_chunked && !m_no_body)) {
+      stop();
+    } else {
+      m_reusable = true;
+    }
+    return m_code;
+  }
+
+  /*
+   * Response reading
+   */
+
+  // Fill the buffer with whatever is available, without waiting. Returns
+  // false if nothing was read.
+  bool receive() {
+    if (m_client->available() <= 0) {
+      return false;
+    }
+    int c = m_client->read(m_buffer, sizeof(m_buffer));
+    if (c <= 0) {
+      return false;
+    }
+    m_buf_pos = 0;
+    m_buf_len = c;
+    m_last_data = simple_http_millis();
+    return true;
+  }
+
+  // The server closed the connection or stopped sending
+  int end_of_data() {
+    if (m_state == BODY) {
+      // Closing is the end of a body without Content-Length
+      return finish(m_remaining < 0 && !m_chunked && !m_timed_out);
+    }
+    if (m_timed_out) {
+      return fail(SIMPLE_HTTP_ERROR_TIMEOUT);
+    }
+    if (m_have_status) {
+      return fail(SIMPLE_HTTP_ERROR_PROTOCOL);
+    }
+    if (retry()) {
+      return send();
+    }
+    return fail(SIMPLE_HTTP_ERROR_NO_RESPONSE);
+  }
+
+  // Parse the buffered part of the head a line at a time, truncating long
+  // lines. Returns the status code once the blank line ending the head is
+  // read.
+  int parse_head() {
+    while (m_buf_pos < m_buf_len) {
+      char c = (char)m_buffer[m_buf_pos++];
+      if (c != '\n') {
+        if (c != '\r' && m_line_len + 1 < sizeof(m_line)) {
+          m_line[m_line_len++] = c;
+        }
+        continue;
+      }
+      m_line[m_line_len] = '\0';
+      size_t len = m_line_len;
+      m_line_len = 0;
+
+      if (!m_have_status) {
+        if (len < 12 || strncmp(m_line, "HTTP/1.", 7) != 0) {
+          return SIMPLE_HTTP_ERROR_PROTOCOL;
+        }
+        if (m_line[7] == '0') {
+          m_close = true; // HTTP/1.0 closes unless told otherwise
+        }
+        m_code = atoi(m_line + 9);
+        if (m_code < 100) {
+          return SIMPLE_HTTP_ERROR_PROTOCOL;
+        }
+        m_have_status = true;
+      } else if (len == 0) {
+        return m_code;
+      } else {
+        parse_header(m_line);
+      }
+    }
+    return SIMPLE_HTTP_PENDING;
+  }
+
+  void parse_header(const char *line) {
+    if (header_is(line, "Content-Length")) {
+      m_content_length = strtoll(header_value(line), NULL, 10);
+    } else if (header_is(line, "Transfer-Encoding")) {
+      m_chunked = strstr(header_value(line), "chunked") != NULL;
+    } else if (header_is(line, "Connection")) {
+      const char *value = header_value(line);
+      m_close = simple_http_equals_nocase(value, "close", 5);
+    } else if (header_is(line, "ETag")) {
+      const char *value = header_value(line);
+      if (strlen(value) < sizeof(m_etag)) {
+        strcpy(m_etag, value);
+      }
+    } else if (header_is(line, "Cache-Control")) {
+      m_max_age = parse_max_age(header_value(line));
+    } else if (header_is(line, "Content-Encoding")) {
+      const char *value = header_value(line);
+      if (strlen(value) < sizeof(m_encoding)) {
+        strcpy(m_encoding, value);
+      }
+    }
+  }
+
+  static bool header_is(const char *line, const char *name) {
+    size_t len = strlen(name);
+    return simple_http_equals_nocase(line, name, len) && line[len] == ':';
+  }
+
+  static const char *header_value(const char *line) {
+    const char *value = strchr(line, ':') + 1;
+    while (*value == ' ' || *value == '\t') {
+      value++;
+    }
+    return value;
+  }
+
+  static int32_t parse_max_age(const char *value) {
+    for (const char *p = value; *p != '\0'; p++) {
+      if (simple_http_equals_nocase(p, "no-cache", 8) ||
+          simple_http_equals_nocase(p, "no-store", 8)) {
+        return 0;
+      }
+    }
+    for (const char *p = value; *p != '\0'; p++) {
+      if (simple_http_equals_nocase(p, "max-age=", 8)) {
+        return (int32_t)strtol(p + 8, NULL, 10);
+      }
+    }
+    return -1;
+  }
+
+  // Pass the buffered part of the body to the sink, decoding chunks, or
+  // reading to Content-Length if known or until the server closes the
+  // connection otherwise. Returns false if the sink stopped or the chunks
+  // were malformed.
+  bool parse_body(SimpleHTTPSink sink, void *ctx) {
+    if (m_chunked) {
+      size_t used;
+      bool ok = m_decoder.feed(m_buffer + m_buf_pos, m_buf_len - m_buf_pos,
+                               m_deliver ? sink : NULL, ctx, &used);
+      m_buf_pos += used;
+      return ok;
+    }
+    while (m_remaining != 0 && m_buf_pos < m_buf_len) {
+      size_t chunk = m_buf_len - m_buf_pos;
+      if (m_remaining > 0 && (int64_t)chunk > m_remaining) {
+        chunk = (size_t)m_remaining;
+      }
+      const uint8_t *data = m_buffer + m_buf_pos;
+      m_buf_pos += chunk;
+      if (m_remaining > 0) {
+        m_remaining -= chunk;
+      }
+      if (m_deliver && sink != NULL && !sink(ctx, data, chunk)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  enum State { IDLE, HEAD, BODY };
+
+  TClient *m_client;
+  SimpleHTTPUrl m_url;
+  SimpleHTTPStats m_stats;
+  uint32_t m_timeout;
+  bool m_reusable; // Last response left the connection ready for reuse
+  bool m_reused;   // Request in progress was sent on an open connection
+
+  // Request in progress, kept to send again on a new connection
+  State m_state;
+  const char *m_method;
+  const char *m_path;
+  const uint8_t *m_body;
+  size_t m_body_len;
+  const char *m_headers;
+  uint32_t m_started;   // Time the request was started
+  uint32_t m_deadline;  // Time limit for the request, 0 for none
+  uint32_t m_last_data; // Time data last arrived, for the timeout
+  bool m_progressed;
+
+  uint8_t m_buffer[SIMPLE_HTTP_BUFFER_SIZE];
+  size_t m_buf_pos;
+  size_t m_buf_len;
+
+  char m_line[128]; // Head line being read
+  size_t m_line_len;
+  bool m_have_status;
+  int m_code;
+  bool m_no_body;
+  bool m_deliver;     // Pass the body to the sink
+  int64_t m_remaining; // Body left to read, -1 if read until close
+  bool m_chunked;
+  SimpleHTTPChunkedDecoder m_decoder;
+
+  int64_t m_content_length;
+  char m_etag[SIMPLE_HTTP_ETAG_LENGTH + 1];
+  char m_encoding[16];
+  int32_t m_max_age;
+  bool m_close;
+  bool m_complete;
+  bool m_timed_out;
+};
+
+#endif
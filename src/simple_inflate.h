@@ -0,0 +1,664 @@
+/** @file
+ * Streaming decompression of deflate, zlib and gzip data
+ *
+ *  Copyright 2020 confrm.io
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __SIMPLE_INFLATE_H__
+#define __SIMPLE_INFLATE_H__
+
+#include <cstdint>
+#include <cstring>
+
+#include "simple_http.h"
+
+/*
+ * Compressed data can be fed in pieces of any size, as it arrives. The
+ * decompressed data is kept in a fixed window, which back references are
+ * copied from, and passed to the sink each time the window fills, so the
+ * output is never held in full.
+ *
+ * The window must be at least as large as the one the data was compressed
+ * with, 32 KB for gzip and zlib defaults. zlib data declares its window and
+ * is refused up front if it is larger; gzip and raw deflate data fail where
+ * a reference reaches further back than the window.
+ *
+ * The checksums in the zlib and gzip trailers are skipped, as the caller is
+ * expected to check a hash of the output.
+ *
+ * The decoder is based on Mark Adler's puff, reworked so that it can stop
+ * for more input at any bit.
+ */
+
+#ifndef SIMPLE_INFLATE_WINDOW_BITS
+#define SIMPLE_INFLATE_WINDOW_BITS 15
+#endif
+
+#define SIMPLE_INFLATE_WINDOW_SIZE (1u << SIMPLE_INFLATE_WINDOW_BITS)
+
+enum SimpleInflateFormat {
+  SIMPLE_INFLATE_RAW,  // Deflate blocks only
+  SIMPLE_INFLATE_ZLIB, // HTTP Content-Encoding: deflate
+  SIMPLE_INFLATE_GZIP  // HTTP Content-Encoding: gzip
+};
+
+class SimpleInflate {
+
+public:
+  explicit SimpleInflate(SimpleInflateFormat format = SIMPLE_INFLATE_GZIP) {
+    reset(format);
+  }
+
+  void reset(SimpleInflateFormat format) {
+    m_format = format;
+    m_state = (format == SIMPLE_INFLATE_RAW) ? BLOCK : HEADER;
+    m_bitbuf = 0;
+    m_bitcnt = 0;
+    m_final = false;
+    m_stopped = false;
+    m_skip = 0;
+    m_wpos = 0;
+    m_flushed = 0;
+    m_total_in = 0;
+    m_total_out = 0;
+    decode_reset();
+  }
+
+  /**
+   * @brief True once the end of the data, including any trailer, is read
+   */
+  bool done() const { return m_state == DONE; }
+
+  bool error() const { return m_state == ERROR; }
+
+  uint32_t total_in() const { return m_total_in; }
+
+  uint32_t total_out() const { return m_total_out; }
+
+  /**
+   * @brief Decompress the next piece of the data
+   *
+   * @param data  Compressed data
+   * @param len   Length of data
+   * @param sink  Called with the decompressed data, may be NULL
+   * @param ctx   Passed to the sink
+   * @param used  Set to the number of bytes used, less than len only if the
+   *              data ended or there was an error
+   * @return False on malformed data or if the sink stopped
+   */
+  bool feed(const uint8_t *data, size_t len, SimpleHTTPSink sink, void *ctx,
+            size_t *used = NULL) {
+    m_in = data;
+    m_in_end = data + len;
+    m_sink = sink;
+    m_ctx = ctx;
+    while (m_state != DONE && m_state != ERROR && !m_stopped && step()) {
+    }
+    flush();
+    size_t consumed = m_in - data;
+    m_total_in += consumed;
+    if (used != NULL) {
+      *used = consumed;
+    }
+    return m_state != ERROR && !m_stopped;
+  }
+
+private:
+  enum State {
+    HEADER,
+    GZIP_HEADER,   // Method and flags
+    GZIP_SKIP,     // Fixed fields, or extra field
+    GZIP_OPTIONAL, // Optional fields, as set in the flags
+    BLOCK,
+    STORED_LEN,
+    STORED_NLEN,
+    STORED,
+    TABLE_COUNTS,
+    TABLE_CODE_LENGTHS,
+    TABLE_LENGTHS,
+    TABLE_REPEAT,
+    CODES_SYMBOL,
+    CODES_LENGTH,
+    CODES_DISTANCE,
+    CODES_DISTANCE_EXTRA,
+    TRAILER,
+    DONE,
+    ERROR
+  };
+
+  enum GzipFlags {
+    GZIP_FHCRC = 0x02,
+    GZIP_FEXTRA = 0x04,
+    GZIP_FNAME = 0x08,
+    GZIP_FCOMMENT = 0x10
+  };
+
+  static const int MAX_BITS = 15;
+  static const int MAX_LENGTH_CODES = 286;
+  static const int MAX_DISTANCE_CODES = 30;
+  static const int FIXED_LENGTH_CODES = 288;
+
+  /*
+   * Bit input, least significant bit first. need() loads input until n
+   * bits are held, false if the input runs out first. n is at most 16.
+   */
+  bool need(unsigned n) {
+    while (m_bitcnt < n) {
+      if (m_in == m_in_end) {
+        return false;
+      }
+      m_bitbuf |= (uint32_t)*m_in++ << m_bitcnt;
+      m_bitcnt += 8;
+    }
+    return true;
+  }
+
+  uint32_t bits(unsigned n) {
+    uint32_t value = m_bitbuf & ((1u << n) - 1);
+    m_bitbuf >>= n;
+    m_bitcnt -= n;
+    return value;
+  }
+
+  /*
+   * Output, through the window
+   */
+  void put(uint8_t c) {
+    m_window[m_wpos++] = c;
+    m_total_out++;
+    if (m_wpos == SIMPLE_INFLATE_WINDOW_SIZE) {
+      flush();
+      m_wpos = 0;
+      m_flushed = 0;
+    }
+  }
+
+  void flush() {
+    if (m_wpos > m_flushed && m_sink != NULL && !m_stopped &&
+        !m_sink(m_ctx, m_window + m_flushed, m_wpos - m_flushed)) {
+      m_stopped = true;
+    }
+    m_flushed = m_wpos;
+  }
+
+  /*
+   * Canonical Huffman codes, as count of codes of each length and the
+   * symbols in code order
+   */
+  static int construct(uint16_t *count, uint16_t *symbol,
+                       const uint8_t *length, int n) {
+    for (int len = 0; len <= MAX_BITS; len++) {
+      count[len] = 0;
+    }
+    for (int s = 0; s < n; s++) {
+      count[length[s]]++;
+    }
+    if (count[0] == n) {
+      return 0;
+    }
+
+    // Over-subscribed is an error, incomplete is left to the caller
+    int left = 1;
+    for (int len = 1; len <= MAX_BITS; len++) {
+      left <<= 1;
+      left -= count[len];
+      if (left < 0) {
+        return left;
+      }
+    }
+
+    uint16_t offs[MAX_BITS + 1];
+    offs[1] = 0;
+    for (int len = 1; len < MAX_BITS; len++) {
+      offs[len + 1] = offs[len] + count[len];
+    }
+    for (int s = 0; s < n; s++) {
+      if (length[s] != 0) {
+        symbol[offs[length[s]]++] = s;
+      }
+    }
+    return left;
+  }
+
+  void decode_reset() {
+    m_code = 0;
+    m_first = 0;
+    m_index = 0;
+    m_len = 1;
+  }
+
+  // Next symbol a bit at a time, -1 if more input is needed and -2 for a
+  // code that is not in the table
+  int decode(const uint16_t *count, const uint16_t *symbol) {
+    while (m_len <= MAX_BITS) {
+      if (!need(1)) {
+        return -1;
+      }
+      m_code |= bits(1);
+      int c = count[m_len];
+      if (m_code - c < m_first) {
+        int s = symbol[m_index + (m_code - m_first)];
+        decode_reset();
+        return s;
+      }
+      m_index += c;
+      m_first += c;
+      m_first <<= 1;
+      m_code <<= 1;
+      m_len++;
+    }
+    return -2;
+  }
+
+  void fixed_tables() {
+    int s = 0;
+    for (; s < 144; s++) {
+      m_lengths[s] = 8;
+    }
+    for (; s < 256; s++) {
+      m_lengths[s] = 9;
+    }
+    for (; s < 280; s++) {
+      m_lengths[s] = 7;
+    }
+    for (; s < FIXED_LENGTH_CODES; s++) {
+      m_lengths[s] = 8;
+    }
+    construct(m_length_count, m_length_symbol, m_lengths, FIXED_LENGTH_CODES);
+    for (s = 0; s < MAX_DISTANCE_CODES; s++) {
+      m_lengths[s] = 5;
+    }
+    construct(m_distance_count, m_distance_symbol, m_lengths,
+              MAX_DISTANCE_CODES);
+  }
+
+  // Build the tables of a dynamic block from the lengths read
+  bool dynamic_tables() {
+    if (m_lengths[256] == 0) {
+      return false; // No end of block code
+    }
+    int left = construct(m_length_count, m_length_symbol, m_lengths,
+                         m_nlen);
+    if (left < 0 || (left > 0 && m_nlen - m_length_count[0] != 1)) {
+      return false;
+    }
+    left = construct(m_distance_count, m_distance_symbol,
+                     m_lengths + m_nlen, m_ndist);
+    return left >= 0 && (left == 0 || m_ndist - m_distance_count[0] == 1);
+  }
+
+  // Copy a match from earlier in the window
+  bool copy(uint32_t distance, uint32_t length) {
+    if (distance > SIMPLE_INFLATE_WINDOW_SIZE || distance > m_total_out) {
+      return false;
+    }
+    size_t from = (m_wpos + SIMPLE_INFLATE_WINDOW_SIZE - distance) &
+                  (SIMPLE_INFLATE_WINDOW_SIZE - 1);
+    while (length-- > 0) {
+      uint8_t c = m_window[from];
+      from = (from + 1) & (SIMPLE_INFLATE_WINDOW_SIZE - 1);
+      put(c);
+    }
+    return true;
+  }
+
+  // Do the next piece of work, false if more input is needed
+  bool step() {
+    static const uint16_t length_base[29] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                             1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                             4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const uint16_t distance_base[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const uint8_t distance_extra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+        6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    static const uint8_t code_length_order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+    switch (m_state) {
+    case HEADER:
+      if (!need(16)) {
+        return false;
+      }
+      if (m_format == SIMPLE_INFLATE_GZIP) {
+        m_state = (bits(16) == 0x8b1f) ? GZIP_HEADER : ERROR;
+      } else {
+        uint32_t cmf = bits(8);
+        uint32_t flg = bits(8);
+        if ((cmf * 256 + flg) % 31 != 0 || (cmf & 0x0F) != 8 ||
+            (cmf >> 4) + 8 > SIMPLE_INFLATE_WINDOW_BITS || (flg & 0x20)) {
+          m_state = ERROR; // Not deflate, window too large, or dictionary
+        } else {
+          m_state = BLOCK;
+        }
+      }
+      return true;
+
+    case GZIP_HEADER:
+      if (!need(16)) {
+        return false;
+      }
+      if (bits(8) != 8) {
+        m_state = ERROR;
+        return true;
+      }
+      m_flags = bits(8);
+      m_skip = 6; // Modification time, extra flags, OS
+      m_state = GZIP_SKIP;
+      return true;
+
+    case GZIP_SKIP:
+      while (m_skip > 0) {
+        if (!need(8)) {
+          return false;
+        }
+        bits(8);
+        m_skip--;
+      }
+      m_state = GZIP_OPTIONAL;
+      return true;
+
+    case GZIP_OPTIONAL:
+      if (m_flags & GZIP_FEXTRA) {
+        if (!need(16)) {
+          return false;
+        }
+        m_skip = bits(16);
+        m_flags &= ~GZIP_FEXTRA;
+        m_state = GZIP_SKIP;
+      } else if (m_flags & (GZIP_FNAME | GZIP_FCOMMENT)) {
+        // Zero terminated, the name comes first
+        if (!need(8)) {
+          return false;
+        }
+        if (bits(8) == 0) {
+          m_flags &= ~((m_flags & GZIP_FNAME) ? GZIP_FNAME : GZIP_FCOMMENT);
+        }
+      } else if (m_flags & GZIP_FHCRC) {
+        m_skip = 2;
+        m_flags &= ~GZIP_FHCRC;
+        m_state = GZIP_SKIP;
+      } else {
+        m_state = BLOCK;
+      }
+      return true;
+
+    case BLOCK:
+      if (!need(3)) {
+        return false;
+      }
+      m_final = bits(1);
+      switch (bits(2)) {
+      case 0:
+        bits(m_bitcnt & 7); // Stored blocks start on a byte
+        m_state = STORED_LEN;
+        break;
+      case 1:
+        fixed_tables();
+        m_state = CODES_SYMBOL;
+        break;
+      case 2:
+        m_state = TABLE_COUNTS;
+        break;
+      default:
+        m_state = ERROR;
+        break;
+      }
+      return true;
+
+    case STORED_LEN:
+      if (!need(16)) {
+        return false;
+      }
+      m_stored = bits(16);
+      m_state = STORED_NLEN;
+      return true;
+
+    case STORED_NLEN:
+      if (!need(16)) {
+        return false;
+      }
+      m_state = (bits(16) == (~m_stored & 0xFFFF)) ? STORED : ERROR;
+      return true;
+
+    case STORED:
+      while (m_stored > 0 && !m_stopped) {
+        if (m_bitcnt >= 8) {
+          put((uint8_t)bits(8));
+        } else if (m_in < m_in_end) {
+          put(*m_in++);
+        } else {
+          return false;
+        }
+        m_stored--;
+      }
+      if (m_stored == 0) {
+        end_block();
+      }
+      return true;
+
+    case TABLE_COUNTS:
+      if (!need(14)) {
+        return false;
+      }
+      m_nlen = bits(5) + 257;
+      m_ndist = bits(5) + 1;
+      m_ncode = bits(4) + 4;
+      m_table_index = 0;
+      m_state = (m_nlen > MAX_LENGTH_CODES || m_ndist > MAX_DISTANCE_CODES)
+                    ? ERROR
+                    : TABLE_CODE_LENGTHS;
+      return true;
+
+    case TABLE_CODE_LENGTHS:
+      while (m_table_index < m_ncode) {
+        if (!need(3)) {
+          return false;
+        }
+        m_lengths[code_length_order[m_table_index++]] = bits(3);
+      }
+      for (int i = m_ncode; i < 19; i++) {
+        m_lengths[code_length_order[i]] = 0;
+      }
+      // The code length code goes in the length table until it is built
+      if (construct(m_length_count, m_length_symbol, m_lengths, 19) != 0) {
+        m_state = ERROR;
+        return true;
+      }
+      m_table_index = 0;
+      decode_reset();
+      m_state = TABLE_LENGTHS;
+      return true;
+
+    case TABLE_LENGTHS:
+      while (m_table_index < m_nlen + m_ndist) {
+        int s = decode(m_length_count, m_length_symbol);
+        if (s == -1) {
+          return false;
+        }
+        if (s < 0) {
+          m_state = ERROR;
+          return true;
+        }
+        if (s >= 16) {
+          m_symbol = s;
+          m_state = TABLE_REPEAT;
+          return true;
+        }
+        m_lengths[m_table_index++] = s;
+      }
+      m_state = dynamic_tables() ? CODES_SYMBOL : ERROR;
+      return true;
+
+    case TABLE_REPEAT: {
+      unsigned extra = (m_symbol == 16) ? 2 : (m_symbol == 17) ? 3 : 7;
+      if (!need(extra)) {
+        return false;
+      }
+      uint8_t length = 0;
+      int repeat = (int)bits(extra) + ((m_symbol == 18) ? 11 : 3);
+      if (m_symbol == 16) {
+        if (m_table_index == 0) {
+          m_state = ERROR;
+          return true;
+        }
+        length = m_lengths[m_table_index - 1];
+      }
+      if (m_table_index + repeat > m_nlen + m_ndist) {
+        m_state = ERROR;
+        return true;
+      }
+      while (repeat-- > 0) {
+        m_lengths[m_table_index++] = length;
+      }
+      m_state = TABLE_LENGTHS;
+      return true;
+    }
+
+    case CODES_SYMBOL:
+      while (!m_stopped) {
+        int s = decode(m_length_count, m_length_symbol);
+        if (s == -1) {
+          return false;
+        }
+        if (s < 0 || s > 285) {
+          m_state = ERROR;
+          return true;
+        }
+        if (s < 256) {
+          put((uint8_t)s);
+          continue;
+        }
+        if (s == 256) {
+          end_block();
+          return true;
+        }
+        m_symbol = s - 257;
+        m_state = CODES_LENGTH;
+        return true;
+      }
+      return true;
+
+    case CODES_LENGTH:
+      if (!need(length_extra[m_symbol])) {
+        return false;
+      }
+      m_length = length_base[m_symbol] + bits(length_extra[m_symbol]);
+      m_state = CODES_DISTANCE;
+      return true;
+
+    case CODES_DISTANCE: {
+      int s = decode(m_distance_count, m_distance_symbol);
+      if (s == -1) {
+        return false;
+      }
+      if (s < 0 || s >= MAX_DISTANCE_CODES) {
+        m_state = ERROR;
+        return true;
+      }
+      m_symbol = s;
+      m_state = CODES_DISTANCE_EXTRA;
+      return true;
+    }
+
+    case CODES_DISTANCE_EXTRA:
+      if (!need(distance_extra[m_symbol])) {
+        return false;
+      }
+      m_state = copy(distance_base[m_symbol] +
+                         bits(distance_extra[m_symbol]),
+                     m_length)
+                    ? CODES_SYMBOL
+                    : ERROR;
+      return true;
+
+    case TRAILER:
+      while (m_skip > 0) {
+        if (!need(8)) {
+          return false;
+        }
+        bits(8);
+        m_skip--;
+      }
+      m_state = DONE;
+      return true;
+
+    default:
+      return false;
+    }
+  }
+
+  void end_block() {
+    if (!m_final) {
+      m_state = BLOCK;
+      return;
+    }
+    bits(m_bitcnt & 7);
+    m_skip = (m_format == SIMPLE_INFLATE_GZIP)   ? 8 // CRC-32, size
+             : (m_format == SIMPLE_INFLATE_ZLIB) ? 4 // Adler-32
+                                                 : 0;
+    m_state = TRAILER;
+  }
+
+  SimpleInflateFormat m_format;
+  State m_state;
+
+  // Input of the current feed()
+  const uint8_t *m_in;
+  const uint8_t *m_in_end;
+  SimpleHTTPSink m_sink;
+  void *m_ctx;
+  bool m_stopped; // Sink returned false
+
+  uint32_t m_bitbuf;
+  unsigned m_bitcnt;
+  bool m_final; // Last block
+  uint8_t m_flags;
+  uint32_t m_skip; // Header or trailer bytes left to skip
+  uint32_t m_stored; // Stored block bytes left to copy
+
+  // Dynamic table being read
+  int m_nlen;
+  int m_ndist;
+  int m_ncode;
+  int m_table_index;
+  uint8_t m_lengths[MAX_LENGTH_CODES + MAX_DISTANCE_CODES + 2];
+
+  uint16_t m_length_count[MAX_BITS + 1];
+  uint16_t m_length_symbol[FIXED_LENGTH_CODES];
+  uint16_t m_distance_count[MAX_BITS + 1];
+  uint16_t m_distance_symbol[MAX_DISTANCE_CODES];
+
+  // Symbol being decoded, kept between feeds
+  int m_code;
+  int m_first;
+  int m_index;
+  int m_len;
+
+  int m_symbol;      // Length or distance code, or code length repeat
+  uint32_t m_length; // Of the match being read
+
+  uint8_t m_window[SIMPLE_INFLATE_WINDOW_SIZE];
+  size_t m_wpos;    // Next byte written
+  size_t m_flushed; // Window written up to here has gone to the sink
+  uint32_t m_total_in;
+  uint32_t m_total_out;
+};
+
+#endif
@@ -7,10 +7,14 @@
 #define String std::string
 #endif
 
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <vector>
 
-typedef enum SimpleJSONType { STRING, BOOLEAN, NUMBER } SimpleJSONType;
+typedef enum SimpleJSONType { STRING, BOOLEAN, NUMBER, OBJECT, ARRAY } SimpleJSONType;
 
 struct SimpleJSONElement {
   String key;
@@ -51,7 +55,529 @@ bool to_bool(String str) {
   }
 }
 
-std::vector<SimpleJSONElement> simple_json(String str) {
+/**
+ * Location of a section of the input, as an offset and length in to the
+ * caller's buffer. The buffer is never copied or modified.
+ */
+struct SimpleJSONSpan {
+  size_t offset;
+  size_t length;
+};
+
+/**
+ * A single key-value pair found by the tokenizer. For strings the value span
+ * excludes the surrounding double quotes, escape sequences are left as-is.
+ */
+struct SimpleJSONToken {
+  SimpleJSONSpan key;
+  SimpleJSONSpan value;
+  SimpleJSONType type;
+};
+
+/**
+ * Structural index, one bit per byte of input (bit n % 32 of word n / 32) set
+ * where the byte is one of the structural characters: " \\ : , { } [ ]
+ *
+ * Built 32 bytes at a time using AVX2 or SSE2 when built for x86 with
+ * CPP_STANDARD, and 32 bit SWAR word operations otherwise (i.e. Xtensa), the
+ * SWAR method assumes a little endian target. The
+ * tokenizer can then jump between structural characters rather than checking
+ * every byte.
+ */
+#define SIMPLE_JSON_INDEX_WORDS(len) (((len) + 31) / 32)
+
+bool simple_json_is_structural(char c) {
+  return c == '"' || c == '\\' || c == ':' || c == ',' || c == '{' ||
+         c == '}' || c == '[' || c == ']';
+}
+
+/**
+ * @brief Reference implementation, one character at a time
+ *
+ * @param str    Input buffer
+ * @param len    Length of input
+ * @param index  SIMPLE_JSON_INDEX_WORDS(len) words to store the index in
+ */
+void simple_json_index_scalar(const char *str, size_t len, uint32_t *index) {
+  memset(index, 0, SIMPLE_JSON_INDEX_WORDS(len) * sizeof(uint32_t));
+  for (size_t i = 0; i < len; i++) {
+    if (simple_json_is_structural(str[i])) {
+      index[i / 32] |= (1UL << (i % 32));
+    }
+  }
+}
+
+/**
+ * Sets the top bit of each byte of word which equals c, using the exact form
+ * of the "has zero byte" trick so that neighbouring bytes do not interfere.
+ */
+uint32_t simple_json_swar_match(uint32_t word, char c) {
+  uint32_t x = word ^ (0x01010101U * (uint8_t)c);
+  uint32_t t = (x & 0x7F7F7F7FU) + 0x7F7F7F7FU;
+  return ~(t | x | 0x7F7F7F7FU);
+}
+
+/**
+ * @brief Index 32 bytes using 32 bit SWAR word operations
+ */
+uint32_t simple_json_index_block_swar(const char *str) {
+  uint32_t mask = 0;
+  for (size_t i = 0; i < 8; i++) {
+    uint32_t word;
+    memcpy(&word, str + 4 * i, sizeof(word)); // Little endian load
+    // '[' ']' and '{' '}' differ only in bit 5, so fold the case bit
+    uint32_t folded = word | 0x20202020U;
+    uint32_t m = simple_json_swar_match(word, '"') |
+                 simple_json_swar_match(word, '\\') |
+                 simple_json_swar_match(word, ':') |
+                 simple_json_swar_match(word, ',') |
+                 simple_json_swar_match(folded, '{') |
+                 simple_json_swar_match(folded, '}');
+    // Gather the top bit of each byte in to the top four bits
+    mask |= (((m >> 7) * 0x10204080U) >> 28) << (4 * i);
+  }
+  return mask;
+}
+
+#if defined(CPP_STANDARD) && defined(__SSE2__)
+#include <emmintrin.h>
+
+uint32_t simple_json_index_block_sse2_16(const char *str) {
+  const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str));
+  __m128i m = _mm_cmpeq_epi8(in, _mm_set1_epi8('"'));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(in, _mm_set1_epi8('\\')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(in, _mm_set1_epi8(':')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(in, _mm_set1_epi8(',')));
+  // '[' ']' and '{' '}' differ only in bit 5, so fold the case bit
+  const __m128i folded = _mm_or_si128(in, _mm_set1_epi8(0x20));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(folded, _mm_set1_epi8('{')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(folded, _mm_set1_epi8('}')));
+  return (uint32_t)_mm_movemask_epi8(m);
+}
+
+/**
+ * @brief Index 32 bytes using SSE2
+ */
+uint32_t simple_json_index_block_sse2(const char *str) {
+  return simple_json_index_block_sse2_16(str) |
+         (simple_json_index_block_sse2_16(str + 16) << 16);
+}
+#endif
+
+#if defined(CPP_STANDARD) && defined(__AVX2__)
+#include <immintrin.h>
+
+/**
+ * @brief Index 32 bytes using AVX2
+ */
+uint32_t simple_json_index_block_avx2(const char *str) {
+  const __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str));
+  __m256i m = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('"'));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\\')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(in, _mm256_set1_epi8(':')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(in, _mm256_set1_epi8(',')));
+  // '[' ']' and '{' '}' differ only in bit 5, so fold the case bit
+  const __m256i folded = _mm256_or_si256(in, _mm256_set1_epi8(0x20));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}')));
+  return (uint32_t)_mm256_movemask_epi8(m);
+}
+#endif
+
+/**
+ * @brief Index 32 bytes using the best method available on this target
+ */
+uint32_t simple_json_index_block(const char *str) {
+#if defined(CPP_STANDARD) && defined(__AVX2__)
+  return simple_json_index_block_avx2(str);
+#elif defined(CPP_STANDARD) && defined(__SSE2__)
+  return simple_json_index_block_sse2(str);
+#else
+  return simple_json_index_block_swar(str);
+#endif
+}
+
+/**
+ * @brief Build the structural index for a buffer
+ *
+ * Gives exactly the same result as simple_json_index_scalar.
+ *
+ * @param str    Input buffer
+ * @param len    Length of input
+ * @param index  SIMPLE_JSON_INDEX_WORDS(len) words to store the index in
+ */
+void simple_json_index(const char *str, size_t len, uint32_t *index) {
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    index[i / 32] = simple_json_index_block(str + i);
+  }
+  if (i < len) {
+    uint32_t mask = 0;
+    for (size_t j = i; j < len; j++) {
+      if (simple_json_is_structural(str[j])) {
+        mask |= (1UL << (j - i));
+      }
+    }
+    index[i / 32] = mask;
+  }
+}
+
+/**
+ * @brief Position of the first structural character at or after pos, or len
+ * if there is none
+ */
+size_t simple_json_next_structural(const uint32_t *index, size_t len,
+                                   size_t pos) {
+  if (pos >= len) {
+    return len;
+  }
+  size_t word = pos / 32;
+  const size_t words = SIMPLE_JSON_INDEX_WORDS(len);
+  uint32_t bits = index[word] & (0xFFFFFFFFUL << (pos % 32));
+  while (bits == 0) {
+    if (++word >= words) {
+      return len;
+    }
+    bits = index[word];
+  }
+  size_t result = word * 32 + __builtin_ctz(bits);
+  return result < len ? result : len;
+}
+
+/**
+ * Tokenizer state, walks a const char* / length view of a JSON document and
+ * returns one SimpleJSONToken per key-value pair without using the heap.
+ */
+struct SimpleJSONTokenizer {
+  const char *str;
+  size_t len;
+  size_t pos;
+  const uint32_t *index; // Optional structural index, NULL if not used
+};
+
+bool simple_json_is_space(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+/**
+ * Starts tokenizing the given buffer, returns false if no opening brace was
+ * found.
+ */
+bool simple_json_begin(SimpleJSONTokenizer &tok, const char *str, size_t len) {
+  tok.str = str;
+  tok.len = len;
+  tok.pos = 0;
+  tok.index = NULL;
+
+  // Find start of json (expect this to be str[0])
+  while (tok.pos < len && str[tok.pos] != '{') {
+    tok.pos++;
+  }
+
+  // No start was found
+  if (tok.pos + 1 >= len) {
+    tok.pos = len;
+    return false;
+  }
+
+  tok.pos++;
+  return true;
+}
+
+/**
+ * Starts tokenizing the given buffer using a structural index built by
+ * simple_json_index, returns false if no opening brace was found.
+ */
+bool simple_json_begin_indexed(SimpleJSONTokenizer &tok, const char *str,
+                               size_t len, const uint32_t *index) {
+  bool result = simple_json_begin(tok, str, len);
+  tok.index = index;
+  return result;
+}
+
+/**
+ * Position of the first of the structural characters a or b at or after ind,
+ * or len if neither is found.
+ */
+size_t simple_json_find_either(const SimpleJSONTokenizer &tok, size_t ind,
+                               char a, char b) {
+  if (tok.index != NULL) {
+    for (; (ind = simple_json_next_structural(tok.index, tok.len, ind)) <
+           tok.len;
+         ind++) {
+      if (tok.str[ind] == a || tok.str[ind] == b) {
+        return ind;
+      }
+    }
+    return tok.len;
+  }
+  for (; ind < tok.len; ind++) {
+    if (tok.str[ind] == a || tok.str[ind] == b) {
+      return ind;
+    }
+  }
+  return tok.len;
+}
+
+/**
+ * Position of the double quote ending the string which starts at ind, or len
+ * if the string is not terminated. Escaped characters are skipped.
+ */
+size_t simple_json_string_end(const SimpleJSONTokenizer &tok, size_t ind) {
+  if (tok.index != NULL) {
+    while ((ind = simple_json_next_structural(tok.index, tok.len, ind)) <
+           tok.len) {
+      if (tok.str[ind] == '"') {
+        return ind;
+      }
+      ind += (tok.str[ind] == '\\') ? 2 : 1;
+    }
+    return tok.len;
+  }
+  for (; ind < tok.len && tok.str[ind] != '"'; ind++) {
+    if (tok.str[ind] == '\\') {
+      ind++;
+    }
+  }
+  return ind < tok.len ? ind : tok.len;
+}
+
+/**
+ * Position of the brace or bracket closing the object or array which opens at
+ * ind, or len if it is not closed. Nested objects and arrays are tracked by
+ * depth and strings are skipped, so their contents are never mistaken for
+ * the end.
+ */
+size_t simple_json_container_end(const SimpleJSONTokenizer &tok, size_t ind) {
+  size_t depth = 0;
+  while (ind < tok.len) {
+    char c = tok.str[ind];
+    if (c == '"') {
+      ind = simple_json_string_end(tok, ind + 1);
+      if (ind >= tok.len) {
+        return tok.len;
+      }
+    } else if (c == '{' || c == '[') {
+      depth++;
+    } else if (c == '}' || c == ']') {
+      if (--depth == 0) {
+        return ind;
+      }
+    }
+    ind = (tok.index != NULL)
+              ? simple_json_next_structural(tok.index, tok.len, ind + 1)
+              : ind + 1;
+  }
+  return tok.len;
+}
+
+/**
+ * Finds the next key-value pair, returns false once the end of the object
+ * has been reached or the remaining input is incomplete.
+ */
+bool simple_json_next(SimpleJSONTokenizer &tok, SimpleJSONToken &out) {
+
+  const char *str = tok.str;
+  const size_t len = tok.len;
+  size_t ind = tok.pos;
+
+  // Advance to the double quote at the start of the key, a closing brace
+  // before the key indicates the end of the object
+  ind = simple_json_find_either(tok, ind, '"', '}');
+  if (ind >= len || str[ind] == '}') {
+    tok.pos = len;
+    return false;
+  }
+
+  // Advance to the double quote at the end of the key
+  out.key.offset = ++ind;
+  ind = simple_json_string_end(tok, ind);
+  if (ind >= len) {
+    tok.pos = len;
+    return false;
+  }
+  out.key.length = ind - out.key.offset;
+  ind++;
+
+  // Advance over white space and the colon delimiter
+  while (ind < len && (simple_json_is_space(str[ind]) || str[ind] == ':')) {
+    ind++;
+  }
+  if (ind >= len) {
+    tok.pos = len;
+    return false;
+  }
+
+  // A double quote indicates a string, a brace or bracket a nested object or
+  // array, true/false a boolean, otherwise treat as a number. Strings end at
+  // the first unescaped double quote, nested values at the matching close and
+  // other values end at white space or an end of element delimiter.
+  if (str[ind] == '"') {
+    out.type = STRING;
+    out.value.offset = ++ind;
+    ind = simple_json_string_end(tok, ind);
+    if (ind >= len) {
+      tok.pos = len;
+      return false;
+    }
+    out.value.length = ind - out.value.offset;
+    ind++;
+  } else if (str[ind] == '{' || str[ind] == '[') {
+    out.type = (str[ind] == '{') ? OBJECT : ARRAY;
+    out.value.offset = ind;
+    ind = simple_json_container_end(tok, ind);
+    if (ind >= len) {
+      tok.pos = len;
+      return false;
+    }
+    out.value.length = ++ind - out.value.offset;
+  } else {
+    char first = tolower(str[ind]);
+    out.type = (first == 't' || first == 'f') ? BOOLEAN : NUMBER;
+    out.value.offset = ind;
+    while (ind < len && str[ind] != ',' && str[ind] != '}' &&
+           !simple_json_is_space(str[ind])) {
+      ind++;
+    }
+    out.value.length = ind - out.value.offset;
+  }
+
+  // Look for the end of this element (could be end of json)
+  ind = simple_json_find_either(tok, ind, ',', '}');
+  if (ind >= len) {
+    tok.pos = len;
+    return false;
+  }
+
+  // Consume a comma, but leave a closing brace for the next call to find
+  tok.pos = (str[ind] == ',') ? ind + 1 : ind;
+  return true;
+}
+
+/**
+ * Compares a span against a null terminated string
+ */
+bool simple_json_span_equals(const char *str, const SimpleJSONSpan &span,
+                             const char *other) {
+  size_t other_len = strlen(other);
+  return other_len == span.length &&
+         memcmp(str + span.offset, other, other_len) == 0;
+}
+
+/**
+ * Converts a NUMBER span in to an int64_t, using the same rules as strtoll
+ * with automatic base detection.
+ */
+int64_t simple_json_span_to_number(const char *str, const SimpleJSONSpan &span) {
+  char buf[24];
+  size_t len = span.length < sizeof(buf) - 1 ? span.length : sizeof(buf) - 1;
+  memcpy(buf, str + span.offset, len);
+  buf[len] = '\0';
+  return strtoll(buf, NULL, 0);
+}
+
+/**
+ * As simple_json_span_to_number, but returns false unless the whole span is
+ * a number that fits in an int64_t.
+ */
+bool simple_json_span_to_int64(const char *str, const SimpleJSONSpan &span,
+                               int64_t &out) {
+  char buf[24];
+  if (span.length == 0 || span.length > sizeof(buf) - 1) {
+    return false;
+  }
+  memcpy(buf, str + span.offset, span.length);
+  buf[span.length] = '\0';
+  char *end;
+  errno = 0;
+  out = strtoll(buf, &end, 0);
+  return end == buf + span.length && errno != ERANGE;
+}
+
+/**
+ * Converts a BOOLEAN span in to a bool, anything other than a case
+ * insensitive "true" is false.
+ */
+bool simple_json_span_to_bool(const char *str, const SimpleJSONSpan &span) {
+  const char *expected = "true";
+  if (span.length != 4) {
+    return false;
+  }
+  for (size_t i = 0; i < 4; i++) {
+    if (tolower(str[span.offset + i]) != expected[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Find the value of a single top level key
+ *
+ * Scanning stops as soon as the key is found, values before it are skipped
+ * over without being copied or converted.
+ *
+ * @param str  Input buffer
+ * @param len  Length of input
+ * @param key  Null terminated key to look for
+ * @param out  Populated with the key and value spans if found
+ * @return True if the key was found
+ */
+bool simple_json_find(const char *str, size_t len, const char *key,
+                      SimpleJSONToken &out) {
+  SimpleJSONTokenizer tok;
+  if (!simple_json_begin(tok, str, len)) {
+    return false;
+  }
+  while (simple_json_next(tok, out)) {
+    if (simple_json_span_equals(str, out.key, key)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Find the values of a set of top level keys
+ *
+ * Scanning stops as soon as every key has been found. If a key appears more
+ * than once the first value is used.
+ *
+ * @param str   Input buffer
+ * @param len   Length of input
+ * @param keys  Null terminated keys to look for, at most 32
+ * @param n     Number of keys
+ * @param out   Array of n tokens, out[i] is populated if keys[i] is found
+ * @return Bit mask with bit i set if keys[i] was found
+ */
+uint32_t simple_json_find_keys(const char *str, size_t len,
+                               const char *const *keys, size_t n,
+                               SimpleJSONToken *out) {
+  uint32_t found = 0;
+  if (n == 0 || n > 32) {
+    return found;
+  }
+  const uint32_t all = (n == 32) ? 0xFFFFFFFFUL : ((1UL << n) - 1);
+
+  SimpleJSONTokenizer tok;
+  if (!simple_json_begin(tok, str, len)) {
+    return found;
+  }
+  SimpleJSONToken token;
+  while (found != all && simple_json_next(tok, token)) {
+    for (size_t i = 0; i < n; i++) {
+      if (!(found & (1UL << i)) &&
+          simple_json_span_equals(str, token.key, keys[i])) {
+        out[i] = token;
+        found |= (1UL << i);
+        break;
+      }
+    }
+  }
+  return found;
+}
+
+std::vector<SimpleJSONElement> simple_json(const String &str) {
 
   /*
    * This JSON decoder is limited to processing only top level elements for key-value pairs which
@@ -62,7 +588,8 @@ std::vector<SimpleJSONElement> simple_json(String str) {
    * The key must be a simple string containing only 0-7,a-z,A-Z,_,-
    *
    * The value may be a number (up to int64_t size) or a string following normal JSON string
-   * requirements
+   * requirements. Nested objects and arrays are skipped over as a whole and returned as raw
+   * text with type OBJECT or ARRAY, use SimpleJSONTape to navigate their contents.
    *
    * i.e:
    *
@@ -71,26 +598,19 @@ std::vector<SimpleJSONElement> simple_json(String str) {
    *   "another-key": 999,
    *   "a_final_key": -2
    * }
+   *
+   * The work is done by simple_json_next, this wraps each token up as a
+   * SimpleJSONElement for callers that want copies of the data.
    */
 
   std::vector<SimpleJSONElement> result;
 
-  size_t ind = 0;
-
-  // Remove new line characters to make processing easier
-  for (ind = 0; ind < str.length(); ind++) {
-    if (str[ind] == '\n')
-      str[ind] = ' ';
+  if (str.length() == 0) {
+    return result;
   }
 
-  // Find start of json (expect this to be str[0]
-  for (ind = 0; ind < str.length(); ind++) {
-    if (str[ind] == '{')
-      break;
-  }
-
-  // No start was found
-  if (ind >= str.length() - 1) {
+  SimpleJSONTokenizer tok;
+  if (!simple_json_begin(tok, str.c_str(), str.length())) {
 #if defined(ARDUINO_ARCH_ESP8266)
     return result; // Exceptions disabled on ESP8266 by default
 #else
@@ -98,156 +618,1189 @@ std::vector<SimpleJSONElement> simple_json(String str) {
 #endif
   }
 
-  /*
-   * Will look for start and end of each key value pair, processing the JSON string one
-   * character at a time.
+  SimpleJSONToken token;
+  while (simple_json_next(tok, token)) {
+
+    // Extract and store data in the results vector
+    SimpleJSONElement kvp;
+#ifdef CPP_STANDARD
+    kvp.key = str.substr(token.key.offset, token.key.length);
+    kvp.value_string = str.substr(token.value.offset, token.value.length);
+#else
+    kvp.key = str.substring(token.key.offset,
+                            token.key.offset + token.key.length);
+    kvp.value_string = str.substring(token.value.offset,
+                                     token.value.offset + token.value.length);
+#endif
+    kvp.type = token.type;
+    kvp.value_number = 0;
+    kvp.value_boolean = false;
+    if (token.type == NUMBER) {
+      kvp.value_number = simple_json_span_to_number(str.c_str(), token.value);
+    } else if (token.type == BOOLEAN) {
+      kvp.value_boolean = simple_json_span_to_bool(str.c_str(), token.value);
+    }
+    result.push_back(kvp);
+  }
+
+  // Fin
+  return result;
+}
+
+/**
+ * Event passed to the stream parser callback. The key and value point in to
+ * the parser's own null terminated buffers and are only valid for the
+ * duration of the callback.
+ */
+struct SimpleJSONStreamEvent {
+  const char *key;
+  size_t key_length;
+  const char *value;
+  size_t value_length;
+  SimpleJSONType type;
+  bool truncated; // Key or value did not fit in the parser buffers
+};
+
+typedef void (*SimpleJSONStreamCallback)(void *ctx,
+                                         const SimpleJSONStreamEvent &event);
+
+/**
+ * Resumable push parser, accepts the JSON document in chunks of any size
+ * (down to a single byte) and calls the callback as soon as each key-value
+ * pair is complete. The rules are the same as simple_json_next.
+ *
+ * Memory use is fixed by the template arguments, keys and values longer than
+ * the buffers are truncated and flagged in the event rather than rejected.
+ */
+template <size_t KEY_LENGTH, size_t VALUE_LENGTH>
+class SimpleJSONStreamParser {
+
+public:
+  SimpleJSONStreamParser(SimpleJSONStreamCallback callback, void *ctx)
+      : m_callback(callback), m_ctx(ctx) {
+    reset();
+  }
+
+  /**
+   * @brief Return the parser to the initial state, ready for a new document
    */
-  
-  size_t key_start = -1, key_end = -1, value_start = -1, value_end = -1;
-  bool advance = true; // Used to indicate advancing over blank space
-  char last_char = '\0'; // Used to keep track of previous character for escape sequence
-  bool was_ending = false;
-  SimpleJSONType value_type = STRING; // Used to track the detected number type
-
-  // Iterating over the length of the string
-  for (; ind < str.length(); ind++) {
-      
-    // Advance to non-space
-    if (advance == true && str[ind] == ' ') {
-      continue;
+  void reset() {
+    m_state = FIND_START;
+    m_key_length = 0;
+    m_value_length = 0;
+    m_truncated = false;
+    m_escape = false;
+    m_nested_string = false;
+    m_depth = 0;
+    m_type = STRING;
+  }
+
+  /**
+   * @brief Process the next chunk of the document
+   *
+   * @param data  Pointer to the chunk
+   * @param len   Length of the chunk
+   * @return Number of bytes consumed, less than len only once the end of the
+   *         object has been found
+   */
+  size_t feed(const char *data, size_t len) {
+    size_t ind = 0;
+    for (; ind < len && m_state != DONE; ind++) {
+      consume(data[ind]);
     }
+    return ind;
+  }
 
-    // Keys all start with '"'
-    if (key_start == -1) {
-      if (str[ind] == '{') {
-        continue;
-      } else if (str[ind] == '"') {
-        key_start = ind + 1;
-        advance = false;
-        continue;
+  /**
+   * @brief True once the opening brace has been found
+   */
+  bool started() const { return m_state != FIND_START; }
+
+  /**
+   * @brief True once the closing brace has been found
+   */
+  bool finished() const { return m_state == DONE; }
+
+private:
+  enum State {
+    FIND_START, // Looking for the opening brace
+    FIND_KEY,   // Looking for the opening double quote of a key
+    IN_KEY,     // Inside a key
+    FIND_VALUE, // Advancing over white space and the colon
+    IN_STRING,  // Inside a string value
+    IN_BARE,    // Inside a number or boolean value
+    IN_NESTED,  // Inside a nested object or array value
+    FIND_END,   // Looking for the end of element delimiter
+    DONE
+  };
+
+  void consume(char c) {
+    switch (m_state) {
+    case FIND_START:
+      if (c == '{') {
+        m_state = FIND_KEY;
+      }
+      break;
+    case FIND_KEY:
+      if (c == '"') {
+        m_key_length = 0;
+        m_value_length = 0;
+        m_truncated = false;
+        m_escape = false;
+        m_state = IN_KEY;
+      } else if (c == '}') {
+        m_state = DONE;
+      }
+      break;
+    case IN_KEY:
+      if (c == '"' && !m_escape) {
+        m_state = FIND_VALUE;
+      } else {
+        m_escape = !m_escape && c == '\\';
+        append(m_key, m_key_length, KEY_LENGTH, c);
+      }
+      break;
+    case FIND_VALUE:
+      if (simple_json_is_space(c) || c == ':') {
+        break;
+      } else if (c == '"') {
+        m_type = STRING;
+        m_escape = false;
+        m_state = IN_STRING;
+      } else if (c == '{' || c == '[') {
+        m_type = (c == '{') ? OBJECT : ARRAY;
+        m_depth = 1;
+        m_nested_string = false;
+        m_escape = false;
+        append(m_value, m_value_length, VALUE_LENGTH, c);
+        m_state = IN_NESTED;
+      } else {
+        char first = tolower(c);
+        m_type = (first == 't' || first == 'f') ? BOOLEAN : NUMBER;
+        append(m_value, m_value_length, VALUE_LENGTH, c);
+        m_state = IN_BARE;
+      }
+      break;
+    case IN_STRING:
+      if (c == '"' && !m_escape) {
+        m_state = FIND_END;
+      } else {
+        m_escape = !m_escape && c == '\\';
+        append(m_value, m_value_length, VALUE_LENGTH, c);
+      }
+      break;
+    case IN_BARE:
+      if (c == ',' || c == '}') {
+        end_element(c);
+      } else if (simple_json_is_space(c)) {
+        m_state = FIND_END;
+      } else {
+        append(m_value, m_value_length, VALUE_LENGTH, c);
+      }
+      break;
+    case IN_NESTED:
+      append(m_value, m_value_length, VALUE_LENGTH, c);
+      if (m_nested_string) {
+        m_nested_string = m_escape || c != '"';
+        m_escape = !m_escape && c == '\\';
+      } else if (c == '"') {
+        m_nested_string = true;
+      } else if (c == '{' || c == '[') {
+        m_depth++;
+      } else if ((c == '}' || c == ']') && --m_depth == 0) {
+        m_state = FIND_END;
       }
+      break;
+    case FIND_END:
+      if (c == ',' || c == '}') {
+        end_element(c);
+      }
+      break;
+    case DONE:
+      break;
     }
+  }
 
-    // Advance to double quote at the end of key
-    if (key_end == -1) {
-      if (str[ind] != '"') {
-        continue;
-      } else {
-        key_end = ind;
-        advance = true;
-        continue;
+  void append(char *buf, size_t &length, size_t size, char c) {
+    if (length < size) {
+      buf[length++] = c;
+    } else {
+      m_truncated = true;
+    }
+  }
+
+  void end_element(char c) {
+    m_key[m_key_length] = '\0';
+    m_value[m_value_length] = '\0';
+
+    SimpleJSONStreamEvent event;
+    event.key = m_key;
+    event.key_length = m_key_length;
+    event.value = m_value;
+    event.value_length = m_value_length;
+    event.type = m_type;
+    event.truncated = m_truncated;
+    m_callback(m_ctx, event);
+
+    m_state = (c == '}') ? DONE : FIND_KEY;
+  }
+
+  SimpleJSONStreamCallback m_callback;
+  void *m_ctx;
+
+  State m_state;
+  SimpleJSONType m_type;
+  bool m_escape;
+  bool m_truncated;
+  bool m_nested_string; // Inside a string within a nested value
+  size_t m_depth;       // Depth of nesting within a nested value
+
+  char m_key[KEY_LENGTH + 1];
+  size_t m_key_length;
+  char m_value[VALUE_LENGTH + 1];
+  size_t m_value_length;
+};
+
+/**
+ * Stream parser callback which appends each event to the
+ * std::vector<SimpleJSONElement> pointed to by ctx, for use with the
+ * get_simple_json_* accessors. Pairs cut short by the parser buffers are
+ * skipped, so a key is only found with its whole value.
+ */
+void simple_json_stream_collect(void *ctx, const SimpleJSONStreamEvent &event) {
+  if (event.truncated) {
+    return;
+  }
+  std::vector<SimpleJSONElement> *result =
+      reinterpret_cast<std::vector<SimpleJSONElement> *>(ctx);
+  SimpleJSONSpan span = {0, event.value_length};
+
+  SimpleJSONElement kvp;
+  kvp.key = event.key;
+  kvp.value_string = event.value;
+  kvp.type = event.type;
+  kvp.value_number = 0;
+  kvp.value_boolean = false;
+  if (event.type == NUMBER) {
+    kvp.value_number = simple_json_span_to_number(event.value, span);
+  } else if (event.type == BOOLEAN) {
+    kvp.value_boolean = simple_json_span_to_bool(event.value, span);
+  }
+  result->push_back(kvp);
+}
+
+/**
+ * Result of parsing in to fixed capacity storage
+ */
+typedef enum SimpleJSONStatus {
+  SIMPLE_JSON_OK,
+  SIMPLE_JSON_INVALID,       // No opening brace was found
+  SIMPLE_JSON_ELEMENTS_FULL, // More elements than the arena can hold
+  SIMPLE_JSON_BYTES_FULL,    // Keys and values do not fit in the arena
+  SIMPLE_JSON_TOO_DEEP,      // Nesting deeper than SIMPLE_JSON_TAPE_MAX_DEPTH
+  SIMPLE_JSON_VALUE_TRUNCATED // A key or value did not fit in the parser
+} SimpleJSONStatus;
+
+/**
+ * Record of one element stored in a SimpleJSONArena, offsets are in to the
+ * arena's byte storage
+ */
+struct SimpleJSONArenaElement {
+  uint16_t key_offset;
+  uint16_t key_length;
+  uint16_t value_offset;
+  uint16_t value_length;
+  SimpleJSONType type;
+};
+
+/**
+ * Fixed capacity storage for parsed elements, used in place of
+ * std::vector<SimpleJSONElement> where heap use must be avoided. Key and
+ * value bytes are packed contiguously (each null terminated) and elements
+ * are stored as offset/length records.
+ *
+ * Running out of space is recorded in status() and never thrown, the
+ * elements stored before the overflow remain valid.
+ */
+template <size_t N_ELEMENTS, size_t N_BYTES> class SimpleJSONArena {
+
+  static_assert(N_BYTES <= 0xFFFF, "Arena offsets are limited to 16 bits");
+
+public:
+  SimpleJSONArena() { clear(); }
+
+  /**
+   * @brief Remove all elements and reset the status
+   */
+  void clear() {
+    m_count = 0;
+    m_used = 0;
+    m_status = SIMPLE_JSON_OK;
+  }
+
+  /**
+   * @brief Store a copy of a key-value pair
+   *
+   * @return SIMPLE_JSON_OK, or the reason the pair could not be stored
+   */
+  SimpleJSONStatus add(const char *key, size_t key_len, const char *value,
+                       size_t value_len, SimpleJSONType type) {
+    if (m_count >= N_ELEMENTS) {
+      return fail(SIMPLE_JSON_ELEMENTS_FULL);
+    }
+    if (key_len + value_len + 2 > N_BYTES - m_used) {
+      return fail(SIMPLE_JSON_BYTES_FULL);
+    }
+
+    SimpleJSONArenaElement &element = m_elements[m_count++];
+    element.type = type;
+    element.key_offset = m_used;
+    element.key_length = key_len;
+    memcpy(m_bytes + m_used, key, key_len);
+    m_used += key_len;
+    m_bytes[m_used++] = '\0';
+    element.value_offset = m_used;
+    element.value_length = value_len;
+    memcpy(m_bytes + m_used, value, value_len);
+    m_used += value_len;
+    m_bytes[m_used++] = '\0';
+
+    return SIMPLE_JSON_OK;
+  }
+
+  /**
+   * @brief First error seen since the last clear, or SIMPLE_JSON_OK
+   */
+  SimpleJSONStatus status() const { return m_status; }
+
+  /**
+   * @brief Record an error found while filling the arena, only the first
+   * error since the last clear is kept
+   *
+   * @return The given status
+   */
+  SimpleJSONStatus fail(SimpleJSONStatus status) {
+    if (m_status == SIMPLE_JSON_OK) {
+      m_status = status;
+    }
+    return status;
+  }
+
+  size_t size() const { return m_count; }
+  size_t bytes_used() const { return m_used; }
+
+  const char *key(size_t i) const {
+    return m_bytes + m_elements[i].key_offset;
+  }
+  const char *value(size_t i) const {
+    return m_bytes + m_elements[i].value_offset;
+  }
+  size_t value_length(size_t i) const { return m_elements[i].value_length; }
+  SimpleJSONType type(size_t i) const { return m_elements[i].type; }
+
+  int64_t number(size_t i) const { return strtoll(value(i), NULL, 0); }
+  bool boolean(size_t i) const {
+    SimpleJSONSpan span = {0, value_length(i)};
+    return simple_json_span_to_bool(value(i), span);
+  }
+
+  /**
+   * @brief Index of the first element with the given key, or -1
+   */
+  int find(const char *key) const {
+    size_t key_len = strlen(key);
+    for (size_t i = 0; i < m_count; i++) {
+      if (m_elements[i].key_length == key_len &&
+          memcmp(this->key(i), key, key_len) == 0) {
+        return (int)i;
       }
     }
+    return -1;
+  }
 
-    // Once white space has been advanced, look for colon delimiter, then look for a
-    // double quite (indicating a string), otherwise treat as a number
-    if (value_start == -1) {
-      last_char = '\0'; // Init the last_char to something non-escape
-      if (str[ind] == ':') {
-        advance = true;
-        continue;
-      } else if (str[ind] == '"') {
-        value_start = ind + 1;
-        value_type = STRING;
-        advance = false;
-        continue;
-      } else if (tolower(str[ind]) == 'f' || tolower(str[ind]) == 't') {
-        value_start = ind;
-        value_type = BOOLEAN;
-        advance = false;
-        continue;
-      } else {
-        value_start = ind;
-        value_type = NUMBER;
-        advance = false;
-        continue;
+private:
+  SimpleJSONArenaElement m_elements[N_ELEMENTS];
+  char m_bytes[N_BYTES];
+  size_t m_count;
+  size_t m_used;
+  SimpleJSONStatus m_status;
+};
+
+/**
+ * @brief Parse every top level key-value pair in to an arena
+ *
+ * The arena is cleared first. Parsing stops at the first pair which does not
+ * fit.
+ *
+ * @return SIMPLE_JSON_OK, or the reason parsing stopped
+ */
+template <size_t N_ELEMENTS, size_t N_BYTES>
+SimpleJSONStatus simple_json_parse(const char *str, size_t len,
+                                   SimpleJSONArena<N_ELEMENTS, N_BYTES> &arena) {
+  arena.clear();
+  SimpleJSONTokenizer tok;
+  if (!simple_json_begin(tok, str, len)) {
+    return SIMPLE_JSON_INVALID;
+  }
+  SimpleJSONToken token;
+  while (simple_json_next(tok, token)) {
+    SimpleJSONStatus status =
+        arena.add(str + token.key.offset, token.key.length,
+                  str + token.value.offset, token.value.length, token.type);
+    if (status != SIMPLE_JSON_OK) {
+      return status;
+    }
+  }
+  return SIMPLE_JSON_OK;
+}
+
+/**
+ * Stream parser callback which adds each event to the SimpleJSONArena
+ * pointed to by ctx, overflow is recorded in the arena's status. Pairs cut
+ * short by the parser buffers are not stored and are recorded as
+ * SIMPLE_JSON_VALUE_TRUNCATED.
+ */
+template <size_t N_ELEMENTS, size_t N_BYTES>
+void simple_json_arena_callback(void *ctx, const SimpleJSONStreamEvent &event) {
+  SimpleJSONArena<N_ELEMENTS, N_BYTES> *arena =
+      reinterpret_cast<SimpleJSONArena<N_ELEMENTS, N_BYTES> *>(ctx);
+  if (event.truncated) {
+    arena->fail(SIMPLE_JSON_VALUE_TRUNCATED);
+    return;
+  }
+  arena->add(event.key, event.key_length, event.value, event.value_length,
+             event.type);
+}
+
+/**
+ * Tape representation of a complete JSON document, including nested objects
+ * and arrays, built in one pass. Each value in the document is one entry, in
+ * document order, so the children of an object or array follow it directly
+ * and next gives the index of the entry after all of its children. A
+ * SimpleJSONCursor moves around the tape without re-parsing anything.
+ *
+ * Offsets are in to the input buffer, which must outlive the tape. As with
+ * the flat API, strings exclude their double quotes and escape sequences are
+ * left as-is, objects and arrays span their full raw text.
+ */
+#define SIMPLE_JSON_TAPE_MAX_DEPTH 16
+#define SIMPLE_JSON_TAPE_NONE 0xFFFFFFFFUL
+
+struct SimpleJSONTapeEntry {
+  SimpleJSONType type;
+  uint32_t key_offset; // Key for members of objects, zero length otherwise
+  uint32_t key_length;
+  uint32_t offset;
+  uint32_t length;
+  uint32_t next;   // Entry following this value and its children
+  uint32_t parent; // Enclosing object or array, SIMPLE_JSON_TAPE_NONE for root
+};
+
+/**
+ * @brief Build the tape for a document
+ *
+ * @param str       Input buffer
+ * @param len       Length of input
+ * @param entries   Storage for the tape
+ * @param capacity  Number of entries available
+ * @param count     Set to the number of entries used
+ * @param index     Optional structural index from simple_json_index
+ * @return SIMPLE_JSON_OK, or the reason the tape is incomplete
+ */
+SimpleJSONStatus simple_json_tape_build(const char *str, size_t len,
+                                        SimpleJSONTapeEntry *entries,
+                                        size_t capacity, size_t &count,
+                                        const uint32_t *index = NULL) {
+
+  SimpleJSONTokenizer tok = {str, len, 0, index};
+  uint32_t stack[SIMPLE_JSON_TAPE_MAX_DEPTH];
+  size_t depth = 0;
+  bool have_key = false;
+  SimpleJSONSpan key = {0, 0};
+  size_t ind = 0;
+
+  count = 0;
+
+  // Find the root object or array
+  while (ind < len && str[ind] != '{' && str[ind] != '[') {
+    ind++;
+  }
+
+  while (true) {
+
+    // Advance over white space and delimiters
+    while (ind < len && (simple_json_is_space(str[ind]) || str[ind] == ',' ||
+                         str[ind] == ':')) {
+      ind++;
+    }
+    if (ind >= len) {
+      return SIMPLE_JSON_INVALID;
+    }
+
+    const char c = str[ind];
+
+    // End of an object or array, fill in the length and next entry
+    if (depth > 0 && (c == '}' || c == ']')) {
+      SimpleJSONTapeEntry &open = entries[stack[--depth]];
+      open.length = ind + 1 - open.offset;
+      open.next = count;
+      have_key = false;
+      ind++;
+      if (depth == 0) {
+        return SIMPLE_JSON_OK;
       }
+      continue;
     }
 
-    // Look for the end of the value part, for numbers this will be a comma or the end of
-    // JSON parenthesis. For strings it will be a double quote. Use the last_char to store
-    // the last processed char, when check to see if it is a backslash in order to allow
-    // strings to contain escaped double quotes.
-    if (value_end == -1) {
-      if (value_type == STRING) {
-        if (str[ind] != '"' || (str[ind] == '"' && last_char == '\\')) {
-          last_char = str[ind];
-          continue;
-        } else {
-          value_end = ind;
-          advance = true;
-          was_ending = false;
-          continue;
-        }
-      } else if (value_type == BOOLEAN) {
-        if (str[ind] == ',' || str[ind] == '}') {
-          was_ending = true;
-          value_end = ind;
-          advance = false;
-        } else if (str[ind] == ' ') {
-          was_ending = false;
-          value_end = ind;
-          advance = false;
-        } else {
-          advance = true;
-          continue;
-        }
-      } else {
-        // was_ending is used to tell the next stage that the number value was terminated 
-        // using a end of element delimiter (comma or end parenthesis)
-        // When value_end is found, do not continue. Allow it to fall through to kvp processing
-        if (str[ind] == ',' || str[ind] == '}') {
-          was_ending = true;
-          value_end = ind;
-          advance = false;
-        } else if (str[ind] == ' ') {
-          was_ending = false;
-          value_end = ind;
-          advance = false;
-        } else {
-          advance = true;
-          continue;
-        }
+    // Members of objects start with a key
+    if (depth > 0 && entries[stack[depth - 1]].type == OBJECT && !have_key) {
+      if (c != '"') {
+        return SIMPLE_JSON_INVALID;
+      }
+      key.offset = ind + 1;
+      ind = simple_json_string_end(tok, ind + 1);
+      if (ind >= len) {
+        return SIMPLE_JSON_INVALID;
       }
+      key.length = ind - key.offset;
+      have_key = true;
+      ind++;
+      continue;
     }
 
-    // Look for the end of this element (could be end of json) unless it has already been detected
-    if (was_ending || str[ind] == ',' || str[ind] == '}') {
+    if (count >= capacity) {
+      return SIMPLE_JSON_ELEMENTS_FULL;
+    }
+    SimpleJSONTapeEntry &entry = entries[count++];
+    entry.parent = (depth > 0) ? stack[depth - 1] : SIMPLE_JSON_TAPE_NONE;
+    entry.key_offset = have_key ? key.offset : 0;
+    entry.key_length = have_key ? key.length : 0;
+    entry.offset = ind;
+    have_key = false;
 
-      // Extract and store data in the results vector
-      SimpleJSONElement kvp;
-#ifdef CPP_STANDARD
-      kvp.key = str.substr(key_start, key_end-key_start);
-      kvp.value_string = str.substr(value_start, value_end-value_start);
-#else
-      kvp.key = str.substring(key_start, key_end);
-      kvp.value_string = str.substring(value_start, value_end);
-#endif
-      kvp.type = value_type;
-      if (value_type == NUMBER) {
-        kvp.value_number = strtoll(kvp.value_string.c_str(), NULL, 0);
-      } else if (value_type == BOOLEAN) {
-        kvp.value_boolean = to_bool(trim(kvp.value_string));
+    if (c == '{' || c == '[') {
+      if (depth >= SIMPLE_JSON_TAPE_MAX_DEPTH) {
+        return SIMPLE_JSON_TOO_DEEP;
+      }
+      entry.type = (c == '{') ? OBJECT : ARRAY;
+      stack[depth++] = count - 1;
+      ind++;
+      continue;
+    }
+
+    if (c == '"') {
+      entry.type = STRING;
+      entry.offset = ind + 1;
+      ind = simple_json_string_end(tok, ind + 1);
+      if (ind >= len) {
+        return SIMPLE_JSON_INVALID;
       }
-      result.push_back(kvp);
+      entry.length = ind - entry.offset;
+      ind++;
+    } else {
+      char first = tolower(c);
+      entry.type = (first == 't' || first == 'f') ? BOOLEAN : NUMBER;
+      while (ind < len && str[ind] != ',' && str[ind] != '}' &&
+             str[ind] != ']' && !simple_json_is_space(str[ind])) {
+        ind++;
+      }
+      entry.length = ind - entry.offset;
+    }
+    entry.next = count;
+
+    if (depth == 0) {
+      return SIMPLE_JSON_OK;
+    }
+  }
+}
+
+/**
+ * Read only view of one value on a tape
+ */
+class SimpleJSONCursor {
+
+public:
+  SimpleJSONCursor()
+      : m_str(NULL), m_entries(NULL), m_count(0), m_index(0) {}
+
+  SimpleJSONCursor(const char *str, const SimpleJSONTapeEntry *entries,
+                   size_t count, size_t index)
+      : m_str(str), m_entries(entries), m_count(count), m_index(index) {}
+
+  /**
+   * @brief False if the cursor does not point at a value, i.e. a missing key
+   */
+  bool valid() const { return m_entries != NULL && m_index < m_count; }
+
+  SimpleJSONType type() const { return entry().type; }
+
+  SimpleJSONSpan key() const {
+    SimpleJSONSpan span = {entry().key_offset, entry().key_length};
+    return span;
+  }
+
+  SimpleJSONSpan value() const {
+    SimpleJSONSpan span = {entry().offset, entry().length};
+    return span;
+  }
+
+  bool key_equals(const char *other) const {
+    return simple_json_span_equals(m_str, key(), other);
+  }
+  bool equals(const char *other) const {
+    return simple_json_span_equals(m_str, value(), other);
+  }
+  int64_t number() const { return simple_json_span_to_number(m_str, value()); }
+  bool boolean() const { return simple_json_span_to_bool(m_str, value()); }
 
-      // Reset state variables
-      was_ending = false;
-      key_start = -1;
-      key_end = -1;
-      value_start = -1;
-      value_end = -1;
-      advance = true;
+  /**
+   * @brief First member of an object or element of an array
+   */
+  SimpleJSONCursor child() const {
+    if (!valid() || (type() != OBJECT && type() != ARRAY) ||
+        m_index + 1 >= m_count || m_entries[m_index + 1].parent != m_index) {
+      return SimpleJSONCursor();
+    }
+    return at_index(m_index + 1);
+  }
+
+  /**
+   * @brief Next member or element within the same object or array
+   */
+  SimpleJSONCursor next() const {
+    if (!valid()) {
+      return SimpleJSONCursor();
+    }
+    size_t next = entry().next;
+    if (next >= m_count || m_entries[next].parent != entry().parent) {
+      return SimpleJSONCursor();
+    }
+    return at_index(next);
+  }
+
+  /**
+   * @brief Member of an object with the given key
+   */
+  SimpleJSONCursor find(const char *key) const {
+    if (!valid() || type() != OBJECT) {
+      return SimpleJSONCursor();
+    }
+    for (SimpleJSONCursor it = child(); it.valid(); it = it.next()) {
+      if (it.key_equals(key)) {
+        return it;
+      }
+    }
+    return SimpleJSONCursor();
+  }
+
+  /**
+   * @brief The i'th member or element of an object or array
+   */
+  SimpleJSONCursor at(size_t i) const {
+    SimpleJSONCursor it = child();
+    for (; it.valid() && i > 0; i--) {
+      it = it.next();
+    }
+    return it;
+  }
+
+  /**
+   * @brief Number of members or elements of an object or array
+   */
+  size_t size() const {
+    size_t result = 0;
+    for (SimpleJSONCursor it = child(); it.valid(); it = it.next()) {
+      result++;
+    }
+    return result;
+  }
+
+private:
+  const SimpleJSONTapeEntry &entry() const { return m_entries[m_index]; }
+
+  SimpleJSONCursor at_index(size_t index) const {
+    return SimpleJSONCursor(m_str, m_entries, m_count, index);
+  }
+
+  const char *m_str;
+  const SimpleJSONTapeEntry *m_entries;
+  size_t m_count;
+  size_t m_index;
+};
 
+/**
+ * Fixed capacity tape, i.e:
+ *
+ *   SimpleJSONTape<32> tape;
+ *   if (simple_json_tape(str, len, tape) == SIMPLE_JSON_OK) {
+ *     SimpleJSONCursor chunk = tape.root().find("chunks").at(2);
+ *   }
+ */
+template <size_t N_ENTRIES> class SimpleJSONTape {
+
+public:
+  SimpleJSONTape() : m_str(NULL), m_count(0), m_status(SIMPLE_JSON_INVALID) {}
+
+  /**
+   * @brief Parse a document, replacing any previous content
+   */
+  SimpleJSONStatus parse(const char *str, size_t len,
+                         const uint32_t *index = NULL) {
+    m_str = str;
+    m_status =
+        simple_json_tape_build(str, len, m_entries, N_ENTRIES, m_count, index);
+    return m_status;
+  }
+
+  SimpleJSONStatus status() const { return m_status; }
+  size_t size() const { return m_count; }
+
+  /**
+   * @brief Cursor for the root object or array, invalid if parsing failed
+   */
+  SimpleJSONCursor root() const {
+    if (m_status != SIMPLE_JSON_OK) {
+      return SimpleJSONCursor();
+    }
+    return SimpleJSONCursor(m_str, m_entries, m_count, 0);
+  }
+
+private:
+  const char *m_str;
+  SimpleJSONTapeEntry m_entries[N_ENTRIES];
+  size_t m_count;
+  SimpleJSONStatus m_status;
+};
+
+template <size_t N_ENTRIES>
+SimpleJSONStatus simple_json_tape(const char *str, size_t len,
+                                  SimpleJSONTape<N_ENTRIES> &tape,
+                                  const uint32_t *index = NULL) {
+  return tape.parse(str, len, index);
+}
+
+/**
+ * FNV-1a hash of a null terminated key, constexpr so that schema keys are
+ * hashed at compile time.
+ */
+constexpr uint32_t simple_json_hash(const char *str,
+                                    uint32_t hash = 2166136261u) {
+  return *str == '\0'
+             ? hash
+             : simple_json_hash(str + 1, (hash ^ (uint8_t)*str) * 16777619u);
+}
+
+/**
+ * FNV-1a hash of a key which is not null terminated, gives the same result as
+ * simple_json_hash
+ */
+uint32_t simple_json_hash_span(const char *str, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t)str[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// https://stackoverflow.com/a/62612409
+char simple_json_h2b(char c) {
+  return '0' <= c && c <= '9'   ? c - '0'
+         : 'A' <= c && c <= 'F' ? c - 'A' + 10
+         : 'a' <= c && c <= 'f' ? c - 'a' + 10
+                                :
+                                /* else */ -1;
+}
+
+/**
+ * Converts a span of hex characters in to bytes, returns false unless the
+ * span is exactly 2 * bin_len valid hex characters.
+ */
+bool simple_json_span_to_hex(const char *str, const SimpleJSONSpan &span,
+                             uint8_t *bin, size_t bin_len) {
+  if (span.length != 2 * bin_len) {
+    return false;
+  }
+  const char *hex = str + span.offset;
+  for (size_t i = 0; i < bin_len; i++) {
+    char b[2] = {simple_json_h2b(hex[2 * i + 0]),
+                 simple_json_h2b(hex[2 * i + 1])};
+    if (b[0] < 0 || b[1] < 0)
+      return false;
+    bin[i] = b[0] * 16 + b[1];
+  }
+  return true;
+}
+
+/**
+ * Native types a schema field can be bound to
+ */
+typedef enum SimpleJSONFieldType {
+  SIMPLE_JSON_FIELD_STRING, // char[N], null terminated
+  SIMPLE_JSON_FIELD_BOOL,   // bool
+  SIMPLE_JSON_FIELD_INT64,  // int64_t
+  SIMPLE_JSON_FIELD_HEX     // uint8_t[N], from 2 * N hex characters
+} SimpleJSONFieldType;
+
+/**
+ * Describes where the value for a key is stored in a plain struct
+ */
+struct SimpleJSONField {
+  const char *key;
+  uint32_t hash;
+  SimpleJSONFieldType type;
+  size_t offset;
+  size_t size;
+};
+
+/**
+ * Declare a schema field, i.e:
+ *
+ *   struct TimeResponse { int64_t time; };
+ *   constexpr SimpleJSONField time_schema[] = {
+ *     SIMPLE_JSON_FIELD(TimeResponse, "time", time, SIMPLE_JSON_FIELD_INT64)
+ *   };
+ */
+#define SIMPLE_JSON_FIELD(STRUCT, KEY, MEMBER, TYPE)                           \
+  {                                                                            \
+    KEY, simple_json_hash(KEY), TYPE, offsetof(STRUCT, MEMBER),                \
+        sizeof(((STRUCT *)0)->MEMBER)                                          \
+  }
+
+/**
+ * State for binding key-value pairs in to a struct. The found bit mask has
+ * bit n set once fields[n] has been stored, the error bit mask has bit n set
+ * if the value for fields[n] was truncated or could not be converted. A
+ * value that could not be converted is stored as zero or false.
+ */
+struct SimpleJSONBinding {
+  const SimpleJSONField *fields;
+  size_t count;
+  uint8_t *out;
+  uint32_t found;
+  uint32_t errors;
+};
+
+/**
+ * @brief Create a binding between a schema and the struct it describes
+ */
+template <class T, size_t N>
+SimpleJSONBinding simple_json_binding(const SimpleJSONField (&fields)[N],
+                                      T &out) {
+  static_assert(N <= 32, "Schema is limited to 32 fields");
+  SimpleJSONBinding binding = {fields, N, reinterpret_cast<uint8_t *>(&out), 0,
+                               0};
+  return binding;
+}
+
+/**
+ * @brief Store a single value, if its key is part of the schema
+ *
+ * @return Index of the field in the schema, -1 if the key is not part of it
+ */
+int simple_json_bind_value(SimpleJSONBinding &binding, const char *key,
+                            size_t key_len, const char *str,
+                            const SimpleJSONSpan &value, SimpleJSONType type) {
+
+  uint32_t hash = simple_json_hash_span(key, key_len);
+
+  for (size_t i = 0; i < binding.count; i++) {
+    const SimpleJSONField &field = binding.fields[i];
+    if (field.hash != hash || strlen(field.key) != key_len ||
+        memcmp(field.key, key, key_len) != 0) {
       continue;
     }
 
+    uint8_t *dest = binding.out + field.offset;
+    bool ok = true;
+    switch (field.type) {
+    case SIMPLE_JSON_FIELD_STRING: {
+      size_t len = value.length;
+      if (len > field.size - 1) {
+        len = field.size - 1;
+        ok = false;
+      }
+      memcpy(dest, str + value.offset, len);
+      dest[len] = '\0';
+      break;
+    }
+    case SIMPLE_JSON_FIELD_BOOL:
+      ok = type == BOOLEAN;
+      *reinterpret_cast<bool *>(dest) =
+          ok && simple_json_span_to_bool(str, value);
+      break;
+    case SIMPLE_JSON_FIELD_INT64: {
+      int64_t number = 0;
+      ok = type == NUMBER && simple_json_span_to_int64(str, value, number);
+      *reinterpret_cast<int64_t *>(dest) = ok ? number : 0;
+      break;
+    }
+    case SIMPLE_JSON_FIELD_HEX:
+      ok = simple_json_span_to_hex(str, value, dest, field.size);
+      break;
+    }
+
+    binding.found |= (1UL << i);
+    if (!ok) {
+      binding.errors |= (1UL << i);
+    }
+    return (int)i;
   }
 
-  // Fin
-  return result;
+  return -1;
+}
+
+/**
+ * @brief Bind every top level key-value pair in a buffer in one pass
+ *
+ * @return False if no opening brace was found
+ */
+bool simple_json_bind(const char *str, size_t len, SimpleJSONBinding &binding) {
+  SimpleJSONTokenizer tok;
+  if (!simple_json_begin(tok, str, len)) {
+    return false;
+  }
+  SimpleJSONToken token;
+  while (simple_json_next(tok, token)) {
+    simple_json_bind_value(binding, str + token.key.offset, token.key.length,
+                           str, token.value, token.type);
+  }
+  return true;
+}
+
+/**
+ * Stream parser callback which binds each event using the SimpleJSONBinding
+ * pointed to by ctx.
+ */
+void simple_json_bind_callback(void *ctx, const SimpleJSONStreamEvent &event) {
+  SimpleJSONBinding *binding = reinterpret_cast<SimpleJSONBinding *>(ctx);
+  SimpleJSONSpan span = {0, event.value_length};
+  int index = simple_json_bind_value(*binding, event.key, event.key_length,
+                                     event.value, span, event.type);
+  if (index >= 0 && event.truncated) {
+    binding->errors |= (1UL << index);
+  }
 }
 
+/**
+ * Output sink for SimpleJSONWriter, return false to abort writing
+ */
+typedef bool (*SimpleJSONWriteSink)(void *ctx, const char *data, size_t len);
+
+/**
+ * Serialises JSON objects without using the heap. Output goes in to a caller
+ * provided buffer, or is passed to a sink in chunks using the buffer as
+ * staging so the document can be any length. With no buffer and no sink the
+ * writer only counts, which gives the length of a document before sending it.
+ *
+ * i.e:
+ *
+ *   char buf[128];
+ *   SimpleJSONWriter writer(buf, sizeof(buf));
+ *   writer.begin_object();
+ *   writer.string("node_id", "AA:BB:CC:DD:EE:FF");
+ *   writer.number("time", 1605000000);
+ *   writer.end_object();
+ *   if (writer.finish()) { ... buf is a null terminated JSON document ... }
+ */
+class SimpleJSONWriter {
+
+public:
+  SimpleJSONWriter(char *buf, size_t size, SimpleJSONWriteSink sink = NULL,
+                   void *ctx = NULL)
+      : m_buf(buf), m_size(buf == NULL ? 0 : size), m_used(0), m_total(0),
+        m_sink(sink), m_ctx(ctx), m_ok(true), m_depth(0), m_first(0) {}
+
+  void begin_object(const char *key = NULL) { open(key, '{'); }
+  void end_object() { close('}'); }
+  void begin_array(const char *key = NULL) { open(key, '['); }
+  void end_array() { close(']'); }
+
+  /**
+   * @brief Add a string, escaped as required. Key is NULL inside arrays.
+   */
+  void string(const char *key, const char *value) {
+    string(key, value, strlen(value));
+  }
+
+  void string(const char *key, const char *value, size_t len) {
+    element(key);
+    put("\"", 1);
+    escaped(value, len);
+    put("\"", 1);
+  }
+
+  void number(const char *key, int64_t value) {
+    element(key);
+    char buf[21];
+    size_t pos = sizeof(buf);
+    uint64_t magnitude =
+        (value < 0) ? (uint64_t)0 - (uint64_t)value : (uint64_t)value;
+    do {
+      buf[--pos] = '0' + (magnitude % 10);
+      magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) {
+      buf[--pos] = '-';
+    }
+    put(buf + pos, sizeof(buf) - pos);
+  }
+
+  void boolean(const char *key, bool value) {
+    element(key);
+    if (value) {
+      put("true", 4);
+    } else {
+      put("false", 5);
+    }
+  }
+
+  /**
+   * @brief Pass any buffered output to the sink, and null terminate the
+   * buffer when there is no sink
+   *
+   * @return False if the output overflowed the buffer or the sink failed
+   */
+  bool finish() {
+    if (m_sink != NULL) {
+      flush();
+    } else if (m_size > 0) {
+      m_buf[m_used] = '\0';
+    }
+    return m_ok;
+  }
+
+  bool ok() const { return m_ok; }
+
+  /**
+   * @brief Total length of the document written so far
+   */
+  size_t length() const { return m_total; }
+
+  const char *c_str() const { return m_buf; }
+
+private:
+  void open(const char *key, char c) {
+    element(key);
+    put(&c, 1);
+    if (m_depth < 32) {
+      m_first |= (1UL << m_depth);
+    }
+    m_depth++;
+  }
+
+  void close(char c) {
+    if (m_depth > 0) {
+      m_depth--;
+    }
+    put(&c, 1);
+  }
+
+  // Comma between elements, then the key if there is one
+  void element(const char *key) {
+    if (m_depth > 0 && m_depth <= 32) {
+      uint32_t bit = 1UL << (m_depth - 1);
+      if (m_first & bit) {
+        m_first &= ~bit;
+      } else {
+        put(",", 1);
+      }
+    }
+    if (key != NULL) {
+      put("\"", 1);
+      escaped(key, strlen(key));
+      put("\":", 2);
+    }
+  }
+
+  void escaped(const char *str, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+      const uint8_t c = str[i];
+      if (c >= 0x20 && c != '"' && c != '\\') {
+        continue;
+      }
+      put(str + start, i - start);
+      start = i + 1;
+      char esc[6] = {'\\', (char)c, 0, 0, 0, 0};
+      size_t esc_len = 2;
+      switch (c) {
+      case '"':
+      case '\\':
+        break;
+      case '\n':
+        esc[1] = 'n';
+        break;
+      case '\r':
+        esc[1] = 'r';
+        break;
+      case '\t':
+        esc[1] = 't';
+        break;
+      case '\b':
+        esc[1] = 'b';
+        break;
+      case '\f':
+        esc[1] = 'f';
+        break;
+      default:
+        esc[1] = 'u';
+        esc[2] = '0';
+        esc[3] = '0';
+        esc[4] = hex[c >> 4];
+        esc[5] = hex[c & 0xF];
+        esc_len = 6;
+      }
+      put(esc, esc_len);
+    }
+    put(str + start, len - start);
+  }
+
+  void put(const char *data, size_t len) {
+    m_total += len;
+    if (m_sink != NULL && m_size > 0) {
+      while (len > 0 && m_ok) {
+        size_t space = m_size - m_used;
+        size_t chunk = (len < space) ? len : space;
+        memcpy(m_buf + m_used, data, chunk);
+        m_used += chunk;
+        data += chunk;
+        len -= chunk;
+        if (m_used == m_size) {
+          flush();
+        }
+      }
+    } else if (m_sink != NULL) {
+      m_ok = m_ok && m_sink(m_ctx, data, len);
+    } else if (m_buf != NULL) {
+      // Keep one byte free for the null terminator
+      if (m_used + len >= m_size) {
+        m_ok = false;
+        len = (m_used + 1 < m_size) ? m_size - m_used - 1 : 0;
+      }
+      memcpy(m_buf + m_used, data, len);
+      m_used += len;
+    }
+  }
+
+  void flush() {
+    if (m_used > 0 && m_ok) {
+      m_ok = m_sink(m_ctx, m_buf, m_used);
+    }
+    m_used = 0;
+  }
+
+  char *m_buf;
+  size_t m_size;
+  size_t m_used;  // Bytes currently in the buffer
+  size_t m_total; // Bytes written in total
+  SimpleJSONWriteSink m_sink;
+  void *m_ctx;
+  bool m_ok;
+  size_t m_depth;
+  uint32_t m_first; // Bit n set until the first element at depth n is added
+};
+
 String get_simple_json_string(std::vector<SimpleJSONElement> &vect,
                               String key) {
   for (std::vector<SimpleJSONElement>::iterator it = vect.begin();
@@ -0,0 +1,337 @@
+/** @file
+ * Streaming application of a binary patch to a stored image
+ *
+ *  Copyright 2020 confrm.io
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __SIMPLE_PATCH_H__
+#define __SIMPLE_PATCH_H__
+
+#include <cstdint>
+#include <cstring>
+
+#include "simple_http.h"
+
+/*
+ * Patches are in the bsdiff 4.3 layout written by Matthew Endsley's bsdiff
+ * library, without the bzip2 wrapper; a patch can be sent compressed with
+ * HTTP Content-Encoding instead. After a 16 byte magic and the size of the
+ * new image, the patch is a sequence of controls, each followed by its data:
+ *
+ *   diff length, extra length, seek    Signed 64 bit, little endian, sign
+ *                                      in the top bit
+ *   diff bytes                         Added to the old image at the old
+ *                                      position, which advances with them
+ *   extra bytes                        Copied as they are
+ *
+ * after which the old position moves by seek. The patch is read in one pass
+ * as it arrives, reading the old image from wherever it is stored, so
+ * neither image is held in memory. The new image is passed to the sink a
+ * buffer at a time.
+ *
+ * The result is not checked here, the caller is expected to check a hash of
+ * the new image. A patch made against a different old image gives a wrong
+ * image rather than an error.
+ */
+
+#ifndef SIMPLE_PATCH_BUFFER_SIZE
+#define SIMPLE_PATCH_BUFFER_SIZE 4096
+#endif
+
+#define SIMPLE_PATCH_MAGIC "ENDSLEY/BSDIFF43"
+
+/**
+ * Reads len bytes of the old image at offset in to data. Return false if
+ * they could not be read.
+ */
+typedef bool (*SimplePatchSource)(void *ctx, uint32_t offset, uint8_t *data,
+                                  size_t len);
+
+class SimplePatch {
+
+public:
+  SimplePatch() { reset(NULL, NULL, 0); }
+
+  /**
+   * @brief Start a new patch
+   *
+   * @param source       Reads the old image
+   * @param source_ctx   Passed to source
+   * @param source_size  Size of the old image, or of where it is stored
+   */
+  void reset(SimplePatchSource source, void *source_ctx,
+             uint32_t source_size) {
+    m_source = source;
+    m_source_ctx = source_ctx;
+    m_source_size = source_size;
+    m_state = HEADER;
+    m_stopped = false;
+    m_field_len = 0;
+    m_new_size = 0;
+    m_new_pos = 0;
+    m_old_pos = 0;
+    m_diff = 0;
+    m_extra = 0;
+    m_seek = 0;
+    m_out_len = 0;
+    m_total_in = 0;
+    m_diff_bytes = 0;
+  }
+
+  /**
+   * @brief True once the whole of the new image has been produced
+   */
+  bool done() const { return m_state == DONE; }
+
+  bool error() const { return m_state == ERROR; }
+
+  /**
+   * @brief Size of the new image, 0 until the header is read
+   */
+  uint32_t image_size() const { return m_new_size; }
+
+  uint32_t total_in() const { return m_total_in; }
+
+  uint32_t total_out() const { return m_new_pos - m_out_len; }
+
+  /**
+   * @brief Bytes of the new image made from the old one, the rest came
+   * from the patch as they are
+   */
+  uint32_t diff_bytes() const { return m_diff_bytes; }
+
+  /**
+   * @brief Apply the next piece of the patch
+   *
+   * @param data  Patch data
+   * @param len   Length of data
+   * @param sink  Called with the new image, may be NULL
+   * @param ctx   Passed to the sink
+   * @param used  Set to the number of bytes used, less than len only if the
+   *              patch ended or there was an error
+   * @return False on a malformed patch, if the old image could not be read
+   *         or if the sink stopped
+   */
+  bool feed(const uint8_t *data, size_t len, SimpleHTTPSink sink, void *ctx,
+            size_t *used = NULL) {
+    m_in = data;
+    m_in_end = data + len;
+    m_sink = sink;
+    m_ctx = ctx;
+    while (m_state != DONE && m_state != ERROR && !m_stopped && step()) {
+    }
+    flush();
+    size_t consumed = m_in - data;
+    m_total_in += consumed;
+    if (used != NULL) {
+      *used = consumed;
+    }
+    return m_state != ERROR && !m_stopped;
+  }
+
+private:
+  enum State { HEADER, CONTROL, DIFF, EXTRA, DONE, ERROR };
+
+  static const size_t MAGIC_LENGTH = 16;
+  static const size_t FIELD_LENGTH = 8;
+
+  // Gather a header or control, false if the input runs out first
+  bool gather(size_t len) {
+    while (m_field_len < len) {
+      if (m_in == m_in_end) {
+        return false;
+      }
+      m_field[m_field_len++] = *m_in++;
+    }
+    m_field_len = 0;
+    return true;
+  }
+
+  static int64_t offset(const uint8_t *buf) {
+    int64_t value = buf[7] & 0x7F;
+    for (int i = 6; i >= 0; i--) {
+      value = (value << 8) | buf[i];
+    }
+    return (buf[7] & 0x80) ? -value : value;
+  }
+
+  bool step() {
+    switch (m_state) {
+
+    case HEADER: {
+      if (!gather(MAGIC_LENGTH + FIELD_LENGTH)) {
+        return false;
+      }
+      int64_t size = offset(m_field + MAGIC_LENGTH);
+      if (memcmp(m_field, SIMPLE_PATCH_MAGIC, MAGIC_LENGTH) != 0 || size < 0 ||
+          size > UINT32_MAX) {
+        m_state = ERROR;
+        return true;
+      }
+      m_new_size = (uint32_t)size;
+      m_state = (m_new_size == 0) ? DONE : CONTROL;
+      return true;
+    }
+
+    case CONTROL: {
+      if (!gather(3 * FIELD_LENGTH)) {
+        return false;
+      }
+      m_diff = offset(m_field);
+      m_extra = offset(m_field + FIELD_LENGTH);
+      m_seek = offset(m_field + 2 * FIELD_LENGTH);
+      int64_t left = m_new_size - m_new_pos;
+      if (m_diff < 0 || m_extra < 0 || m_diff > left ||
+          m_extra > left - m_diff) {
+        m_state = ERROR;
+        return true;
+      }
+      // The old position may leave the old image, where it reads as zeros,
+      // but no further than either image could need
+      int64_t limit = (int64_t)m_source_size + m_new_size;
+      if (m_seek < -2 * limit || m_seek > 2 * limit ||
+          m_old_pos + m_diff + m_seek < -limit ||
+          m_old_pos + m_diff + m_seek > limit) {
+        m_state = ERROR;
+        return true;
+      }
+      m_state = DIFF;
+      return true;
+    }
+
+    case DIFF:
+      while (m_diff > 0) {
+        size_t n = chunk(m_diff);
+        if (n == 0) {
+          return false;
+        }
+        uint8_t *out = m_out + m_out_len;
+        if (!read_old(out, n)) {
+          m_state = ERROR;
+          return true;
+        }
+        for (size_t i = 0; i < n; i++) {
+          out[i] += m_in[i];
+        }
+        m_in += n;
+        m_old_pos += n;
+        m_diff -= n;
+        m_diff_bytes += n;
+        produced(n);
+        if (m_stopped) {
+          return false;
+        }
+      }
+      m_state = EXTRA;
+      return true;
+
+    case EXTRA:
+      while (m_extra > 0) {
+        size_t n = chunk(m_extra);
+        if (n == 0) {
+          return false;
+        }
+        memcpy(m_out + m_out_len, m_in, n);
+        m_in += n;
+        m_extra -= n;
+        produced(n);
+        if (m_stopped) {
+          return false;
+        }
+      }
+      m_old_pos += m_seek;
+      m_state = (m_new_pos == m_new_size) ? DONE : CONTROL;
+      return true;
+
+    default:
+      return false;
+    }
+  }
+
+  // Bytes of the current diff or extra that can be taken now, limited by
+  // the input and the space left in the output buffer
+  size_t chunk(int64_t left) const {
+    size_t n = SIMPLE_PATCH_BUFFER_SIZE - m_out_len;
+    if ((int64_t)n > left) {
+      n = (size_t)left;
+    }
+    if (n > (size_t)(m_in_end - m_in)) {
+      n = m_in_end - m_in;
+    }
+    return n;
+  }
+
+  // Old image at the old position, zero where it lies outside the image
+  bool read_old(uint8_t *data, size_t len) {
+    memset(data, 0, len);
+    int64_t start = m_old_pos < 0 ? 0 : m_old_pos;
+    int64_t end = m_old_pos + (int64_t)len;
+    if (end > (int64_t)m_source_size) {
+      end = m_source_size;
+    }
+    if (start >= end) {
+      return true;
+    }
+    return m_source != NULL &&
+           m_source(m_source_ctx, (uint32_t)start, data + (start - m_old_pos),
+                    (size_t)(end - start));
+  }
+
+  void produced(size_t n) {
+    m_out_len += n;
+    m_new_pos += n;
+    if (m_out_len == SIMPLE_PATCH_BUFFER_SIZE) {
+      flush();
+    }
+  }
+
+  void flush() {
+    if (m_out_len > 0 && m_sink != NULL && !m_stopped &&
+        !m_sink(m_ctx, m_out, m_out_len)) {
+      m_stopped = true;
+    }
+    m_out_len = 0;
+  }
+
+  SimplePatchSource m_source;
+  void *m_source_ctx;
+  uint32_t m_source_size;
+  State m_state;
+
+  // Input of the current feed()
+  const uint8_t *m_in;
+  const uint8_t *m_in_end;
+  SimpleHTTPSink m_sink;
+  void *m_ctx;
+  bool m_stopped; // Sink returned false
+
+  uint8_t m_field[MAGIC_LENGTH + FIELD_LENGTH]; // Header or control read so far
+  size_t m_field_len;
+
+  uint32_t m_new_size;
+  uint32_t m_new_pos; // Produced, including what is in the output buffer
+  int64_t m_old_pos;
+
+  // Current control, what is left of it
+  int64_t m_diff;
+  int64_t m_extra;
+  int64_t m_seek;
+
+  uint8_t m_out[SIMPLE_PATCH_BUFFER_SIZE];
+  size_t m_out_len;
+  uint32_t m_total_in;
+  uint32_t m_diff_bytes;
+};
+
+#endif
@@ -0,0 +1,252 @@
+/** @file
+ * Background task running network work for Confrm
+ *
+ *  Copyright 2020 confrm.io
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WORK_QUEUE_H__
+#define __WORK_QUEUE_H__
+
+#include <atomic>
+#include <cstdint>
+
+#if defined(CPP_STANDARD)
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#else
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#endif
+
+/*
+ * Work is posted as commands to a bounded queue and run one at a time by a
+ * task that owns it, so callers such as timer callbacks never block on the
+ * network. post() never waits: a command that is already queued is not
+ * queued again, as running it once covers both, and if the queue is full
+ * the command is dropped and counted.
+ *
+ * On the esp32 the task is a FreeRTOS task with its own stack, priority and
+ * core. Built with CPP_STANDARD it is a std::thread, for testing on a host.
+ */
+
+#ifndef WORK_QUEUE_LENGTH
+#define WORK_QUEUE_LENGTH 4
+#endif
+
+#define WORK_NO_AFFINITY -1
+
+enum WorkCommand {
+  WORK_POLL,           // Heartbeat, register and check for updates
+  WORK_REFRESH_CONFIG, // Revalidate the watched config keys
+  WORK_UPDATE,         // Download and install the pending update
+  WORK_COMMANDS        // Number of commands
+};
+
+typedef void (*WorkHandler)(void *ctx, WorkCommand command);
+
+struct WorkTaskConfig {
+  uint32_t stack_size; // Bytes, not used on a host
+  uint32_t priority;   // Not used on a host
+  int32_t core;        // Core to run on or WORK_NO_AFFINITY, not used on a host
+};
+
+struct WorkQueueStats {
+  uint32_t posted;    // Commands queued
+  uint32_t coalesced; // Commands not queued as already waiting
+  uint32_t dropped;   // Commands not queued as the queue was full
+  uint32_t done;      // Commands run
+};
+
+class WorkQueue {
+
+public:
+  WorkQueue()
+      : m_handler(NULL), m_ctx(NULL), m_pending(0), m_posted(0),
+        m_coalesced(0), m_dropped(0), m_done(0) {
+#if defined(CPP_STANDARD)
+    m_head = 0;
+    m_count = 0;
+    m_stop = false;
+#else
+    m_queue = NULL;
+    m_task = NULL;
+#endif
+  }
+
+  ~WorkQueue() { stop(); }
+
+  /**
+   * @brief Start the task
+   *
+   * @param handler  Called on the task with each command
+   * @param ctx      Passed to the handler
+   * @param config   Task settings
+   * @return False if the task could not be started
+   */
+  bool begin(WorkHandler handler, void *ctx, const WorkTaskConfig &config) {
+    m_handler = handler;
+    m_ctx = ctx;
+#if defined(CPP_STANDARD)
+    (void)config;
+    m_stop = false;
+    m_thread = std::thread(WorkQueue::run, this);
+    return true;
+#else
+    m_queue = xQueueCreate(WORK_QUEUE_LENGTH, sizeof(uint8_t));
+    if (m_queue == NULL) {
+      return false;
+    }
+    BaseType_t core =
+        (config.core == WORK_NO_AFFINITY) ? tskNO_AFFINITY : config.core;
+    return xTaskCreatePinnedToCore(WorkQueue::run, "confrm_worker",
+                                   config.stack_size, this, config.priority,
+                                   &m_task, core) == pdPASS;
+#endif
+  }
+
+  /**
+   * @brief Queue a command without waiting
+   *
+   * @return False if the queue was full
+   */
+  bool post(WorkCommand command) {
+    uint32_t bit = 1u << command;
+    if (m_pending.fetch_or(bit) & bit) {
+      m_coalesced++;
+      return true;
+    }
+    if (!push((uint8_t)command)) {
+      m_pending.fetch_and(~bit);
+      m_dropped++;
+      return false;
+    }
+    m_posted++;
+    return true;
+  }
+
+  WorkQueueStats stats() const {
+    WorkQueueStats stats;
+    stats.posted = m_posted.load();
+    stats.coalesced = m_coalesced.load();
+    stats.dropped = m_dropped.load();
+    stats.done = m_done.load();
+    return stats;
+  }
+
+  /**
+   * @brief Stop the task once the command being run finishes, queued
+   * commands are discarded
+   */
+  void stop() {
+#if defined(CPP_STANDARD)
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_thread.joinable()) {
+      m_thread.join();
+    }
+#else
+    if (m_task != NULL) {
+      vTaskDelete(m_task);
+      m_task = NULL;
+    }
+#endif
+  }
+
+private:
+#if defined(CPP_STANDARD)
+  bool push(uint8_t command) {
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      if (m_count == WORK_QUEUE_LENGTH) {
+        return false;
+      }
+      m_ring[(m_head + m_count) % WORK_QUEUE_LENGTH] = command;
+      m_count++;
+    }
+    m_cv.notify_one();
+    return true;
+  }
+
+  // Next command, false when stopping
+  bool pop(uint8_t &command) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_count == 0 && !m_stop) {
+      m_cv.wait(lock);
+    }
+    if (m_stop) {
+      return false;
+    }
+    command = m_ring[m_head];
+    m_head = (m_head + 1) % WORK_QUEUE_LENGTH;
+    m_count--;
+    return true;
+  }
+
+  static void run(WorkQueue *self) {
+    uint8_t command;
+    while (self->pop(command)) {
+      self->execute(command);
+    }
+  }
+#else
+  bool push(uint8_t command) {
+    return m_queue != NULL && xQueueSend(m_queue, &command, 0) == pdPASS;
+  }
+
+  static void run(void *ptr) {
+    WorkQueue *self = reinterpret_cast<WorkQueue *>(ptr);
+    uint8_t command;
+    while (true) {
+      if (xQueueReceive(self->m_queue, &command, portMAX_DELAY) == pdPASS) {
+        self->execute(command);
+      }
+    }
+  }
+#endif
+
+  void execute(uint8_t command) {
+    // Cleared first, so a post while running queues another run
+    m_pending.fetch_and(~(1u << command));
+    m_handler(m_ctx, (WorkCommand)command);
+    m_done++;
+  }
+
+  WorkHandler m_handler;
+  void *m_ctx;
+  std::atomic<uint32_t> m_pending; // Bit per command that is queued
+  std::atomic<uint32_t> m_posted;
+  std::atomic<uint32_t> m_coalesced;
+  std::atomic<uint32_t> m_dropped;
+  std::atomic<uint32_t> m_done;
+
+#if defined(CPP_STANDARD)
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::thread m_thread;
+  uint8_t m_ring[WORK_QUEUE_LENGTH];
+  size_t m_head;
+  size_t m_count;
+  bool m_stop;
+#else
+  QueueHandle_t m_queue;
+  TaskHandle_t m_task;
+#endif
+};
+
+#endif
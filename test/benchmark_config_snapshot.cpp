@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CPP_STANDARD
+#include "../src/config_snapshot.h"
+
+#include "benchmark_report.h"
+
+/*
+ * Contention benchmark for config reads, compares readers taking the lock
+ * that is held across requests to the server with readers using the
+ * published snapshot. A writer thread stands in for the background refresh,
+ * holding the lock for a simulated request then storing a new value.
+ * Readers stand in for application tasks, reading a value between short
+ * pieces of work.
+ *
+ *   g++ -O2 benchmark_config_snapshot.cpp -o benchmark_config_snapshot \
+ *       -lpthread
+ *   ./benchmark_config_snapshot [results.json]
+ */
+
+using bench_clock = std::chrono::steady_clock;
+
+static const int c_readers = 4;
+static const int c_request_us = 2000; // Time the lock is held per request
+static const int c_run_ms = 1000;
+static const int c_read_us = 50; // Application work between reads
+
+static BenchmarkReport g_report;
+
+class Fixture {
+public:
+  virtual ~Fixture() {}
+  virtual void read(char *value) = 0;
+  virtual void refresh(const char *value) = 0;
+};
+
+// Readers take the same lock as the refresh, as get_config did
+class LockedFixture : public Fixture {
+public:
+  void read(char *value) override {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    ConfigCacheEntry *entry;
+    if (m_cache.lookup("key", 0, &entry) != CONFIG_CACHE_MISS) {
+      strcpy(value, entry->value);
+    }
+  }
+  void refresh(const char *value) override {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    std::this_thread::sleep_for(std::chrono::microseconds(c_request_us));
+    m_cache.store("key", value, NULL, 0, 1000000);
+  }
+
+private:
+  std::mutex m_mutex;
+  ConfigCache m_cache;
+};
+
+// Readers use the snapshot, the refresh still holds its lock for the request
+class SnapshotFixture : public Fixture {
+public:
+  void read(char *value) override {
+    m_snapshot.read("key", 0, value, NULL);
+  }
+  void refresh(const char *value) override {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    std::this_thread::sleep_for(std::chrono::microseconds(c_request_us));
+    m_cache.store("key", value, NULL, 0, 1000000);
+    m_snapshot.publish(m_cache);
+  }
+
+private:
+  std::mutex m_mutex;
+  ConfigCache m_cache;
+  ConfigSnapshot m_snapshot;
+};
+
+static double percentile(std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * p))];
+}
+
+static void measure(const char *method, Fixture &fixture) {
+  fixture.refresh("initial");
+
+  std::atomic<bool> done(false);
+  std::vector<std::vector<double>> latencies(c_readers);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < c_readers; t++) {
+    readers.emplace_back([&, t] {
+      char value[CONFIG_CACHE_VALUE_LENGTH + 1];
+      while (!done) {
+        bench_clock::time_point start = bench_clock::now();
+        fixture.read(value);
+        latencies[t].push_back(
+            std::chrono::duration<double, std::micro>(bench_clock::now() -
+                                                      start)
+                .count());
+        std::this_thread::sleep_for(std::chrono::microseconds(c_read_us));
+      }
+    });
+  }
+
+  std::thread writer([&] {
+    int i = 0;
+    while (!done) {
+      fixture.refresh(std::to_string(i++).c_str());
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(c_run_ms));
+  done = true;
+  writer.join();
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+
+  std::vector<double> all;
+  for (const std::vector<double> &l : latencies) {
+    all.insert(all.end(), l.begin(), l.end());
+  }
+  std::sort(all.begin(), all.end());
+
+  g_report.add(BenchmarkResult()
+                   .text("method", method, 10)
+                   .number("reads_per_second", all.size() * 1000.0 / c_run_ms,
+                           0, 12, " reads/s")
+                   .number("p50_us", percentile(all, 0.5), 2, 10, " p50 us")
+                   .number("p99_us", percentile(all, 0.99), 2, 10, " p99 us")
+                   .number("max_us", all.empty() ? 0 : all.back(), 1, 10,
+                           " max us"));
+}
+
+int main(int argc, char **argv) {
+
+  printf("config reads, %d readers every %d us, lock held %d us per refresh\n",
+         c_readers, c_read_us, c_request_us);
+  {
+    LockedFixture fixture;
+    measure("locked", fixture);
+  }
+  {
+    SnapshotFixture fixture;
+    measure("snapshot", fixture);
+  }
+
+  return g_report.finish(argc, argv);
+}
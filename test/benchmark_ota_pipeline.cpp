@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CPP_STANDARD
+#include "../src/ota_pipeline.h"
+
+#include "benchmark_report.h"
+#include "host_client.h"
+#include "stand_in_server.h"
+
+/*
+ * Update download benchmark, compares writing each piece of the blob to
+ * flash as it is read, as do_update did, with passing it through the
+ * OtaPipeline to a writer thread.
+ *
+ * The blob comes from the local stand-in server through a simulated link
+ * with TCP flow control: the sender may have no more than a receive window
+ * of data unread by the node, and hears that the node has read a segment a
+ * round trip after it does. A reader that stops to write flash therefore
+ * holds back the sender. Flash is simulated with a cost per write and per
+ * byte, which includes the hash; the partition is erased by esp_ota_begin
+ * before the download so erases are not part of it.
+ *
+ *   g++ -O2 benchmark_ota_pipeline.cpp -o benchmark_ota_pipeline -lpthread
+ *   ./benchmark_ota_pipeline [results.json]
+ */
+
+using bench_clock = std::chrono::steady_clock;
+
+static const size_t c_image_bytes = 256 * 1024;
+
+// Link
+static const double c_link_bytes_per_us = 1.0; // About 1 MB/s
+static const size_t c_segment_bytes = 1436;    // MSS
+static const size_t c_window_segments = 4;     // lwIP default window
+static const uint32_t c_rtt_us = 10000;
+
+// Flash
+static const uint32_t c_write_us = 100; // Per write
+static const double c_program_us_per_byte = 1.5;
+
+static BenchmarkReport g_report;
+
+static uint64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             bench_clock::now().time_since_epoch())
+      .count();
+}
+
+/*
+ * HostClient behind a link with limited rate and a receive window
+ */
+class SimulatedLink {
+
+public:
+  int connect(const char *host, uint16_t port) {
+    m_start = now_us();
+    m_arrival.clear();
+    m_read.clear();
+    m_consumed = 0;
+    return m_client.connect(host, port);
+  }
+
+  size_t write(const uint8_t *buf, size_t size) {
+    return m_client.write(buf, size);
+  }
+
+  int available() {
+    size_t arrived = arrived_bytes();
+    return (int)std::min(arrived - m_consumed, (size_t)m_client.available());
+  }
+
+  int read(uint8_t *buf, size_t size) {
+    size = std::min(size, arrived_bytes() - m_consumed);
+    if (size == 0) {
+      return -1;
+    }
+    int c = m_client.read(buf, size);
+    if (c > 0) {
+      m_consumed += c;
+      while ((m_read.size() + 1) * c_segment_bytes <= m_consumed) {
+        m_read.push_back(now_us());
+      }
+    }
+    return c;
+  }
+
+  void stop() { m_client.stop(); }
+
+  uint8_t connected() { return m_client.connected(); }
+
+private:
+  // Work out when each segment arrives, as far as the reads so far allow,
+  // and return the bytes that have arrived by now
+  size_t arrived_bytes() {
+    const uint64_t segment_us =
+        (uint64_t)(c_segment_bytes / c_link_bytes_per_us);
+    while (true) {
+      size_t i = m_arrival.size();
+      uint64_t t = (i == 0 ? m_start + c_rtt_us : m_arrival[i - 1]) +
+                   segment_us;
+      if (i >= c_window_segments) {
+        if (i - c_window_segments >= m_read.size()) {
+          break; // Not sent until that segment is read
+        }
+        t = std::max(t, m_read[i - c_window_segments] + c_rtt_us);
+      }
+      m_arrival.push_back(t);
+    }
+    uint64_t now = now_us();
+    size_t segments = 0;
+    while (segments < m_arrival.size() && m_arrival[segments] <= now) {
+      segments++;
+    }
+    return segments * c_segment_bytes;
+  }
+
+  HostClient m_client;
+  uint64_t m_start;
+  std::vector<uint64_t> m_arrival; // Time each segment arrives
+  std::vector<uint64_t> m_read;    // Time each segment was read
+  size_t m_consumed;
+};
+
+/*
+ * Flash that takes time to write
+ */
+struct SimulatedFlash {
+  size_t written = 0;
+
+  void write(size_t len) {
+    double us = c_write_us + len * c_program_us_per_byte;
+    written += len;
+    std::this_thread::sleep_for(std::chrono::microseconds((uint64_t)us));
+  }
+};
+
+static bool flash_sink(void *ctx, const uint8_t *, size_t len) {
+  reinterpret_cast<SimulatedFlash *>(ctx)->write(len);
+  return true;
+}
+
+static void record(const char *method, uint64_t start, size_t written,
+                   uint32_t stalls) {
+  double seconds = (now_us() - start) / 1e6;
+  g_report.add(BenchmarkResult()
+                   .text("method", method, 10)
+                   .number("kb_per_second", written / 1024.0 / seconds, 1, 10,
+                           " KB/s")
+                   .number("seconds", seconds, 2, 8, " s")
+                   .number("stalls", stalls, 0, 8, " stalls"));
+}
+
+static void measure(const char *method, bool pipelined, const char *url) {
+  SimulatedLink link;
+  SimpleHTTPConnection<SimulatedLink> http;
+  http.begin(&link, url);
+  SimulatedFlash flash;
+
+  uint64_t start = now_us();
+  int code;
+  uint32_t stalls = 0;
+  if (pipelined) {
+    OtaPipeline pipeline;
+    WorkTaskConfig config = {4096, 1, WORK_NO_AFFINITY};
+    pipeline.begin(flash_sink, &flash, config);
+    code = http.request("GET", "/blob/", NULL, 0, OtaPipeline::sink,
+                        &pipeline);
+    pipeline.end();
+    stalls = pipeline.stats().stalls;
+  } else {
+    code = http.request("GET", "/blob/", NULL, 0, flash_sink, &flash);
+  }
+  if (code != 200 || !http.complete() || flash.written != c_image_bytes) {
+    fprintf(stderr, "%s: download failed\n", method);
+    return;
+  }
+  record(method, start, flash.written, stalls);
+}
+
+int main(int argc, char **argv) {
+
+  std::string image(c_image_bytes, 'x');
+  StandInServer server([&image](const StandInRequest &) {
+    return stand_in_response(200, image);
+  });
+
+  printf("update download, %u KB image, %u x %u byte buffers, "
+         "%u ms round trip\n",
+         (unsigned)(c_image_bytes / 1024), (unsigned)OTA_PIPELINE_BUFFERS,
+         (unsigned)OTA_PIPELINE_BUFFER_SIZE, (unsigned)(c_rtt_us / 1000));
+  measure("serial", false, server.url().c_str());
+  measure("pipelined", true, server.url().c_str());
+
+  return g_report.finish(argc, argv);
+}
@@ -0,0 +1,120 @@
+/*
+ * Results of the benchmarks, each a row of named fields. Results are printed
+ * as a table, and written as JSON to the file given on the command line so
+ * that they can be compared between releases:
+ *
+ *   ./benchmark_name [results.json]
+ */
+
+#ifndef __BENCHMARK_REPORT_H__
+#define __BENCHMARK_REPORT_H__
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class BenchmarkResult {
+
+public:
+  /*
+   * Fields are padded to width in the table, those with width 0 are only
+   * written to the JSON
+   */
+  BenchmarkResult &text(const char *name, const std::string &value,
+                        int width = 0) {
+    Field field = {name, true, value, 0, 0, width, ""};
+    m_fields.push_back(field);
+    return *this;
+  }
+
+  /*
+   * Numbers have the given number of decimal places, and are followed in
+   * the table by unit
+   */
+  BenchmarkResult &number(const char *name, double value, int precision,
+                          int width = 0, const char *unit = "") {
+    Field field = {name, false, "", value, precision, width, unit};
+    m_fields.push_back(field);
+    return *this;
+  }
+
+private:
+  friend class BenchmarkReport;
+
+  struct Field {
+    std::string name;
+    bool is_text;
+    std::string text;
+    double value;
+    int precision;
+    int width;
+    std::string unit;
+  };
+
+  std::vector<Field> m_fields;
+};
+
+class BenchmarkReport {
+
+public:
+  void add(const BenchmarkResult &result) {
+    printf(" ");
+    for (const BenchmarkResult::Field &field : result.m_fields) {
+      if (field.width == 0) {
+        continue;
+      }
+      if (field.is_text) {
+        printf(" %-*s", field.width, field.text.c_str());
+      } else {
+        printf(" %*.*f%s", field.width, field.precision, field.value,
+               field.unit.c_str());
+      }
+    }
+    printf("\n");
+    m_results.push_back(result);
+  }
+
+  /**
+   * @brief Write the results to the file named by the first argument, if
+   * there is one
+   *
+   * @return Exit code for main
+   */
+  int finish(int argc, char **argv) const {
+    if (argc > 1 && !write(argv[1])) {
+      fprintf(stderr, "Unable to write results to %s\n", argv[1]);
+      return 1;
+    }
+    return 0;
+  }
+
+private:
+  bool write(const char *path) const {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+      return false;
+    }
+    fprintf(file, "{\n  \"results\": [\n");
+    for (size_t i = 0; i < m_results.size(); i++) {
+      const BenchmarkResult &result = m_results[i];
+      fprintf(file, "    {");
+      for (size_t j = 0; j < result.m_fields.size(); j++) {
+        const BenchmarkResult::Field &field = result.m_fields[j];
+        fprintf(file, "%s\"%s\": ", j > 0 ? ", " : "", field.name.c_str());
+        if (field.is_text) {
+          fprintf(file, "\"%s\"", field.text.c_str());
+        } else {
+          fprintf(file, "%.*f", field.precision, field.value);
+        }
+      }
+      fprintf(file, "}%s\n", (i + 1 < m_results.size()) ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    return true;
+  }
+
+  std::vector<BenchmarkResult> m_results;
+};
+
+#endif
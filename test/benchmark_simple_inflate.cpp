@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#define CPP_STANDARD
+#include "../src/simple_inflate.h"
+
+#include "benchmark_report.h"
+
+/*
+ * Compressed update benchmark, shows how much smaller a gzip blob is than
+ * the image at each compression level, and how fast SimpleInflate
+ * decompresses it in the pieces the download delivers, with zlib's inflate
+ * for reference.
+ *
+ * The image is this benchmark's own executable, as machine code compresses
+ * much as a firmware image does.
+ *
+ *   g++ -O2 benchmark_simple_inflate.cpp -o benchmark_simple_inflate -lz
+ *   ./benchmark_simple_inflate [results.json]
+ */
+
+using bench_clock = std::chrono::steady_clock;
+
+static const size_t c_piece_bytes = 4096; // As passed by the OTA pipeline
+static const int c_runs = 20;
+
+static BenchmarkReport g_report;
+
+static std::string read_image() {
+  std::string image;
+  FILE *file = fopen("/proc/self/exe", "rb");
+  if (file == NULL) {
+    return image;
+  }
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+    image.append(buf, n);
+  }
+  fclose(file);
+  return image;
+}
+
+static std::string gzip(const std::string &data, int level) {
+  z_stream stream = {};
+  deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY);
+  std::string out(deflateBound(&stream, data.size()) + 64, '\0');
+  stream.next_in = (Bytef *)data.data();
+  stream.avail_in = data.size();
+  stream.next_out = (Bytef *)&out[0];
+  stream.avail_out = out.size();
+  deflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+static bool count_sink(void *ctx, const uint8_t *, size_t len) {
+  *reinterpret_cast<size_t *>(ctx) += len;
+  return true;
+}
+
+static size_t simple_inflate(const std::string &compressed) {
+  SimpleInflate inflater(SIMPLE_INFLATE_GZIP);
+  size_t out = 0;
+  for (size_t i = 0; i < compressed.size(); i += c_piece_bytes) {
+    inflater.feed((const uint8_t *)compressed.data() + i,
+                  std::min(c_piece_bytes, compressed.size() - i), count_sink,
+                  &out);
+  }
+  return inflater.done() ? out : 0;
+}
+
+static size_t zlib_inflate(const std::string &compressed) {
+  z_stream stream = {};
+  inflateInit2(&stream, 15 + 16);
+  uint8_t window[1 << 15];
+  size_t out = 0;
+  int ret = Z_OK;
+  for (size_t i = 0; i < compressed.size() && ret != Z_STREAM_END;
+       i += c_piece_bytes) {
+    stream.next_in = (Bytef *)compressed.data() + i;
+    stream.avail_in = std::min(c_piece_bytes, compressed.size() - i);
+    do {
+      stream.next_out = window;
+      stream.avail_out = sizeof(window);
+      ret = inflate(&stream, Z_NO_FLUSH);
+      out += sizeof(window) - stream.avail_out;
+    } while (stream.avail_out == 0 && ret == Z_OK);
+  }
+  inflateEnd(&stream);
+  return ret == Z_STREAM_END ? out : 0;
+}
+
+static void measure(const char *method,
+                    size_t (*decompress)(const std::string &),
+                    const std::string &image, int level) {
+  std::string compressed = gzip(image, level);
+  bench_clock::time_point start = bench_clock::now();
+  for (int i = 0; i < c_runs; i++) {
+    if (decompress(compressed) != image.size()) {
+      fprintf(stderr, "%s: decompression failed\n", method);
+      return;
+    }
+  }
+  double seconds =
+      std::chrono::duration<double>(bench_clock::now() - start).count();
+
+  double ratio = (double)compressed.size() / image.size();
+  double mb_per_second = image.size() * c_runs / 1e6 / seconds;
+  g_report.add(BenchmarkResult()
+                   .text("method", method, 14)
+                   .number("level", level, 0, 2, " level")
+                   .number("ratio", ratio, 3, 6, " of image")
+                   .number("mb_per_second", mb_per_second, 1, 10, " MB/s"));
+}
+
+int main(int argc, char **argv) {
+
+  std::string image = read_image();
+  if (image.empty()) {
+    fprintf(stderr, "Unable to read image\n");
+    return 1;
+  }
+
+  printf("gzip update, %u KB image, %u byte pieces, %u KB window\n",
+         (unsigned)(image.size() / 1024), (unsigned)c_piece_bytes,
+         (unsigned)(SIMPLE_INFLATE_WINDOW_SIZE / 1024));
+  const int levels[] = {1, 6, 9};
+  for (int level : levels) {
+    measure("simple_inflate", simple_inflate, image, level);
+    measure("zlib", zlib_inflate, image, level);
+  }
+
+  return g_report.finish(argc, argv);
+}
@@ -0,0 +1,330 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#define CPP_STANDARD
+#include "../src/confrm_responses.h"
+#include "../src/simple_json.h"
+
+#include "benchmark_report.h"
+
+/*
+ * Benchmark suite for simple_json, measures parse throughput, allocations
+ * per parse and peak heap for each parsing method on representative confrm
+ * server responses and larger synthetic objects.
+ *
+ *   g++ -O2 benchmark_simple_json.cpp -o benchmark_simple_json
+ *   ./benchmark_simple_json [results.json]
+ */
+
+/*
+ * Allocation tracking, every allocation is prefixed with its size so that
+ * the current and peak heap use can be followed.
+ */
+static size_t g_allocations = 0;
+static size_t g_heap_current = 0;
+static size_t g_heap_peak = 0;
+
+static const size_t c_alloc_header = 16;
+
+void *operator new(size_t size) {
+  uint8_t *ptr = reinterpret_cast<uint8_t *>(malloc(size + c_alloc_header));
+  if (ptr == NULL) {
+    throw std::bad_alloc();
+  }
+  *reinterpret_cast<size_t *>(ptr) = size;
+  g_allocations++;
+  g_heap_current += size;
+  if (g_heap_current > g_heap_peak) {
+    g_heap_peak = g_heap_current;
+  }
+  return ptr + c_alloc_header;
+}
+
+void operator delete(void *ptr) noexcept {
+  if (ptr == NULL) {
+    return;
+  }
+  uint8_t *base = reinterpret_cast<uint8_t *>(ptr) - c_alloc_header;
+  g_heap_current -= *reinterpret_cast<size_t *>(base);
+  free(base);
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete[](void *ptr) noexcept { operator delete(ptr); }
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { operator delete(ptr); }
+
+static volatile size_t g_sink = 0;
+
+static BenchmarkReport g_report;
+
+template <class F>
+static void measure(const std::string &payload, const char *method,
+                    size_t bytes, F func) {
+
+  // Allocations and peak heap for a single run
+  size_t start_allocations = g_allocations;
+  size_t start_heap = g_heap_current;
+  g_heap_peak = g_heap_current;
+  func();
+  size_t allocations = g_allocations - start_allocations;
+  size_t peak_heap = g_heap_peak - start_heap;
+
+  // Throughput
+  using clock = std::chrono::steady_clock;
+  size_t iterations = 0;
+  clock::time_point start = clock::now();
+  double elapsed = 0;
+  do {
+    func();
+    iterations++;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  } while (elapsed < 0.1);
+  double mbps = (bytes * iterations) / elapsed / 1e6;
+
+  g_report.add(BenchmarkResult()
+                   .text("payload", payload)
+                   .text("method", method, 20)
+                   .number("bytes", bytes, 0)
+                   .number("mbps", mbps, 1, 10, " MB/s")
+                   .number("allocations", allocations, 0, 8, " allocs")
+                   .number("peak_heap", peak_heap, 0, 10, " peak bytes"));
+}
+
+static const std::string c_check_for_update =
+    "{\"current_version\":\"0.5.1\",\"blob\":\"9656f840e8d94170b9d99ead29bb3d78\","
+    "\"hash\":\"4ac64de7167d6b21d1bf4370d27987e3812b556048c9641584fa3ea66a7a6e4c"
+    "\",\"force\":true}";
+static const std::string c_time = "{\"time\": 1605000000}";
+static const std::string c_config = "{\"value\": \"mqtt.example.com:1883\"}";
+
+static std::string make_payload(size_t pairs, size_t value_length) {
+  std::string json = "{\n";
+  for (size_t i = 0; i < pairs; i++) {
+    json += "  \"key_" + std::to_string(i) + "\": ";
+    switch (i % 3) {
+    case 0:
+      json += "\"" + std::string(value_length, 'x') + "\"";
+      break;
+    case 1:
+      json += std::to_string(i * 1000);
+      break;
+    case 2:
+      json += (i % 2) ? "true" : "false";
+      break;
+    }
+    json += (i + 1 < pairs) ? ",\n" : "\n";
+  }
+  return json + "}";
+}
+
+static void run_index(const std::string &name, const std::string &json) {
+
+  const char *str = json.c_str();
+  const size_t len = json.length();
+  std::vector<uint32_t> index(SIMPLE_JSON_INDEX_WORDS(len));
+
+  measure(name, "index_scalar", len, [&]() {
+    simple_json_index_scalar(str, len, index.data());
+    g_sink += index[0];
+  });
+
+  measure(name, "index_swar", len, [&]() {
+    for (size_t i = 0; i + 32 <= len; i += 32) {
+      index[i / 32] = simple_json_index_block_swar(str + i);
+    }
+    g_sink += index[0];
+  });
+
+#if defined(__SSE2__)
+  measure(name, "index_sse2", len, [&]() {
+    for (size_t i = 0; i + 32 <= len; i += 32) {
+      index[i / 32] = simple_json_index_block_sse2(str + i);
+    }
+    g_sink += index[0];
+  });
+#endif
+
+#if defined(__AVX2__)
+  measure(name, "index_avx2", len, [&]() {
+    for (size_t i = 0; i + 32 <= len; i += 32) {
+      index[i / 32] = simple_json_index_block_avx2(str + i);
+    }
+    g_sink += index[0];
+  });
+#endif
+}
+
+static void run_parse(const std::string &name, const std::string &json) {
+
+  const char *str = json.c_str();
+  const size_t len = json.length();
+
+  measure(name, "simple_json", len, [&]() {
+    std::vector<SimpleJSONElement> result = simple_json(json);
+    g_sink += result.size();
+  });
+
+  measure(name, "tokenize", len, [&]() {
+    SimpleJSONTokenizer tok;
+    SimpleJSONToken token;
+    simple_json_begin(tok, str, len);
+    while (simple_json_next(tok, token)) {
+      g_sink += token.value.length;
+    }
+  });
+
+  std::vector<uint32_t> index(SIMPLE_JSON_INDEX_WORDS(len));
+  measure(name, "tokenize_indexed", len, [&]() {
+    SimpleJSONTokenizer tok;
+    SimpleJSONToken token;
+    simple_json_index(str, len, index.data());
+    simple_json_begin_indexed(tok, str, len, index.data());
+    while (simple_json_next(tok, token)) {
+      g_sink += token.value.length;
+    }
+  });
+
+  // Static so that the arena is not counted as stack in the heap figures
+  static SimpleJSONArena<2048, 65535> arena;
+  measure(name, "arena", len, [&]() {
+    simple_json_parse(str, len, arena);
+    g_sink += arena.size();
+  });
+
+  static SimpleJSONTape<4096> tape;
+  measure(name, "tape", len, [&]() {
+    simple_json_tape(str, len, tape);
+    g_sink += tape.size();
+  });
+
+  measure(name, "stream", len, [&]() {
+    std::vector<SimpleJSONElement> result;
+    ConfrmJSONParser parser(simple_json_stream_collect, &result);
+    parser.feed(str, len);
+    g_sink += result.size();
+  });
+}
+
+/*
+ * Looking up a few keys in a response with many keys, against
+ * materialising every pair
+ */
+static void run_find(const std::string &name, const std::string &json) {
+
+  const char *str = json.c_str();
+  const size_t len = json.length();
+
+  measure(name, "simple_json_get", len, [&]() {
+    std::vector<SimpleJSONElement> result = simple_json(json);
+    g_sink += get_simple_json_string(result, "key_30").length();
+  });
+
+  measure(name, "find", len, [&]() {
+    SimpleJSONToken token;
+    if (simple_json_find(str, len, "key_30", token)) {
+      g_sink += token.value.length;
+    }
+  });
+
+  const char *keys[] = {"key_10", "key_20", "key_30"};
+  measure(name, "find_keys", len, [&]() {
+    SimpleJSONToken tokens[3];
+    g_sink += simple_json_find_keys(str, len, keys, 3, tokens);
+  });
+}
+
+template <class T, size_t N>
+static void run_bind(const std::string &name, const std::string &json,
+                     const SimpleJSONField (&schema)[N]) {
+
+  const char *str = json.c_str();
+  const size_t len = json.length();
+
+  measure(name, "bind", len, [&]() {
+    T response;
+    SimpleJSONBinding binding = simple_json_binding(schema, response);
+    simple_json_bind(str, len, binding);
+    g_sink += binding.found;
+  });
+
+  measure(name, "stream_bind", len, [&]() {
+    T response;
+    SimpleJSONBinding binding = simple_json_binding(schema, response);
+    ConfrmJSONParser parser(simple_json_bind_callback, &binding);
+    parser.feed(str, len);
+    g_sink += binding.found;
+  });
+}
+
+/*
+ * Parsing done by one Confrm poll, the /time/, /check_for_update/ and
+ * /config/ responses streamed through Confrm's own parser and schemas
+ */
+static void run_cycle() {
+  size_t len = c_time.length() + c_check_for_update.length() +
+               c_config.length();
+  measure("request_cycle", "stream_bind", len, [&]() {
+    TimeResponse time;
+    SimpleJSONBinding time_binding = simple_json_binding(time_schema, time);
+    ConfrmJSONParser time_parser(simple_json_bind_callback, &time_binding);
+    time_parser.feed(c_time.c_str(), c_time.length());
+
+    CheckForUpdateResponse update;
+    SimpleJSONBinding update_binding =
+        simple_json_binding(check_for_update_schema, update);
+    ConfrmJSONParser update_parser(simple_json_bind_callback, &update_binding);
+    update_parser.feed(c_check_for_update.c_str(), c_check_for_update.length());
+
+    ConfigResponse config;
+    SimpleJSONBinding config_binding =
+        simple_json_binding(config_schema, config);
+    ConfrmJSONParser config_parser(simple_json_bind_callback, &config_binding);
+    config_parser.feed(c_config.c_str(), c_config.length());
+
+    g_sink += time_binding.found + update_binding.found + config_binding.found;
+  });
+}
+
+static void section(const std::string &name, const std::string &json) {
+  printf("%s (%zu bytes)\n", name.c_str(), json.length());
+}
+
+int main(int argc, char **argv) {
+
+  section("check_for_update", c_check_for_update);
+  run_parse("check_for_update", c_check_for_update);
+  run_bind<CheckForUpdateResponse>("check_for_update", c_check_for_update,
+                                   check_for_update_schema);
+
+  section("time", c_time);
+  run_parse("time", c_time);
+  run_bind<TimeResponse>("time", c_time, time_schema);
+
+  section("config", c_config);
+  run_parse("config", c_config);
+  run_bind<ConfigResponse>("config", c_config, config_schema);
+
+  printf("request_cycle\n");
+  run_cycle();
+
+  const std::string short_values = make_payload(2000, 8);
+  section("synthetic_short_values", short_values);
+  run_index("synthetic_short_values", short_values);
+  run_parse("synthetic_short_values", short_values);
+
+  const std::string long_values = make_payload(500, 256);
+  section("synthetic_long_values", long_values);
+  run_index("synthetic_long_values", long_values);
+  run_parse("synthetic_long_values", long_values);
+
+  const std::string many_keys = make_payload(300, 16);
+  section("synthetic_many_keys", many_keys);
+  run_find("synthetic_many_keys", many_keys);
+
+  return g_report.finish(argc, argv);
+}
@@ -0,0 +1,109 @@
+/*
+ * Socket based stand-in for the Arduino WiFiClient, so that the networking
+ * code can be tested on a host against a local server.
+ */
+
+#ifndef __HOST_CLIENT_H__
+#define __HOST_CLIENT_H__
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+class HostClient {
+
+public:
+  HostClient() : m_fd(-1) {}
+  ~HostClient() { stop(); }
+
+  int connect(const char *host, uint16_t port) {
+    stop();
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL) {
+      return 0;
+    }
+    struct sockaddr_in addr;
+    memcpy(&addr, res->ai_addr, sizeof(addr));
+    addr.sin_port = htons(port);
+    freeaddrinfo(res);
+
+    m_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m_fd < 0) {
+      return 0;
+    }
+    if (::connect(m_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+      stop();
+      return 0;
+    }
+    int one = 1;
+    setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 1;
+  }
+
+  size_t write(const uint8_t *buf, size_t size) {
+    if (m_fd < 0) {
+      return 0;
+    }
+    ssize_t c = send(m_fd, buf, size, MSG_NOSIGNAL);
+    return c < 0 ? 0 : (size_t)c;
+  }
+
+  int available() {
+    if (m_fd < 0) {
+      return 0;
+    }
+    int count = 0;
+    if (ioctl(m_fd, FIONREAD, &count) != 0) {
+      return 0;
+    }
+    return count;
+  }
+
+  int read(uint8_t *buf, size_t size) {
+    if (m_fd < 0) {
+      return -1;
+    }
+    ssize_t c = recv(m_fd, buf, size, MSG_DONTWAIT);
+    return c <= 0 ? -1 : (int)c;
+  }
+
+  void stop() {
+    if (m_fd >= 0) {
+      close(m_fd);
+      m_fd = -1;
+    }
+  }
+
+  // As with WiFiClient, unread data counts as connected
+  uint8_t connected() {
+    if (m_fd < 0) {
+      return 0;
+    }
+    uint8_t c;
+    ssize_t r = recv(m_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (r > 0) {
+      return 1;
+    }
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 1;
+    }
+    return 0;
+  }
+
+private:
+  int m_fd;
+};
+
+#endif
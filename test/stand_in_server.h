@@ -0,0 +1,248 @@
+/*
+ * Local HTTP/1.1 server standing in for the confrm server in host tests.
+ *
+ * Runs on a thread, accepts any number of keep-alive connections and passes
+ * each request to a handler which returns the raw response. Responses
+ * containing "Connection: close" close the connection once sent. Data can be
+ * pushed to open connections later with send_all, as for event streams.
+ */
+
+#ifndef __STAND_IN_SERVER_H__
+#define __STAND_IN_SERVER_H__
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct StandInRequest {
+  std::string method;
+  std::string path;
+  std::string headers; // Raw header lines
+  std::string body;
+
+  // Value of the named header, empty if not present
+  std::string header(const std::string &name) const {
+    std::string lower_headers = lower(headers);
+    std::string key = "\r\n" + lower(name) + ":";
+    size_t pos = ("\r\n" + lower_headers).find(key);
+    if (pos == std::string::npos) {
+      return "";
+    }
+    pos += key.size() - 2;
+    size_t end = headers.find("\r\n", pos);
+    std::string value = headers.substr(pos, end - pos);
+    value.erase(0, value.find_first_not_of(" \t"));
+    return value;
+  }
+
+  static std::string lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+    return s;
+  }
+};
+
+typedef std::function<std::string(const StandInRequest &)> StandInHandler;
+
+/**
+ * Build a response with a Content-Length
+ */
+inline std::string stand_in_response(int code, const std::string &body,
+                                     const std::string &headers = "") {
+  return "HTTP/1.1 " + std::to_string(code) + " X\r\nContent-Length: " +
+         std::to_string(body.size()) + "\r\n" + headers + "\r\n" + body;
+}
+
+class StandInServer {
+
+public:
+  explicit StandInServer(StandInHandler handler)
+      : m_handler(handler), m_running(true), m_drop(false), m_connections(0),
+        m_requests(0) {
+    m_listen = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(m_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    bind(m_listen, (struct sockaddr *)&addr, sizeof(addr));
+    listen(m_listen, 16);
+    socklen_t len = sizeof(addr);
+    getsockname(m_listen, (struct sockaddr *)&addr, &len);
+    m_port = ntohs(addr.sin_port);
+    m_thread = std::thread(&StandInServer::run, this);
+  }
+
+  ~StandInServer() {
+    m_running = false;
+    m_thread.join();
+    for (size_t i = 0; i < m_clients.size(); i++) {
+      close(m_clients[i].fd);
+    }
+    close(m_listen);
+  }
+
+  uint16_t port() const { return m_port; }
+
+  std::string url(const std::string &path = "") const {
+    return "http://127.0.0.1:" + std::to_string(m_port) + path;
+  }
+
+  int connections() const { return m_connections; }
+  int requests() const { return m_requests; }
+
+  /**
+   * Write raw data to every open connection, for streamed responses
+   */
+  void send_all(const std::string &data) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_pending += data;
+  }
+
+  /**
+   * Close every open connection, as a server does with idle connections
+   */
+  void drop_connections() {
+    m_drop = true;
+    while (m_drop) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+private:
+  struct Connection {
+    int fd;
+    std::string data;
+  };
+
+  void run() {
+    while (m_running) {
+      if (m_drop) {
+        for (size_t i = 0; i < m_clients.size(); i++) {
+          close(m_clients[i].fd);
+        }
+        m_clients.clear();
+        m_drop = false;
+      }
+
+      {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        for (size_t i = 0; i < m_clients.size() && !m_pending.empty(); i++) {
+          send(m_clients[i].fd, m_pending.data(), m_pending.size(),
+               MSG_NOSIGNAL);
+        }
+        m_pending.clear();
+      }
+
+      std::vector<struct pollfd> fds(m_clients.size() + 1);
+      fds[0].fd = m_listen;
+      fds[0].events = POLLIN;
+      for (size_t i = 0; i < m_clients.size(); i++) {
+        fds[i + 1].fd = m_clients[i].fd;
+        fds[i + 1].events = POLLIN;
+      }
+      if (poll(fds.data(), fds.size(), 5) <= 0) {
+        continue;
+      }
+
+      if (fds[0].revents & POLLIN) {
+        Connection c;
+        c.fd = accept(m_listen, NULL, NULL);
+        if (c.fd >= 0) {
+          m_clients.push_back(c);
+          m_connections++;
+        }
+      }
+
+      std::vector<Connection> open;
+      for (size_t i = 0; i < m_clients.size(); i++) {
+        Connection &c = m_clients[i];
+        bool keep = true;
+        if (i + 1 < fds.size() && (fds[i + 1].revents & (POLLIN | POLLHUP))) {
+          char buf[4096];
+          ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+          if (n <= 0) {
+            keep = false;
+          } else {
+            c.data.append(buf, n);
+            keep = serve(c);
+          }
+        }
+        if (keep) {
+          open.push_back(c);
+        } else {
+          close(c.fd);
+        }
+      }
+      m_clients.swap(open);
+    }
+  }
+
+  // Answer every complete request received, false to close the connection
+  bool serve(Connection &c) {
+    while (true) {
+      size_t head_end = c.data.find("\r\n\r\n");
+      if (head_end == std::string::npos) {
+        return true;
+      }
+      StandInRequest request;
+      size_t line_end = c.data.find("\r\n");
+      std::string line = c.data.substr(0, line_end);
+      size_t sp1 = line.find(' ');
+      size_t sp2 = line.find(' ', sp1 + 1);
+      request.method = line.substr(0, sp1);
+      request.path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+      request.headers = c.data.substr(line_end + 2, head_end - line_end);
+      size_t length = atoi(request.header("Content-Length").c_str());
+      if (c.data.size() < head_end + 4 + length) {
+        return true;
+      }
+      request.body = c.data.substr(head_end + 4, length);
+      c.data.erase(0, head_end + 4 + length);
+
+      m_requests++;
+      std::string response = m_handler(request);
+      size_t sent = 0;
+      while (sent < response.size()) {
+        ssize_t n = send(c.fd, response.data() + sent, response.size() - sent,
+                         MSG_NOSIGNAL);
+        if (n <= 0) {
+          return false;
+        }
+        sent += n;
+      }
+      std::string head = response.substr(0, response.find("\r\n\r\n"));
+      if (head.find("Connection: close") != std::string::npos) {
+        return false;
+      }
+    }
+  }
+
+  StandInHandler m_handler;
+  int m_listen;
+  uint16_t m_port;
+  std::thread m_thread;
+  std::atomic<bool> m_running;
+  std::atomic<bool> m_drop;
+  std::atomic<int> m_connections;
+  std::atomic<int> m_requests;
+  std::vector<Connection> m_clients;
+  std::mutex m_mutex;
+  std::string m_pending;
+};
+
+#endif
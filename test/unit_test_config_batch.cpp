@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#define CPP_STANDARD
+#include "../src/config_batch.h"
+
+// Stands in for the server, records each fetch and takes a while over it
+struct Server {
+  std::mutex mutex;
+  std::vector<std::vector<std::string>> fetches;
+  std::set<std::string> fetched;
+  std::atomic<int> active;
+  std::atomic<int> overlaps;
+  int delay_ms;
+  bool ok;
+
+  Server() : active(0), overlaps(0), delay_ms(20), ok(true) {}
+  ~Server() { CHECK(overlaps == 0); }
+};
+
+static bool fetch(void *ctx, const char *const *keys, size_t n) {
+  Server *server = reinterpret_cast<Server *>(ctx);
+  if (server->active++ != 0) {
+    server->overlaps++;
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(server->delay_ms));
+  {
+    std::lock_guard<std::mutex> guard(server->mutex);
+    server->fetches.push_back(std::vector<std::string>(keys, keys + n));
+    for (size_t i = 0; i < n; i++) {
+      server->fetched.insert(keys[i]);
+    }
+  }
+  server->active--;
+  return server->ok;
+}
+
+// Run request for each key on its own thread, started together
+static void run(ConfigBatcher &batcher, Server &server,
+                const std::vector<std::string> &keys,
+                std::vector<bool> *seen = NULL) {
+  std::vector<std::thread> threads;
+  std::atomic<bool> go(false);
+  for (size_t i = 0; i < keys.size(); i++) {
+    threads.emplace_back([&, i] {
+      while (!go) {
+        std::this_thread::yield();
+      }
+      batcher.request(keys[i].c_str(), fetch, &server);
+      if (seen != NULL) {
+        // The key must have been fetched by the time request returns
+        std::lock_guard<std::mutex> guard(server.mutex);
+        (*seen)[i] = server.fetched.count(keys[i]) == 1;
+      }
+    });
+  }
+  go = true;
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+TEST_CASE("Config Batch", "[config_batch]") {
+
+  ConfigBatcher batcher;
+  Server server;
+
+  SECTION("Single request") {
+    batcher.request("key", fetch, &server);
+    REQUIRE(server.fetches.size() == 1);
+    REQUIRE(server.fetches[0] == std::vector<std::string>({"key"}));
+    ConfigBatchStats stats = batcher.stats();
+    REQUIRE(stats.requests == 1);
+    REQUIRE(stats.fetches == 1);
+    REQUIRE(stats.coalesced == 0);
+    REQUIRE(stats.batched == 0);
+  }
+
+  SECTION("Same key from many tasks is fetched once") {
+    batcher.set_window(20);
+    std::vector<bool> seen(8);
+    run(batcher, server, std::vector<std::string>(8, "key"), &seen);
+    REQUIRE(server.fetches.size() == 1);
+    REQUIRE(std::count(seen.begin(), seen.end(), true) == 8);
+    ConfigBatchStats stats = batcher.stats();
+    REQUIRE(stats.requests == 8);
+    REQUIRE(stats.fetches == 1);
+    REQUIRE(stats.coalesced == 7);
+  }
+
+  SECTION("Distinct keys in the window are one fetch") {
+    batcher.set_window(50);
+    std::vector<std::string> keys = {"a", "b", "c", "d"};
+    std::vector<bool> seen(4);
+    run(batcher, server, keys, &seen);
+    REQUIRE(server.fetches.size() == 1);
+    REQUIRE(server.fetches[0].size() == 4);
+    REQUIRE(std::count(seen.begin(), seen.end(), true) == 4);
+    REQUIRE(batcher.stats().batched == 3);
+  }
+
+  SECTION("Keys arriving during a fetch are batched for the next") {
+    server.delay_ms = 100;
+    std::thread first([&] { batcher.request("first", fetch, &server); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::vector<bool> seen(3);
+    run(batcher, server, {"x", "y", "first"}, &seen);
+    first.join();
+    REQUIRE(std::count(seen.begin(), seen.end(), true) == 3);
+    REQUIRE(server.fetches.size() == 2);
+    REQUIRE(server.fetches[1].size() == 2);
+    ConfigBatchStats stats = batcher.stats();
+    REQUIRE(stats.coalesced == 1); // "first" joined the fetch in flight
+    REQUIRE(stats.batched == 1);
+  }
+
+  SECTION("Full batches are split") {
+    batcher.set_window(30);
+    std::vector<std::string> keys;
+    for (int i = 0; i < CONFIG_BATCH_KEYS * 2 + 1; i++) {
+      keys.push_back("key" + std::to_string(i));
+    }
+    std::vector<bool> seen(keys.size());
+    run(batcher, server, keys, &seen);
+    REQUIRE(std::count(seen.begin(), seen.end(), true) == (long)keys.size());
+    REQUIRE(server.fetched.size() == keys.size());
+    REQUIRE(server.fetches.size() >= 3);
+    for (const std::vector<std::string> &f : server.fetches) {
+      REQUIRE(f.size() <= CONFIG_BATCH_KEYS);
+    }
+  }
+
+  SECTION("Failures are counted and everyone returns") {
+    server.ok = false;
+    run(batcher, server, {"a", "a", "b"});
+    REQUIRE(batcher.stats().failures == batcher.stats().fetches);
+  }
+
+  SECTION("Many rounds") {
+    server.delay_ms = 1;
+    batcher.set_window(1);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 6; t++) {
+      threads.emplace_back([&, t] {
+        for (int i = 0; i < 50; i++) {
+          std::string key = "k" + std::to_string((t + i) % 5);
+          batcher.request(key.c_str(), fetch, &server);
+        }
+      });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    ConfigBatchStats stats = batcher.stats();
+    REQUIRE(stats.requests == 300);
+    REQUIRE(stats.fetches == server.fetches.size());
+    REQUIRE(stats.fetches < stats.requests);
+  }
+}
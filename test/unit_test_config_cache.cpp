@@ -0,0 +1,234 @@
+#include <string>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#define CPP_STANDARD
+#include "../src/config_cache.h"
+
+TEST_CASE("Config Cache", "[config_cache]") {
+
+  ConfigCache cache;
+  ConfigCacheEntry *entry;
+
+  SECTION("Fresh, stale and revalidated") {
+    REQUIRE(cache.lookup("key", 0, &entry) == CONFIG_CACHE_MISS);
+    REQUIRE(entry == NULL);
+
+    REQUIRE(cache.store("key", "value", "\"e1\"", 1000, 500) != NULL);
+    REQUIRE(cache.lookup("key", 1499, &entry) == CONFIG_CACHE_FRESH);
+    REQUIRE(std::string(entry->value) == "value");
+    REQUIRE(std::string(entry->etag) == "\"e1\"");
+
+    REQUIRE(cache.lookup("key", 1500, &entry) == CONFIG_CACHE_STALE);
+    cache.revalidated(entry, 1500, 500);
+    REQUIRE(cache.lookup("key", 1600, &entry) == CONFIG_CACHE_FRESH);
+
+    REQUIRE(cache.lookup("key", 2000, &entry) == CONFIG_CACHE_STALE);
+    cache.store("key", "changed", NULL, 2000, 500);
+    REQUIRE(cache.lookup("key", 2001, &entry) == CONFIG_CACHE_FRESH);
+    REQUIRE(std::string(entry->value) == "changed");
+    REQUIRE(std::string(entry->etag) == "");
+
+    REQUIRE(cache.stats().misses == 1);
+    REQUIRE(cache.stats().hits == 3);
+    REQUIRE(cache.stats().revalidations == 1);
+    REQUIRE(cache.stats().updates == 1);
+  }
+
+  SECTION("Zero TTL is always stale") {
+    cache.store("key", "value", NULL, 1000, 0);
+    REQUIRE(cache.lookup("key", 1000, &entry) == CONFIG_CACHE_STALE);
+  }
+
+  SECTION("Timer wrap") {
+    cache.store("key", "value", NULL, 0xFFFFFF00u, 1000);
+    REQUIRE(cache.lookup("key", 0x100, &entry) == CONFIG_CACHE_FRESH);
+    REQUIRE(cache.lookup("key", 0x400, &entry) == CONFIG_CACHE_STALE);
+  }
+
+  SECTION("Expire all") {
+    cache.store("a", "1", NULL, 0, 1000);
+    cache.store("b", "2", NULL, 0, 1000);
+    cache.expire_all();
+    REQUIRE(cache.lookup("a", 1, &entry) == CONFIG_CACHE_STALE);
+    REQUIRE(cache.lookup("b", 1, &entry) == CONFIG_CACHE_STALE);
+    REQUIRE(std::string(entry->value) == "2");
+  }
+
+  SECTION("Least recently used is evicted") {
+    for (int i = 0; i < CONFIG_CACHE_ENTRIES; i++) {
+      cache.store(std::to_string(i).c_str(), "v", NULL, 0, 1000);
+    }
+    REQUIRE(cache.lookup("0", 1, &entry) == CONFIG_CACHE_FRESH);
+    cache.store("new", "v", NULL, 0, 1000);
+    REQUIRE(cache.stats().evictions == 1);
+    REQUIRE(cache.lookup("0", 1, &entry) == CONFIG_CACHE_FRESH);
+    REQUIRE(cache.lookup("1", 1, &entry) == CONFIG_CACHE_MISS);
+    REQUIRE(cache.lookup("new", 1, &entry) == CONFIG_CACHE_FRESH);
+  }
+
+  SECTION("Too long to cache") {
+    std::string long_value(CONFIG_CACHE_VALUE_LENGTH + 1, 'x');
+    cache.store("key", "short", NULL, 0, 1000);
+    REQUIRE(cache.store("key", long_value.c_str(), NULL, 0, 1000) == NULL);
+    REQUIRE(cache.lookup("key", 1, &entry) == CONFIG_CACHE_MISS);
+
+    std::string long_key(CONFIG_CACHE_KEY_LENGTH + 1, 'k');
+    REQUIRE(cache.store(long_key.c_str(), "v", NULL, 0, 1000) == NULL);
+  }
+
+  SECTION("Remove") {
+    cache.store("key", "value", NULL, 0, 1000);
+    cache.remove("key");
+    REQUIRE(cache.lookup("key", 1, &entry) == CONFIG_CACHE_MISS);
+  }
+}
+
+TEST_CASE("Config Table", "[config_cache]") {
+
+  ConfigTable table;
+
+  SECTION("Sorted lookup") {
+    const char *keys[] = {"mqtt_server", "flash_time", "zeta", "alpha",
+                          "mqtt_port", "b"};
+    for (size_t i = 0; i < 6; i++) {
+      std::string value = std::string("v_") + keys[i];
+      REQUIRE(table.add(keys[i], strlen(keys[i]), value.c_str(),
+                        value.size()));
+    }
+    REQUIRE(table.size() == 6);
+    for (size_t i = 1; i < table.size(); i++) {
+      REQUIRE(strcmp(table.key(i - 1), table.key(i)) < 0);
+    }
+    for (size_t i = 0; i < 6; i++) {
+      REQUIRE(std::string(table.get(keys[i])) == std::string("v_") + keys[i]);
+    }
+    REQUIRE(table.get("mqtt") == NULL);
+    REQUIRE(table.get("mqtt_server_") == NULL);
+    REQUIRE(table.get("") == NULL);
+    REQUIRE(table.ok());
+  }
+
+  SECTION("Keys need not be null terminated") {
+    const char *data = "keyvalue";
+    REQUIRE(table.add(data, 3, data + 3, 5));
+    REQUIRE(std::string(table.get("key")) == "value");
+  }
+
+  SECTION("Replace value") {
+    table.add("a", 1, "1", 1);
+    table.add("a", 1, "22", 2);
+    REQUIRE(table.size() == 1);
+    REQUIRE(std::string(table.get("a")) == "22");
+  }
+
+  SECTION("Full") {
+    for (int i = 0; i < CONFIG_TABLE_ENTRIES; i++) {
+      std::string key = "k" + std::to_string(i);
+      REQUIRE(table.add(key.c_str(), key.size(), "v", 1));
+    }
+    REQUIRE_FALSE(table.add("extra", 5, "v", 1));
+    REQUIRE_FALSE(table.ok());
+    REQUIRE(table.size() == CONFIG_TABLE_ENTRIES);
+    REQUIRE(std::string(table.get("k7")) == "v");
+
+    table.clear();
+    REQUIRE(table.ok());
+    std::string big(CONFIG_TABLE_BYTES, 'x');
+    REQUIRE_FALSE(table.add("big", 3, big.c_str(), big.size()));
+    REQUIRE(table.size() == 0);
+  }
+}
+
+TEST_CASE("Config Native Values", "[config_cache]") {
+
+  ConfigNative native;
+
+  SECTION("Parsed once when stored") {
+    ConfigCache cache;
+    ConfigCacheEntry *entry;
+    cache.store("n", "-42", NULL, 0, 1000);
+    cache.lookup("n", 0, &entry);
+    REQUIRE(entry->native.types ==
+            (CONFIG_NATIVE_INT64 | CONFIG_NATIVE_DOUBLE));
+    REQUIRE(entry->native.int64 == -42);
+    REQUIRE(entry->native.number == -42.0);
+
+    cache.store("n", "on", NULL, 0, 1000);
+    REQUIRE(entry->native.types == CONFIG_NATIVE_BOOL);
+    REQUIRE(entry->native.boolean == true);
+  }
+
+  SECTION("Integers") {
+    config_parse_native("9223372036854775807", native);
+    REQUIRE((native.types & CONFIG_NATIVE_INT64));
+    REQUIRE(native.int64 == INT64_MAX);
+    config_parse_native(" 7 ", native);
+    REQUIRE(native.int64 == 7);
+
+    int64_t value = 5;
+    REQUIRE_FALSE(config_parse_int64("9223372036854775808", value));
+    REQUIRE_FALSE(config_parse_int64("", value));
+    REQUIRE_FALSE(config_parse_int64("12abc", value));
+    REQUIRE_FALSE(config_parse_int64("1.5", value));
+    REQUIRE(value == 5);
+  }
+
+  SECTION("Booleans") {
+    const char *truths[] = {"true", "TRUE", "Yes", "on", "1"};
+    const char *lies[] = {"false", "No", "OFF", "0"};
+    for (const char *truth : truths) {
+      config_parse_native(truth, native);
+      REQUIRE((native.types & CONFIG_NATIVE_BOOL));
+      REQUIRE(native.boolean == true);
+    }
+    for (const char *lie : lies) {
+      config_parse_native(lie, native);
+      REQUIRE((native.types & CONFIG_NATIVE_BOOL));
+      REQUIRE(native.boolean == false);
+    }
+    config_parse_native("2", native);
+    REQUIRE_FALSE((native.types & CONFIG_NATIVE_BOOL));
+    config_parse_native("tru", native);
+    REQUIRE(native.types == 0);
+    config_parse_native("truee", native);
+    REQUIRE(native.types == 0);
+  }
+
+  SECTION("Doubles") {
+    config_parse_native("2.5e3", native);
+    REQUIRE(native.types == CONFIG_NATIVE_DOUBLE);
+    REQUIRE(native.number == 2500.0);
+    double value = 1.0;
+    REQUIRE_FALSE(config_parse_double("1e999", value));
+    REQUIRE_FALSE(config_parse_double("1.5x", value));
+    REQUIRE(value == 1.0);
+  }
+
+  SECTION("Bytes") {
+    uint8_t bytes[4];
+    REQUIRE(config_decode_bytes("DEADbeef", bytes, 4));
+    REQUIRE(bytes[0] == 0xDE);
+    REQUIRE(bytes[3] == 0xEF);
+
+    // Base64 with each amount of padding
+    REQUIRE(config_decode_bytes("3q2+7w==", bytes, 4));
+    REQUIRE(bytes[0] == 0xDE);
+    REQUIRE(bytes[3] == 0xEF);
+    REQUIRE(config_decode_bytes("3q2+", bytes, 3));
+    REQUIRE(bytes[2] == 0xBE);
+    REQUIRE(config_decode_bytes("3q0=", bytes, 2));
+    REQUIRE(bytes[1] == 0xAD);
+
+    // Eight characters of hex that are also valid base64
+    REQUIRE(config_decode_bytes("00000000", bytes, 4));
+    REQUIRE(bytes[0] == 0);
+
+    REQUIRE_FALSE(config_decode_bytes("DEADbee", bytes, 4));
+    REQUIRE_FALSE(config_decode_bytes("DEADbeef", bytes, 3));
+    REQUIRE_FALSE(config_decode_bytes("3q2+7w=a", bytes, 4));
+    REQUIRE_FALSE(config_decode_bytes("3q=+7w==", bytes, 4));
+    REQUIRE_FALSE(config_decode_bytes("3q2!7w==", bytes, 4));
+  }
+}
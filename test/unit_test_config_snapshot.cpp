@@ -0,0 +1,113 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#define CPP_STANDARD
+#include "../src/config_snapshot.h"
+
+TEST_CASE("Config Snapshot", "[config_snapshot]") {
+
+  ConfigCache cache;
+  ConfigSnapshot snapshot;
+  char value[CONFIG_CACHE_VALUE_LENGTH + 1];
+  ConfigNative native;
+
+  SECTION("Reads follow published changes") {
+    REQUIRE(snapshot.read("key", 0, value, NULL) == CONFIG_CACHE_MISS);
+
+    cache.store("key", "12", NULL, 1000, 500);
+    REQUIRE(snapshot.read("key", 1000, value, NULL) == CONFIG_CACHE_MISS);
+    snapshot.publish(cache);
+    REQUIRE(snapshot.read("key", 1000, value, &native) == CONFIG_CACHE_FRESH);
+    REQUIRE(std::string(value) == "12");
+    REQUIRE(native.int64 == 12);
+    REQUIRE(snapshot.read("key", 1500, value, NULL) == CONFIG_CACHE_STALE);
+    REQUIRE(snapshot.hits() == 1);
+
+    cache.expire("key");
+    snapshot.publish(cache);
+    REQUIRE(snapshot.read("key", 1000, value, NULL) == CONFIG_CACHE_STALE);
+    REQUIRE(std::string(value) == "12");
+
+    cache.store("key", "13", NULL, 2000, 500);
+    cache.store("other", "x", NULL, 2000, 500);
+    snapshot.publish(cache);
+    REQUIRE(snapshot.read("key", 2000, value, NULL) == CONFIG_CACHE_FRESH);
+    REQUIRE(std::string(value) == "13");
+    REQUIRE(snapshot.read("other", 2000, value, NULL) == CONFIG_CACHE_FRESH);
+
+    cache.remove("key");
+    snapshot.publish(cache);
+    REQUIRE(snapshot.read("key", 2000, value, NULL) == CONFIG_CACHE_MISS);
+  }
+
+  SECTION("Version only changes with the cache contents") {
+    uint32_t version = cache.version();
+    ConfigCacheEntry *entry;
+    cache.lookup("key", 0, &entry);
+    REQUIRE(cache.version() == version);
+    cache.store("key", "1", NULL, 0, 500);
+    REQUIRE(cache.version() != version);
+    version = cache.version();
+    cache.lookup("key", 0, &entry);
+    REQUIRE(cache.version() == version);
+    cache.revalidated(entry, 100, 500);
+    REQUIRE(cache.version() != version);
+  }
+}
+
+static std::string value_for(int i) {
+  return std::to_string(i) + ":" + std::string(100 + i % 150, 'a' + i % 26);
+}
+
+TEST_CASE("Config Snapshot Threads", "[config_snapshot]") {
+
+  // Readers must only ever see a value the writer stored, never a mix of
+  // two, while the writer publishes as fast as it can
+  ConfigCache cache;
+  ConfigSnapshot snapshot;
+  const int c_values = 20000;
+  std::atomic<bool> done(false);
+  std::atomic<int> bad(0);
+  std::atomic<size_t> reads(0);
+
+  cache.store("key", value_for(0).c_str(), NULL, 0, 1000000);
+  snapshot.publish(cache);
+
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&] {
+      char value[CONFIG_CACHE_VALUE_LENGTH + 1];
+      int last = 0;
+      while (!done) {
+        if (snapshot.read("key", 0, value, NULL) == CONFIG_CACHE_MISS) {
+          bad++;
+          continue;
+        }
+        // Whole value as written, and never older than one already seen
+        int i = atoi(value);
+        if (value_for(i) != value || i < last) {
+          bad++;
+        }
+        last = i;
+        reads++;
+      }
+    });
+  }
+
+  for (int i = 1; i < c_values; i++) {
+    cache.store("key", value_for(i).c_str(), NULL, 0, 1000000);
+    snapshot.publish(cache);
+  }
+  done = true;
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+
+  REQUIRE(bad == 0);
+  REQUIRE(reads > 0);
+}
@@ -0,0 +1,151 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#define CPP_STANDARD
+#include "../src/config_watch.h"
+
+struct Changes {
+  std::vector<std::string> keys;
+  std::vector<std::string> values;
+};
+
+static void record(const char *key, const char *value, void *ctx) {
+  Changes *changes = reinterpret_cast<Changes *>(ctx);
+  changes->keys.push_back(key);
+  changes->values.push_back(value);
+}
+
+TEST_CASE("Config Watch", "[config_watch]") {
+
+  ConfigWatchers watchers;
+  Changes changes;
+
+  SECTION("Only changes are delivered") {
+    REQUIRE(watchers.add("mqtt", record, &changes));
+    REQUIRE(watchers.size() == 1);
+    REQUIRE(std::string(watchers.key(0)) == "mqtt");
+
+    // First value seen counts as a change
+    REQUIRE(watchers.notify("mqtt", "10.0.0.1"));
+    REQUIRE(watchers.dispatch() == 1);
+    REQUIRE(changes.values.back() == "10.0.0.1");
+
+    REQUIRE_FALSE(watchers.notify("mqtt", "10.0.0.1"));
+    REQUIRE_FALSE(watchers.notify("other", "x"));
+    REQUIRE(watchers.dispatch() == 0);
+
+    REQUIRE(watchers.notify("mqtt", "10.0.0.2"));
+    REQUIRE(watchers.dispatch() == 1);
+    REQUIRE(changes.keys.back() == "mqtt");
+    REQUIRE(changes.values.back() == "10.0.0.2");
+
+    // Removed
+    REQUIRE(watchers.notify("mqtt", ""));
+    REQUIRE(watchers.dispatch() == 1);
+    REQUIRE(changes.values.back() == "");
+    REQUIRE(changes.values.size() == 3);
+  }
+
+  SECTION("Values are compared in full") {
+    // Same length and the same FNV-1a hash
+    watchers.add("a", record, &changes);
+    REQUIRE(watchers.notify("a", "glbvs"));
+    REQUIRE(watchers.notify("a", "yacxa"));
+    REQUIRE(watchers.dispatch() == 1);
+    REQUIRE(changes.values.back() == "yacxa");
+  }
+
+  SECTION("Changes before dispatch are coalesced") {
+    watchers.add("a", record, &changes);
+    watchers.add("b", record, &changes);
+    watchers.notify("a", "1");
+    watchers.notify("b", "1");
+    watchers.notify("a", "2");
+    watchers.notify("a", "3");
+    REQUIRE(watchers.dispatch() == 2);
+    REQUIRE(changes.keys == std::vector<std::string>({"a", "b"}));
+    REQUIRE(changes.values == std::vector<std::string>({"3", "1"}));
+
+    // Changing back before dispatch still delivers the latest value
+    watchers.notify("a", "4");
+    watchers.notify("a", "3");
+    REQUIRE(watchers.dispatch() == 1);
+    REQUIRE(changes.values.back() == "3");
+  }
+
+  SECTION("Same key watched twice") {
+    Changes other;
+    watchers.add("a", record, &changes);
+    watchers.add("a", record, &other);
+    watchers.notify("a", "1");
+    REQUIRE(watchers.dispatch() == 2);
+    REQUIRE(changes.values.size() == 1);
+    REQUIRE(other.values.size() == 1);
+  }
+
+  SECTION("Limits") {
+    REQUIRE_FALSE(
+        watchers.add(std::string(CONFIG_WATCH_KEY_LENGTH + 1, 'k').c_str(),
+                     record, &changes));
+    REQUIRE_FALSE(watchers.add("a", NULL, NULL));
+    for (int i = 0; i < CONFIG_WATCH_ENTRIES; i++) {
+      REQUIRE(watchers.add(std::to_string(i).c_str(), record, &changes));
+    }
+    REQUIRE_FALSE(watchers.add("full", record, &changes));
+
+    // Long values are truncated in the callback but still compared in full
+    std::string value(CONFIG_WATCH_VALUE_LENGTH + 10, 'v');
+    REQUIRE(watchers.notify("0", value.c_str()));
+    watchers.dispatch();
+    REQUIRE(changes.values.back().size() == CONFIG_WATCH_VALUE_LENGTH);
+    value.back() = 'w';
+    REQUIRE(watchers.notify("0", value.c_str()));
+  }
+}
+
+static void reenter(const char *, const char *value, void *ctx) {
+  ConfigWatchers *watchers = reinterpret_cast<ConfigWatchers *>(ctx);
+  // Callbacks run without the lock, so may use the watchers themselves
+  watchers->notify("b", value);
+}
+
+TEST_CASE("Config Watch Dispatcher", "[config_watch]") {
+
+  SECTION("Callbacks may call back in") {
+    ConfigWatchers watchers;
+    Changes changes;
+    watchers.add("a", reenter, &watchers);
+    watchers.add("b", record, &changes);
+    watchers.notify("a", "1");
+    REQUIRE(watchers.dispatch() == 2);
+    REQUIRE(changes.values.back() == "1");
+  }
+
+  SECTION("Changes from another thread") {
+    ConfigWatchers watchers;
+    std::atomic<int> last(-1);
+    std::atomic<bool> done(false);
+    watchers.add("n", [](const char *, const char *value, void *ctx) {
+      reinterpret_cast<std::atomic<int> *>(ctx)->store(atoi(value));
+    }, &last);
+
+    std::thread dispatcher([&] {
+      while (!done) {
+        watchers.dispatch();
+        std::this_thread::yield();
+      }
+      watchers.dispatch();
+    });
+    for (int i = 0; i <= 10000; i++) {
+      watchers.notify("n", std::to_string(i).c_str());
+    }
+    done = true;
+    dispatcher.join();
+    REQUIRE(last == 10000);
+  }
+}
@@ -0,0 +1,144 @@
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+// Small buffers, so that tests fill the ring quickly
+#define OTA_PIPELINE_BUFFERS 3
+#define OTA_PIPELINE_BUFFER_SIZE 16
+
+#define CPP_STANDARD
+#include "../src/ota_pipeline.h"
+
+#include "host_client.h"
+#include "stand_in_server.h"
+
+struct Flash {
+  std::string data;
+  std::vector<size_t> writes;
+  std::thread::id thread;
+  std::atomic<bool> release;
+  std::atomic<int> fail_after;
+
+  Flash() : release(true), fail_after(-1) {}
+};
+
+static bool flash_writer(void *ctx, const uint8_t *data, size_t len) {
+  Flash *flash = reinterpret_cast<Flash *>(ctx);
+  while (!flash->release) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (flash->fail_after == (int)flash->writes.size()) {
+    return false;
+  }
+  flash->data.append((const char *)data, len);
+  flash->writes.push_back(len);
+  flash->thread = std::this_thread::get_id();
+  return true;
+}
+
+static std::string pattern(size_t len) {
+  std::string data;
+  for (size_t i = 0; i < len; i++) {
+    data += (char)('a' + i % 23);
+  }
+  return data;
+}
+
+static const WorkTaskConfig c_config = {4096, 1, WORK_NO_AFFINITY};
+
+TEST_CASE("OTA Pipeline", "[ota_pipeline]") {
+
+  Flash flash;
+  OtaPipeline pipeline;
+  REQUIRE(pipeline.begin(flash_writer, &flash, c_config));
+
+  SECTION("Data is written in order in whole buffers") {
+    std::string image = pattern(100);
+    // Odd sized pieces, as read from the connection
+    for (size_t i = 0; i < image.size(); i += 7) {
+      REQUIRE(pipeline.write((const uint8_t *)image.data() + i,
+                             std::min((size_t)7, image.size() - i)));
+    }
+    REQUIRE(pipeline.end());
+    REQUIRE(flash.data == image);
+    REQUIRE(flash.writes ==
+            std::vector<size_t>({16, 16, 16, 16, 16, 16, 4}));
+    REQUIRE(flash.thread != std::this_thread::get_id());
+    REQUIRE(pipeline.stats().bytes == 100);
+    REQUIRE(pipeline.stats().buffers == 7);
+  }
+
+  SECTION("A full ring holds back the download") {
+    flash.release = false;
+    std::string image = pattern(16 * 6);
+    std::atomic<bool> written(false);
+    std::thread download([&] {
+      pipeline.write((const uint8_t *)image.data(), image.size());
+      written = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    REQUIRE_FALSE(written);
+    flash.release = true;
+    download.join();
+    REQUIRE(pipeline.end());
+    REQUIRE(flash.data == image);
+    REQUIRE(pipeline.stats().stalls > 0);
+    REQUIRE(pipeline.stats().stall_ms >= 10);
+  }
+
+  SECTION("Writer failing stops the download") {
+    flash.fail_after = 1;
+    std::string image = pattern(16 * 10);
+    bool ok = true;
+    for (size_t i = 0; i < image.size() && ok; i += 16) {
+      ok = pipeline.write((const uint8_t *)image.data() + i, 16);
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    REQUIRE_FALSE(ok);
+    REQUIRE_FALSE(pipeline.end());
+    REQUIRE(pipeline.failed());
+    REQUIRE(flash.writes.size() == 1);
+  }
+
+  SECTION("Nothing written") {
+    REQUIRE(pipeline.end());
+    REQUIRE(flash.writes.empty());
+    REQUIRE(pipeline.end());
+  }
+
+  SECTION("Reused for another image") {
+    pipeline.write((const uint8_t *)"first", 5);
+    REQUIRE(pipeline.end());
+    flash.data.clear();
+    REQUIRE(pipeline.begin(flash_writer, &flash, c_config));
+    pipeline.write((const uint8_t *)"second", 6);
+    REQUIRE(pipeline.end());
+    REQUIRE(flash.data == "second");
+    REQUIRE(pipeline.stats().bytes == 6);
+  }
+}
+
+TEST_CASE("OTA Pipeline download", "[ota_pipeline]") {
+
+  std::string image = pattern(5000);
+  StandInServer server([&image](const StandInRequest &) {
+    return stand_in_response(200, image);
+  });
+  HostClient client;
+  SimpleHTTPConnection<HostClient> http;
+  http.begin(&client, server.url().c_str());
+
+  Flash flash;
+  OtaPipeline pipeline;
+  REQUIRE(pipeline.begin(flash_writer, &flash, c_config));
+  REQUIRE(http.request("GET", "/blob/", NULL, 0, OtaPipeline::sink,
+                       &pipeline) == 200);
+  REQUIRE(http.complete());
+  REQUIRE(pipeline.end());
+  REQUIRE(flash.data == image);
+}
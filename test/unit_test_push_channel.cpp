@@ -0,0 +1,198 @@
+#include <string>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#define CPP_STANDARD
+#include "../src/push_channel.h"
+
+#include "host_client.h"
+#include "stand_in_server.h"
+
+struct Received {
+  std::vector<PushEvent> events;
+  std::vector<std::string> data;
+};
+
+static void record(void *ctx, PushEvent event, const char *data) {
+  Received *received = reinterpret_cast<Received *>(ctx);
+  received->events.push_back(event);
+  received->data.push_back(data);
+}
+
+// Poll until the condition holds, false on timeout
+template <typename F>
+static bool poll_until(PushChannel<HostClient> &channel, F condition,
+                       uint32_t timeout_ms = 2000) {
+  uint32_t start = simple_http_millis();
+  while (!condition()) {
+    if (simple_http_millis() - start > timeout_ms) {
+      return false;
+    }
+    channel.poll();
+    simple_http_wait();
+  }
+  return true;
+}
+
+static std::string event_stream(const StandInRequest &request) {
+  if (request.path != "/sub/?package=p") {
+    return stand_in_response(404, "");
+  }
+  return "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n\r\n"
+         ": welcome\n\n";
+}
+
+static std::string chunk(const std::string &data) {
+  char size[16];
+  snprintf(size, sizeof(size), "%zx\r\n", data.size());
+  return size + data + "\r\n";
+}
+
+TEST_CASE("Push Events", "[push_channel]") {
+
+  StandInServer server(event_stream);
+  HostClient client;
+  PushChannel<HostClient> channel;
+  Received received;
+  REQUIRE(channel.begin(&client, server.url().c_str(), "/sub/?package=p",
+                        record, &received));
+
+  REQUIRE(poll_until(channel, [&] { return channel.streaming(); }));
+  REQUIRE(channel.stats().connects == 1);
+
+  server.send_all("event: config\ndata: mqtt_server\n\n"
+                  "event: update\r\ndata\r\n\r\n"
+                  ": keep-alive\n\n"
+                  "event: unknown\ndata: x\n\n"
+                  "event:config\ndata:a\ndata:b\n\n");
+  REQUIRE(poll_until(channel, [&] { return received.events.size() == 3; }));
+
+  REQUIRE(received.events[0] == PUSH_CONFIG);
+  REQUIRE(received.data[0] == "mqtt_server");
+  REQUIRE(received.events[1] == PUSH_UPDATE);
+  REQUIRE(received.data[1] == "");
+  REQUIRE(received.events[2] == PUSH_CONFIG);
+  REQUIRE(received.data[2] == "a\nb");
+  REQUIRE(channel.stats().events == 3);
+
+  // Events split across reads
+  std::string event = "event: config\ndata: split\n\n";
+  for (size_t i = 0; i < event.size(); i++) {
+    server.send_all(event.substr(i, 1));
+    channel.poll();
+  }
+  REQUIRE(poll_until(channel, [&] { return received.events.size() == 4; }));
+  REQUIRE(received.data[3] == "split");
+}
+
+TEST_CASE("Chunked Push Events", "[push_channel]") {
+
+  StandInServer server([](const StandInRequest &) {
+    return std::string("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+                       "Transfer-Encoding: chunked\r\n\r\n") +
+           chunk(": hi\n\n");
+  });
+  HostClient client;
+  PushChannel<HostClient> channel;
+  Received received;
+  channel.begin(&client, server.url().c_str(), "/sub/", record, &received);
+  REQUIRE(poll_until(channel, [&] { return channel.streaming(); }));
+
+  server.send_all(chunk("event: con") + chunk("fig\ndata: key\n") +
+                  chunk("\n"));
+  REQUIRE(poll_until(channel, [&] { return received.events.size() == 1; }));
+  REQUIRE(received.data[0] == "key");
+
+  // End of the chunked body ends the stream
+  server.send_all("0\r\n\r\n");
+  REQUIRE(poll_until(channel, [&] { return !channel.streaming(); }));
+  REQUIRE(channel.stats().drops == 1);
+}
+
+TEST_CASE("Push Reconnect", "[push_channel]") {
+
+  StandInServer server(event_stream);
+  HostClient client;
+  PushChannel<HostClient> channel;
+  Received received;
+  channel.set_retry(10, 40);
+  channel.begin(&client, server.url().c_str(), "/sub/?package=p", record,
+                &received);
+
+  SECTION("Dropped stream is reopened") {
+    REQUIRE(poll_until(channel, [&] { return channel.streaming(); }));
+    server.drop_connections();
+    REQUIRE(poll_until(channel, [&] { return !channel.streaming(); }));
+    REQUIRE(channel.stats().drops == 1);
+    REQUIRE(channel.state() == PUSH_WAITING);
+    REQUIRE(poll_until(channel, [&] { return channel.streaming(); }));
+    REQUIRE(channel.stats().connects == 2);
+    REQUIRE(server.connections() == 2);
+
+    server.send_all("event: update\ndata:\n\n");
+    REQUIRE(poll_until(channel, [&] { return received.events.size() == 1; }));
+  }
+
+  SECTION("Idle stream is reopened") {
+    channel.set_idle_timeout(50);
+    REQUIRE(poll_until(channel, [&] { return channel.streaming(); }));
+    REQUIRE(poll_until(channel, [&] { return channel.stats().drops == 1; }));
+    REQUIRE(poll_until(channel, [&] { return channel.stats().connects == 2; }));
+  }
+
+  SECTION("Server retry field") {
+    channel.set_retry(10, 1000);
+    REQUIRE(poll_until(channel, [&] { return channel.streaming(); }));
+    server.send_all("retry: 25\n\n");
+    REQUIRE(poll_until(channel, [&] { return false; }, 20) == false);
+    server.drop_connections();
+    REQUIRE(poll_until(channel, [&] { return !channel.streaming(); }));
+    REQUIRE(channel.retry_delay() == 50);
+  }
+}
+
+TEST_CASE("Push Fallback", "[push_channel]") {
+
+  HostClient client;
+  PushChannel<HostClient> channel;
+  Received received;
+  channel.set_retry(10, 40);
+
+  SECTION("Server without the endpoint") {
+    StandInServer server(event_stream);
+    channel.begin(&client, server.url().c_str(), "/other/", record,
+                  &received);
+    REQUIRE(poll_until(channel,
+                       [&] { return channel.state() == PUSH_UNSUPPORTED; }));
+    REQUIRE(poll_until(channel, [&] { return false; }, 100) == false);
+    REQUIRE(server.connections() == 1);
+  }
+
+  SECTION("Server down, backoff grows to the maximum") {
+    uint16_t port;
+    {
+      StandInServer server(event_stream);
+      port = server.port();
+    }
+    std::string url = "http://127.0.0.1:" + std::to_string(port);
+    channel.begin(&client, url.c_str(), "/sub/?package=p", record, &received);
+    REQUIRE(channel.retry_delay() == 10);
+    channel.poll();
+    REQUIRE(channel.stats().failures == 1);
+    REQUIRE(channel.retry_delay() == 20);
+    REQUIRE(poll_until(channel, [&] { return channel.stats().failures == 3; }));
+    REQUIRE(channel.retry_delay() == 40);
+    REQUIRE(channel.state() == PUSH_WAITING);
+  }
+
+  SECTION("Server error is retried") {
+    StandInServer server([](const StandInRequest &) {
+      return stand_in_response(503, "busy");
+    });
+    channel.begin(&client, server.url().c_str(), "/sub/", record, &received);
+    REQUIRE(poll_until(channel, [&] { return channel.stats().failures == 2; }));
+    REQUIRE(server.connections() >= 2);
+  }
+}
@@ -0,0 +1,114 @@
+#include <string>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#define CPP_STANDARD
+#include "../src/request_builder.h"
+
+TEST_CASE("Request Buffer", "[request_builder]") {
+
+  SECTION("Percent-encoding") {
+    RequestPath path;
+    path.append_encoded("light sensor/1 & 2?=50%~._-");
+    REQUIRE(std::string(path.c_str()) ==
+            "light%20sensor%2F1%20%26%202%3F%3D50%25~._-");
+    REQUIRE(path.ok());
+  }
+
+  SECTION("Unreserved characters are unchanged") {
+    RequestPath path;
+    const char *unreserved = "abcxyzABCXYZ0189-._~";
+    path.append_encoded(unreserved);
+    REQUIRE(std::string(path.c_str()) == unreserved);
+  }
+
+  SECTION("Bytes outside ASCII") {
+    RequestPath path;
+    path.append_encoded("\xC3\xA9\x01");
+    REQUIRE(std::string(path.c_str()) == "%C3%A9%01");
+  }
+
+  SECTION("Full buffer") {
+    RequestBuffer<8> buffer;
+    buffer.append("abcd").append_encoded("e ");
+    REQUIRE(buffer.ok());
+    REQUIRE(std::string(buffer.c_str()) == "abcde%20");
+    buffer.append("g");
+    REQUIRE_FALSE(buffer.ok());
+    REQUIRE(std::string(buffer.c_str()) == "abcde%20");
+  }
+
+  SECTION("No partial escape is left") {
+    RequestBuffer<8> buffer;
+    buffer.append("abcde").append_encoded("ab ");
+    REQUIRE_FALSE(buffer.ok());
+    REQUIRE(std::string(buffer.c_str()) == "abcde");
+    buffer.clear();
+    REQUIRE(buffer.ok());
+    REQUIRE(buffer.length() == 0);
+  }
+}
+
+TEST_CASE("Request Builder", "[request_builder]") {
+
+  RequestBuilder builder;
+  REQUIRE(builder.begin("my package", "AA:BB:CC:DD:EE:FF", "light sensor",
+                        "esp32"));
+  REQUIRE(std::string(builder.node_id()) == "AA:BB:CC:DD:EE:FF");
+
+  const std::string query = "?package=my%20package&node_id=AA%3ABB%3ACC%3ADD"
+                            "%3AEE%3AFF";
+  RequestPath path;
+
+  SECTION("Check for update") {
+    builder.check_for_update(path, "1.2.0 beta");
+    REQUIRE(path.ok());
+    REQUIRE(std::string(path.c_str()) ==
+            "/check_for_update/" + query + "&version=1.2.0%20beta");
+  }
+
+  SECTION("Register") {
+    builder.register_node(path, "1.2.0");
+    REQUIRE(std::string(path.c_str()) ==
+            "/register_node/" + query +
+                "&version=1.2.0&description=light%20sensor&platform=esp32");
+  }
+
+  SECTION("Config") {
+    builder.config(path, "a key");
+    REQUIRE(std::string(path.c_str()) == "/config/" + query + "&key=a%20key");
+  }
+
+  SECTION("Bulk config") {
+    const char *keys[] = {"a", "b,c"};
+    builder.configs(path, keys, 2);
+    REQUIRE(std::string(path.c_str()) ==
+            "/configs/" + query + "&keys=a,b%2Cc");
+    path.clear();
+    builder.configs(path, keys, 0);
+    REQUIRE(std::string(path.c_str()) == "/configs/" + query);
+  }
+
+  SECTION("Blob") {
+    builder.blob(path, "abc");
+    REQUIRE(std::string(path.c_str()) == "/blob/?package=my%20package&blob=abc");
+  }
+
+  SECTION("Appends to a prefix") {
+    path.append("http://host");
+    builder.subscribe(path);
+    REQUIRE(std::string(path.c_str()) == "http://host/subscribe/" + query);
+  }
+
+  SECTION("Parts too long") {
+    RequestBuilder other;
+    REQUIRE_FALSE(other.begin("p", "n", std::string(200, 'd').c_str(), "x"));
+    REQUIRE_FALSE(other.begin(std::string(200, 'p').c_str(), "n", "d", "x"));
+  }
+
+  SECTION("Path too long") {
+    builder.config(path, std::string(REQUEST_PATH_LENGTH, 'k').c_str());
+    REQUIRE_FALSE(path.ok());
+  }
+}
@@ -0,0 +1,531 @@
+#include <chrono>
+#include <string>
+#include <thread>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#define CPP_STANDARD
+#include "../src/simple_http.h"
+
+#include "host_client.h"
+#include "stand_in_server.h"
+
+static bool string_sink(void *ctx, const uint8_t *data, size_t len) {
+  reinterpret_cast<std::string *>(ctx)->append((const char *)data, len);
+  return true;
+}
+
+static std::string echo_handler(const StandInRequest &request) {
+  return stand_in_response(200, request.method + " " + request.path + " " +
+                                    request.body);
+}
+
+TEST_CASE("URL Parsing", "[simple_http]") {
+
+  SimpleHTTPUrl url;
+
+  REQUIRE(simple_http_parse_url("http://192.168.0.42:8080", url));
+  REQUIRE(std::string(url.host) == "192.168.0.42");
+  REQUIRE(url.port == 8080);
+  REQUIRE(std::string(url.path) == "");
+  REQUIRE(url.secure == false);
+
+  REQUIRE(simple_http_parse_url("https://confrm.io/api/", url));
+  REQUIRE(std::string(url.host) == "confrm.io");
+  REQUIRE(url.port == 443);
+  REQUIRE(std::string(url.path) == "/api");
+  REQUIRE(url.secure == true);
+
+  REQUIRE(simple_http_parse_url("http://host", url));
+  REQUIRE(url.port == 80);
+
+  REQUIRE_FALSE(simple_http_parse_url("ftp://host", url));
+  REQUIRE_FALSE(simple_http_parse_url("http://", url));
+  REQUIRE_FALSE(simple_http_parse_url("http://host:port", url));
+  REQUIRE_FALSE(simple_http_parse_url("http://host:70000", url));
+}
+
+TEST_CASE("Keep-alive", "[simple_http]") {
+
+  StandInServer server(echo_handler);
+  HostClient client;
+  SimpleHTTPConnection<HostClient> http;
+  REQUIRE(http.begin(&client, server.url("/root").c_str()));
+
+  SECTION("Requests share one connection") {
+    for (int i = 0; i < 5; i++) {
+      std::string body;
+      REQUIRE(http.request("GET", "/time/", NULL, 0, string_sink, &body) ==
+              200);
+      REQUIRE(body == "GET /root/time/ ");
+      REQUIRE(http.complete());
+    }
+    std::string body;
+    const char *payload = "{\"a\":1}";
+    REQUIRE(http.request("PUT", "/register/?x=1", (const uint8_t *)payload,
+                         strlen(payload), string_sink, &body) == 200);
+    REQUIRE(body == "PUT /root/register/?x=1 {\"a\":1}");
+
+    REQUIRE(server.connections() == 1);
+    REQUIRE(server.requests() == 6);
+    REQUIRE(http.stats().requests == 6);
+    REQUIRE(http.stats().connects == 1);
+    REQUIRE(http.stats().reuses == 5);
+    REQUIRE(http.stats().reconnects == 0);
+    REQUIRE(http.stats().failures == 0);
+  }
+
+  SECTION("Server closing idle connection is transparent") {
+    std::string body;
+    REQUIRE(http.request("GET", "/a", NULL, 0, string_sink, &body) == 200);
+    server.drop_connections();
+    body.clear();
+    REQUIRE(http.request("GET", "/b", NULL, 0, string_sink, &body) == 200);
+    REQUIRE(body == "GET /root/b ");
+    body.clear();
+    REQUIRE(http.request("GET", "/c", NULL, 0, string_sink, &body) == 200);
+
+    REQUIRE(server.connections() == 2);
+    REQUIRE(http.stats().connects == 2);
+    REQUIRE(http.stats().reconnects == 1);
+    REQUIRE(http.stats().reuses == 1);
+    REQUIRE(http.stats().failures == 0);
+  }
+
+  SECTION("Explicit stop") {
+    REQUIRE(http.request("GET", "/a", NULL, 0, NULL, NULL) == 200);
+    http.stop();
+    REQUIRE(http.request("GET", "/a", NULL, 0, NULL, NULL) == 200);
+    REQUIRE(server.connections() == 2);
+    REQUIRE(http.stats().reconnects == 0);
+  }
+}
+
+TEST_CASE("Connection close", "[simple_http]") {
+
+  SECTION("Connection: close header") {
+    StandInServer server([](const StandInRequest &) {
+      return stand_in_response(200, "bye", "Connection: close\r\n");
+    });
+    HostClient client;
+    SimpleHTTPConnection<HostClient> http;
+    http.begin(&client, server.url().c_str());
+    for (int i = 0; i < 3; i++) {
+      std::string body;
+      REQUIRE(http.request("GET", "/", NULL, 0, string_sink, &body) == 200);
+      REQUIRE(body == "bye");
+    }
+    REQUIRE(server.connections() == 3);
+    REQUIRE(http.stats().connects == 3);
+    REQUIRE(http.stats().reuses == 0);
+    REQUIRE(http.stats().reconnects == 0);
+  }
+
+  SECTION("Body without Content-Length is read until close") {
+    StandInServer server([](const StandInRequest &) {
+      return std::string("HTTP/1.0 200 OK\r\nConnection: close\r\n\r\nall");
+    });
+    HostClient client;
+    SimpleHTTPConnection<HostClient> http;
+    http.begin(&client, server.url().c_str());
+    std::string body;
+    REQUIRE(http.request("GET", "/", NULL, 0, string_sink, &body) == 200);
+    REQUIRE(body == "all");
+    REQUIRE(http.complete());
+    REQUIRE(http.content_length() == -1);
+  }
+}
+
+TEST_CASE("Responses", "[simple_http]") {
+
+  StandInServer server([](const StandInRequest &request) {
+    if (request.path == "/missing") {
+      return stand_in_response(404, "{\"detail\":\"Not Found\"}");
+    }
+    if (request.path == "/empty") {
+      return stand_in_response(204, "");
+    }
+    if (request.path == "/gzip") {
+      return stand_in_response(200, "\x1f\x8b", "Content-Encoding: gzip\r\n");
+    }
+    return stand_in_response(200, std::string(5000, 'x'),
+                             "X-Long-Header: " + std::string(300, 'y') +
+                                 "\r\n");
+  });
+  HostClient client;
+  SimpleHTTPConnection<HostClient> http;
+  http.begin(&client, server.url().c_str());
+
+  SECTION("Bodies larger than the buffer and long headers") {
+    std::string body;
+    REQUIRE(http.request("GET", "/big", NULL, 0, string_sink, &body) == 200);
+    REQUIRE(body == std::string(5000, 'x'));
+    REQUIRE(http.content_length() == 5000);
+  }
+
+  SECTION("Error bodies are not passed to the sink") {
+    std::string body;
+    REQUIRE(http.request("GET", "/missing", NULL, 0, string_sink, &body) ==
+            404);
+    REQUIRE(body.empty());
+    REQUIRE(http.request("GET", "/empty", NULL, 0, string_sink, &body) == 204);
+    REQUIRE(http.request("GET", "/big", NULL, 0, string_sink, &body) == 200);
+    REQUIRE(body.size() == 5000);
+    REQUIRE(server.connections() == 1);
+  }
+
+  SECTION("Content-Encoding") {
+    std::string body;
+    REQUIRE(http.request("GET", "/gzip", NULL, 0, string_sink, &body) == 200);
+    REQUIRE(std::string(http.content_encoding()) == "gzip");
+    REQUIRE(body == "\x1f\x8b");
+    REQUIRE(http.request("GET", "/big", NULL, 0, NULL, NULL) == 200);
+    REQUIRE(std::string(http.content_encoding()) == "");
+  }
+
+  SECTION("Sink stopping closes the connection") {
+    REQUIRE(http.request("GET", "/big", NULL, 0,
+                         [](void *, const uint8_t *, size_t) { return false; },
+                         NULL) == 200);
+    REQUIRE_FALSE(http.complete());
+    REQUIRE(http.request("GET", "/big", NULL, 0, NULL, NULL) == 200);
+    REQUIRE(http.complete());
+    REQUIRE(server.connections() == 2);
+  }
+}
+
+TEST_CASE("Failures", "[simple_http]") {
+
+  HostClient client;
+  SimpleHTTPConnection<HostClient> http;
+  http.set_timeout(100);
+
+  SECTION("Nothing listening") {
+    uint16_t port;
+    {
+      StandInServer server(echo_handler);
+      port = server.port();
+    }
+    std::string url = "http://127.0.0.1:" + std::to_string(port);
+    http.begin(&client, url.c_str());
+    REQUIRE(http.request("GET", "/", NULL, 0, NULL, NULL) ==
+            SIMPLE_HTTP_ERROR_CONNECT);
+    REQUIRE(http.stats().failures == 1);
+  }
+
+  SECTION("Server never answers") {
+    StandInServer server([](const StandInRequest &) { return std::string(); });
+    http.begin(&client, server.url().c_str());
+    REQUIRE(http.request("GET", "/", NULL, 0, NULL, NULL) ==
+            SIMPLE_HTTP_ERROR_TIMEOUT);
+  }
+
+  SECTION("Not HTTP") {
+    StandInServer server(
+        [](const StandInRequest &) { return std::string("hello\r\n"); });
+    http.begin(&client, server.url().c_str());
+    REQUIRE(http.request("GET", "/", NULL, 0, NULL, NULL) ==
+            SIMPLE_HTTP_ERROR_PROTOCOL);
+  }
+}
+
+TEST_CASE("Conditional GET", "[simple_http]") {
+
+  StandInServer server([](const StandInRequest &request) {
+    if (request.header("If-None-Match") == "\"v1\"") {
+      return std::string("HTTP/1.1 304 Not Modified\r\nETag: \"v1\"\r\n\r\n");
+    }
+    return stand_in_response(200, "{\"value\":\"x\"}",
+                             "ETag: \"v1\"\r\n"
+                             "Cache-Control: public, max-age=30\r\n");
+  });
+  HostClient client;
+  SimpleHTTPConnection<HostClient> http;
+  http.begin(&client, server.url().c_str());
+
+  std::string body;
+  REQUIRE(http.request("GET", "/config/", NULL, 0, string_sink, &body) ==
+          200);
+  REQUIRE(std::string(http.etag()) == "\"v1\"");
+  REQUIRE(http.max_age() == 30);
+
+  body.clear();
+  REQUIRE(http.request("GET", "/config/", NULL, 0, string_sink, &body,
+                       "If-None-Match: \"v1\"\r\n") == 304);
+  REQUIRE(body.empty());
+  REQUIRE(http.complete());
+  REQUIRE(http.max_age() == -1);
+
+  // 304 has no body, so the connection is still usable
+  REQUIRE(http.request("GET", "/config/", NULL, 0, NULL, NULL) == 200);
+  REQUIRE(server.connections() == 1);
+}
+
+static std::string decode_chunked(const std::string &encoded, size_t split,
+                                  bool &done, bool &ok) {
+  SimpleHTTPChunkedDecoder decoder;
+  std::string body;
+  ok = decoder.feed((const uint8_t *)encoded.data(), split, string_sink,
+                    &body) &&
+       decoder.feed((const uint8_t *)encoded.data() + split,
+                    encoded.size() - split, string_sink, &body);
+  done = decoder.done();
+  return body;
+}
+
+// Poll until a result or data is read, as a cooperative loop would
+static int poll_once(SimpleHTTPConnection<HostClient> &http, std::string &body) {
+  for (int i = 0; i < 1000; i++) {
+    int code = http.poll(string_sink, &body);
+    if (code != SIMPLE_HTTP_PENDING || http.progressed()) {
+      return code;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return SIMPLE_HTTP_ERROR_TIMEOUT;
+}
+
+TEST_CASE("Incremental requests", "[simple_http]") {
+
+  HostClient client;
+  SimpleHTTPConnection<HostClient> http;
+
+  SECTION("Response arriving in pieces") {
+    // Nothing is sent until the test sends it
+    StandInServer server([](const StandInRequest &) { return std::string(); });
+    http.begin(&client, server.url().c_str());
+
+    REQUIRE(http.start("GET", "/", NULL, 0) == SIMPLE_HTTP_PENDING);
+    REQUIRE(http.busy());
+
+    std::string body;
+    REQUIRE(http.poll(string_sink, &body) == SIMPLE_HTTP_PENDING);
+    REQUIRE_FALSE(http.progressed());
+    while (server.requests() == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    server.send_all("HTTP/1.1 200 OK\r\nContent-Le");
+    REQUIRE(poll_once(http, body) == SIMPLE_HTTP_PENDING);
+    server.send_all("ngth: 10\r\n\r\n01234");
+    REQUIRE(poll_once(http, body) == SIMPLE_HTTP_PENDING);
+    REQUIRE(body == "01234");
+    REQUIRE(http.content_length() == 10);
+    server.send_all("56789");
+    REQUIRE(poll_once(http, body) == 200);
+    REQUIRE(body == "0123456789");
+    REQUIRE(http.complete());
+    REQUIRE_FALSE(http.busy());
+  }
+
+  SECTION("Each poll reads at most one buffer") {
+    StandInServer server([](const StandInRequest &) {
+      return stand_in_response(200, std::string(4 * SIMPLE_HTTP_BUFFER_SIZE,
+                                                'x'));
+    });
+    http.begin(&client, server.url().c_str());
+    REQUIRE(http.start("GET", "/", NULL, 0) == SIMPLE_HTTP_PENDING);
+    std::string body;
+    int polls = 0;
+    int code;
+    while ((code = poll_once(http, body)) == SIMPLE_HTTP_PENDING) {
+      polls++;
+    }
+    REQUIRE(code == 200);
+    REQUIRE(body.size() == 4 * SIMPLE_HTTP_BUFFER_SIZE);
+    REQUIRE(polls >= 4);
+  }
+
+  SECTION("Keep-alive and retry are as for request") {
+    StandInServer server(echo_handler);
+    http.begin(&client, server.url().c_str());
+    for (int i = 0; i < 3; i++) {
+      if (i == 2) {
+        server.drop_connections();
+      }
+      std::string body;
+      REQUIRE(http.start("PUT", "/a", (const uint8_t *)"b", 1) ==
+              SIMPLE_HTTP_PENDING);
+      int code;
+      while ((code = poll_once(http, body)) == SIMPLE_HTTP_PENDING) {
+      }
+      REQUIRE(code == 200);
+      REQUIRE(body == "PUT /a b");
+    }
+    REQUIRE(server.connections() == 2);
+    REQUIRE(http.stats().reconnects == 1);
+    REQUIRE(http.stats().failures == 0);
+  }
+
+  SECTION("Starting another request abandons the one in progress") {
+    StandInServer server([](const StandInRequest &request) {
+      if (request.path == "/slow") {
+        return std::string();
+      }
+      return echo_handler(request);
+    });
+    http.begin(&client, server.url().c_str());
+    REQUIRE(http.start("GET", "/slow", NULL, 0) == SIMPLE_HTTP_PENDING);
+    std::string body;
+    REQUIRE(http.request("GET", "/fast", NULL, 0, string_sink, &body) == 200);
+    REQUIRE(body == "GET /fast ");
+    REQUIRE(http.poll(string_sink, &body) == SIMPLE_HTTP_ERROR_NO_RESPONSE);
+    REQUIRE(server.connections() == 2);
+  }
+}
+
+TEST_CASE("Chunked Decoding", "[simple_http]") {
+
+  bool done, ok;
+
+  SECTION("Split at every offset") {
+    std::string encoded = "5\r\nHello\r\n1;ext=1\r\n \r\n"
+                          "0000C\r\nchunked body\r\n0\r\nTrailer: x\r\n\r\n";
+    for (size_t split = 0; split <= encoded.size(); split++) {
+      REQUIRE(decode_chunked(encoded, split, done, ok) ==
+              "Hello chunked body");
+      REQUIRE(ok);
+      REQUIRE(done);
+    }
+  }
+
+  SECTION("Bare line feeds") {
+    REQUIRE(decode_chunked("3\nabc\n0\n\n", 0, done, ok) == "abc");
+    REQUIRE(done);
+  }
+
+  SECTION("Stops at end of body") {
+    std::string encoded = "2\r\nab\r\n0\r\n\r\nHTTP/1.1 200";
+    SimpleHTTPChunkedDecoder decoder;
+    size_t used;
+    REQUIRE(decoder.feed((const uint8_t *)encoded.data(), encoded.size(), NULL,
+                         NULL, &used));
+    REQUIRE(decoder.done());
+    REQUIRE(used == encoded.size() - 12);
+  }
+
+  SECTION("Incomplete") {
+    REQUIRE(decode_chunked("5\r\nHel", 2, done, ok) == "Hel");
+    REQUIRE(ok);
+    REQUIRE_FALSE(done);
+  }
+
+  SECTION("Malformed") {
+    decode_chunked("x\r\n", 0, done, ok);
+    REQUIRE_FALSE(ok);
+    decode_chunked("2\r\nabc\r\n", 0, done, ok);
+    REQUIRE_FALSE(ok);
+    decode_chunked("ffffffffffffffffff\r\n", 0, done, ok);
+    REQUIRE_FALSE(ok);
+  }
+}
+
+TEST_CASE("Chunked responses", "[simple_http]") {
+
+  StandInServer server([](const StandInRequest &request) {
+    std::string head = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+    if (request.path == "/bad") {
+      return head + "zz\r\n";
+    }
+    std::string body;
+    for (int i = 0; i < 20; i++) {
+      body += "20\r\n" + std::string(32, (char)('a' + i)) + "\r\n";
+    }
+    return head + body + "0\r\n\r\n";
+  });
+  HostClient client;
+  SimpleHTTPConnection<HostClient> http;
+  http.begin(&client, server.url().c_str());
+
+  SECTION("Decoded and the connection kept") {
+    for (int i = 0; i < 3; i++) {
+      std::string body;
+      REQUIRE(http.request("GET", "/", NULL, 0, string_sink, &body) == 200);
+      REQUIRE(http.complete());
+      REQUIRE(http.chunked());
+      REQUIRE(http.content_length() == -1);
+      REQUIRE(body.size() == 20 * 32);
+      REQUIRE(body.substr(0, 32) == std::string(32, 'a'));
+      REQUIRE(body.substr(19 * 32) == std::string(32, 't'));
+    }
+    REQUIRE(server.connections() == 1);
+  }
+
+  SECTION("Malformed chunks close the connection") {
+    http.set_timeout(100);
+    REQUIRE(http.request("GET", "/bad", NULL, 0, NULL, NULL) == 200);
+    REQUIRE_FALSE(http.complete());
+    REQUIRE(http.request("GET", "/", NULL, 0, NULL, NULL) == 200);
+    REQUIRE(http.complete());
+    REQUIRE(server.connections() == 2);
+  }
+}
+
+TEST_CASE("Request time limit", "[simple_http]") {
+
+  // Sends the head then a byte of the body every few milliseconds, so the
+  // timeout between pieces never passes
+  StandInServer server([](const StandInRequest &) { return std::string(); });
+  HostClient client;
+  SimpleHTTPConnection<HostClient> http;
+  http.begin(&client, server.url().c_str());
+  http.set_timeout(1000);
+
+  REQUIRE(http.start("GET", "/", NULL, 0, NULL, 50) == SIMPLE_HTTP_PENDING);
+  while (server.requests() == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  server.send_all("HTTP/1.1 200 OK\r\nContent-Length: 1000\r\n\r\n");
+
+  auto start = std::chrono::steady_clock::now();
+  std::string body;
+  int code = SIMPLE_HTTP_PENDING;
+  while (code == SIMPLE_HTTP_PENDING) {
+    server.send_all("x");
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    code = http.poll(string_sink, &body);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  REQUIRE(code == 200);
+  REQUIRE_FALSE(http.complete());
+  REQUIRE_FALSE(body.empty());
+  REQUIRE(elapsed < std::chrono::milliseconds(500));
+
+  // A limit applies only to its request
+  server.drop_connections();
+  REQUIRE(http.start("GET", "/", NULL, 0) == SIMPLE_HTTP_PENDING);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  REQUIRE(http.poll(NULL, NULL) == SIMPLE_HTTP_PENDING);
+  http.stop();
+}
+
+TEST_CASE("Response buffer", "[simple_http]") {
+
+  StandInServer server([](const StandInRequest &request) {
+    return stand_in_response(200, request.path == "/long"
+                                      ? std::string(100, 'x')
+                                      : std::string("{\"a\":1}"));
+  });
+  HostClient client;
+  SimpleHTTPConnection<HostClient> http;
+  http.begin(&client, server.url().c_str());
+
+  SimpleHTTPResponseBuffer<16> buffer;
+  REQUIRE(http.request("GET", "/", NULL, 0, buffer.sink, &buffer) == 200);
+  REQUIRE(std::string(buffer.c_str()) == "{\"a\":1}");
+  REQUIRE_FALSE(buffer.truncated());
+
+  buffer.clear();
+  REQUIRE(http.request("GET", "/long", NULL, 0, buffer.sink, &buffer) == 200);
+  REQUIRE(http.complete());
+  REQUIRE(buffer.truncated());
+  REQUIRE(buffer.length() == 16);
+  REQUIRE(std::string(buffer.c_str()) == std::string(16, 'x'));
+
+  // The rest was drained, so the connection is reused
+  buffer.clear();
+  REQUIRE(http.request("GET", "/", NULL, 0, buffer.sink, &buffer) == 200);
+  REQUIRE_FALSE(buffer.truncated());
+  REQUIRE(server.connections() == 1);
+}
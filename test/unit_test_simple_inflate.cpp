@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#define CPP_STANDARD
+#include "../src/simple_inflate.h"
+
+static bool string_sink(void *ctx, const uint8_t *data, size_t len) {
+  reinterpret_cast<std::string *>(ctx)->append((const char *)data, len);
+  return true;
+}
+
+// Compress with zlib, window_bits as for deflateInit2: 8-15 for zlib, +16
+// for gzip, negative for raw deflate
+static std::string compress(const std::string &data, int window_bits,
+                            int level = Z_DEFAULT_COMPRESSION,
+                            int strategy = Z_DEFAULT_STRATEGY) {
+  z_stream stream = {};
+  deflateInit2(&stream, level, Z_DEFLATED, window_bits, 9, strategy);
+  std::string out(deflateBound(&stream, data.size()) + 64, '\0');
+  stream.next_in = (Bytef *)data.data();
+  stream.avail_in = data.size();
+  stream.next_out = (Bytef *)&out[0];
+  stream.avail_out = out.size();
+  deflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+// Image-like test data: runs, repeats from far back and noise
+static std::string sample(size_t len, unsigned seed = 1) {
+  srand(seed);
+  std::string data;
+  while (data.size() < len) {
+    switch (rand() % 4) {
+    case 0:
+      data.append(rand() % 200, (char)(rand() % 256));
+      break;
+    case 1:
+      if (data.size() > 1000) {
+        size_t from = data.size() - 1 - rand() % std::min(data.size(),
+                                                          (size_t)30000);
+        data += data.substr(from, rand() % 300);
+      }
+      break;
+    default:
+      for (int i = rand() % 100; i > 0; i--) {
+        data += (char)(rand() % 256);
+      }
+      break;
+    }
+  }
+  data.resize(len);
+  return data;
+}
+
+// Feed in pieces of the given size
+static std::string inflate_pieces(const std::string &compressed,
+                                  SimpleInflateFormat format, size_t piece,
+                                  bool &ok, bool &done) {
+  SimpleInflate inflater(format);
+  std::string out;
+  ok = true;
+  for (size_t i = 0; i < compressed.size() && ok; i += piece) {
+    ok = inflater.feed((const uint8_t *)compressed.data() + i,
+                       std::min(piece, compressed.size() - i), string_sink,
+                       &out);
+  }
+  done = inflater.done();
+  return out;
+}
+
+TEST_CASE("Inflate", "[simple_inflate]") {
+
+  std::string data = sample(200000);
+  bool ok, done;
+
+  SECTION("Formats") {
+    REQUIRE(inflate_pieces(compress(data, 15 + 16), SIMPLE_INFLATE_GZIP,
+                           4096, ok, done) == data);
+    REQUIRE(done);
+    REQUIRE(inflate_pieces(compress(data, 15), SIMPLE_INFLATE_ZLIB, 4096, ok,
+                           done) == data);
+    REQUIRE(done);
+    REQUIRE(inflate_pieces(compress(data, -15), SIMPLE_INFLATE_RAW, 4096, ok,
+                           done) == data);
+    REQUIRE(done);
+  }
+
+  SECTION("Block types") {
+    // Stored, fixed Huffman codes and best compression
+    REQUIRE(inflate_pieces(compress(data, 15, 0), SIMPLE_INFLATE_ZLIB, 1000,
+                           ok, done) == data);
+    REQUIRE(done);
+    REQUIRE(inflate_pieces(compress(data, 15, 6, Z_FIXED),
+                           SIMPLE_INFLATE_ZLIB, 1000, ok, done) == data);
+    REQUIRE(done);
+    REQUIRE(inflate_pieces(compress(data, 15, 9, Z_RLE), SIMPLE_INFLATE_ZLIB,
+                           1000, ok, done) == data);
+    REQUIRE(done);
+  }
+
+  SECTION("Split at every offset") {
+    std::string small = sample(3000, 2);
+    std::string compressed = compress(small, 15 + 16);
+    for (size_t split = 0; split <= compressed.size(); split++) {
+      SimpleInflate inflater(SIMPLE_INFLATE_GZIP);
+      std::string out;
+      REQUIRE(inflater.feed((const uint8_t *)compressed.data(), split,
+                            string_sink, &out));
+      REQUIRE(inflater.feed((const uint8_t *)compressed.data() + split,
+                            compressed.size() - split, string_sink, &out));
+      REQUIRE(inflater.done());
+      REQUIRE(out == small);
+    }
+  }
+
+  SECTION("A byte at a time") {
+    REQUIRE(inflate_pieces(compress(data, 15 + 16), SIMPLE_INFLATE_GZIP, 1,
+                           ok, done) == data);
+    REQUIRE(done);
+  }
+
+  SECTION("Counts") {
+    std::string compressed = compress(data, 15 + 16);
+    SimpleInflate inflater(SIMPLE_INFLATE_GZIP);
+    std::string tail = compressed + "next";
+    size_t used;
+    REQUIRE(inflater.feed((const uint8_t *)tail.data(), tail.size(), NULL,
+                          NULL, &used));
+    REQUIRE(inflater.done());
+    REQUIRE(used == compressed.size());
+    REQUIRE(inflater.total_in() == compressed.size());
+    REQUIRE(inflater.total_out() == data.size());
+  }
+
+  SECTION("Optional gzip header fields") {
+    std::string compressed = compress("hello", 15 + 16);
+    // Set FEXTRA, FNAME, FCOMMENT and FHCRC, and add the fields
+    std::string header = compressed.substr(0, 10);
+    header[3] = 0x02 | 0x04 | 0x08 | 0x10;
+    header += std::string("\x03\x00xyz", 5) + "name" + '\0' + "comment" +
+              '\0' + "cc";
+    REQUIRE(inflate_pieces(header + compressed.substr(10),
+                           SIMPLE_INFLATE_GZIP, 3, ok, done) == "hello");
+    REQUIRE(done);
+  }
+
+  SECTION("Empty") {
+    REQUIRE(inflate_pieces(compress("", 15 + 16), SIMPLE_INFLATE_GZIP, 10, ok,
+                           done) == "");
+    REQUIRE(done);
+  }
+
+  SECTION("Sink stopping") {
+    std::string compressed = compress(data, 15 + 16);
+    SimpleInflate inflater(SIMPLE_INFLATE_GZIP);
+    int calls = 0;
+    REQUIRE_FALSE(inflater.feed((const uint8_t *)compressed.data(),
+                                compressed.size(),
+                                [](void *ctx, const uint8_t *, size_t) {
+                                  (*reinterpret_cast<int *>(ctx))++;
+                                  return false;
+                                },
+                                &calls));
+    REQUIRE(calls == 1);
+  }
+}
+
+TEST_CASE("Inflate errors", "[simple_inflate]") {
+
+  std::string data = sample(20000);
+  bool ok, done;
+
+  SECTION("Wrong format") {
+    inflate_pieces(compress(data, 15), SIMPLE_INFLATE_GZIP, 100, ok, done);
+    REQUIRE_FALSE(ok);
+    inflate_pieces(compress(data, 15 + 16), SIMPLE_INFLATE_ZLIB, 100, ok,
+                   done);
+    REQUIRE_FALSE(ok);
+  }
+
+  SECTION("Corrupt") {
+    std::string compressed = compress(data, -15);
+    for (size_t i = 0; i < 50; i++) {
+      std::string corrupt = compressed;
+      corrupt[i * 7 % corrupt.size()] ^= 0x5A;
+      std::string out =
+          inflate_pieces(corrupt, SIMPLE_INFLATE_RAW, 500, ok, done);
+      // Either detected, or output that a hash check would catch
+      REQUIRE((!ok || !done || out != data));
+    }
+  }
+
+  SECTION("Truncated") {
+    std::string compressed = compress(data, 15 + 16);
+    inflate_pieces(compressed.substr(0, compressed.size() - 9),
+                   SIMPLE_INFLATE_GZIP, 100, ok, done);
+    REQUIRE(ok);
+    REQUIRE_FALSE(done);
+  }
+}
+
+TEST_CASE("Inflate window", "[simple_inflate]") {
+
+  // References as far back as the window allows
+  std::string data = sample(100000, 3);
+  bool ok, done;
+
+  REQUIRE(inflate_pieces(compress(data, 9), SIMPLE_INFLATE_ZLIB, 777, ok,
+                         done) == data);
+  REQUIRE(done);
+
+  // Output is passed on a window at a time at most
+  std::string compressed = compress(data, 15);
+  SimpleInflate inflater(SIMPLE_INFLATE_ZLIB);
+  size_t largest = 0;
+  inflater.feed((const uint8_t *)compressed.data(), compressed.size(),
+                [](void *ctx, const uint8_t *, size_t len) {
+                  size_t *largest = reinterpret_cast<size_t *>(ctx);
+                  *largest = std::max(*largest, len);
+                  return true;
+                },
+                &largest);
+  REQUIRE(inflater.done());
+  REQUIRE(largest == SIMPLE_INFLATE_WINDOW_SIZE);
+}
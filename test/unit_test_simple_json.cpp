@@ -89,3 +89,508 @@ TEST_CASE( "JSON Reading", "[simple_json]" ) {
   REQUIRE (get_simple_json_bool(result2, "force") == true);
 
 }
+
+TEST_CASE( "JSON Tokenizing", "[simple_json]" ) {
+
+  const char *myjson = "{ \"Key1\" : \"a \\\"quoted\\\" \\\\\", \"Key2\":-42 ,\n\"Key3\": True }";
+  size_t len = strlen(myjson);
+
+  SimpleJSONTokenizer tok;
+  SimpleJSONToken token;
+  REQUIRE( simple_json_begin(tok, myjson, len) );
+
+  REQUIRE( simple_json_next(tok, token) );
+  REQUIRE( simple_json_span_equals(myjson, token.key, "Key1") );
+  REQUIRE( token.type == STRING );
+  REQUIRE( simple_json_span_equals(myjson, token.value, "a \\\"quoted\\\" \\\\") );
+
+  REQUIRE( simple_json_next(tok, token) );
+  REQUIRE( simple_json_span_equals(myjson, token.key, "Key2") );
+  REQUIRE( token.type == NUMBER );
+  REQUIRE( simple_json_span_equals(myjson, token.value, "-42") );
+  REQUIRE( simple_json_span_to_number(myjson, token.value) == -42 );
+
+  REQUIRE( simple_json_next(tok, token) );
+  REQUIRE( simple_json_span_equals(myjson, token.key, "Key3") );
+  REQUIRE( token.type == BOOLEAN );
+  REQUIRE( simple_json_span_to_bool(myjson, token.value) == true );
+
+  REQUIRE_FALSE( simple_json_next(tok, token) );
+
+  // Incomplete elements are not returned
+  const char *partial = "{\"Key1\": 1, \"Key2\": \"abc";
+  REQUIRE( simple_json_begin(tok, partial, strlen(partial)) );
+  REQUIRE( simple_json_next(tok, token) );
+  REQUIRE_FALSE( simple_json_next(tok, token) );
+
+  REQUIRE_FALSE( simple_json_begin(tok, "no json", 7) );
+}
+
+static void check_stream_matches(const std::string &json) {
+
+  std::vector<SimpleJSONElement> expected = simple_json(json);
+
+  // Split the input at every possible offset
+  for (size_t split = 0; split <= json.length(); split++) {
+    std::vector<SimpleJSONElement> result;
+    SimpleJSONStreamParser<32, 128> parser(simple_json_stream_collect, &result);
+    parser.feed(json.c_str(), split);
+    parser.feed(json.c_str() + split, json.length() - split);
+
+    REQUIRE( parser.finished() );
+    REQUIRE( result.size() == expected.size() );
+    for (size_t i = 0; i < result.size(); i++) {
+      REQUIRE( result[i].key == expected[i].key );
+      REQUIRE( result[i].type == expected[i].type );
+      REQUIRE( result[i].value_string == expected[i].value_string );
+      REQUIRE( result[i].value_number == expected[i].value_number );
+      REQUIRE( result[i].value_boolean == expected[i].value_boolean );
+    }
+  }
+
+  // One byte at a time
+  std::vector<SimpleJSONElement> result;
+  SimpleJSONStreamParser<32, 128> parser(simple_json_stream_collect, &result);
+  for (size_t i = 0; i < json.length(); i++) {
+    parser.feed(json.c_str() + i, 1);
+  }
+  REQUIRE( result.size() == expected.size() );
+}
+
+TEST_CASE( "JSON Streaming", "[simple_json]" ) {
+
+  check_stream_matches(
+    "{\n"
+    "  \"Key1\": \"value      \",\n"
+    "  \"Key2\" : 2,\n"
+    "  \"Key3\" : true,\n"
+    "  \"Key4\" : -42 ,\n"
+    "  \"Key5\" : false,\n"
+    "  \"Key6\" : true,\n"
+    "  \"Key7\" : true ,\n"
+    "  \"Key8\" : true , \n"
+    "  \"Key9\" :true,\n"
+    "\"Key10\"  :-42 ,\n"
+    "  \"Key11\" :42\n"
+    "}");
+
+  check_stream_matches("{\"current_version\":\"0.5.1\",\"blob\":\"9656f840e8d94170b9d99ead29bb3d78\",\"hash\":\"4ac64de7167d6b21d1bf4370d27987e3812b556048c9641584fa3ea66a7a6e4c\",\"force\":true}");
+  check_stream_matches("{\"time\": 1605000000}");
+  check_stream_matches("{\"value\": \"a \\\"quoted\\\" value\"}");
+
+  // Values longer than the buffer are truncated and flagged
+  struct Capture {
+    static void callback(void *ctx, const SimpleJSONStreamEvent &event) {
+      *reinterpret_cast<SimpleJSONStreamEvent *>(ctx) = event;
+    }
+  };
+  SimpleJSONStreamEvent event;
+  SimpleJSONStreamParser<8, 4> parser(Capture::callback, &event);
+  std::string json = "{\"Key\": \"longer than four\"} trailing";
+  REQUIRE( parser.feed(json.c_str(), json.length()) == json.find('}') + 1 );
+  REQUIRE( event.truncated );
+  REQUIRE( event.value_length == 4 );
+  REQUIRE( std::string(event.value) == "long" );
+
+  // and are left out when collected
+  std::vector<SimpleJSONElement> result;
+  SimpleJSONStreamParser<8, 4> collector(simple_json_stream_collect, &result);
+  json = "{\"Key\": \"longer than four\", \"Two\": 42}";
+  collector.feed(json.c_str(), json.length());
+  REQUIRE( collector.finished() );
+  REQUIRE( result.size() == 1 );
+  REQUIRE( result[0].key == "Two" );
+  REQUIRE( result[0].value_number == 42 );
+}
+
+struct CheckForUpdateResponse {
+  char version[32];
+  bool force;
+  bool reboot;
+  char blob[33];
+  uint8_t hash[32];
+};
+
+constexpr SimpleJSONField check_for_update_schema[] = {
+  SIMPLE_JSON_FIELD(CheckForUpdateResponse, "current_version", version, SIMPLE_JSON_FIELD_STRING),
+  SIMPLE_JSON_FIELD(CheckForUpdateResponse, "force", force, SIMPLE_JSON_FIELD_BOOL),
+  SIMPLE_JSON_FIELD(CheckForUpdateResponse, "reboot", reboot, SIMPLE_JSON_FIELD_BOOL),
+  SIMPLE_JSON_FIELD(CheckForUpdateResponse, "blob", blob, SIMPLE_JSON_FIELD_STRING),
+  SIMPLE_JSON_FIELD(CheckForUpdateResponse, "hash", hash, SIMPLE_JSON_FIELD_HEX)
+};
+
+struct TimeResponse {
+  int64_t time;
+};
+
+constexpr SimpleJSONField time_schema[] = {
+  SIMPLE_JSON_FIELD(TimeResponse, "time", time, SIMPLE_JSON_FIELD_INT64)
+};
+
+TEST_CASE( "JSON Schema Binding", "[simple_json]" ) {
+
+  static_assert(simple_json_hash("") == 2166136261u, "Hash must be constexpr");
+  REQUIRE( simple_json_hash("current_version") == simple_json_hash_span("current_version", 15) );
+
+  std::string real_test = "{\"current_version\":\"0.5.1\",\"blob\":\"9656f840e8d94170b9d99ead29bb3d78\",\"hash\":\"4ac64de7167d6b21d1bf4370d27987e3812b556048c9641584fa3ea66a7a6e4c\",\"force\":true,\"unknown\":1}";
+
+  CheckForUpdateResponse response = {};
+  SimpleJSONBinding binding = simple_json_binding(check_for_update_schema, response);
+  REQUIRE( simple_json_bind(real_test.c_str(), real_test.length(), binding) );
+
+  REQUIRE( binding.found == 0x1b ); // All but reboot
+  REQUIRE( binding.errors == 0 );
+  REQUIRE( std::string(response.version) == "0.5.1" );
+  REQUIRE( response.force == true );
+  REQUIRE( response.reboot == false );
+  REQUIRE( std::string(response.blob) == "9656f840e8d94170b9d99ead29bb3d78" );
+  REQUIRE( response.hash[0] == 0x4a );
+  REQUIRE( response.hash[31] == 0x4c );
+
+  // Same result when bound from the stream parser
+  CheckForUpdateResponse streamed = {};
+  SimpleJSONBinding stream_binding = simple_json_binding(check_for_update_schema, streamed);
+  SimpleJSONStreamParser<32, 128> parser(simple_json_bind_callback, &stream_binding);
+  for (size_t i = 0; i < real_test.length(); i++) {
+    parser.feed(real_test.c_str() + i, 1);
+  }
+  REQUIRE( stream_binding.found == binding.found );
+  REQUIRE( memcmp(&streamed.hash, &response.hash, 32) == 0 );
+  REQUIRE( std::string(streamed.blob) == response.blob );
+
+  // Truncated strings and bad hex are reported as errors
+  std::string bad = "{\"current_version\":\"0123456789012345678901234567890123456789\",\"hash\":\"zz\"}";
+  CheckForUpdateResponse bad_response = {};
+  SimpleJSONBinding bad_binding = simple_json_binding(check_for_update_schema, bad_response);
+  REQUIRE( simple_json_bind(bad.c_str(), bad.length(), bad_binding) );
+  REQUIRE( bad_binding.found == 0x11 );
+  REQUIRE( bad_binding.errors == 0x11 );
+  REQUIRE( strlen(bad_response.version) == 31 );
+
+  // Values truncated by the stream parser are errors for their own field
+  std::string clipped = "{\"unknown\":\"0123456789\",\"blob\":\"0123456789\",\"force\":true}";
+  CheckForUpdateResponse clipped_response = {};
+  SimpleJSONBinding clipped_binding = simple_json_binding(check_for_update_schema, clipped_response);
+  SimpleJSONStreamParser<32, 8> clipped_parser(simple_json_bind_callback, &clipped_binding);
+  clipped_parser.feed(clipped.c_str(), clipped.length());
+  REQUIRE( clipped_binding.found == 0x0a );
+  REQUIRE( clipped_binding.errors == 0x08 );
+  REQUIRE( std::string(clipped_response.blob) == "01234567" );
+
+  // Values that are not of the field type are errors, stored as zero or false
+  const char *bad_times[] = {"{\"time\":\"abc\"}", "{\"time\":\"\"}",
+                             "{\"time\":null}", "{\"time\":12abc}",
+                             "{\"time\":99999999999999999999}"};
+  for (const char *json : bad_times) {
+    TimeResponse time_response = {42};
+    SimpleJSONBinding time_binding = simple_json_binding(time_schema, time_response);
+    REQUIRE( simple_json_bind(json, strlen(json), time_binding) );
+    REQUIRE( time_binding.found == 1 );
+    REQUIRE( time_binding.errors == 1 );
+    REQUIRE( time_response.time == 0 );
+  }
+  TimeResponse time_response = {};
+  SimpleJSONBinding time_binding = simple_json_binding(time_schema, time_response);
+  REQUIRE( simple_json_bind("{\"time\":-1605000000}", 20, time_binding) );
+  REQUIRE( time_binding.errors == 0 );
+  REQUIRE( time_response.time == -1605000000 );
+
+  std::string yes = "{\"force\":\"yes\",\"reboot\":1}";
+  CheckForUpdateResponse yes_response = {};
+  SimpleJSONBinding yes_binding = simple_json_binding(check_for_update_schema, yes_response);
+  REQUIRE( simple_json_bind(yes.c_str(), yes.length(), yes_binding) );
+  REQUIRE( yes_binding.found == 0x06 );
+  REQUIRE( yes_binding.errors == 0x06 );
+  REQUIRE( yes_response.force == false );
+}
+
+TEST_CASE( "JSON Structural Index", "[simple_json]" ) {
+
+  // Random input biased towards structural characters, every method must
+  // give the same result as the scalar reference
+  const char alphabet[] = "\"\\:,{}[] az09\n\x7b\x5b\xfb\xdb\x80";
+  srand(42);
+  for (size_t len = 0; len < 300; len++) {
+    std::string input;
+    for (size_t i = 0; i < len; i++) {
+      input += alphabet[rand() % (sizeof(alphabet) - 1)];
+    }
+    std::vector<uint32_t> expected(SIMPLE_JSON_INDEX_WORDS(len) + 1);
+    std::vector<uint32_t> result(SIMPLE_JSON_INDEX_WORDS(len) + 1);
+    simple_json_index_scalar(input.c_str(), len, expected.data());
+    simple_json_index(input.c_str(), len, result.data());
+    REQUIRE( expected == result );
+
+    for (size_t i = 0; i + 32 <= len; i += 32) {
+      REQUIRE( simple_json_index_block_swar(input.c_str() + i) == expected[i / 32] );
+#if defined(__SSE2__)
+      REQUIRE( simple_json_index_block_sse2(input.c_str() + i) == expected[i / 32] );
+#endif
+#if defined(__AVX2__)
+      REQUIRE( simple_json_index_block_avx2(input.c_str() + i) == expected[i / 32] );
+#endif
+    }
+  }
+
+  // Tokenizing with the index gives the same tokens as without
+  std::string myjson = "{\"Key1\": \"a long value, with: {structural} [chars] and \\\"escapes\\\\\","
+                       "  \"Key2\" : 2 , \"Key3\":true,\"Key4\":\"\",\"Key5\": -42}";
+  std::vector<uint32_t> index(SIMPLE_JSON_INDEX_WORDS(myjson.length()));
+  simple_json_index(myjson.c_str(), myjson.length(), index.data());
+
+  SimpleJSONTokenizer scalar, indexed;
+  SimpleJSONToken a, b;
+  REQUIRE( simple_json_begin(scalar, myjson.c_str(), myjson.length()) );
+  REQUIRE( simple_json_begin_indexed(indexed, myjson.c_str(), myjson.length(), index.data()) );
+  size_t count = 0;
+  while (simple_json_next(scalar, a)) {
+    REQUIRE( simple_json_next(indexed, b) );
+    REQUIRE( a.key.offset == b.key.offset );
+    REQUIRE( a.key.length == b.key.length );
+    REQUIRE( a.value.offset == b.value.offset );
+    REQUIRE( a.value.length == b.value.length );
+    REQUIRE( a.type == b.type );
+    count++;
+  }
+  REQUIRE_FALSE( simple_json_next(indexed, b) );
+  REQUIRE( count == 5 );
+}
+
+TEST_CASE( "JSON Find", "[simple_json]" ) {
+
+  std::string myjson =
+    "{\n"
+    "  \"group\": {\"inner\": [1, {\"value\": \"}]\\\"\"}], \"other\": 2},\n"
+    "  \"list\" : [ \"a,b\", [ ], {} ] ,\n"
+    "  \"value\": \"found\",\n"
+    "  \"time\": 1605000000,\n"
+    "  \"value\": \"duplicate\"\n"
+    "}";
+  const char *str = myjson.c_str();
+
+  // Nested values are skipped over as a whole, and returned raw
+  std::vector<SimpleJSONElement> all = simple_json(myjson);
+  REQUIRE( all.size() == 5 );
+  REQUIRE( all[0].key == "group" );
+  REQUIRE( all[0].type == OBJECT );
+  REQUIRE( all[0].value_string == "{\"inner\": [1, {\"value\": \"}]\\\"\"}], \"other\": 2}" );
+  REQUIRE( all[1].key == "list" );
+  REQUIRE( all[1].type == ARRAY );
+  REQUIRE( all[1].value_string == "[ \"a,b\", [ ], {} ]" );
+  REQUIRE( all[2].value_string == "found" );
+
+  SimpleJSONToken token;
+  REQUIRE( simple_json_find(str, myjson.length(), "value", token) );
+  REQUIRE( simple_json_span_equals(str, token.value, "found") );
+  REQUIRE( simple_json_find(str, myjson.length(), "time", token) );
+  REQUIRE( simple_json_span_to_number(str, token.value) == 1605000000 );
+  REQUIRE_FALSE( simple_json_find(str, myjson.length(), "inner", token) );
+  REQUIRE_FALSE( simple_json_find(str, myjson.length(), "missing", token) );
+
+  const char *keys[] = {"time", "missing", "value"};
+  SimpleJSONToken tokens[3];
+  REQUIRE( simple_json_find_keys(str, myjson.length(), keys, 3, tokens) == 0x5 );
+  REQUIRE( simple_json_span_to_number(str, tokens[0].value) == 1605000000 );
+  REQUIRE( simple_json_span_equals(str, tokens[2].value, "found") );
+
+  // The stream parser and the indexed tokenizer agree
+  check_stream_matches(myjson);
+
+  std::vector<uint32_t> index(SIMPLE_JSON_INDEX_WORDS(myjson.length()));
+  simple_json_index(str, myjson.length(), index.data());
+  SimpleJSONTokenizer tok;
+  REQUIRE( simple_json_begin_indexed(tok, str, myjson.length(), index.data()) );
+  for (size_t i = 0; i < all.size(); i++) {
+    REQUIRE( simple_json_next(tok, token) );
+    REQUIRE( token.type == all[i].type );
+    REQUIRE( myjson.substr(token.value.offset, token.value.length) == all[i].value_string );
+  }
+  REQUIRE_FALSE( simple_json_next(tok, token) );
+}
+
+TEST_CASE( "JSON Arena", "[simple_json]" ) {
+
+  std::string real_test = "{\"current_version\":\"0.5.1\",\"blob\":\"9656f840e8d94170b9d99ead29bb3d78\",\"hash\":\"4ac64de7167d6b21d1bf4370d27987e3812b556048c9641584fa3ea66a7a6e4c\",\"force\":true,\"count\":-42}";
+
+  SimpleJSONArena<8, 256> arena;
+  REQUIRE( simple_json_parse(real_test.c_str(), real_test.length(), arena) == SIMPLE_JSON_OK );
+  REQUIRE( arena.status() == SIMPLE_JSON_OK );
+  REQUIRE( arena.size() == 5 );
+  REQUIRE( std::string(arena.key(0)) == "current_version" );
+  REQUIRE( std::string(arena.value(0)) == "0.5.1" );
+  REQUIRE( arena.type(3) == BOOLEAN );
+  REQUIRE( arena.boolean(3) == true );
+  REQUIRE( arena.find("count") == 4 );
+  REQUIRE( arena.number(4) == -42 );
+  REQUIRE( arena.find("missing") == -1 );
+
+  // Same content from the stream parser
+  SimpleJSONArena<8, 256> streamed;
+  SimpleJSONStreamParser<32, 128> parser(simple_json_arena_callback<8, 256>, &streamed);
+  parser.feed(real_test.c_str(), real_test.length());
+  REQUIRE( streamed.size() == arena.size() );
+  REQUIRE( streamed.bytes_used() == arena.bytes_used() );
+
+  // A value too long for the parser is not stored as if it were whole
+  SimpleJSONArena<8, 256> short_values;
+  SimpleJSONStreamParser<32, 8> short_parser(simple_json_arena_callback<8, 256>, &short_values);
+  short_parser.feed(real_test.c_str(), real_test.length());
+  REQUIRE( short_parser.finished() );
+  REQUIRE( short_values.status() == SIMPLE_JSON_VALUE_TRUNCATED );
+  REQUIRE( short_values.find("blob") == -1 );
+  REQUIRE( std::string(short_values.value(short_values.find("current_version"))) == "0.5.1" );
+
+  // Overflow is reported, not thrown, and earlier elements are kept
+  SimpleJSONArena<2, 256> few_elements;
+  REQUIRE( simple_json_parse(real_test.c_str(), real_test.length(), few_elements) == SIMPLE_JSON_ELEMENTS_FULL );
+  REQUIRE( few_elements.size() == 2 );
+  REQUIRE( std::string(few_elements.value(1)) == "9656f840e8d94170b9d99ead29bb3d78" );
+
+  SimpleJSONArena<8, 64> few_bytes;
+  REQUIRE( simple_json_parse(real_test.c_str(), real_test.length(), few_bytes) == SIMPLE_JSON_BYTES_FULL );
+  REQUIRE( few_bytes.status() == SIMPLE_JSON_BYTES_FULL );
+  REQUIRE( few_bytes.size() == 2 );
+
+  REQUIRE( simple_json_parse("no json", 7, arena) == SIMPLE_JSON_INVALID );
+  REQUIRE( arena.size() == 0 );
+}
+
+TEST_CASE( "JSON Tape", "[simple_json]" ) {
+
+  std::string manifest =
+    "{\n"
+    "  \"version\": \"1.2.0\",\n"
+    "  \"config\": {\"mqtt\": {\"server\": \"10.0.0.1\", \"port\": 1883}, \"debug\": true},\n"
+    "  \"chunks\": [\n"
+    "    {\"offset\": 0, \"size\": 4096},\n"
+    "    {\"offset\": 4096, \"size\": 1024, \"note\": \"has ] and } chars\"},\n"
+    "    []\n"
+    "  ],\n"
+    "  \"count\": -3\n"
+    "}";
+  const char *str = manifest.c_str();
+
+  SimpleJSONTape<32> tape;
+  REQUIRE( simple_json_tape(str, manifest.length(), tape) == SIMPLE_JSON_OK );
+
+  SimpleJSONCursor root = tape.root();
+  REQUIRE( root.valid() );
+  REQUIRE( root.type() == OBJECT );
+  REQUIRE( root.size() == 4 );
+  REQUIRE( root.find("version").equals("1.2.0") );
+  REQUIRE( root.find("count").number() == -3 );
+  REQUIRE_FALSE( root.find("missing").valid() );
+
+  SimpleJSONCursor mqtt = root.find("config").find("mqtt");
+  REQUIRE( mqtt.type() == OBJECT );
+  REQUIRE( mqtt.find("server").equals("10.0.0.1") );
+  REQUIRE( mqtt.find("port").number() == 1883 );
+  REQUIRE( root.find("config").find("debug").boolean() == true );
+
+  SimpleJSONCursor chunks = root.find("chunks");
+  REQUIRE( chunks.type() == ARRAY );
+  REQUIRE( chunks.size() == 3 );
+  REQUIRE( chunks.at(1).find("offset").number() == 4096 );
+  REQUIRE( chunks.at(1).find("note").equals("has ] and } chars") );
+  REQUIRE( chunks.at(2).type() == ARRAY );
+  REQUIRE( chunks.at(2).size() == 0 );
+  REQUIRE_FALSE( chunks.at(3).valid() );
+
+  // Containers span their raw text, matching the flat API
+  SimpleJSONToken token;
+  REQUIRE( simple_json_find(str, manifest.length(), "chunks", token) );
+  REQUIRE( chunks.value().offset == token.value.offset );
+  REQUIRE( chunks.value().length == token.value.length );
+
+  // Same tape when built with the structural index
+  std::vector<uint32_t> index(SIMPLE_JSON_INDEX_WORDS(manifest.length()));
+  simple_json_index(str, manifest.length(), index.data());
+  SimpleJSONTape<32> indexed;
+  REQUIRE( simple_json_tape(str, manifest.length(), indexed, index.data()) == SIMPLE_JSON_OK );
+  REQUIRE( indexed.size() == tape.size() );
+  REQUIRE( indexed.root().find("chunks").at(1).find("size").number() == 1024 );
+
+  // Errors
+  SimpleJSONTape<4> small;
+  REQUIRE( simple_json_tape(str, manifest.length(), small) == SIMPLE_JSON_ELEMENTS_FULL );
+  REQUIRE_FALSE( small.root().valid() );
+  REQUIRE( simple_json_tape(str, manifest.length() - 1, tape) == SIMPLE_JSON_INVALID );
+  std::string deep = std::string(20, '[') + std::string(20, ']');
+  REQUIRE( simple_json_tape(deep.c_str(), deep.length(), tape) == SIMPLE_JSON_TOO_DEEP );
+  REQUIRE( simple_json_tape("[1, 2]", 6, tape) == SIMPLE_JSON_OK );
+  REQUIRE( tape.root().at(1).number() == 2 );
+}
+
+static bool string_write_sink(void *ctx, const char *data, size_t len) {
+  reinterpret_cast<std::string *>(ctx)->append(data, len);
+  return true;
+}
+
+static void write_document(SimpleJSONWriter &writer) {
+  writer.begin_object();
+  writer.string("node_id", "AA:BB:CC:DD:EE:FF");
+  writer.string("description", "Quote \" backslash \\ newline \n tab \t bell \x07");
+  writer.number("time", 1605000000);
+  writer.number("min", INT64_MIN);
+  writer.boolean("force", true);
+  writer.begin_object("config");
+  writer.string("flash_time", "100");
+  writer.begin_array("list");
+  writer.number(NULL, 1);
+  writer.boolean(NULL, false);
+  writer.end_array();
+  writer.end_object();
+  writer.begin_object("empty");
+  writer.end_object();
+  writer.end_object();
+}
+
+TEST_CASE( "JSON Writer", "[simple_json]" ) {
+
+  const std::string expected =
+    "{\"node_id\":\"AA:BB:CC:DD:EE:FF\","
+    "\"description\":\"Quote \\\" backslash \\\\ newline \\n tab \\t bell \\u0007\","
+    "\"time\":1605000000,\"min\":-9223372036854775808,\"force\":true,"
+    "\"config\":{\"flash_time\":\"100\",\"list\":[1,false]},\"empty\":{}}";
+
+  char buf[256];
+  SimpleJSONWriter writer(buf, sizeof(buf));
+  write_document(writer);
+  REQUIRE( writer.finish() );
+  REQUIRE( std::string(buf) == expected );
+  REQUIRE( writer.length() == expected.length() );
+
+  // The output parses back
+  SimpleJSONTape<32> tape;
+  REQUIRE( simple_json_tape(buf, writer.length(), tape) == SIMPLE_JSON_OK );
+  REQUIRE( tape.root().find("config").find("list").at(0).number() == 1 );
+  REQUIRE( tape.root().find("min").number() == INT64_MIN );
+
+  // Chunked through a sink with a small staging buffer
+  std::string sunk;
+  char staging[7];
+  SimpleJSONWriter chunked(staging, sizeof(staging), string_write_sink, &sunk);
+  write_document(chunked);
+  REQUIRE( chunked.finish() );
+  REQUIRE( sunk == expected );
+
+  // Counting only
+  SimpleJSONWriter counter(NULL, 0);
+  write_document(counter);
+  REQUIRE( counter.finish() );
+  REQUIRE( counter.length() == expected.length() );
+
+  // Overflow is reported and the buffer stays terminated
+  char small[16];
+  SimpleJSONWriter overflow(small, sizeof(small));
+  write_document(overflow);
+  REQUIRE_FALSE( overflow.finish() );
+  REQUIRE( std::string(small) == expected.substr(0, 15) );
+
+  // A buffer with no room is never written to
+  char none[1] = {'x'};
+  SimpleJSONWriter empty(none, 0);
+  write_document(empty);
+  REQUIRE_FALSE( empty.finish() );
+  REQUIRE( none[0] == 'x' );
+}
@@ -0,0 +1,506 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+
+#include <zlib.h>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+// Small buffers, so that tests cross buffer boundaries often
+#define SIMPLE_PATCH_BUFFER_SIZE 64
+#define OTA_PIPELINE_BUFFERS 3
+#define OTA_PIPELINE_BUFFER_SIZE 100
+
+#define CPP_STANDARD
+#include "../src/ota_pipeline.h"
+#include "../src/simple_inflate.h"
+#include "../src/simple_patch.h"
+
+#include "host_client.h"
+#include "stand_in_server.h"
+
+/*
+ * Partition backed by a temporary file, erased to 0xFF as flash is. The
+ * running partition holds the old image, the new image is written to the
+ * next partition from the start.
+ */
+class FilePartition {
+
+public:
+  explicit FilePartition(uint32_t size) : m_size(size), m_written(0) {
+    m_file = tmpfile();
+    std::string erased(size, '\xFF');
+    fwrite(erased.data(), 1, size, m_file);
+  }
+
+  ~FilePartition() { fclose(m_file); }
+
+  uint32_t size() const { return m_size; }
+
+  bool write(const uint8_t *data, size_t len) {
+    if (m_written + len > m_size) {
+      return false;
+    }
+    fseek(m_file, m_written, SEEK_SET);
+    fwrite(data, 1, len, m_file);
+    m_written += len;
+    return true;
+  }
+
+  bool read(uint32_t offset, uint8_t *data, size_t len) {
+    if (offset + len > m_size) {
+      return false;
+    }
+    fseek(m_file, offset, SEEK_SET);
+    return fread(data, 1, len, m_file) == len;
+  }
+
+  // What has been written since it was erased
+  std::string image() {
+    std::string data(m_written, '\0');
+    read(0, (uint8_t *)&data[0], m_written);
+    return data;
+  }
+
+  static bool sink(void *ctx, const uint8_t *data, size_t len) {
+    return reinterpret_cast<FilePartition *>(ctx)->write(data, len);
+  }
+
+  static bool source(void *ctx, uint32_t offset, uint8_t *data, size_t len) {
+    return reinterpret_cast<FilePartition *>(ctx)->read(offset, data, len);
+  }
+
+private:
+  FILE *m_file;
+  uint32_t m_size;
+  uint32_t m_written;
+};
+
+static const uint32_t c_partition_size = 256 * 1024;
+
+static void put_offset(std::string &out, int64_t value) {
+  uint64_t magnitude = value < 0 ? -value : value;
+  for (int i = 0; i < 8; i++) {
+    uint8_t c = (magnitude >> (8 * i)) & 0xFF;
+    if (i == 7 && value < 0) {
+      c |= 0x80;
+    }
+    out += (char)c;
+  }
+}
+
+static std::string patch_header(size_t new_size) {
+  std::string patch = SIMPLE_PATCH_MAGIC;
+  put_offset(patch, new_size);
+  return patch;
+}
+
+static void put_control(std::string &patch, int64_t diff, int64_t extra,
+                        int64_t seek) {
+  put_offset(patch, diff);
+  put_offset(patch, extra);
+  put_offset(patch, seek);
+}
+
+/*
+ * Makes a patch in the same layout as bsdiff, by finding blocks of the new
+ * image in the old and extending each match while it mostly agrees, so that
+ * diffs have some bytes that differ. Not as small as bsdiff makes them, but
+ * good enough to check they are applied correctly.
+ */
+static std::string make_patch(const std::string &old_image,
+                              const std::string &new_image) {
+  const size_t block = 16;
+  std::unordered_map<std::string, size_t> index;
+  for (size_t i = 0; i + block <= old_image.size(); i++) {
+    index.emplace(old_image.substr(i, block), i);
+  }
+
+  std::string patch = patch_header(new_image.size());
+  size_t diff_new = 0, diff_old = 0, diff_len = 0;
+  std::string extra;
+  auto emit = [&](size_t next_old) {
+    put_control(patch, diff_len, extra.size(),
+                (int64_t)next_old - (int64_t)(diff_old + diff_len));
+    for (size_t i = 0; i < diff_len; i++) {
+      patch += (char)(new_image[diff_new + i] - old_image[diff_old + i]);
+    }
+    patch += extra;
+  };
+
+  size_t p = 0;
+  while (p < new_image.size()) {
+    auto found = (p + block <= new_image.size())
+                     ? index.find(new_image.substr(p, block))
+                     : index.end();
+    if (found == index.end()) {
+      extra += new_image[p++];
+      continue;
+    }
+    size_t q = found->second;
+    emit(q);
+    size_t len = 0;
+    while (p + len < new_image.size() && q + len < old_image.size()) {
+      size_t agree = 0, n = 0;
+      for (; n < block && p + len + n < new_image.size() &&
+             q + len + n < old_image.size();
+           n++) {
+        agree += new_image[p + len + n] == old_image[q + len + n];
+      }
+      if (agree * 4 < n * 3) {
+        break;
+      }
+      len += n;
+    }
+    diff_new = p;
+    diff_old = q;
+    diff_len = len;
+    extra.clear();
+    p += len;
+  }
+  emit(diff_old + diff_len);
+  return patch;
+}
+
+// Image-like data: runs, repeats and noise
+static std::string sample(size_t len, unsigned seed) {
+  srand(seed);
+  std::string data;
+  while (data.size() < len) {
+    if (rand() % 3 == 0) {
+      data.append(rand() % 100, (char)(rand() % 256));
+    } else {
+      for (int i = rand() % 100; i > 0; i--) {
+        data += (char)(rand() % 256);
+      }
+    }
+  }
+  data.resize(len);
+  return data;
+}
+
+// A new release: code moves, addresses change and a function is added
+static std::string next_release(const std::string &old_image) {
+  std::string data = old_image;
+  for (size_t i = 1000; i + 4 < data.size(); i += 997) {
+    data[i] = (char)(data[i] + 4);
+  }
+  data.insert(20000, sample(3000, 7));
+  data.erase(50000, 1500);
+  data += sample(2000, 8);
+  return data;
+}
+
+static std::string gzip(const std::string &data) {
+  z_stream stream = {};
+  deflateInit2(&stream, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY);
+  std::string out(deflateBound(&stream, data.size()) + 64, '\0');
+  stream.next_in = (Bytef *)data.data();
+  stream.avail_in = data.size();
+  stream.next_out = (Bytef *)&out[0];
+  stream.avail_out = out.size();
+  deflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+struct Apply {
+  bool ok;
+  bool done;
+  std::string image;
+};
+
+// Apply the patch, fed in pieces of the given size
+static Apply apply(FilePartition &running, const std::string &patch,
+                   size_t piece) {
+  FilePartition next(c_partition_size);
+  SimplePatch patcher;
+  patcher.reset(FilePartition::source, &running, running.size());
+  Apply result;
+  result.ok = true;
+  for (size_t i = 0; i < patch.size() && result.ok; i += piece) {
+    result.ok = patcher.feed((const uint8_t *)patch.data() + i,
+                             std::min(piece, patch.size() - i),
+                             FilePartition::sink, &next);
+  }
+  result.done = patcher.done();
+  result.image = next.image();
+  return result;
+}
+
+TEST_CASE("Patch", "[simple_patch]") {
+
+  std::string old_image = sample(100000, 1);
+  std::string new_image = next_release(old_image);
+  FilePartition running(c_partition_size);
+  running.write((const uint8_t *)old_image.data(), old_image.size());
+
+  // Diffs are mostly zeros, so a patch is small once compressed
+  std::string patch = make_patch(old_image, new_image);
+  REQUIRE(gzip(patch).size() < new_image.size() / 10);
+
+  SECTION("Applied against the running partition") {
+    const size_t pieces[] = {1, 7, 100, 4096, patch.size()};
+    for (size_t piece : pieces) {
+      Apply result = apply(running, patch, piece);
+      REQUIRE(result.ok);
+      REQUIRE(result.done);
+      REQUIRE(result.image == new_image);
+    }
+  }
+
+  SECTION("Counts") {
+    SimplePatch patcher;
+    patcher.reset(FilePartition::source, &running, running.size());
+    std::string tail = patch + "next";
+    size_t used;
+    REQUIRE(patcher.feed((const uint8_t *)tail.data(), tail.size(), NULL,
+                         NULL, &used));
+    REQUIRE(patcher.done());
+    REQUIRE(used == patch.size());
+    REQUIRE(patcher.total_in() == patch.size());
+    REQUIRE(patcher.total_out() == new_image.size());
+    REQUIRE(patcher.image_size() == new_image.size());
+    REQUIRE(patcher.diff_bytes() > new_image.size() / 2);
+  }
+
+  SECTION("Split at every offset") {
+    std::string small_old = sample(2000, 3);
+    std::string small_new = small_old;
+    small_new.insert(500, "inserted");
+    small_new[1500] ^= 1;
+    FilePartition small_running(4096);
+    small_running.write((const uint8_t *)small_old.data(), small_old.size());
+    std::string small_patch = make_patch(small_old, small_new);
+    for (size_t split = 0; split <= small_patch.size(); split++) {
+      FilePartition next(4096);
+      SimplePatch patcher;
+      patcher.reset(FilePartition::source, &small_running, 4096);
+      REQUIRE(patcher.feed((const uint8_t *)small_patch.data(), split,
+                           FilePartition::sink, &next));
+      REQUIRE(patcher.feed((const uint8_t *)small_patch.data() + split,
+                           small_patch.size() - split, FilePartition::sink,
+                           &next));
+      REQUIRE(patcher.done());
+      REQUIRE(next.image() == small_new);
+    }
+  }
+
+  SECTION("Compressed patch") {
+    std::string compressed = gzip(patch);
+
+    FilePartition next(c_partition_size);
+    SimplePatch patcher;
+    patcher.reset(FilePartition::source, &running, running.size());
+    struct Chain {
+      SimplePatch *patcher;
+      FilePartition *next;
+    } chain = {&patcher, &next};
+    SimpleInflate inflater(SIMPLE_INFLATE_GZIP);
+    for (size_t i = 0; i < compressed.size(); i += 500) {
+      REQUIRE(inflater.feed(
+          (const uint8_t *)compressed.data() + i,
+          std::min((size_t)500, compressed.size() - i),
+          [](void *ctx, const uint8_t *data, size_t len) {
+            Chain *chain = reinterpret_cast<Chain *>(ctx);
+            return chain->patcher->feed(data, len, FilePartition::sink,
+                                        chain->next);
+          },
+          &chain));
+    }
+    REQUIRE(inflater.done());
+    REQUIRE(patcher.done());
+    REQUIRE(next.image() == new_image);
+  }
+
+  SECTION("Wrong running image") {
+    FilePartition other(c_partition_size);
+    std::string other_image = sample(100000, 2);
+    other.write((const uint8_t *)other_image.data(), other_image.size());
+    Apply result = apply(other, patch, 4096);
+    // Applies, but to an image that the hash check will refuse
+    REQUIRE(result.done);
+    REQUIRE(result.image != new_image);
+  }
+}
+
+TEST_CASE("Patch edge cases", "[simple_patch]") {
+
+  std::string old_image = "0123456789";
+  FilePartition running(16);
+  running.write((const uint8_t *)old_image.data(), old_image.size());
+
+  SECTION("Empty new image") {
+    Apply result = apply(running, patch_header(0), 100);
+    REQUIRE(result.ok);
+    REQUIRE(result.done);
+    REQUIRE(result.image.empty());
+  }
+
+  SECTION("Extra only") {
+    std::string patch = patch_header(5);
+    put_control(patch, 0, 5, 0);
+    patch += "hello";
+    REQUIRE(apply(running, patch, 100).image == "hello");
+  }
+
+  SECTION("Seeking backwards") {
+    std::string patch = patch_header(8);
+    put_control(patch, 4, 0, -2);
+    patch += std::string(4, '\0');
+    put_control(patch, 4, 0, 0);
+    patch += std::string(4, '\1');
+    Apply result = apply(running, patch, 100);
+    REQUIRE(result.done);
+    REQUIRE(result.image == "01233456");
+  }
+
+  SECTION("Old image outside the partition reads as zero") {
+    std::string before = patch_header(6);
+    put_control(before, 0, 0, -2);
+    put_control(before, 6, 0, 0);
+    before += std::string(6, '\0');
+    REQUIRE(apply(running, before, 100).image == std::string("\0\0", 2) +
+                                                     "0123");
+    std::string beyond = patch_header(4);
+    put_control(beyond, 0, 0, 14);
+    put_control(beyond, 4, 0, 0);
+    beyond += std::string(4, '\0');
+    // 14 and 15 are erased flash, the rest is past the end
+    REQUIRE(apply(running, beyond, 100).image ==
+            std::string("\xFF\xFF\0\0", 4));
+  }
+}
+
+TEST_CASE("Patch errors", "[simple_patch]") {
+
+  std::string old_image = sample(5000, 4);
+  std::string new_image = next_release(sample(60000, 4)).substr(0, 6000);
+  FilePartition running(8192);
+  running.write((const uint8_t *)old_image.data(), old_image.size());
+  std::string patch = make_patch(old_image, new_image);
+
+  SECTION("Not a patch") {
+    std::string bad = patch;
+    bad[0] = 'X';
+    REQUIRE_FALSE(apply(running, bad, 100).ok);
+    REQUIRE_FALSE(apply(running, gzip(patch), 100).ok);
+  }
+
+  SECTION("Control beyond the new image") {
+    std::string bad = patch_header(4);
+    put_control(bad, 3, 2, 0);
+    bad += "abcde";
+    REQUIRE_FALSE(apply(running, bad, 100).ok);
+    bad = patch_header(4);
+    put_control(bad, -1, 0, 0);
+    REQUIRE_FALSE(apply(running, bad, 100).ok);
+  }
+
+  SECTION("Seek beyond both images") {
+    for (int64_t seek : {(int64_t)1 << 40, -((int64_t)1 << 40), (int64_t)20000,
+                         (int64_t)-20000}) {
+      std::string bad = patch_header(8);
+      put_control(bad, 0, 4, seek);
+      bad += "abcd";
+      put_control(bad, 4, 0, 0);
+      bad += std::string(4, '\0');
+      REQUIRE_FALSE(apply(running, bad, 100).ok);
+    }
+    // Outside the old image but within reach is allowed
+    std::string good = patch_header(8);
+    put_control(good, 0, 4, 8195);
+    good += "abcd";
+    put_control(good, 4, 0, 0);
+    good += std::string(4, '\0');
+    REQUIRE(apply(running, good, 100).ok);
+  }
+
+  SECTION("Truncated") {
+    Apply result = apply(running, patch.substr(0, patch.size() - 1), 100);
+    REQUIRE(result.ok);
+    REQUIRE_FALSE(result.done);
+  }
+
+  SECTION("Old image unreadable") {
+    SimplePatch patcher;
+    patcher.reset(
+        [](void *, uint32_t, uint8_t *, size_t) { return false; }, NULL,
+        8192);
+    REQUIRE_FALSE(patcher.feed((const uint8_t *)patch.data(), patch.size(),
+                               NULL, NULL));
+    REQUIRE(patcher.error());
+  }
+
+  SECTION("Sink stopping") {
+    SimplePatch patcher;
+    patcher.reset(FilePartition::source, &running, running.size());
+    int calls = 0;
+    REQUIRE_FALSE(patcher.feed((const uint8_t *)patch.data(), patch.size(),
+                               [](void *ctx, const uint8_t *, size_t) {
+                                 (*reinterpret_cast<int *>(ctx))++;
+                                 return false;
+                               },
+                               &calls));
+    REQUIRE(calls == 1);
+    REQUIRE_FALSE(patcher.error());
+  }
+}
+
+/*
+ * The update as do_update does it: the patch is downloaded compressed
+ * through the OTA pipeline, and the writer decompresses it and applies it
+ * against the running partition in to the next.
+ */
+struct DeltaWrite {
+  SimpleInflate inflater;
+  SimplePatch patcher;
+  FilePartition *next;
+};
+
+static bool delta_image(void *ctx, const uint8_t *data, size_t len) {
+  DeltaWrite *delta = reinterpret_cast<DeltaWrite *>(ctx);
+  return delta->patcher.feed(data, len, FilePartition::sink, delta->next);
+}
+
+static bool delta_write(void *ctx, const uint8_t *data, size_t len) {
+  DeltaWrite *delta = reinterpret_cast<DeltaWrite *>(ctx);
+  return delta->inflater.feed(data, len, delta_image, delta);
+}
+
+TEST_CASE("Delta update download", "[simple_patch]") {
+
+  std::string old_image = sample(100000, 5);
+  std::string new_image = next_release(old_image);
+  std::string patch = gzip(make_patch(old_image, new_image));
+  StandInServer server([&patch](const StandInRequest &) {
+    return stand_in_response(200, patch, "Content-Encoding: gzip\r\n");
+  });
+  HostClient client;
+  SimpleHTTPConnection<HostClient> http;
+  http.begin(&client, server.url().c_str());
+
+  FilePartition running(c_partition_size);
+  running.write((const uint8_t *)old_image.data(), old_image.size());
+  FilePartition next(c_partition_size);
+
+  DeltaWrite delta;
+  delta.patcher.reset(FilePartition::source, &running, running.size());
+  delta.next = &next;
+  OtaPipeline pipeline;
+  WorkTaskConfig config = {4096, 1, WORK_NO_AFFINITY};
+  REQUIRE(pipeline.begin(delta_write, &delta, config));
+  REQUIRE(http.request("GET", "/blob/", NULL, 0, OtaPipeline::sink,
+                       &pipeline) == 200);
+  REQUIRE(std::string(http.content_encoding()) == "gzip");
+  REQUIRE(http.complete());
+  REQUIRE(pipeline.end());
+  REQUIRE(delta.inflater.done());
+  REQUIRE(delta.patcher.done());
+  REQUIRE(next.image() == new_image);
+  REQUIRE(pipeline.stats().bytes == patch.size());
+}
@@ -0,0 +1,136 @@
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+// Shorter than the number of commands, so that a full queue can be tested
+#define WORK_QUEUE_LENGTH 2
+
+#define CPP_STANDARD
+#include "../src/work_queue.h"
+
+struct Worker {
+  std::mutex mutex;
+  std::vector<WorkCommand> commands;
+  std::thread::id thread;
+  std::atomic<bool> release;
+  std::atomic<int> running;
+
+  Worker() : release(true), running(0) {}
+};
+
+static void handler(void *ctx, WorkCommand command) {
+  Worker *worker = reinterpret_cast<Worker *>(ctx);
+  worker->running++;
+  while (!worker->release) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::lock_guard<std::mutex> guard(worker->mutex);
+  worker->commands.push_back(command);
+  worker->thread = std::this_thread::get_id();
+  worker->running--;
+}
+
+static bool wait_done(WorkQueue &queue, uint32_t done) {
+  for (int i = 0; i < 2000; i++) {
+    if (queue.stats().done >= done) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return false;
+}
+
+static const WorkTaskConfig c_config = {4096, 1, WORK_NO_AFFINITY};
+
+TEST_CASE("Work Queue", "[work_queue]") {
+
+  Worker worker;
+  WorkQueue queue;
+  REQUIRE(queue.begin(handler, &worker, c_config));
+
+  SECTION("Commands run in order on the worker thread") {
+    REQUIRE(queue.post(WORK_POLL));
+    REQUIRE(wait_done(queue, 1));
+    REQUIRE(queue.post(WORK_REFRESH_CONFIG));
+    REQUIRE(queue.post(WORK_UPDATE));
+    REQUIRE(wait_done(queue, 3));
+    REQUIRE(worker.commands == std::vector<WorkCommand>(
+                                   {WORK_POLL, WORK_REFRESH_CONFIG,
+                                    WORK_UPDATE}));
+    REQUIRE(worker.thread != std::this_thread::get_id());
+    REQUIRE(queue.stats().posted == 3);
+  }
+
+  SECTION("Posting never waits on a slow command") {
+    worker.release = false;
+    queue.post(WORK_UPDATE);
+    while (worker.running == 0) {
+      std::this_thread::yield();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 1000; i++) {
+      queue.post(WORK_POLL);
+      queue.post(WORK_REFRESH_CONFIG);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    REQUIRE(elapsed < std::chrono::milliseconds(100));
+
+    // Repeats of a waiting command are coalesced
+    WorkQueueStats stats = queue.stats();
+    REQUIRE(stats.posted == 3);
+    REQUIRE(stats.coalesced == 1998);
+    REQUIRE(stats.dropped == 0);
+
+    // Queue is bounded
+    REQUIRE_FALSE(queue.post(WORK_UPDATE));
+    REQUIRE(queue.stats().dropped == 1);
+
+    worker.release = true;
+    REQUIRE(wait_done(queue, 3));
+    REQUIRE(worker.commands == std::vector<WorkCommand>(
+                                   {WORK_UPDATE, WORK_POLL,
+                                    WORK_REFRESH_CONFIG}));
+  }
+
+  SECTION("Posting while running queues another run") {
+    worker.release = false;
+    queue.post(WORK_POLL);
+    while (worker.running == 0) {
+      std::this_thread::yield();
+    }
+    REQUIRE(queue.post(WORK_POLL));
+    REQUIRE(queue.stats().coalesced == 0);
+    worker.release = true;
+    REQUIRE(wait_done(queue, 2));
+  }
+
+  SECTION("Posts from many threads") {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&queue] {
+        for (int i = 0; i < 1000; i++) {
+          queue.post((WorkCommand)(i % WORK_COMMANDS));
+        }
+      });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    WorkQueueStats stats = queue.stats();
+    REQUIRE(stats.posted + stats.coalesced + stats.dropped == 4000);
+    REQUIRE(wait_done(queue, stats.posted));
+  }
+
+  SECTION("Stop") {
+    queue.stop();
+    REQUIRE(queue.post(WORK_POLL));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    REQUIRE(queue.stats().done == 0);
+  }
+}